@@ -0,0 +1,18 @@
+#!/bin/sh
+
+echo "This script compares the time taken by ray casting and by depth buffer"
+echo "rendering to compute partial views of bottle.xyz and tabletop.xyz."
+
+# Viewpoints must lie outside the bounding sphere of the object, otherwise
+# the depth buffer falls back to ray casting. tabletop.xyz is seen from the
+# sensor at the origin, and bottle.xyz from its side.
+echo "0 0 0" > /tmp/tabletop-viewpoint.xyz
+echo "400 66 150" > /tmp/bottle-viewpoint.xyz
+
+for f in bottle tabletop; do
+  for r in 256 512 1024; do
+    echo "$f.xyz, ${r}x${r} depth buffer:"
+    nuklei partial_view --benchmark -z $r -v /tmp/$f-viewpoint.xyz \
+      data/$f.xyz /tmp/$f-view.xyz
+  done
+done
@@ -71,6 +71,10 @@ const TYPE VAR = initConst<TYPE>("NUKLEI_" #VAR, VAL)
   defConst(std::string, PARALLELIZATION, "openmp");
 #endif
 
+  defConst(std::string, SIMD, "auto");
+
+  defConst(unsigned, POOL_SIZE, 0);
+
   defConst(bool, ENABLE_CONSOLE_BACKSPACE, true);
   
   defConst(unsigned, LOG_LEVEL, 0);
@@ -57,6 +57,134 @@ namespace nuklei
        gsl_vector_free (eval);
        gsl_matrix_free (evec);
     }
+    
+    // The closed-form solver below follows D. Eberly, "A Robust Eigensolver
+    // for 3x3 Symmetric Matrices". Eigenvalues are the roots of the
+    // characteristic polynomial, computed with trigonometric functions.
+    // The eigenvector of the best-separated eigenvalue is the largest cross
+    // product of two rows of (A - eI). The second eigenvector is solved in
+    // the plane orthogonal to the first.
+    
+    static Vector3 eigenVector0(const Matrix3& a, const coord_t e)
+    {
+      const Vector3 r0(a(0,0)-e, a(0,1), a(0,2));
+      const Vector3 r1(a(0,1), a(1,1)-e, a(1,2));
+      const Vector3 r2(a(0,2), a(1,2), a(2,2)-e);
+      const Vector3 c[3] = { r0.Cross(r1), r0.Cross(r2), r1.Cross(r2) };
+      int best = 0;
+      for (int i = 1; i < 3; ++i)
+        if (c[i].SquaredLength() > c[best].SquaredLength()) best = i;
+      const coord_t l = c[best].Length();
+      if (l == 0) return Vector3::UNIT_X;
+      return c[best] / l;
+    }
+    
+    static Vector3 eigenVector1(const Matrix3& a, const Vector3& v0,
+                                const coord_t e)
+    {
+      Vector3 u, v;
+      Vector3 w = v0;
+      Vector3::GenerateComplementBasis(u, v, w);
+      
+      const Vector3 au = a*u, av = a*v;
+      coord_t m00 = u.Dot(au) - e, m01 = u.Dot(av), m11 = v.Dot(av) - e;
+      const coord_t abs00 = std::fabs(m00), abs01 = std::fabs(m01),
+        abs11 = std::fabs(m11);
+      if (abs00 >= abs11)
+      {
+        if (std::max(abs00, abs01) == 0) return u;
+        if (abs00 >= abs01)
+        {
+          m01 /= m00; m00 = 1/std::sqrt(1 + m01*m01); m01 *= m00;
+        }
+        else
+        {
+          m00 /= m01; m01 = 1/std::sqrt(1 + m00*m00); m00 *= m01;
+        }
+        return m01*u - m00*v;
+      }
+      else
+      {
+        if (std::max(abs11, abs01) == 0) return u;
+        if (abs11 >= abs01)
+        {
+          m01 /= m11; m11 = 1/std::sqrt(1 + m01*m01); m01 *= m11;
+        }
+        else
+        {
+          m11 /= m01; m01 = 1/std::sqrt(1 + m11*m11); m11 *= m01;
+        }
+        return m11*u - m01*v;
+      }
+    }
+    
+    void fastEigenDecomposition(Matrix3 &eVectors, Vector3& eValues, const Matrix3& sym)
+    {
+      // Scaling by the largest entry avoids overflow and underflow.
+      coord_t scale = 0;
+      for (int i = 0; i < 3; ++i) for (int j = 0; j < 3; ++j)
+        scale = std::max(scale, std::fabs(sym(i,j)));
+      if (scale == 0)
+      {
+        eValues = Vector3::ZERO;
+        eVectors = Matrix3::IDENTITY;
+        return;
+      }
+      Matrix3 a = sym / scale;
+      
+      const coord_t q = (a(0,0) + a(1,1) + a(2,2)) / 3;
+      const coord_t b00 = a(0,0)-q, b11 = a(1,1)-q, b22 = a(2,2)-q;
+      const coord_t p2 = (b00*b00 + b11*b11 + b22*b22 +
+                          2*(a(0,1)*a(0,1) + a(0,2)*a(0,2) + a(1,2)*a(1,2))) / 6;
+      if (p2 == 0)
+      {
+        eValues = Vector3(q, q, q) * scale;
+        eVectors = Matrix3::IDENTITY;
+        return;
+      }
+      const coord_t p = std::sqrt(p2);
+      // Half the determinant of (a - qI)/p.
+      const coord_t halfDet =
+        (b00*(b11*b22 - a(1,2)*a(1,2)) -
+         a(0,1)*(a(0,1)*b22 - a(1,2)*a(0,2)) +
+         a(0,2)*(a(0,1)*a(1,2) - b11*a(0,2))) / (2*p2*p);
+      const coord_t phi =
+        std::acos(std::min(coord_t(1), std::max(coord_t(-1), halfDet))) / 3;
+      
+      // e[0] >= e[1] >= e[2]
+      coord_t e[3];
+      e[0] = q + 2*p*std::cos(phi);
+      e[2] = q + 2*p*std::cos(phi + 2*M_PI/3);
+      e[1] = 3*q - e[0] - e[2];
+      
+      Vector3 v[3];
+      if (e[0] - e[1] >= e[1] - e[2])
+      {
+        v[0] = eigenVector0(a, e[0]);
+        v[1] = eigenVector1(a, v[0], e[1]);
+        v[2] = v[0].Cross(v[1]);
+      }
+      else
+      {
+        v[2] = eigenVector0(a, e[2]);
+        v[1] = eigenVector1(a, v[2], e[1]);
+        v[0] = v[1].Cross(v[2]);
+      }
+      
+      // Same order and handedness as eigenDecomposition().
+      int order[3] = { 0, 1, 2 };
+      for (int i = 0; i < 3; ++i)
+        for (int j = i+1; j < 3; ++j)
+          if (std::fabs(e[order[j]]) > std::fabs(e[order[i]]))
+            std::swap(order[i], order[j]);
+      for (int i = 0; i < 3; ++i)
+      {
+        eValues[i] = e[order[i]] * scale;
+        eVectors.SetColumn(i, v[order[i]]);
+      }
+      if (Vector3(eVectors.GetColumn(0)).Cross(eVectors.GetColumn(1)).Dot(eVectors.GetColumn(2)) < 0)
+        eVectors.SetColumn(2, -Vector3(eVectors.GetColumn(2)));
+    }
         
     // The following function
     //     Vector3 project(const Plane3& plane, const Vector3& point)
@@ -14,62 +14,272 @@
 #include <nuklei/Random.h>
 #include <nuklei/Common.h>
 #include <nuklei/Log.h>
+#include <nuklei/SimdMath.h>
 
 #include <boost/random.hpp>
 
+#include <set>
+#include <atomic>
+#include <cstring>
+#include <stdint.h>
+#include <memory>
+#include <boost/noncopyable.hpp>
+
 namespace nuklei {
 
 // Either use GSL random gen, or Boost random gen
 //#define NUKLEI_USE_BOOST_RANDOM_GEN
 
-// Sync before accessing random gen?
-// -> NUKLEI_RANDOM_SYNC_OMP: use OMP exclusive access
-//    This one is obsolete, because when OMP is enabled, omp_get_thread_num
-//    allows Random methods to access thread-specific random gens.
-// -> NUKLEI_RANDOM_SYNC_MUTEX: use posix mutex
-//    This makes Nuklei much slower
-// -> NUKLEI_RANDOM_SYNC_NONE: default, use this on single-thread, or with OMP.
-  
-#define NUKLEI_RANDOM_SYNC_NONE
-
 #ifdef _OPENMP
 #include <omp.h>
-  static inline int nuklei_thread_num()
+#endif
+
+  // Each thread draws from its own generators, which live in thread-local
+  // storage: drawing a number never takes a lock. The generators of a thread
+  // are identified by a stream number, and the generators of stream i are
+  // seeded with seed()+i (the GSL generator with seed()+i+1, because GSL
+  // complains when seed == 0). Streams are assigned when a thread first
+  // draws a number:
+  // - the main thread uses stream 0,
+  // - OpenMP thread i uses stream i,
+  // - a thread that called Random::useThreadGenerators(s) uses stream
+  //   OMP_STREAMS+s,
+  // - other threads, and threads whose stream is already used by a live
+  //   thread, use AUTO_STREAMS, AUTO_STREAMS+1, ... in the order in which
+  //   they ask for one.
+  // Generators are seeded again when their thread notices that seed() has
+  // been called.
+  static const unsigned OMP_STREAMS = 1024;
+  static const unsigned AUTO_STREAMS = 1 << 20;
+  
+  // Function-local statics, so that they are constructed before their first
+  // use, even if that use comes from the static initialization of another
+  // translation unit.
+  static boost::mutex& streamMutex()
   {
-    return omp_get_thread_num();
+    static boost::mutex m;
+    return m;
   }
-  static inline int nuklei_max_threads()
+  static std::set<unsigned>& liveStreams()
   {
-    // I had issues with omp_get_max_threads(), returning 1 while spawning
-    // more than one thread.
-    // I had this with static executables.
-    // I guess it could be a race condition.
-    // Let's just return a large number instead (who would have more than 1000
-    // procs anyway?)
-    //return omp_get_max_threads();
-    return 1024;
+    static std::set<unsigned> s;
+    return s;
   }
-#else
-  static inline int nuklei_thread_num()
+  static unsigned nextAutoStream = AUTO_STREAMS;
+  
+  static const boost::thread::id mainThread = boost::this_thread::get_id();
+  static std::atomic<unsigned> currentSeed(0);
+  static std::atomic<int> seedGeneration(0);
+  
+  // Four xoshiro256+ generators, stored word by word so that the four lanes
+  // step together in vector registers. Used by the fill*() methods.
+  struct xoshiro4
   {
-    return 0;
+    // s[word][lane]
+    uint64_t s[4][4];
+    
+    void seed(uint64_t x)
+    {
+      // splitmix64, as recommended by the authors of xoshiro.
+      for (int w = 0; w < 4; ++w)
+        for (int l = 0; l < 4; ++l)
+        {
+          uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+          z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+          z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+          s[w][l] = z ^ (z >> 31);
+        }
+    }
+  };
+  
+  struct ThreadGenerators : boost::noncopyable
+  {
+    explicit ThreadGenerators(const unsigned stream) :
+    gsl(gsl_rng_alloc(gsl_rng_mt19937)), stream(stream), generation(-1) {}
+    ~ThreadGenerators()
+    {
+      gsl_rng_free(gsl);
+      boost::lock_guard<boost::mutex> lock(streamMutex());
+      liveStreams().erase(stream);
+    }
+    boost::mt19937 boost;
+    gsl_rng* gsl;
+    xoshiro4 fast;
+    const unsigned stream;
+    int generation;
+  };
+  static thread_local std::unique_ptr<ThreadGenerators> threadGens;
+  
+  // Gives the calling thread the generators of stream preferred, or of the
+  // next automatic stream if preferred is used by another thread.
+  static ThreadGenerators* nuklei_bind_thread(const unsigned preferred)
+  {
+    unsigned stream = preferred;
+    {
+      boost::lock_guard<boost::mutex> lock(streamMutex());
+      if (!liveStreams().insert(stream).second)
+      {
+        do stream = nextAutoStream++;
+        while (!liveStreams().insert(stream).second);
+      }
+    }
+    threadGens.reset(new ThreadGenerators(stream));
+    return threadGens.get();
+  }
+  
+  static ThreadGenerators* nuklei_bind_thread()
+  {
+#ifdef _OPENMP
+    if (omp_in_parallel())
+      return nuklei_bind_thread(omp_get_thread_num());
+#endif
+    if (boost::this_thread::get_id() == mainThread)
+      return nuklei_bind_thread(0);
+    boost::unique_lock<boost::mutex> lock(streamMutex());
+    const unsigned stream = nextAutoStream++;
+    lock.unlock();
+    return nuklei_bind_thread(stream);
   }
-  static inline int nuklei_max_threads()
+  
+  static inline ThreadGenerators& nuklei_thread_generators()
   {
-    return 1;
+    ThreadGenerators* t = threadGens.get();
+    if (t == NULL) t = nuklei_bind_thread();
+    const int generation = seedGeneration.load(std::memory_order_acquire);
+    if (t->generation != generation)
+    {
+      const unsigned s = currentSeed.load(std::memory_order_relaxed) + t->stream;
+      t->boost.seed(s);
+      gsl_rng_set(t->gsl, s+1);
+      t->fast.seed(s);
+      t->generation = generation;
+    }
+    return *t;
   }
+  
+  static inline gsl_rng* nuklei_gsl_generator()
+  {
+    return nuklei_thread_generators().gsl;
+  }
+  
+  static inline boost::mt19937& nuklei_boost_generator()
+  {
+    return nuklei_thread_generators().boost;
+  }
+  
+  // The upper 52 bits of a xoshiro256+ output, as the mantissa of a number
+  // in [1,2), minus 1. The vector versions below produce the same numbers.
+  static inline double nuklei_unit(const uint64_t x)
+  {
+    const uint64_t bits = (x >> 12) | 0x3FF0000000000000ULL;
+    double d;
+    std::memcpy(&d, &bits, sizeof(d));
+    return d - 1;
+  }
+  
+  // Writes 4*nBlocks numbers to out. Block b holds one number of each lane.
+  static void xoshiro_fill_scalar(xoshiro4& g, double* out,
+                                  const size_t nBlocks)
+  {
+    uint64_t (&s)[4][4] = g.s;
+    for (size_t b = 0; b < nBlocks; ++b)
+      for (int l = 0; l < 4; ++l)
+      {
+        out[4*b+l] = nuklei_unit(s[0][l] + s[3][l]);
+        const uint64_t t = s[1][l] << 17;
+        s[2][l] ^= s[0][l];
+        s[3][l] ^= s[1][l];
+        s[1][l] ^= s[2][l];
+        s[0][l] ^= s[3][l];
+        s[2][l] ^= t;
+        s[3][l] = (s[3][l] << 45) | (s[3][l] >> 19);
+      }
+  }
+  
+#if NUKLEI_X86_SIMD
+  
+  __attribute__((target("sse2")))
+  static void xoshiro_fill_sse2(xoshiro4& g, double* out,
+                                const size_t nBlocks)
+  {
+    const __m128i exponent = _mm_set1_epi64x(0x3FF0000000000000LL);
+    const __m128d one = _mm_set1_pd(1);
+    // Lanes 0-1 and 2-3.
+    for (int h = 0; h < 2; ++h)
+    {
+      __m128i s0 = _mm_loadu_si128((const __m128i*)(g.s[0]+2*h));
+      __m128i s1 = _mm_loadu_si128((const __m128i*)(g.s[1]+2*h));
+      __m128i s2 = _mm_loadu_si128((const __m128i*)(g.s[2]+2*h));
+      __m128i s3 = _mm_loadu_si128((const __m128i*)(g.s[3]+2*h));
+      for (size_t b = 0; b < nBlocks; ++b)
+      {
+        const __m128i r = _mm_add_epi64(s0, s3);
+        const __m128i t = _mm_slli_epi64(s1, 17);
+        s2 = _mm_xor_si128(s2, s0);
+        s3 = _mm_xor_si128(s3, s1);
+        s1 = _mm_xor_si128(s1, s2);
+        s0 = _mm_xor_si128(s0, s3);
+        s2 = _mm_xor_si128(s2, t);
+        s3 = _mm_or_si128(_mm_slli_epi64(s3, 45), _mm_srli_epi64(s3, 19));
+        const __m128i bits = _mm_or_si128(_mm_srli_epi64(r, 12), exponent);
+        _mm_storeu_pd(out+4*b+2*h, _mm_sub_pd(_mm_castsi128_pd(bits), one));
+      }
+      _mm_storeu_si128((__m128i*)(g.s[0]+2*h), s0);
+      _mm_storeu_si128((__m128i*)(g.s[1]+2*h), s1);
+      _mm_storeu_si128((__m128i*)(g.s[2]+2*h), s2);
+      _mm_storeu_si128((__m128i*)(g.s[3]+2*h), s3);
+    }
+  }
+  
+  __attribute__((target("avx2")))
+  static void xoshiro_fill_avx2(xoshiro4& g, double* out,
+                                const size_t nBlocks)
+  {
+    const __m256i exponent = _mm256_set1_epi64x(0x3FF0000000000000LL);
+    const __m256d one = _mm256_set1_pd(1);
+    __m256i s0 = _mm256_loadu_si256((const __m256i*)g.s[0]);
+    __m256i s1 = _mm256_loadu_si256((const __m256i*)g.s[1]);
+    __m256i s2 = _mm256_loadu_si256((const __m256i*)g.s[2]);
+    __m256i s3 = _mm256_loadu_si256((const __m256i*)g.s[3]);
+    for (size_t b = 0; b < nBlocks; ++b)
+    {
+      const __m256i r = _mm256_add_epi64(s0, s3);
+      const __m256i t = _mm256_slli_epi64(s1, 17);
+      s2 = _mm256_xor_si256(s2, s0);
+      s3 = _mm256_xor_si256(s3, s1);
+      s1 = _mm256_xor_si256(s1, s2);
+      s0 = _mm256_xor_si256(s0, s3);
+      s2 = _mm256_xor_si256(s2, t);
+      s3 = _mm256_or_si256(_mm256_slli_epi64(s3, 45),
+                           _mm256_srli_epi64(s3, 19));
+      const __m256i bits = _mm256_or_si256(_mm256_srli_epi64(r, 12), exponent);
+      _mm256_storeu_pd(out+4*b, _mm256_sub_pd(_mm256_castsi256_pd(bits), one));
+    }
+    _mm256_storeu_si256((__m256i*)g.s[0], s0);
+    _mm256_storeu_si256((__m256i*)g.s[1], s1);
+    _mm256_storeu_si256((__m256i*)g.s[2], s2);
+    _mm256_storeu_si256((__m256i*)g.s[3], s3);
+  }
+  
 #endif
-
   
-  // bRandGens must be a pointer. If not, its construtor may be called after
-  // init() is called, which will destroy the bRandGens setup in init().
-  static std::vector<boost::mt19937>* bRandGens;
-  // Same holds for these:
-  static std::vector<gsl_rng*>* gRandGens;
-  static std::vector<boost::shared_ptr<boost::mutex> >* mutexes;
-  // Keep in mind that it's unsafe to store pointers in std::vectors because
-  // they could be discarted without being deallocated. Here it's fine as we
-  // won't be resizing or deleting the vector before the end if the program.
+  static void xoshiro_fill(xoshiro4& g, double* out, const size_t nBlocks)
+  {
+    switch (simdLevel())
+    {
+#if NUKLEI_X86_SIMD
+      case SIMD_AVX512:
+      case SIMD_AVX2:
+        xoshiro_fill_avx2(g, out, nBlocks);
+        break;
+      case SIMD_SSE2:
+        xoshiro_fill_sse2(g, out, nBlocks);
+        break;
+#endif
+      default:
+        xoshiro_fill_scalar(g, out, nBlocks);
+    }
+  }
   
   bool Random::initialized_ = Random::init();
   
@@ -81,21 +291,11 @@ namespace nuklei {
     if (envValPara != NULL)
     {
       std::string para(envValPara);
-      if (para == "single" || para == "openmp")
+      if (para == "single" || para == "openmp" || para == "pthread" ||
+          para == "fork" || para == "pool")
       {
         // all ok
       }
-      else if (para == "pthread")
-      {
-#if defined(NUKLEI_RANDOM_SYNC_OMP) || defined(NUKLEI_RANDOM_SYNC_NONE) || !defined(NUKLEI_RANDOM_SYNC_MUTEX)
-        std::cout << "NUKLEI_PARALLELIZATION is set to pthread. "
-        "You should manually undefine all NUKLEI_RANDOM_SYNC_* in Random.cpp, "
-        "and define NUKLEI_RANDOM_SYNC_MUTEX instead. Note that multithreading "
-        "will be slower than with OpenMP. "
-        "See http://renaud-detry.net/nuklei/group__faq.html" << std::endl;
-        std::terminate();
-#endif
-      }
       else
       {
         std::cout << "Unknown value '" << para << "' for NUKLEI_PARALLELIZATION"
@@ -119,15 +319,6 @@ namespace nuklei {
         seed = time(NULL)*getpid(); // Unsigned don't overflow, they wrap around
     }
     
-    bRandGens = new std::vector<boost::mt19937>(nuklei_max_threads());
-    gRandGens = new std::vector<gsl_rng*>(nuklei_max_threads(), NULL);
-    for (int i = 0; i < nuklei_max_threads(); i++)
-      gRandGens->at(i) = gsl_rng_alloc(gsl_rng_mt19937);
-    
-    mutexes = new std::vector<boost::shared_ptr<boost::mutex> >();
-    for (int i = 0; i < nuklei_max_threads(); i++)
-      mutexes->push_back(boost::shared_ptr<boost::mutex>(new boost::mutex()));
-    
     Random::seed(seed);
     return true;
   }
@@ -143,14 +334,16 @@ namespace nuklei {
       ::srand(s);
     }
     
-    for (int i = 0; i < bRandGens->size(); ++i)
-    {
-      bRandGens->at(i).seed(s+i);
-    }
-    for (int i = 0; i < gRandGens->size(); ++i)
-    {
-      gsl_rng_set(gRandGens->at(i), s+i+1); // +1 because GSL complains when seed == 0
-    }
+    // Thread generators are seeded again at their next use.
+    currentSeed.store(s, std::memory_order_relaxed);
+    seedGeneration.fetch_add(1, std::memory_order_release);
+  }
+  
+  void Random::useThreadGenerators(unsigned stream)
+  {
+    // Release the current stream first, so that the thread may take it again.
+    threadGens.reset();
+    nuklei_bind_thread(OMP_STREAMS + stream);
   }
   
   //This function returns a double precision floating point number
@@ -159,23 +352,15 @@ namespace nuklei {
   double Random::uniform()
   {
     double r;
-#if defined(NUKLEI_RANDOM_SYNC_OMP)
-#  pragma omp critical(nuklei_randomRng)
-#elif defined(NUKLEI_RANDOM_SYNC_MUTEX)
-    boost::unique_lock<boost::mutex> lock(*mutexes->at(nuklei_thread_num()));
-#elif defined(NUKLEI_RANDOM_SYNC_NONE)
-#else
-#  error Undefined random sync method
-#endif
 #ifdef NUKLEI_USE_BOOST_RANDOM_GEN
     {
       boost::uniform_01<> dist;
       boost::variate_generator<boost::mt19937&, boost::uniform_01<> >
-      die(bRandGens->at(nuklei_thread_num()), dist);
+      die(nuklei_boost_generator(), dist);
       r = die();
     }
 #else
-    r = gsl_rng_uniform(gRandGens->at(nuklei_thread_num()));
+    r = gsl_rng_uniform(nuklei_gsl_generator());
 #endif
     return r;
   }
@@ -195,33 +380,15 @@ namespace nuklei {
   unsigned long int Random::uniformInt(unsigned long int n)
   {
     unsigned long int r;
-    // GSL has trouble with concurrent random number generation:
-    //   - if a single generator is used, it must be mutexed.
-    //   - using one random generator per thread is somehow very slow
-    // Random::uniformInt is used *a lot*, everytime a KernelCollection is
-    // iterated in random order. Using a mutex here entirely breaks
-    // multithreading (n threads on n cpus takes as much time as the same work
-    // on a single cpu).  Multithreading will only be fast if done through
-    // OpenMP. This is because it is hard to map pthreads to a
-    // number. boost::thread::id could be used to implement nuklei_thread_num()
-    // (todo?), but random generators could not be cleaned when a thread exits.
-#if defined(NUKLEI_RANDOM_SYNC_OMP)
-#  pragma omp critical(nuklei_randomRng)
-#elif defined(NUKLEI_RANDOM_SYNC_MUTEX)
-    boost::unique_lock<boost::mutex> lock(*mutexes->at(nuklei_thread_num()));
-#elif defined(NUKLEI_RANDOM_SYNC_NONE)
-#else
-#  error Undefined random sync method
-#endif
 #ifdef NUKLEI_USE_BOOST_RANDOM_GEN
     {
       boost::uniform_int<unsigned long> dist(0, n-1);
       boost::variate_generator<boost::mt19937&, boost::uniform_int<unsigned long> >
-      die(bRandGens->at(nuklei_thread_num()), dist);
+      die(nuklei_boost_generator(), dist);
       r = die();
     }
 #else
-    r = gsl_rng_uniform_int(gRandGens->at(nuklei_thread_num()), n);
+    r = gsl_rng_uniform_int(nuklei_gsl_generator(), n);
 #endif
     return r;
   }
@@ -229,18 +396,10 @@ namespace nuklei {
   double Random::triangle(double b)
   {
     double r;
-#if defined(NUKLEI_RANDOM_SYNC_OMP)
-#  pragma omp critical(nuklei_randomRng)
-#elif defined(NUKLEI_RANDOM_SYNC_MUTEX)
-    boost::unique_lock<boost::mutex> lock(*mutexes->at(nuklei_thread_num()));
-#elif defined(NUKLEI_RANDOM_SYNC_NONE)
-#else
-#  error Undefined random sync method
-#endif
     {
       boost::triangle_distribution<> dist(-b/2, 0, b/2);
       boost::variate_generator<boost::mt19937&, boost::triangle_distribution<> >
-      die(bRandGens->at(nuklei_thread_num()), dist);
+      die(nuklei_boost_generator(), dist);
       r = die();
     }
     return r;
@@ -253,23 +412,15 @@ namespace nuklei {
   double Random::gaussian(double sigma)
   {
     double r;
-#if defined(NUKLEI_RANDOM_SYNC_OMP)
-#  pragma omp critical(nuklei_randomRng)
-#elif defined(NUKLEI_RANDOM_SYNC_MUTEX)
-    boost::unique_lock<boost::mutex> lock(*mutexes->at(nuklei_thread_num()));
-#elif defined(NUKLEI_RANDOM_SYNC_NONE)
-#else
-#  error Undefined random sync method
-#endif
 #ifdef NUKLEI_USE_BOOST_RANDOM_GEN
     {
       boost::normal_distribution<> dist(0, sigma);
       boost::variate_generator<boost::mt19937&, boost::normal_distribution<> >
-      die(bRandGens->at(nuklei_thread_num()), dist);
+      die(nuklei_boost_generator(), dist);
       r = die();
     }
 #else
-    r = gsl_ran_gaussian(gRandGens->at(nuklei_thread_num()), sigma);
+    r = gsl_ran_gaussian(nuklei_gsl_generator(), sigma);
 #endif
     return r;
   }
@@ -277,42 +428,26 @@ namespace nuklei {
   double Random::beta(double a, double b)
   {
     double r;
-#if defined(NUKLEI_RANDOM_SYNC_OMP)
-#  pragma omp critical(nuklei_randomRng)
-#elif defined(NUKLEI_RANDOM_SYNC_MUTEX)
-    boost::unique_lock<boost::mutex> lock(*mutexes->at(nuklei_thread_num()));
-#elif defined(NUKLEI_RANDOM_SYNC_NONE)
-#else
-#  error Undefined random sync method
-#endif
-    r = gsl_ran_beta(gRandGens->at(nuklei_thread_num()), a, b);
+    r = gsl_ran_beta(nuklei_gsl_generator(), a, b);
     return r;
   }
   
   Vector2 Random::uniformDirection2d()
   {
     Vector2 dir;
-#if defined(NUKLEI_RANDOM_SYNC_OMP)
-#  pragma omp critical(nuklei_randomRng)
-#elif defined(NUKLEI_RANDOM_SYNC_MUTEX)
-    boost::unique_lock<boost::mutex> lock(*mutexes->at(nuklei_thread_num()));
-#elif defined(NUKLEI_RANDOM_SYNC_NONE)
-#else
-#  error Undefined random sync method
-#endif
 #ifdef NUKLEI_USE_BOOST_RANDOM_GEN
     {
       const int dim = 2;
       typedef boost::uniform_on_sphere<double, std::vector<double> > dist_t;
       dist_t dist(dim);
       boost::variate_generator<boost::mt19937&, dist_t >
-      die(bRandGens->at(nuklei_thread_num()), dist);
+      die(nuklei_boost_generator(), dist);
       std::vector<double> r = die();
       dir.X() = r.at(0);
       dir.Y() = r.at(1);
     }
 #else
-    gsl_ran_dir_2d(gRandGens->at(nuklei_thread_num()), &dir.X(), &dir.Y());
+    gsl_ran_dir_2d(nuklei_gsl_generator(), &dir.X(), &dir.Y());
 #endif
     return dir;
   }
@@ -320,26 +455,18 @@ namespace nuklei {
   Vector3 Random::uniformDirection3d()
   {
     Vector3 dir;
-#if defined(NUKLEI_RANDOM_SYNC_OMP)
-#  pragma omp critical(nuklei_randomRng)
-#elif defined(NUKLEI_RANDOM_SYNC_MUTEX)
-    boost::unique_lock<boost::mutex> lock(*mutexes->at(nuklei_thread_num()));
-#elif defined(NUKLEI_RANDOM_SYNC_NONE)
-#else
-#  error Undefined random sync method
-#endif
 #ifdef NUKLEI_USE_BOOST_RANDOM_GEN
     const int dim = 3;
     typedef boost::uniform_on_sphere<double, std::vector<double> > dist_t;
     dist_t dist(dim);
     boost::variate_generator<boost::mt19937&, dist_t >
-    die(bRandGens->at(nuklei_thread_num()), dist);
+    die(nuklei_boost_generator(), dist);
     std::vector<double> r = die();
     dir.X() = r.at(0);
     dir.Y() = r.at(1);
     dir.Z() = r.at(2);
 #else
-    gsl_ran_dir_3d(gRandGens->at(nuklei_thread_num()), &dir.X(), &dir.Y(), &dir.Z());
+    gsl_ran_dir_3d(nuklei_gsl_generator(), &dir.X(), &dir.Y(), &dir.Z());
 #endif
     return dir;
   }
@@ -398,6 +525,73 @@ namespace nuklei {
 #endif
   }
   
+  void Random::fillUniform(double* out, size_t n)
+  {
+    xoshiro4& g = nuklei_thread_generators().fast;
+    const size_t nBlocks = n/4;
+    xoshiro_fill(g, out, nBlocks);
+    if (n > 4*nBlocks)
+    {
+      double tail[4];
+      xoshiro_fill(g, tail, 1);
+      std::copy(tail, tail + n - 4*nBlocks, out + 4*nBlocks);
+    }
+  }
+  
+  void Random::fillUniform(double* out, size_t n, double a, double b)
+  {
+    NUKLEI_FAST_ASSERT(a < b);
+    fillUniform(out, n);
+    const double w = b-a;
+    for (size_t i = 0; i < n; ++i)
+      out[i] = a + out[i]*w;
+  }
+  
+  void Random::fillGaussian(double* out, size_t n, double sigma)
+  {
+    // Box-Muller transform, on pairs of uniform numbers. 1-u is in (0,1].
+    const size_t nPairs = n/2;
+    fillUniform(out, 2*nPairs);
+    for (size_t i = 0; i < nPairs; ++i)
+    {
+      const double r = sigma * std::sqrt(-2 * std::log(1 - out[2*i]));
+      const double theta = 2 * M_PI * out[2*i+1];
+      out[2*i] = r * std::cos(theta);
+      out[2*i+1] = r * std::sin(theta);
+    }
+    if (n > 2*nPairs)
+    {
+      double u[2];
+      fillUniform(u, 2);
+      out[n-1] = sigma * std::sqrt(-2 * std::log(1 - u[0])) *
+        std::cos(2 * M_PI * u[1]);
+    }
+  }
+  
+  void Random::fillUniformQuaternion(Quaternion* out, size_t n)
+  {
+    // Same method as uniformQuaternion(), on chunks of rotations.
+    const size_t CHUNK = 128;
+    double u[3*CHUNK];
+    for (size_t begin = 0; begin < n; begin += CHUNK)
+    {
+      const size_t m = std::min(CHUNK, n-begin);
+      fillUniform(u, 3*m);
+      for (size_t i = 0; i < m; ++i)
+      {
+        const coord_t s = u[3*i];
+        const coord_t s1 = std::sqrt(1-s);
+        const coord_t s2 = std::sqrt(s);
+        const coord_t t1 = 2 * M_PI * u[3*i+1];
+        const coord_t t2 = 2 * M_PI * u[3*i+2];
+        out[begin+i] = Quaternion(std::cos(t2) * s2,
+                                  std::sin(t1) * s1,
+                                  std::cos(t1) * s1,
+                                  std::sin(t2) * s2);
+      }
+    }
+  }
+  
   void Random::printRandomState()
   {
     NUKLEI_INFO("Random state: " <<
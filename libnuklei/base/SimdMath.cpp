@@ -0,0 +1,192 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#include <algorithm>
+
+#include <nuklei/Common.h>
+#include <nuklei/Math.h>
+#include <nuklei/SimdMath.h>
+
+namespace nuklei
+{
+
+  static SimdLevel detectSimdLevel()
+  {
+    SimdLevel cap = SIMD_AVX512;
+    if (SIMD == "none") cap = SIMD_NONE;
+    else if (SIMD == "sse2") cap = SIMD_SSE2;
+    else if (SIMD == "avx2") cap = SIMD_AVX2;
+    else if (SIMD == "avx512" || SIMD == "auto") cap = SIMD_AVX512;
+    else NUKLEI_WARN("Unknown value '" << SIMD <<
+                     "' for NUKLEI_SIMD. Using 'auto'.");
+
+    SimdLevel cpu = SIMD_NONE;
+#if NUKLEI_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) cpu = SIMD_AVX512;
+    else if (__builtin_cpu_supports("avx2")) cpu = SIMD_AVX2;
+    else cpu = SIMD_SSE2;
+#endif
+    return std::min(cap, cpu);
+  }
+
+  SimdLevel simdLevel()
+  {
+    static const SimdLevel level = detectSimdLevel();
+    return level;
+  }
+
+  // The batch functions below run the vector code on full blocks of 2, 4 or
+  // 8 values, and the scalar code below on the remainder. The scalar code
+  // clamps its input like the vector code, instead of asserting like
+  // FastNegExp(T) and FastACos(T).
+
+  namespace
+  {
+
+    struct neg_exp_op
+    {
+      static coord_t scalar(const coord_t x)
+      {
+        return nuklei_wmf::Math<coord_t>::FastNegExp3(std::max(x, coord_t(0)));
+      }
+#if NUKLEI_X86_SIMD
+      __attribute__((target("sse2")))
+      static __m128d vector(const __m128d x) { return simd::FastNegExp(x); }
+      __attribute__((target("avx2")))
+      static __m256d vector(const __m256d x) { return simd::FastNegExp(x); }
+      __attribute__((target("avx512f")))
+      static __m512d vector(const __m512d x) { return simd::FastNegExp(x); }
+#endif
+    };
+
+    struct acos_op
+    {
+      static coord_t scalar(const coord_t x)
+      {
+        const coord_t a = std::min(std::fabs(x), coord_t(1));
+        const coord_t r = nuklei_wmf::Math<coord_t>::FastInvCos0(a);
+        return x < 0 ? M_PI - r : r;
+      }
+#if NUKLEI_X86_SIMD
+      __attribute__((target("sse2")))
+      static __m128d vector(const __m128d x) { return simd::FastACos(x); }
+      __attribute__((target("avx2")))
+      static __m256d vector(const __m256d x) { return simd::FastACos(x); }
+      __attribute__((target("avx512f")))
+      static __m512d vector(const __m512d x) { return simd::FastACos(x); }
+#endif
+    };
+
+    struct quaternion_angle_op
+    {
+      static coord_t scalar(const coord_t x)
+      {
+        return 2*acos_op::scalar(std::fabs(x));
+      }
+#if NUKLEI_X86_SIMD
+      __attribute__((target("sse2")))
+      static __m128d vector(const __m128d x)
+      {
+        const __m128d a = _mm_andnot_pd(_mm_set1_pd(-0.), x);
+        return _mm_mul_pd(_mm_set1_pd(2), simd::FastACos(a));
+      }
+      __attribute__((target("avx2")))
+      static __m256d vector(const __m256d x)
+      {
+        const __m256d a = _mm256_andnot_pd(_mm256_set1_pd(-0.), x);
+        return _mm256_mul_pd(_mm256_set1_pd(2), simd::FastACos(a));
+      }
+      __attribute__((target("avx512f")))
+      static __m512d vector(const __m512d x)
+      {
+        return _mm512_mul_pd(_mm512_set1_pd(2), simd::FastACos(simd::abs(x)));
+      }
+#endif
+    };
+
+    template<class Op>
+    void apply_scalar(const coord_t* in, coord_t* out,
+                      const size_t begin, const size_t n)
+    {
+      for (size_t i = begin; i < n; ++i)
+        out[i] = Op::scalar(in[i]);
+    }
+
+#if NUKLEI_X86_SIMD
+
+    template<class Op>
+    __attribute__((target("sse2")))
+    void apply_sse2(const coord_t* in, coord_t* out, const size_t n)
+    {
+      size_t i = 0;
+      for (; i+2 <= n; i += 2)
+        _mm_storeu_pd(out+i, Op::vector(_mm_loadu_pd(in+i)));
+      apply_scalar<Op>(in, out, i, n);
+    }
+
+    template<class Op>
+    __attribute__((target("avx2")))
+    void apply_avx2(const coord_t* in, coord_t* out, const size_t n)
+    {
+      size_t i = 0;
+      for (; i+4 <= n; i += 4)
+        _mm256_storeu_pd(out+i, Op::vector(_mm256_loadu_pd(in+i)));
+      apply_scalar<Op>(in, out, i, n);
+    }
+
+    template<class Op>
+    __attribute__((target("avx512f")))
+    void apply_avx512(const coord_t* in, coord_t* out, const size_t n)
+    {
+      size_t i = 0;
+      for (; i+8 <= n; i += 8)
+        _mm512_storeu_pd(out+i, Op::vector(_mm512_loadu_pd(in+i)));
+      apply_scalar<Op>(in, out, i, n);
+    }
+
+#endif
+
+    template<class Op>
+    void apply(const coord_t* in, coord_t* out, const size_t n)
+    {
+      switch (simdLevel())
+      {
+#if NUKLEI_X86_SIMD
+        case SIMD_AVX512:
+          apply_avx512<Op>(in, out, n);
+          break;
+        case SIMD_AVX2:
+          apply_avx2<Op>(in, out, n);
+          break;
+        case SIMD_SSE2:
+          apply_sse2<Op>(in, out, n);
+          break;
+#endif
+        default:
+          apply_scalar<Op>(in, out, 0, n);
+      }
+    }
+
+  }
+
+  void FastNegExp(const coord_t* in, coord_t* out, const size_t n)
+  {
+    apply<neg_exp_op>(in, out, n);
+  }
+
+  void FastACos(const coord_t* in, coord_t* out, const size_t n)
+  {
+    apply<acos_op>(in, out, n);
+  }
+
+  void FastQuaternionAngle(const coord_t* dots, coord_t* angles,
+                           const size_t n)
+  {
+    apply<quaternion_angle_op>(dots, angles, n);
+  }
+
+}
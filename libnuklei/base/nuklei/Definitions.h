@@ -59,6 +59,10 @@ namespace nuklei {
 
   extern const std::string PARALLELIZATION;
 
+  extern const std::string SIMD;
+  
+  extern const unsigned POOL_SIZE;
+
   extern const bool ENABLE_CONSOLE_BACKSPACE;
   
   extern const unsigned LOG_LEVEL;
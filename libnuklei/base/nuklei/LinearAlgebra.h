@@ -365,6 +365,13 @@ namespace nuklei {
     }
 
     void eigenDecomposition(Matrix3 &eVectors, Vector3& eValues, const Matrix3& sym);
+    /**
+     * @brief Closed-form version of eigenDecomposition().
+     *
+     * Returns eigenvalues and eigenvectors in the same order, without
+     * iterations or memory allocations.
+     */
+    void fastEigenDecomposition(Matrix3 &eVectors, Vector3& eValues, const Matrix3& sym);
 
     double determinant(const GMatrix &m);
     GMatrix inverse(const GMatrix &m);
@@ -74,6 +74,40 @@ namespace nuklei {
     return nuklei_wmf::Math<coord_t>::FastNegExp3( fValue );
   }
   
+  /**
+   * @brief Computes FastNegExp() of @p n values.
+   *
+   * Writes FastNegExp(@p in[i]) to @p out[i], for i in [0, n). Negative
+   * values are treated as 0. The absolute error with respect to
+   * std::exp(-x) is below 2.5e-7. @p in and @p out may be the same array.
+   *
+   * This function is vectorized (see simdLevel()).
+   */
+  void FastNegExp(const coord_t* in, coord_t* out, const size_t n);
+
+  /**
+   * @brief Computes FastACos() of @p n values.
+   *
+   * Values are clamped to [-1, 1]. The absolute error with respect to
+   * std::acos() is below 6.8e-5. @p in and @p out may be the same array.
+   *
+   * This function is vectorized (see simdLevel()).
+   */
+  void FastACos(const coord_t* in, coord_t* out, const size_t n);
+
+  /**
+   * @brief Computes the angle between pairs of unit quaternions from their
+   * dot products.
+   *
+   * Writes 2*FastACos(|@p dots[i]|) to @p angles[i], which is the value of
+   * dist<groupS::so3, func_implS::approx>. The absolute error is below
+   * 1.4e-4. @p dots and @p angles may be the same array.
+   *
+   * This function is vectorized (see simdLevel()).
+   */
+  void FastQuaternionAngle(const coord_t* dots, coord_t* angles,
+                           const size_t n);
+  
   inline coord_t
   trivariateGaussian(const Vector3 &x, const Vector3 &m, const Matrix3 &cov,
                       const weight_t w = 1)
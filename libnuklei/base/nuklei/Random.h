@@ -27,9 +27,30 @@ namespace nuklei {
      *
      * This method will seed a built-in GSL generator, and the standard
      * library's generator.
+     *
+     * Each thread draws from its own generators, without locking. The
+     * generators of a thread are seeded from @p s and a stream number that
+     * identifies the thread: stream 0 for the main thread, stream @c i for
+     * OpenMP thread @c i, and see useThreadGenerators() for other threads.
+     * The generators of all threads are seeded again at their next use.
      */
     static void seed(unsigned s);
     
+    /**
+     * @brief Makes the calling thread draw from stream @p stream.
+     *
+     * Threads that are neither the main thread nor OpenMP threads are given
+     * a stream in the order in which they first draw a random number. A
+     * thread that calls this method draws reproducible numbers, whatever
+     * the order in which threads start. Concurrent threads should ask for
+     * different streams; if @p stream is already used by another thread, the
+     * calling thread is given an unused stream.
+     *
+     * The workers of task_pool, and the threads of the PTHREAD
+     * parallelization, call this method with their index.
+     */
+    static void useThreadGenerators(unsigned stream);
+    
     /**
      * @brief This function returns a double precision floating point number
      * uniformly distributed in the range @f$ [0,1) @f$.
@@ -99,6 +120,36 @@ namespace nuklei {
      */
     static Quaternion uniformQuaternion();
     
+    /**
+     * @brief Fills @p out with @p n numbers uniformly distributed in the
+     * range @f$ [0,1) @f$.
+     *
+     * The fill*() methods draw from a generator of their own (four
+     * xoshiro256+ generators stepped together with SIMD instructions),
+     * which is seeded like the other generators of the calling thread. Their
+     * numbers have 52 random bits. For a given seed and stream, they do not
+     * depend on the instruction set.
+     */
+    static void fillUniform(double* out, size_t n);
+    
+    /**
+     * @brief Fills @p out with @p n numbers uniformly distributed in the
+     * range @f$ [a,b) @f$.
+     */
+    static void fillUniform(double* out, size_t n, double a, double b);
+    
+    /**
+     * @brief Fills @p out with @p n Gaussian variates of mean zero and
+     * standard deviation @p sigma.
+     */
+    static void fillGaussian(double* out, size_t n, double sigma);
+    
+    /**
+     * @brief Fills @p out with @p n rotations uniformly distributed on
+     * @f$ SO(3) @f$.
+     */
+    static void fillUniformQuaternion(Quaternion* out, size_t n);
+    
     static void printRandomState();
     
     /**
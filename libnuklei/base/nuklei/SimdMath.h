@@ -0,0 +1,169 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#ifndef NUKLEI_SIMD_MATH_H
+#define NUKLEI_SIMD_MATH_H
+
+#include <cmath>
+
+#include <nuklei/Definitions.h>
+
+// The vectorized code paths are compiled with per-function target
+// attributes, and selected at runtime with simdLevel(). They are only
+// available on x86-64 with GCC or Clang, where size_t indices can be fed to
+// 64-bit gathers.
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define NUKLEI_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define NUKLEI_X86_SIMD 0
+#endif
+
+namespace nuklei {
+
+  /**
+   * @brief Instruction sets that Nuklei's vectorized code can use.
+   */
+  typedef enum { SIMD_NONE, SIMD_SSE2, SIMD_AVX2, SIMD_AVX512 } SimdLevel;
+
+  /**
+   * @brief Returns the instruction set used by vectorized code.
+   *
+   * The level is the best one supported by the CPU, capped by the value
+   * of the @c NUKLEI_SIMD environment variable (@c none, @c sse2,
+   * @c avx2, @c avx512 or @c auto). It is determined once per process.
+   */
+  SimdLevel simdLevel();
+
+#if NUKLEI_X86_SIMD
+
+  /**
+   * @brief Vector versions of FastNegExp() and FastACos().
+   *
+   * Each function follows the operations of its scalar counterpart on 2, 4
+   * or 8 values, and returns the same values up to rounding. Inputs are
+   * clamped instead of asserted: FastNegExp() treats negative inputs as 0,
+   * FastACos() clamps its input to [-1, 1].
+   */
+  namespace simd {
+
+    // SSE2 ------------------------------------------------------------------
+
+    __attribute__((target("sse2")))
+    inline __m128d FastNegExp(__m128d x)
+    {
+      x = _mm_max_pd(x, _mm_setzero_pd());
+      __m128d r = _mm_set1_pd(0.0000006906);
+      r = _mm_add_pd(_mm_mul_pd(r, x), _mm_set1_pd(0.0000054302));
+      r = _mm_add_pd(_mm_mul_pd(r, x), _mm_set1_pd(0.0001715620));
+      r = _mm_add_pd(_mm_mul_pd(r, x), _mm_set1_pd(0.0025913712));
+      r = _mm_add_pd(_mm_mul_pd(r, x), _mm_set1_pd(0.0312575832));
+      r = _mm_add_pd(_mm_mul_pd(r, x), _mm_set1_pd(0.2499986842));
+      r = _mm_add_pd(_mm_mul_pd(r, x), _mm_set1_pd(1));
+      r = _mm_mul_pd(r, r);
+      r = _mm_mul_pd(r, r);
+      return _mm_div_pd(_mm_set1_pd(1), r);
+    }
+
+    __attribute__((target("sse2")))
+    inline __m128d FastACos(__m128d x)
+    {
+      const __m128d one = _mm_set1_pd(1);
+      const __m128d signmask = _mm_set1_pd(-0.);
+      const __m128d a = _mm_min_pd(_mm_andnot_pd(signmask, x), one);
+      __m128d r = _mm_set1_pd(-0.0187293);
+      r = _mm_add_pd(_mm_mul_pd(r, a), _mm_set1_pd(0.0742610));
+      r = _mm_add_pd(_mm_mul_pd(r, a), _mm_set1_pd(-0.2121144));
+      r = _mm_add_pd(_mm_mul_pd(r, a), _mm_set1_pd(1.5707288));
+      r = _mm_mul_pd(r, _mm_sqrt_pd(_mm_sub_pd(one, a)));
+      const __m128d neg = _mm_cmplt_pd(x, _mm_setzero_pd());
+      return _mm_or_pd(_mm_and_pd(neg, _mm_sub_pd(_mm_set1_pd(M_PI), r)),
+                       _mm_andnot_pd(neg, r));
+    }
+
+    // AVX2 ------------------------------------------------------------------
+
+    __attribute__((target("avx2")))
+    inline __m256d FastNegExp(__m256d x)
+    {
+      x = _mm256_max_pd(x, _mm256_setzero_pd());
+      __m256d r = _mm256_set1_pd(0.0000006906);
+      r = _mm256_add_pd(_mm256_mul_pd(r, x), _mm256_set1_pd(0.0000054302));
+      r = _mm256_add_pd(_mm256_mul_pd(r, x), _mm256_set1_pd(0.0001715620));
+      r = _mm256_add_pd(_mm256_mul_pd(r, x), _mm256_set1_pd(0.0025913712));
+      r = _mm256_add_pd(_mm256_mul_pd(r, x), _mm256_set1_pd(0.0312575832));
+      r = _mm256_add_pd(_mm256_mul_pd(r, x), _mm256_set1_pd(0.2499986842));
+      r = _mm256_add_pd(_mm256_mul_pd(r, x), _mm256_set1_pd(1));
+      r = _mm256_mul_pd(r, r);
+      r = _mm256_mul_pd(r, r);
+      return _mm256_div_pd(_mm256_set1_pd(1), r);
+    }
+
+    __attribute__((target("avx2")))
+    inline __m256d FastACos(__m256d x)
+    {
+      const __m256d one = _mm256_set1_pd(1);
+      const __m256d signmask = _mm256_set1_pd(-0.);
+      const __m256d a = _mm256_min_pd(_mm256_andnot_pd(signmask, x), one);
+      __m256d r = _mm256_set1_pd(-0.0187293);
+      r = _mm256_add_pd(_mm256_mul_pd(r, a), _mm256_set1_pd(0.0742610));
+      r = _mm256_add_pd(_mm256_mul_pd(r, a), _mm256_set1_pd(-0.2121144));
+      r = _mm256_add_pd(_mm256_mul_pd(r, a), _mm256_set1_pd(1.5707288));
+      r = _mm256_mul_pd(r, _mm256_sqrt_pd(_mm256_sub_pd(one, a)));
+      return _mm256_blendv_pd(r, _mm256_sub_pd(_mm256_set1_pd(M_PI), r),
+                              _mm256_cmp_pd(x, _mm256_setzero_pd(), _CMP_LT_OQ));
+    }
+
+    // AVX-512 ---------------------------------------------------------------
+
+    // AVX-512F has no floating-point bitwise operations (they are in
+    // AVX-512DQ). Absolute values are taken on the integer view.
+
+    __attribute__((target("avx512f")))
+    inline __m512d abs(__m512d x)
+    {
+      return _mm512_castsi512_pd(_mm512_and_si512(_mm512_castpd_si512(x),
+                                                  _mm512_set1_epi64(0x7fffffffffffffffLL)));
+    }
+
+    __attribute__((target("avx512f")))
+    inline __m512d FastNegExp(__m512d x)
+    {
+      x = _mm512_max_pd(x, _mm512_setzero_pd());
+      __m512d r = _mm512_set1_pd(0.0000006906);
+      r = _mm512_add_pd(_mm512_mul_pd(r, x), _mm512_set1_pd(0.0000054302));
+      r = _mm512_add_pd(_mm512_mul_pd(r, x), _mm512_set1_pd(0.0001715620));
+      r = _mm512_add_pd(_mm512_mul_pd(r, x), _mm512_set1_pd(0.0025913712));
+      r = _mm512_add_pd(_mm512_mul_pd(r, x), _mm512_set1_pd(0.0312575832));
+      r = _mm512_add_pd(_mm512_mul_pd(r, x), _mm512_set1_pd(0.2499986842));
+      r = _mm512_add_pd(_mm512_mul_pd(r, x), _mm512_set1_pd(1));
+      r = _mm512_mul_pd(r, r);
+      r = _mm512_mul_pd(r, r);
+      return _mm512_div_pd(_mm512_set1_pd(1), r);
+    }
+
+    __attribute__((target("avx512f")))
+    inline __m512d FastACos(__m512d x)
+    {
+      const __m512d one = _mm512_set1_pd(1);
+      const __m512d a = _mm512_min_pd(abs(x), one);
+      __m512d r = _mm512_set1_pd(-0.0187293);
+      r = _mm512_add_pd(_mm512_mul_pd(r, a), _mm512_set1_pd(0.0742610));
+      r = _mm512_add_pd(_mm512_mul_pd(r, a), _mm512_set1_pd(-0.2121144));
+      r = _mm512_add_pd(_mm512_mul_pd(r, a), _mm512_set1_pd(1.5707288));
+      r = _mm512_mul_pd(r, _mm512_sqrt_pd(_mm512_sub_pd(one, a)));
+      return _mm512_mask_sub_pd(r, _mm512_cmp_pd_mask(x, _mm512_setzero_pd(),
+                                                      _CMP_LT_OQ),
+                                _mm512_set1_pd(M_PI), r);
+    }
+
+  }
+
+#endif
+
+}
+
+#endif
@@ -0,0 +1,183 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#ifndef NUKLEI_ARENA_H
+#define NUKLEI_ARENA_H
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <boost/noncopyable.hpp>
+#include <nuklei/Definitions.h>
+
+namespace nuklei {
+
+  /**
+   * @brief Bump allocator for short-lived objects.
+   *
+   * Objects are constructed in large slabs, and destroyed all at once by
+   * clear(), or by a scope created on the arena. Slabs are kept from one
+   * use to the next, so that an arena that is cleared regularly stops
+   * allocating memory after a few uses.
+   *
+   * An arena is not thread-safe. Each thread may use its own arena, returned
+   * by scratch().
+   *
+   * @code
+   * arena::scope s(arena::scratch());
+   * kernel::base* t = k.polyTransformedWith(pose, s.get());
+   * // *t is destroyed when s goes out of scope.
+   * @endcode
+   */
+  class arena : boost::noncopyable
+  {
+  public:
+    /** @brief Size of a slab, in bytes. Larger objects get their own slab. */
+    static const std::size_t SLAB_SIZE = 64 * 1024;
+
+    arena() : slab_(0), offset_(0) {}
+    ~arena()
+    {
+      clear();
+      for (std::vector<char*>::iterator i = slabs_.begin();
+           i != slabs_.end(); ++i)
+        ::operator delete(*i);
+    }
+
+    /**
+     * @brief Constructs a @p T with @p args in the arena.
+     *
+     * The object is destroyed by clear(), or when the innermost enclosing
+     * scope ends.
+     */
+    template<class T, class... Args>
+    T* create(Args&&... args)
+    {
+      void* p = allocate(sizeof(T), alignof(T));
+      T* t = new (p) T(std::forward<Args>(args)...);
+      if (!std::is_trivially_destructible<T>::value)
+        destructors_.push_back(destructor(&destroy<T>, t));
+      return t;
+    }
+
+    /** @brief Destroys all objects, and keeps the slabs for reuse. */
+    void clear() { rewind(mark_t()); }
+
+    /** @brief Total size of the slabs, in bytes. */
+    std::size_t capacity() const
+    {
+      std::size_t c = 0;
+      for (std::vector<std::size_t>::const_iterator i = sizes_.begin();
+           i != sizes_.end(); ++i)
+        c += *i;
+      return c;
+    }
+
+  private:
+    // Allocation state, restored by scope.
+    struct mark_t
+    {
+      mark_t() : slab(0), offset(0), destructors(0) {}
+      std::size_t slab, offset, destructors;
+    };
+
+  public:
+    /**
+     * @brief Destroys the objects created in the arena during the lifetime
+     * of the scope.
+     *
+     * Scopes may be nested.
+     */
+    class scope : boost::noncopyable
+    {
+    public:
+      explicit scope(arena& a) : arena_(a), mark_(a.mark()) {}
+      ~scope() { arena_.rewind(mark_); }
+      arena& get() const { return arena_; }
+    private:
+      arena& arena_;
+      const mark_t mark_;
+    };
+
+    /** @brief Returns the arena of the calling thread. */
+    static arena& scratch()
+    {
+      static thread_local arena a;
+      return a;
+    }
+
+  private:
+    typedef std::pair<void (*)(void*), void*> destructor;
+
+    template<class T>
+    static void destroy(void* p) { static_cast<T*>(p)->~T(); }
+
+    mark_t mark() const
+    {
+      mark_t m;
+      m.slab = slab_;
+      m.offset = offset_;
+      m.destructors = destructors_.size();
+      return m;
+    }
+
+    void rewind(const mark_t& m)
+    {
+      NUKLEI_ASSERT(m.destructors <= destructors_.size());
+      while (destructors_.size() > m.destructors)
+      {
+        destructors_.back().first(destructors_.back().second);
+        destructors_.pop_back();
+      }
+      slab_ = m.slab;
+      offset_ = m.offset;
+    }
+
+    // Slabs after slab_ are free. When the current slab is full, the next
+    // one is used if it is large enough. Otherwise, a new slab is inserted
+    // after the current one.
+    void* allocate(const std::size_t size, const std::size_t alignment)
+    {
+      for (;;)
+      {
+        if (slab_ < slabs_.size())
+        {
+          const std::size_t begin =
+            (offset_ + alignment - 1) / alignment * alignment;
+          if (begin + size <= sizes_[slab_])
+          {
+            offset_ = begin + size;
+            return slabs_[slab_] + begin;
+          }
+          if (slab_+1 < slabs_.size() && size <= sizes_[slab_+1])
+          {
+            ++slab_;
+            offset_ = 0;
+            continue;
+          }
+        }
+        const std::size_t s = std::max(size, std::size_t(SLAB_SIZE));
+        const std::size_t at = slab_ < slabs_.size() ? slab_+1 : slabs_.size();
+        slabs_.insert(slabs_.begin() + at,
+                      static_cast<char*>(::operator new(s)));
+        sizes_.insert(sizes_.begin() + at, s);
+        slab_ = at;
+        offset_ = 0;
+      }
+    }
+
+    std::vector<char*> slabs_;
+    std::vector<std::size_t> sizes_;
+    std::vector<destructor> destructors_;
+    std::size_t slab_, offset_;
+  };
+
+}
+
+#endif
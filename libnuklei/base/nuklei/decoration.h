@@ -66,6 +66,11 @@ namespace nuklei {
       decorations_.clear();
     }
     
+    bool empty() const
+    {
+      return decorations_.empty();
+    }
+    
   private:
     map_t decorations_;
   };
@@ -11,6 +11,7 @@
 #include <nuklei/Common.h>
 #include <nuklei/BoostSerialization.h>
 #include <nuklei/parallelizer_decl.h>
+#include <nuklei/task_pool.h>
 
 #include <cstdlib>
 #include <boost/filesystem.hpp>
@@ -23,22 +24,17 @@ namespace nuklei {
   std::vector<R> parallelizer::run_openmp(Callable callable,
                                           PrintAccessor pa) const
   {
-    std::vector<R> retv;
+    // Each task writes its own slot, and results are logged once all tasks
+    // have completed.
+    std::vector<R> retv(n_);
 #ifdef _OPENMP
 #pragma omp parallel for
 #endif
     for (int i = 0; i < n_; ++i)
-    {
-      R tmp = callable();
-#ifdef _OPENMP
-#pragma omp critical(nuklei_parallelizer_merge)
-#endif
-      {
-        retv.push_back(tmp);
-        NUKLEI_INFO("Finished OpenMP thread " << i << " with value "
-                    << pa(tmp) << ".");
-      }
-    }
+      retv[i] = callable();
+    for (int i = 0; i < n_; ++i)
+      NUKLEI_INFO("Finished OpenMP thread " << i << " with value "
+                  << pa(retv.at(i)) << ".");
     return retv;
   }
   
@@ -127,10 +123,11 @@ namespace nuklei {
       //  ret = callable();
       //}
       
+      boost::function<void ()> task =
+        boost::bind<void>(pthread_wrapper<R, Callable>(callable),
+                          boost::ref(retv.at(i)));
       boost::shared_ptr<boost::thread> thread
-      (new boost::thread
-       (boost::bind<void>(pthread_wrapper<R, Callable>(callable),
-                          boost::ref(retv.at(i)))));
+      (new boost::thread(stream_wrapper< boost::function<void ()> >(task, i)));
       threads.push_back(thread);
     }
     for (int i = 0; i < n_; ++i)
@@ -157,6 +154,63 @@ namespace nuklei {
     return retv;
   }
   
+  template<typename R, typename Callable, typename PrintAccessor>
+  std::vector<R> parallelizer::run_pool(Callable callable,
+                                        PrintAccessor pa) const
+  {
+    std::vector<R> retv(n_);
+    task_group group;
+    for (int i = 0; i < n_; ++i)
+      group.run(boost::bind<void>(pthread_wrapper<R, Callable>(callable),
+                                  boost::ref(retv.at(i))));
+    group.wait();
+    for (int i = 0; i < n_; ++i)
+      NUKLEI_INFO("Finished task " << i << " with value "
+                  << pa(retv.at(i)) << ".");
+    return retv;
+  }
+  
+  template<typename Callable>
+  void parallelizer::for_each_openmp(Callable callable) const
+  {
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+    for (int i = 0; i < n_; ++i)
+      callable(i);
+  }
+  
+  template<typename Callable>
+  void parallelizer::for_each_pthread(Callable callable) const
+  {
+    std::vector< boost::shared_ptr<boost::thread> > threads;
+    for (int i = 0; i < n_; ++i)
+    {
+      boost::function<void ()> task = boost::bind<void>(callable, i);
+      boost::shared_ptr<boost::thread> thread
+      (new boost::thread(stream_wrapper< boost::function<void ()> >(task, i)));
+      threads.push_back(thread);
+    }
+    for (int i = 0; i < n_; ++i)
+      threads.at(i)->join();
+  }
+  
+  template<typename Callable>
+  void parallelizer::for_each_single(Callable callable) const
+  {
+    for (int i = 0; i < n_; ++i)
+      callable(i);
+  }
+  
+  template<typename Callable>
+  void parallelizer::for_each_pool(Callable callable) const
+  {
+    task_group group;
+    for (int i = 0; i < n_; ++i)
+      group.run(boost::bind<void>(callable, i));
+    group.wait();
+  }
+  
 }
 
 #endif
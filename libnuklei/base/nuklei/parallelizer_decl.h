@@ -20,7 +20,7 @@ namespace nuklei {
   
   struct parallelizer
   {
-    typedef enum { OPENMP = 0, FORK, PTHREAD, SINGLE, UNKNOWN } Type;
+    typedef enum { OPENMP = 0, FORK, PTHREAD, SINGLE, POOL, UNKNOWN } Type;
     static const Type defaultType = OPENMP;
     static const std::string TypeNames[];
     
@@ -28,6 +28,10 @@ namespace nuklei {
      * If chosing the fork()-based implementation, make sure that your program
      * consists of a single thread at the time run() is called, or you will run
      * into problems (Google "forking a multithreaded program" to see why).
+     *
+     * The POOL implementation runs tasks on task_pool::global(), whose
+     * workers are started once and reused by all subsequent calls. Tasks may
+     * themselves submit tasks to the pool (see task_group).
      */
     parallelizer(const int n,
                  const Type& type = OPENMP,
@@ -78,14 +82,69 @@ namespace nuklei {
         case SINGLE:
           return run_single<R>(callable, pa);
           break;
+        case POOL:
+          return run_pool<R>(callable, pa);
+          break;
         default:
           NUKLEI_THROW("Unknown parallelization method.");
       }
       return std::vector<R>();
     }
     
+    /**
+     * @brief Calls @p callable(i) for each @p i in [0, n), where n is the
+     * number of tasks given to the constructor.
+     *
+     * Unlike run(), this method does not collect return values. @p callable
+     * should write its result to a location owned by task @p i, so that
+     * results do not depend on the order in which tasks are scheduled.
+     *
+     * Forked processes cannot write to the memory of the caller: the FORK
+     * method falls back to PTHREAD.
+     */
+    template<typename Callable>
+    void for_each(Callable callable) const
+    {
+      switch (type_)
+      {
+        case OPENMP:
+          for_each_openmp(callable);
+          break;
+        case FORK:
+        case PTHREAD:
+          for_each_pthread(callable);
+          break;
+        case SINGLE:
+          for_each_single(callable);
+          break;
+        case POOL:
+          for_each_pool(callable);
+          break;
+        default:
+          NUKLEI_THROW("Unknown parallelization method.");
+      }
+    }
+    
+    /**
+     * @brief Returns the number of tasks that @p type can execute
+     * concurrently on this machine.
+     */
+    static int concurrency(const Type& type);
+    
   private:
     
+    template<typename Callable>
+    void for_each_openmp(Callable callable) const;
+    
+    template<typename Callable>
+    void for_each_pthread(Callable callable) const;
+    
+    template<typename Callable>
+    void for_each_single(Callable callable) const;
+    
+    template<typename Callable>
+    void for_each_pool(Callable callable) const;
+    
     template<typename R, typename Callable, typename PrintAccessor>
     std::vector<R> run_openmp(Callable callable,
                               PrintAccessor pa) const;
@@ -106,6 +165,22 @@ namespace nuklei {
       Callable callable_;
     };
     
+    // Runs a task in its own thread, with the random stream of its index.
+    template<typename Callable>
+    struct stream_wrapper
+    {
+      stream_wrapper(Callable callable, const int i) :
+      callable_(callable), i_(i) {}
+      void operator()()
+      {
+        Random::useThreadGenerators(i_);
+        callable_();
+      }
+    private:
+      Callable callable_;
+      int i_;
+    };
+    
     template<typename R, typename Callable, typename PrintAccessor>
     std::vector<R> run_pthread(Callable callable,
                                PrintAccessor pa) const;
@@ -114,6 +189,10 @@ namespace nuklei {
     std::vector<R> run_single(Callable callable,
                               PrintAccessor pa) const;
     
+    template<typename R, typename Callable, typename PrintAccessor>
+    std::vector<R> run_pool(Callable callable,
+                            PrintAccessor pa) const;
+    
     static void reap();
     
     int n_;
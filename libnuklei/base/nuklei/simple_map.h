@@ -92,6 +92,11 @@ namespace nuklei {
       map_.clear();
     }
 
+    bool empty() const
+    {
+      return map_.empty();
+    }
+
   private:
     map_impl map_;
 
@@ -0,0 +1,183 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#ifndef NUKLEI_TASK_POOL_H
+#define NUKLEI_TASK_POOL_H
+
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <exception>
+#include <future>
+#include <type_traits>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+namespace nuklei {
+
+  class task_group;
+
+  /**
+   * @brief Work-stealing thread pool.
+   *
+   * Each worker owns a queue of tasks. A worker runs the most recent task of
+   * its own queue, and when its queue is empty, it steals the oldest task of
+   * another worker. Tasks submitted by a worker go to the queue of that
+   * worker, which keeps nested tasks local until an idle worker steals them.
+   * Tasks submitted by other threads are distributed round robin.
+   *
+   * Tasks are submitted through a task_group, which allows waiting for their
+   * completion, or through async(), which returns a future.
+   *
+   * Workers draw random numbers from their own generators (see
+   * Random::useThreadGenerators()).
+   */
+  class task_pool : boost::noncopyable
+  {
+  public:
+    typedef boost::function<void ()> task;
+
+    /** @brief Starts @p nThreads workers. */
+    explicit task_pool(const int nThreads);
+    /** @brief Waits for the running tasks, and stops the workers. */
+    ~task_pool();
+
+    /** @brief Number of workers. */
+    int size() const { return queues_.size(); }
+
+    /**
+     * @brief Number of workers that are waiting for a task.
+     *
+     * This number is a hint: it may change by the time the caller uses it.
+     */
+    int idleWorkers() const { return idle_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Index of the calling thread within this pool, or -1 if the
+     * calling thread is not a worker of this pool.
+     */
+    int workerIndex() const;
+
+    /**
+     * @brief Runs @p callable on a worker, and returns a future holding its
+     * result, or the exception it threw.
+     *
+     * Waiting on the future blocks the calling thread. Tasks that run on a
+     * worker should wait for other tasks through a task_group instead.
+     */
+    template<typename Callable>
+    std::future<typename std::result_of<Callable()>::type>
+    async(Callable callable)
+    {
+      typedef typename std::result_of<Callable()>::type R;
+      boost::shared_ptr< std::packaged_task<R ()> >
+        t(new std::packaged_task<R ()>(callable));
+      std::future<R> f = t->get_future();
+      submit([t]() { (*t)(); }, NULL);
+      return f;
+    }
+    
+    /**
+     * @brief Returns the pool used by parallelizer::POOL, started at first
+     * use.
+     *
+     * The pool lives until the end of the program. Its size is given by
+     * setGlobalSize(), or else by the @c NUKLEI_POOL_SIZE environment
+     * variable, or else by the number of hardware threads.
+     */
+    static task_pool& global();
+    
+    /**
+     * @brief Sets the number of workers of global().
+     *
+     * Must be called before global() is first used.
+     */
+    static void setGlobalSize(const int nThreads);
+
+  private:
+    friend class task_group;
+
+    struct entry
+    {
+      entry() : group(NULL) {}
+      entry(const task& t, const task_group* g) : fn(t), group(g) {}
+      task fn;
+      const task_group* group;
+    };
+
+    struct queue
+    {
+      boost::mutex mutex;
+      std::deque<entry> tasks;
+    };
+
+    void submit(const task& t, const task_group* group);
+    // Pops the most recent task of group from the calling worker's queue.
+    bool popLocal(const task_group* group, entry& e);
+    // Pops the most recent task of queue index, or steals the oldest task of
+    // another queue.
+    bool pop(const int index, entry& e);
+    void work(const int index);
+
+    std::vector< boost::shared_ptr<queue> > queues_;
+    boost::thread_group threads_;
+    boost::mutex sleepMutex_;
+    boost::condition_variable wakeUp_;
+    std::atomic<int> pending_;
+    std::atomic<int> idle_;
+    std::atomic<unsigned> next_;
+    std::atomic<bool> stop_;
+  };
+
+  /**
+   * @brief Set of tasks executed by a task_pool.
+   *
+   * @code
+   * task_group g;
+   * for (int i = 0; i < n; ++i)
+   *   g.run(boost::bind(&f, i, boost::ref(results.at(i))));
+   * g.wait();
+   * @endcode
+   *
+   * When wait() is called from a worker of the pool, the worker runs the
+   * tasks of the group that are still in its queue, instead of blocking.
+   * Tasks may thus create and wait for groups of their own.
+   */
+  class task_group : boost::noncopyable
+  {
+  public:
+    explicit task_group(task_pool& pool = task_pool::global()) :
+    pool_(pool), pending_(0) {}
+    /** @brief Waits for the tasks of the group. Exceptions are dropped. */
+    ~task_group();
+
+    /** @brief Submits @p t to the pool. */
+    void run(const task_pool::task& t);
+
+    /**
+     * @brief Waits until all the tasks of the group have completed.
+     *
+     * If a task has thrown an exception, the first one is rethrown here.
+     */
+    void wait();
+
+  private:
+    friend class task_pool;
+
+    void execute(const task_pool::task& t);
+
+    task_pool& pool_;
+    std::atomic<int> pending_;
+    boost::mutex mutex_;
+    boost::condition_variable done_;
+    std::exception_ptr error_;
+  };
+
+}
+
+#endif
@@ -8,9 +8,13 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 namespace nuklei {
   
-  const std::string parallelizer::TypeNames[] = { "openmp", "fork", "pthread", "single" };
+  const std::string parallelizer::TypeNames[] = { "openmp", "fork", "pthread", "single", "pool" };
   
   void parallelizer::reap()
   {
@@ -19,4 +23,27 @@ namespace nuklei {
     while (::waitpid(-1, &status, WNOHANG) > 0) {}
   }
   
+  int parallelizer::concurrency(const Type& type)
+  {
+    switch (type)
+    {
+      case OPENMP:
+#ifdef _OPENMP
+        return std::max(omp_get_max_threads(), 1);
+#else
+        return 1;
+#endif
+      case FORK:
+      case PTHREAD:
+        return std::max(int(boost::thread::hardware_concurrency()), 1);
+      case SINGLE:
+        return 1;
+      case POOL:
+        return task_pool::global().size();
+      default:
+        NUKLEI_THROW("Unknown parallelization method.");
+    }
+    return 1;
+  }
+  
 }
@@ -0,0 +1,231 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#include <algorithm>
+#include <boost/bind.hpp>
+
+#include <nuklei/task_pool.h>
+#include <nuklei/Random.h>
+#include <nuklei/Common.h>
+
+namespace nuklei {
+
+  // Pool and index of the calling worker.
+  static thread_local const task_pool* currentPool = NULL;
+  static thread_local int currentIndex = -1;
+
+  task_pool::task_pool(const int nThreads) :
+  pending_(0), idle_(0), next_(0), stop_(false)
+  {
+    NUKLEI_TRACE_BEGIN();
+    NUKLEI_ASSERT(nThreads > 0);
+    for (int i = 0; i < nThreads; ++i)
+      queues_.push_back(boost::shared_ptr<queue>(new queue));
+    for (int i = 0; i < nThreads; ++i)
+      threads_.create_thread(boost::bind(&task_pool::work, this, i));
+    NUKLEI_TRACE_END();
+  }
+
+  task_pool::~task_pool()
+  {
+    {
+      boost::lock_guard<boost::mutex> lock(sleepMutex_);
+      stop_ = true;
+    }
+    wakeUp_.notify_all();
+    threads_.join_all();
+  }
+
+  int task_pool::workerIndex() const
+  {
+    return currentPool == this ? currentIndex : -1;
+  }
+
+  // Size of the global pool, or 0 if it has not been set.
+  static std::atomic<int> globalSize(0);
+  static std::atomic<bool> globalStarted(false);
+  
+  task_pool& task_pool::global()
+  {
+    static task_pool pool(globalSize > 0 ? int(globalSize) :
+                          POOL_SIZE > 0 ? int(POOL_SIZE) :
+                          std::max(int(boost::thread::hardware_concurrency()),
+                                   1));
+    globalStarted = true;
+    return pool;
+  }
+  
+  void task_pool::setGlobalSize(const int nThreads)
+  {
+    NUKLEI_TRACE_BEGIN();
+    NUKLEI_ASSERT(nThreads > 0);
+    if (globalStarted && global().size() != nThreads)
+      NUKLEI_THROW("The global pool has already been started with " <<
+                   global().size() << " workers.");
+    globalSize = nThreads;
+    NUKLEI_TRACE_END();
+  }
+
+  void task_pool::submit(const task& t, const task_group* group)
+  {
+    int index = workerIndex();
+    if (index < 0)
+      index = next_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+    // pending_ is incremented before the task is queued, so that a worker
+    // never goes to sleep while a task is on its way. The worker that sees
+    // pending_ > 0 before the task is queued will simply try again.
+    ++pending_;
+    {
+      queue& q = *queues_[index];
+      boost::lock_guard<boost::mutex> lock(q.mutex);
+      q.tasks.push_back(entry(t, group));
+    }
+    // Paired with the increment of idle_ in work(): either the worker sees
+    // the new value of pending_, or we see it idle and wake it up.
+    if (idle_.load() > 0)
+    {
+      boost::lock_guard<boost::mutex> lock(sleepMutex_);
+      wakeUp_.notify_one();
+    }
+  }
+
+  bool task_pool::popLocal(const task_group* group, entry& e)
+  {
+    const int index = workerIndex();
+    if (index < 0) return false;
+    queue& q = *queues_[index];
+    boost::lock_guard<boost::mutex> lock(q.mutex);
+    // Tasks submitted to the queue by other threads after the tasks of group
+    // are skipped.
+    for (std::deque<entry>::iterator i = q.tasks.end(); i != q.tasks.begin(); )
+    {
+      --i;
+      if (i->group != group) continue;
+      e = *i;
+      q.tasks.erase(i);
+      --pending_;
+      return true;
+    }
+    return false;
+  }
+
+  bool task_pool::pop(const int index, entry& e)
+  {
+    if (pending_.load() <= 0) return false;
+    const int n = queues_.size();
+    {
+      queue& q = *queues_[index];
+      boost::lock_guard<boost::mutex> lock(q.mutex);
+      if (!q.tasks.empty())
+      {
+        e = q.tasks.back();
+        q.tasks.pop_back();
+        --pending_;
+        return true;
+      }
+    }
+    for (int k = 1; k < n; ++k)
+    {
+      queue& q = *queues_[(index+k) % n];
+      boost::lock_guard<boost::mutex> lock(q.mutex);
+      if (!q.tasks.empty())
+      {
+        e = q.tasks.front();
+        q.tasks.pop_front();
+        --pending_;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void task_pool::work(const int index)
+  {
+    currentPool = this;
+    currentIndex = index;
+    Random::useThreadGenerators(index);
+    for (;;)
+    {
+      entry e;
+      if (pop(index, e))
+      {
+        // Tasks submitted by async() have no group. Their exceptions are
+        // stored in their future.
+        if (e.group != NULL)
+          const_cast<task_group*>(e.group)->execute(e.fn);
+        else
+          e.fn();
+        continue;
+      }
+      boost::unique_lock<boost::mutex> lock(sleepMutex_);
+      if (stop_) break;
+      ++idle_;
+      if (pending_.load() == 0 && !stop_)
+        wakeUp_.wait(lock);
+      --idle_;
+    }
+    currentPool = NULL;
+    currentIndex = -1;
+  }
+
+  task_group::~task_group()
+  {
+    try
+    {
+      wait();
+    }
+    catch (...) {}
+  }
+
+  void task_group::run(const task_pool::task& t)
+  {
+    ++pending_;
+    pool_.submit(t, this);
+  }
+
+  void task_group::execute(const task_pool::task& t)
+  {
+    try
+    {
+      t();
+    }
+    catch (...)
+    {
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      if (!error_) error_ = std::current_exception();
+    }
+    // The group may be destroyed as soon as wait() sees pending_ == 0. The
+    // decrement happens under mutex_, which wait() locks before returning.
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    if (--pending_ == 0)
+      done_.notify_all();
+  }
+
+  void task_group::wait()
+  {
+    task_pool::entry e;
+    while (pending_.load() > 0)
+    {
+      // Run the tasks of the group that no other worker has stolen yet.
+      if (pool_.popLocal(this, e))
+      {
+        execute(e.fn);
+        continue;
+      }
+      boost::unique_lock<boost::mutex> lock(mutex_);
+      while (pending_.load() > 0)
+        done_.wait(lock);
+    }
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    if (error_)
+    {
+      std::exception_ptr error = error_;
+      error_ = std::exception_ptr();
+      std::rethrow_exception(error);
+    }
+  }
+
+}
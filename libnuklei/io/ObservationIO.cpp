@@ -60,7 +60,7 @@ namespace nuklei {
     NUKLEI_UNIQUE_PTR<Observation> o;
     while ( (o = readObservation()).get() != NULL )
     {
-      kc.add(*o->getKernel());
+      kc.add(o->getKernel());
     }
     
     NUKLEI_TRACE_END();
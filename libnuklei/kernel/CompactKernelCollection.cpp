@@ -0,0 +1,429 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#include <nuklei/CompactKernelCollection.h>
+#include <nuklei/Common.h>
+#include <nuklei/Random.h>
+#include <nuklei/parallelizer.h>
+
+#include "KernelCollectionArray.h"
+
+#include "nanoflann.hpp"
+
+#include <boost/bind.hpp>
+#include <boost/iterator/indirect_iterator.hpp>
+
+namespace nuklei {
+
+  namespace
+  {
+    // nanoflann dataset adaptor that reads the positions of a packed array.
+    struct KernelArrayPoints
+    {
+      typedef kernel_array_types::KernelArray<float> Array;
+
+      explicit KernelArrayPoints(const Array& a) : a(a) {}
+
+      inline size_t kdtree_get_point_count() const { return a.size(); }
+
+      inline float kdtree_distance(const float *p1, const size_t idx_p2, size_t size) const
+      {
+        const float d0=p1[0]-a.x[idx_p2];
+        const float d1=p1[1]-a.y[idx_p2];
+        const float d2=p1[2]-a.z[idx_p2];
+        return d0*d0+d1*d1+d2*d2;
+      }
+
+      inline float kdtree_get_pt(const size_t idx, int dim) const
+      {
+        if (dim==0) return a.x[idx];
+        else if (dim==1) return a.y[idx];
+        else return a.z[idx];
+      }
+
+      template <class BBOX>
+      bool kdtree_get_bbox(BBOX &bb) const { return false; }
+
+      const Array& a;
+    };
+
+    typedef nuklei_nanoflann::KDTreeSingleIndexAdaptor<
+      nuklei_nanoflann::L2_Simple_Adaptor<float, KernelArrayPoints>,
+      KernelArrayPoints,
+      3 /* dim */
+      > KDTreeIndex;
+
+    // Adaptor of the kd-tree for kernel_array_types::eval_queries().
+    struct KDTreeNeighbors
+    {
+      KDTreeNeighbors(const KDTreeIndex& index, const float range) :
+        index(index), range(range) {}
+
+      void findNeighbors(const Vector3& loc, std::vector<size_t>& neighbors) const
+      {
+        static thread_local std::vector<std::pair<size_t,float> > indices_dists;
+        const float p[3] = { float(loc.X()), float(loc.Y()), float(loc.Z()) };
+        nuklei_nanoflann::RadiusResultSet<float,size_t> resultSet(range, indices_dists);
+        index.findNeighbors(resultSet, p, nuklei_nanoflann::SearchParams());
+        for (std::vector<std::pair<size_t,float> >::const_iterator i = indices_dists.begin();
+             i != indices_dists.end(); ++i)
+          neighbors.push_back(i->first);
+      }
+
+      const KDTreeIndex& index;
+      const float range;
+    };
+  }
+
+  struct CompactKernelCollection::KdTree
+  {
+    explicit KdTree(const kernel_array_types::KernelArray<float>& a) :
+      points(a),
+      index(3 /*dim*/, points,
+            nuklei_nanoflann::KDTreeSingleIndexAdaptorParams(10 /* max leaf */))
+    {
+      index.buildIndex();
+    }
+
+    KernelArrayPoints points;
+    KDTreeIndex index;
+  };
+
+  CompactKernelCollection::CompactKernelCollection() :
+    array_(new kernel_array_types::KernelArray<float>),
+    totalWeight_(0), maxLocCutPoint_(0)
+  {
+  }
+
+  CompactKernelCollection::CompactKernelCollection(const KernelCollection &kc) :
+    array_(new kernel_array_types::KernelArray<float>),
+    totalWeight_(0), maxLocCutPoint_(0)
+  {
+    assign(kc);
+  }
+
+  void CompactKernelCollection::assign(const KernelCollection &kc)
+  {
+    NUKLEI_TRACE_BEGIN();
+    using namespace kernel_array_types;
+
+    // The array is replaced instead of modified, as copies of *this may
+    // share it.
+    boost::shared_ptr< KernelArray<float> > array(new KernelArray<float>);
+    kernelType_ = boost::none;
+    if (!kc.empty())
+    {
+      kernelType_ = kc.front().polyType();
+      switch (*kernelType_)
+      {
+        case kernel::base::R3:
+          build_kernel_array<kernel::r3>(*array, kc.begin(), kc.end());
+          break;
+        case kernel::base::R3XS2:
+          build_kernel_array<kernel::r3xs2>(*array, kc.begin(), kc.end());
+          break;
+        case kernel::base::R3XS2P:
+          build_kernel_array<kernel::r3xs2p>(*array, kc.begin(), kc.end());
+          break;
+        case kernel::base::SE3:
+          build_kernel_array<kernel::se3>(*array, kc.begin(), kc.end());
+          break;
+        default:
+          NUKLEI_THROW("Unknow kernel type.");
+      }
+    }
+    array_ = array;
+    tree_.reset();
+
+    maxLocCutPoint_ = 0;
+    for (KernelCollection::const_iterator i = kc.begin(); i != kc.end(); ++i)
+    {
+      NUKLEI_ASSERT(i->polyType() == *kernelType_);
+      maxLocCutPoint_ = std::max(maxLocCutPoint_, i->polyCutPoint());
+    }
+    // The total is that of the stored weights, which sample() walks
+    // through.
+    totalWeight_ = 0;
+    for (std::vector<float>::const_iterator i = array_->w.begin();
+         i != array_->w.end(); ++i)
+      totalWeight_ += *i;
+    NUKLEI_TRACE_END();
+  }
+
+  size_t CompactKernelCollection::size() const
+  {
+    return array_->size();
+  }
+
+  kernel::base::Type CompactKernelCollection::kernelType() const
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (!kernelType_)
+      NUKLEI_THROW("Undefined kernel type.");
+    return *kernelType_;
+    NUKLEI_TRACE_END();
+  }
+
+  kernel::base::ptr CompactKernelCollection::at(const size_t i) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    using namespace kernel_array_types;
+    NUKLEI_ASSERT(i < size());
+    switch (kernelType())
+    {
+      case kernel::base::R3:
+        return kernel_array_at<kernel::r3>(*array_, i);
+      case kernel::base::R3XS2:
+        return kernel_array_at<kernel::r3xs2>(*array_, i);
+      case kernel::base::R3XS2P:
+        return kernel_array_at<kernel::r3xs2p>(*array_, i);
+      case kernel::base::SE3:
+        return kernel_array_at<kernel::se3>(*array_, i);
+      default:
+        NUKLEI_THROW("Unknow kernel type.");
+    }
+    NUKLEI_TRACE_END();
+  }
+
+  void CompactKernelCollection::buildKdTree()
+  {
+    NUKLEI_TRACE_BEGIN();
+    tree_.reset(new KdTree(*array_));
+    NUKLEI_TRACE_END();
+  }
+
+  template<class KernelType, class QueryIterator>
+  void CompactKernelCollection::staticEvaluationAt(QueryIterator first,
+                                                   QueryIterator last,
+                                                   weight_t* values,
+                                                   const EvaluationStrategy strategy,
+                                                   const kernel::se3* queryTransform) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    using namespace kernel_array_types;
+    typedef array_kernel<KernelType> ak;
+
+    NUKLEI_ASSERT(size() > 0);
+    NUKLEI_ASSERT(KernelType().type() == *kernelType_);
+
+    KernelArrayQuery<coord_t> query;
+    KernelType buffer;
+
+    if (KDTREE_DENSITY_EVAL && size() > 1000)
+    {
+      if (!tree_)
+        NUKLEI_THROW("Undefined kd-tree. Call buildKdTree() first.");
+
+      float range = maxLocCutPoint_;
+      // nanoflann takes squared distances.
+      range = range*range;
+
+      eval_queries<KernelType>(*array_, KDTreeNeighbors(tree_->index, range),
+                               first, last, values, strategy, queryTransform);
+    }
+    else
+    {
+      for (QueryIterator q = first; q != last; ++q, ++values)
+      {
+        NUKLEI_ASSERT(*kernelType_ == q->polyType());
+        const KernelType &evalPoint =
+          transformed_query(static_cast<const KernelType&>(*q), queryTransform, buffer);
+        ak::fill(query, evalPoint);
+        *values = eval_block<KernelType>(*array_, NULL, array_->size(),
+                                         query, strategy);
+      }
+    }
+
+    NUKLEI_TRACE_END();
+  }
+
+  template<class QueryIterator>
+  void CompactKernelCollection::dispatchEvaluationAt(QueryIterator first,
+                                                     QueryIterator last,
+                                                     weight_t* values,
+                                                     const EvaluationStrategy strategy,
+                                                     const kernel::se3* queryTransform) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    switch (kernelType())
+    {
+      case kernel::base::R3:
+        staticEvaluationAt<kernel::r3>(first, last, values, strategy, queryTransform);
+        break;
+      case kernel::base::R3XS2:
+        staticEvaluationAt<kernel::r3xs2>(first, last, values, strategy, queryTransform);
+        break;
+      case kernel::base::R3XS2P:
+        staticEvaluationAt<kernel::r3xs2p>(first, last, values, strategy, queryTransform);
+        break;
+      case kernel::base::SE3:
+        staticEvaluationAt<kernel::se3>(first, last, values, strategy, queryTransform);
+        break;
+      default:
+        NUKLEI_THROW("Unknow kernel type.");
+    }
+    NUKLEI_TRACE_END();
+  }
+
+  weight_t CompactKernelCollection::evaluationAt(const kernel::base &k,
+                                                 const EvaluationStrategy strategy) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (empty()) return 0;
+
+    weight_t value = 0;
+    const kernel::base* query = &k;
+    dispatchEvaluationAt(boost::make_indirect_iterator(&query),
+                         boost::make_indirect_iterator(&query + 1),
+                         &value, strategy);
+    return value;
+    NUKLEI_TRACE_END();
+  }
+
+  weight_t CompactKernelCollection::evaluationAt(const kernel::base &k,
+                                                 const kernel::se3 &t,
+                                                 const EvaluationStrategy strategy) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (empty()) return 0;
+
+    weight_t value = 0;
+    const kernel::base* query = &k;
+    dispatchEvaluationAt(boost::make_indirect_iterator(&query),
+                         boost::make_indirect_iterator(&query + 1),
+                         &value, strategy, &t);
+    return value;
+    NUKLEI_TRACE_END();
+  }
+
+  void CompactKernelCollection::evaluationAt(std::vector<const kernel::base*>::const_iterator first,
+                                             std::vector<const kernel::base*>::const_iterator last,
+                                             const kernel::se3 &t,
+                                             std::vector<weight_t> &values,
+                                             const EvaluationStrategy strategy) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    values.assign(std::distance(first, last), 0);
+    if (empty() || values.empty()) return;
+    dispatchEvaluationAt(boost::make_indirect_iterator(first),
+                         boost::make_indirect_iterator(last),
+                         &values.front(), strategy, &t);
+    NUKLEI_TRACE_END();
+  }
+
+  void CompactKernelCollection::evaluationAt(const KernelCollection &points,
+                                             std::vector<weight_t> &values,
+                                             const EvaluationStrategy strategy) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    values.assign(points.size(), 0);
+    if (empty() || values.empty()) return;
+    dispatchEvaluationAt(points.begin(), points.end(), &values.front(), strategy);
+    NUKLEI_TRACE_END();
+  }
+
+  void CompactKernelCollection::evaluationSliceAt(KernelCollection::const_iterator first,
+                                                  weight_t* values,
+                                                  const size_t n,
+                                                  const size_t sliceSize,
+                                                  const EvaluationStrategy strategy,
+                                                  const kernel::se3* queryTransform,
+                                                  const int slice) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    const size_t begin = slice*sliceSize;
+    const size_t end = std::min(begin+sliceSize, n);
+    if (begin >= end) return;
+    dispatchEvaluationAt(first+begin, first+end, values+begin, strategy,
+                         queryTransform);
+    NUKLEI_TRACE_END();
+  }
+
+  void CompactKernelCollection::evaluationAt(const KernelCollection &points,
+                                             std::vector<weight_t> &values,
+                                             const EvaluationStrategy strategy,
+                                             const parallelizer::Type parallelization) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    parallelEvaluationAt(points, values, strategy, NULL, parallelization);
+    NUKLEI_TRACE_END();
+  }
+
+  void CompactKernelCollection::evaluationAt(const KernelCollection &points,
+                                             const kernel::se3 &t,
+                                             std::vector<weight_t> &values,
+                                             const EvaluationStrategy strategy,
+                                             const parallelizer::Type parallelization) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    parallelEvaluationAt(points, values, strategy, &t, parallelization);
+    NUKLEI_TRACE_END();
+  }
+
+  void CompactKernelCollection::parallelEvaluationAt(const KernelCollection &points,
+                                                     std::vector<weight_t> &values,
+                                                     const EvaluationStrategy strategy,
+                                                     const kernel::se3* queryTransform,
+                                                     const parallelizer::Type parallelization) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    const size_t n = points.size();
+    values.assign(n, 0);
+    if (empty() || n == 0) return;
+
+    // See kernel_array_types::check_query_types().
+    kernel_array_types::check_query_types(points.begin(), points.end(),
+                                          kernelType());
+    if (KDTREE_DENSITY_EVAL && size() > 1000 && !tree_)
+      NUKLEI_THROW("Undefined kd-tree. Call buildKdTree() first.");
+
+    // See KernelCollection::evaluationAt() for the choice of slice sizes.
+    const size_t minSliceSize = 256;
+    int nSlices = parallelizer::concurrency(parallelization);
+    if (parallelization == parallelizer::OPENMP) nSlices *= 4;
+    nSlices = std::max<int>(1, std::min<size_t>(nSlices, n/minSliceSize));
+    const size_t sliceSize = (n + nSlices - 1) / nSlices;
+
+    if (nSlices == 1)
+    {
+      dispatchEvaluationAt(points.begin(), points.end(), &values.front(),
+                           strategy, queryTransform);
+      return;
+    }
+
+    parallelizer p(nSlices, parallelization);
+    p.for_each(boost::bind(&CompactKernelCollection::evaluationSliceAt, this,
+                           points.begin(), &values.front(), n, sliceSize,
+                           strategy, queryTransform, _1));
+    NUKLEI_TRACE_END();
+  }
+
+  KernelCollection CompactKernelCollection::sample(int sampleSize) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    // Systematic sampling, as in KernelCollection::sample().
+    KernelCollection s;
+    if (sampleSize <= 0 || empty()) return s;
+    s.reserve(sampleSize);
+    const std::vector<float>& w = array_->w;
+    const weight_t step = totalWeight_ / sampleSize;
+    weight_t position = Random::uniform() * step;
+    for (size_t j = 0; j < w.size(); ++j)
+    {
+      while (position < w[j])
+      {
+        position += step;
+        kernel::base::ptr k = at(j)->polySample();
+        k->setWeight( 1.0/sampleSize );
+        s.add(NUKLEI_MOVE(k));
+      }
+      position -= w[j];
+    }
+    return s;
+    NUKLEI_TRACE_END();
+  }
+
+}
@@ -8,6 +8,7 @@
 #include <cassert>
 #include <algorithm>
 #include <cmath>
+#include <cstring>
 
 #include <queue>
 #include <set>
@@ -17,15 +18,124 @@
 #include <nuklei/Common.h>
 #include <nuklei/Indenter.h>
 
+#include "KernelCollectionArray.h"
+
+
 
 namespace nuklei {
 
-  const int KernelCollection::HULL_KEY          = 0;
-  const int KernelCollection::KDTREE_KEY        = 1;
-  const int KernelCollection::NSTREE_KEY        = 2;
-  const int KernelCollection::MESH_KEY          = 3;
-  const int KernelCollection::AABBTREE_KEY      = 4;
-  const int KernelCollection::VIEWCACHE_KEY     = 5;
+  const int KernelCollection::HULL_KEY          = HULL_HELPER;
+  const int KernelCollection::KDTREE_KEY        = KDTREE_HELPER;
+  const int KernelCollection::NSTREE_KEY        = NSTREE_HELPER;
+  const int KernelCollection::MESH_KEY          = MESH_HELPER;
+  const int KernelCollection::VISIBILITY_KEY    = VISIBILITY_HELPER;
+  const int KernelCollection::VIEWCACHE_KEY     = VIEWCACHE_HELPER;
+  const int KernelCollection::KERNELARRAY_KEY   = KERNELARRAY_HELPER;
+  
+  namespace
+  {
+    // Kernel properties on which intermediary results depend.
+    const bitfield_t LOC_PROPERTY = 1 << 0;
+    const bitfield_t ORI_PROPERTY = 1 << 1;
+    const bitfield_t LOC_H_PROPERTY = 1 << 2;
+    const bitfield_t ORI_H_PROPERTY = 1 << 3;
+    const bitfield_t WEIGHT_PROPERTY = 1 << 4;
+    const int N_PROPERTIES = 5;
+    const bitfield_t ALL_PROPERTIES = (1 << N_PROPERTIES) - 1;
+    
+    // Properties on which each result stored in deco_ depends, indexed by
+    // key. Kernel statistics are handled in dropHelperStructures().
+    const bitfield_t HELPER_DEPENDENCIES[] =
+    {
+      LOC_PROPERTY,                // HULL_KEY
+      LOC_PROPERTY,                // KDTREE_KEY
+      LOC_PROPERTY,                // NSTREE_KEY
+      LOC_PROPERTY,                // MESH_KEY
+      LOC_PROPERTY,                // VISIBILITY_KEY
+      LOC_PROPERTY | ORI_PROPERTY, // VIEWCACHE_KEY
+      ALL_PROPERTIES               // KERNELARRAY_KEY
+    };
+    
+    // Values of the properties of a kernel, as recorded by
+    // KernelCollection::snapshot(). The values of property p are at
+    // [PROPERTY_VALUES[p], PROPERTY_VALUES[p+1]).
+    const int PROPERTY_VALUES[N_PROPERTIES+1] = { 0, 3, 7, 8, 9, 10 };
+    const int N_VALUES = PROPERTY_VALUES[N_PROPERTIES];
+    
+    // Writes the N_VALUES property values of k to v.
+    void read_properties(coord_t* v, const kernel::base& k)
+    {
+      std::fill(v, v+N_VALUES, coord_t(0));
+      const Vector3 loc = k.getLoc();
+      v[0] = loc.X(); v[1] = loc.Y(); v[2] = loc.Z();
+      switch (k.polyType())
+      {
+        case kernel::base::SE3:
+        {
+          const Quaternion& q = static_cast<const kernel::se3&>(k).ori_;
+          v[3] = q.W(); v[4] = q.X(); v[5] = q.Y(); v[6] = q.Z();
+          break;
+        }
+        case kernel::base::R3XS2:
+        {
+          const Vector3& d = static_cast<const kernel::r3xs2&>(k).dir_;
+          v[3] = d.X(); v[4] = d.Y(); v[5] = d.Z();
+          break;
+        }
+        case kernel::base::R3XS2P:
+        {
+          const Vector3& d = static_cast<const kernel::r3xs2p&>(k).dir_;
+          v[3] = d.X(); v[4] = d.Y(); v[5] = d.Z();
+          break;
+        }
+        default:
+          break;
+      }
+      v[7] = k.getLocH();
+      v[8] = k.getOriH();
+      v[9] = k.getWeight();
+    }
+    
+    // Returns the properties whose values differ between before and after.
+    // Values are compared bitwise: a NaN equals itself.
+    bitfield_t changed_properties(const coord_t* before, const coord_t* after)
+    {
+      bitfield_t changed = 0;
+      for (int p = 0; p < N_PROPERTIES; ++p)
+      {
+        const int first = PROPERTY_VALUES[p];
+        const int n = PROPERTY_VALUES[p+1] - first;
+        if (std::memcmp(before+first, after+first, n*sizeof(coord_t)) != 0)
+          changed |= bitfield_t(1) << p;
+      }
+      return changed;
+    }
+  }
+  
+  KernelCollection::HelperTracker::HelperTracker() :
+    modified(false),
+    buildCounts(N_HELPERS, 0), invalidationCounts(N_HELPERS, 0)
+  {
+  }
+  
+  KernelCollection::HelperTracker::HelperTracker(const HelperTracker& t) :
+    modified(t.modified.load()), snapshot(t.snapshot),
+    touched(t.touched), pendingFrom(t.pendingFrom),
+    buildCounts(t.buildCounts), invalidationCounts(t.invalidationCounts)
+  {
+  }
+  
+  KernelCollection::HelperTracker&
+  KernelCollection::HelperTracker::operator=(const HelperTracker& t)
+  {
+    modified = t.modified.load();
+    snapshot = t.snapshot;
+    touched = t.touched;
+    pendingFrom = t.pendingFrom;
+    buildCounts = t.buildCounts;
+    invalidationCounts = t.invalidationCounts;
+    return *this;
+  }
   
   std::istream& operator>>(std::istream &in, KernelCollection &v)
   {
@@ -37,9 +147,211 @@ namespace nuklei {
   
   void KernelCollection::invalidateHelperStructures()
   {
-    totalWeight_ = boost::none;
-    maxLocCutPoint_ = boost::none;
-    deco_.clear();
+    if (!deco_.empty() || totalWeight_ || maxLocCutPoint_)
+      dropHelperStructures(ALL_PROPERTIES);
+    helperFrame_ = boost::none;
+    tracker_.snapshot.clear();
+    tracker_.touched.clear();
+    tracker_.pendingFrom = boost::none;
+    tracker_.modified = false;
+  }
+  
+  void KernelCollection::replaceKernels(Container& kernels,
+                                        const bool samePositions)
+  {
+    NUKLEI_TRACE_BEGIN();
+    refreshHelperStructures();
+    kernels_.swap(kernels);
+    if (kernels_.empty())
+      kernelType_ = boost::none;
+    else
+      kernelType_ = kernels_.front().polyType();
+    if (samePositions)
+      dropHelperStructures(ALL_PROPERTIES & ~LOC_PROPERTY);
+    else
+      invalidateHelperStructures();
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelCollection::invalidateHelperStructures(const bitfield_t properties) const
+  {
+    refreshHelperStructures();
+    dropHelperStructures(properties);
+  }
+  
+  void KernelCollection::dropHelperStructures(const bitfield_t properties) const
+  {
+    for (int key = 0; key < KERNELSTATISTICS_HELPER; ++key)
+      if ((HELPER_DEPENDENCIES[key] & properties) && deco_.has_key(key))
+        eraseHelperStructure(key);
+    
+    bool statistics = false;
+    if ((properties & WEIGHT_PROPERTY) && totalWeight_)
+    {
+      totalWeight_ = boost::none;
+      statistics = true;
+    }
+    if ((properties & LOC_H_PROPERTY) && maxLocCutPoint_)
+    {
+      maxLocCutPoint_ = boost::none;
+      statistics = true;
+    }
+    if (statistics)
+      tracker_.invalidationCounts.at(KERNELSTATISTICS_HELPER)++;
+    
+    if (!deco_.has_key(KDTREE_KEY) && !deco_.has_key(KERNELARRAY_KEY))
+      helperFrame_ = boost::none;
+  }
+  
+  void KernelCollection::updateHelperStructures(const size_t idx,
+                                                const kernel::base* previous) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    const kernel::base& k = kernels_[idx];
+    
+    if (totalWeight_)
+    {
+      *totalWeight_ += k.getWeight();
+      if (previous != NULL) *totalWeight_ -= previous->getWeight();
+    }
+    if (maxLocCutPoint_)
+    {
+      if (previous != NULL && previous->polyCutPoint() >= *maxLocCutPoint_ &&
+          k.polyCutPoint() < previous->polyCutPoint())
+      {
+        // The largest cut point may have been removed.
+        *maxLocCutPoint_ = 0;
+        for (Container::const_iterator i = kernels_.begin(); i != kernels_.end(); ++i)
+          *maxLocCutPoint_ = std::max(*maxLocCutPoint_, i->polyCutPoint());
+      }
+      else
+        *maxLocCutPoint_ = std::max(*maxLocCutPoint_, k.polyCutPoint());
+    }
+    
+    for (int key = 0; key < KERNELSTATISTICS_HELPER; ++key)
+      if (key != KDTREE_KEY && deco_.has_key(key))
+        eraseHelperStructure(key);
+    if (deco_.has_key(KDTREE_KEY))
+      updateKdTree(idx, previous);
+    else
+      helperFrame_ = boost::none;
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelCollection::eraseHelperStructure(const int key) const
+  {
+    deco_.erase(key);
+    tracker_.invalidationCounts.at(key)++;
+  }
+  
+  std::vector<coord_t> KernelCollection::snapshot() const
+  {
+    const size_t n = integratedSize();
+    std::vector<coord_t> v(n*N_VALUES);
+    for (size_t i = 0; i < n; ++i)
+      read_properties(&v[i*N_VALUES], kernels_[i]);
+    return v;
+  }
+  
+  size_t KernelCollection::integratedSize() const
+  {
+    return tracker_.pendingFrom ? *tracker_.pendingFrom : size();
+  }
+  
+  void KernelCollection::markModified()
+  {
+    if (!tracker_.snapshot.empty()) return;
+    if (deco_.empty() && !totalWeight_ && !maxLocCutPoint_) return;
+    // Kernels already in touched keep their own snapshot, which catches the
+    // changes made before this call.
+    tracker_.snapshot = snapshot();
+    tracker_.modified = true;
+  }
+  
+  void KernelCollection::markModified(const size_t idx)
+  {
+    // Pending kernels are integrated with the values they hold at the next
+    // refresh, and need no snapshot.
+    if (idx >= integratedSize() || !tracker_.snapshot.empty()) return;
+    if (deco_.empty() && !totalWeight_ && !maxLocCutPoint_) return;
+    std::vector<coord_t>& v = tracker_.touched[idx];
+    if (!v.empty()) return;
+    v.resize(N_VALUES);
+    read_properties(&v.front(), kernels_[idx]);
+    tracker_.modified = true;
+  }
+  
+  void KernelCollection::addPending(kernel::base::ptr f)
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (deco_.empty() && !totalWeight_ && !maxLocCutPoint_)
+    {
+      // Nothing to update.
+      add(NUKLEI_MOVE(f));
+      return;
+    }
+    NUKLEI_ASSERT(f.get() != NULL);
+    if (size() == 0)
+      kernelType_ = f->polyType();
+    else
+      NUKLEI_ASSERT(*kernelType_ == f->polyType());
+    if (!tracker_.pendingFrom)
+      tracker_.pendingFrom = size();
+    kernels_.push_back(NUKLEI_RELEASE(f));
+    tracker_.modified = true;
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelCollection::refreshHelperStructures() const
+  {
+    // Concurrent const calls may get here together. The first one compares
+    // snapshots, the others wait for it.
+    if (!tracker_.modified.load(std::memory_order_acquire)) return;
+    boost::mutex::scoped_lock lock(tracker_.mutex);
+    if (!tracker_.modified.load(std::memory_order_relaxed)) return;
+    
+    bitfield_t changed = 0;
+    coord_t v[N_VALUES];
+    if (!tracker_.snapshot.empty())
+    {
+      const size_t n = std::min(tracker_.snapshot.size() / N_VALUES, size());
+      for (size_t i = 0; i < n && changed != ALL_PROPERTIES; ++i)
+      {
+        read_properties(v, kernels_[i]);
+        changed |= changed_properties(&tracker_.snapshot[i*N_VALUES], v);
+      }
+    }
+    for (std::map< std::size_t, std::vector<coord_t> >::const_iterator
+         i = tracker_.touched.begin(); i != tracker_.touched.end(); ++i)
+    {
+      read_properties(v, kernels_.at(i->first));
+      changed |= changed_properties(&i->second.front(), v);
+    }
+    dropHelperStructures(changed);
+    if (tracker_.pendingFrom)
+    {
+      const size_t first = *tracker_.pendingFrom;
+      tracker_.pendingFrom = boost::none;
+      for (size_t i = first; i < size(); ++i)
+        updateHelperStructures(i, NULL);
+    }
+    tracker_.snapshot.clear();
+    tracker_.touched.clear();
+    tracker_.modified.store(false, std::memory_order_release);
+  }
+  
+  int KernelCollection::helperBuildCount(const HelperStructure h) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    return tracker_.buildCounts.at(h);
+    NUKLEI_TRACE_END();
+  }
+  
+  int KernelCollection::helperInvalidationCount(const HelperStructure h) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    return tracker_.invalidationCounts.at(h);
+    NUKLEI_TRACE_END();
   }
 
   void KernelCollection::assertConsistency() const
@@ -64,20 +376,45 @@ namespace nuklei {
   void KernelCollection::add(const kernel::base &f)
   {
     NUKLEI_TRACE_BEGIN();
-    invalidateHelperStructures();
+    add(f.clone());
+    NUKLEI_TRACE_END();
+  }
+
+  void KernelCollection::add(kernel::base::ptr f)
+  {
+    NUKLEI_TRACE_BEGIN();
+    NUKLEI_ASSERT(f.get() != NULL);
     if (size() == 0)
-      kernelType_ = f.polyType();
+      kernelType_ = f->polyType();
     else
-      NUKLEI_ASSERT(*kernelType_ == f.polyType());
-    kernels_.push_back(NUKLEI_RELEASE(f.clone()));
+      NUKLEI_ASSERT(*kernelType_ == f->polyType());
+    refreshHelperStructures();
+    kernels_.push_back(NUKLEI_RELEASE(f));
+    updateHelperStructures(size()-1, NULL);
     NUKLEI_TRACE_END();
   }
 
   void KernelCollection::add(const KernelCollection &kv)
   {
     NUKLEI_TRACE_BEGIN();
-    for (const_iterator i = kv.begin(); i != kv.end(); ++i)
-      add(*i);
+    // kv may be *this: its size is read once, and storage is reserved
+    // before any kernel is copied.
+    const size_t n = kv.size(), first = size();
+    if (n == 0) return;
+    if (first == 0)
+      kernelType_ = kv.kernelType();
+    else
+      NUKLEI_ASSERT(*kernelType_ == kv.kernelType());
+    refreshHelperStructures();
+    kernels_.reserve(first + n);
+    for (size_t i = 0; i < n; ++i)
+      kernels_.push_back(NUKLEI_RELEASE(kv.kernels_[i].clone()));
+    
+    if (deco_.has_key(KDTREE_KEY))
+      for (size_t i = first; i < first + n; ++i)
+        updateHelperStructures(i, NULL);
+    else
+      invalidateHelperStructures();
     NUKLEI_TRACE_END();
   }
   
@@ -86,8 +423,10 @@ namespace nuklei {
     NUKLEI_TRACE_BEGIN();
     NUKLEI_ASSERT(0 <= idx && idx < size());
     NUKLEI_ASSERT(*kernelType_ == k.polyType());
-    kernels_.replace(idx, NUKLEI_RELEASE(k.clone()));
-    invalidateHelperStructures();
+    refreshHelperStructures();
+    Container::auto_type previous =
+      kernels_.replace(idx, NUKLEI_RELEASE(k.clone()));
+    updateHelperStructures(idx, previous.get());
     NUKLEI_TRACE_END();
   }
 
@@ -107,9 +446,8 @@ namespace nuklei {
   {
     // First create predicate
     is_picked predicate(sampleSize, totalWeight());
-    // Then invalidate helper structures, as the user may use the iterator
-    // to change the data.
-    invalidateHelperStructures();        
+    // begin() records a snapshot of the kernels, as the user may use the
+    // iterator to change the data.
     return sample_iterator(predicate, begin(), end());
   }
   
@@ -123,7 +461,6 @@ namespace nuklei {
   KernelCollection::sort_iterator
   KernelCollection::sortBegin(size_t sortSize)
   {
-    invalidateHelperStructures();
     return nuklei_trsl::sort_iterator(begin(), end(),
                                       std::greater<kernel::base>(), sortSize);
   }
@@ -139,6 +476,7 @@ namespace nuklei {
   void KernelCollection::computeKernelStatistics()
   {
     NUKLEI_TRACE_BEGIN();
+    refreshHelperStructures();
     totalWeight_ = 0;
     maxLocCutPoint_ = 0;
     for (Container::const_iterator i = kernels_.begin(); i != kernels_.end(); i++)
@@ -146,12 +484,14 @@ namespace nuklei {
       *totalWeight_ += i->getWeight();
       *maxLocCutPoint_ = std::max(*maxLocCutPoint_, i->polyCutPoint());
     }
+    tracker_.buildCounts.at(KERNELSTATISTICS_HELPER)++;
     NUKLEI_TRACE_END();
   }
 
   weight_t KernelCollection::totalWeight() const
   {
     NUKLEI_TRACE_BEGIN();
+    refreshHelperStructures();
     if (!totalWeight_)
       NUKLEI_THROW("Undefined total weight. Call computeKernelStatistics() first.");
     return *totalWeight_;
@@ -161,6 +501,7 @@ namespace nuklei {
   weight_t KernelCollection::maxLocCutPoint() const
   {
     NUKLEI_TRACE_BEGIN();
+    refreshHelperStructures();
     if (!maxLocCutPoint_)
       NUKLEI_THROW("Undefined max cut point. Call computeKernelStatistics() first.");
     return *maxLocCutPoint_;
@@ -177,12 +518,15 @@ namespace nuklei {
       return;
     }
     
+    refreshHelperStructures();
     if (!totalWeight_)
       computeKernelStatistics();
     
+    weight_t total = *totalWeight_;
+    invalidateHelperStructures(WEIGHT_PROPERTY);
     for (Container::iterator i = kernels_.begin(); i != kernels_.end(); ++i)
     {
-      i->setWeight( i->getWeight() / *totalWeight_ );
+      i->setWeight( i->getWeight() / total );
     }
     
     totalWeight_ = 1;
@@ -193,6 +537,7 @@ namespace nuklei {
   void KernelCollection::uniformizeWeights()
   {
     coord_t w = coord_t(1)/size();
+    invalidateHelperStructures(WEIGHT_PROPERTY);
     for (Container::iterator i = kernels_.begin(); i != kernels_.end(); ++i)
       i->setWeight(w);
     totalWeight_ = 1;
@@ -249,8 +594,22 @@ namespace nuklei {
   void KernelCollection::transformWith(const kernel::se3& t)
   {
     NUKLEI_TRACE_BEGIN();
-    invalidateHelperStructures();
-    for (iterator i = begin(); i != end(); i++)
+    refreshHelperStructures();
+    // Rigid transformations preserve the kernel statistics. The kd-tree and
+    // the kernel array stay in their own frame, which is recorded in
+    // helperFrame_. The other intermediary results are destroyed.
+    if (deco_.has_key(KDTREE_KEY) || deco_.has_key(KERNELARRAY_KEY))
+    {
+      if (helperFrame_)
+        helperFrame_ = helperFrame_->transformedWith(t);
+      else
+        helperFrame_ = t;
+    }
+    const int keys[] = { HULL_KEY, NSTREE_KEY, MESH_KEY, VISIBILITY_KEY,
+      VIEWCACHE_KEY };
+    for (unsigned i = 0; i < sizeof(keys)/sizeof(int); ++i)
+      if (deco_.has_key(keys[i])) eraseHelperStructure(keys[i]);
+    for (Container::iterator i = kernels_.begin(); i != kernels_.end(); i++)
       i->polyMakeTransformWith(t);
     NUKLEI_TRACE_END();
   }
@@ -278,13 +637,41 @@ namespace nuklei {
   {
     NUKLEI_TRACE_BEGIN();
     KernelCollection s;
+    refreshHelperStructures();
+    if (deco_.has_key(KERNELARRAY_KEY))
+    {
+      // Systematic sampling, as in sampleBegin(), over the packed weights.
+      using namespace kernel_array_types;
+      boost::shared_ptr< KernelArray<coord_t> > array =
+        deco_.get< boost::shared_ptr< KernelArray<coord_t> > >(KERNELARRAY_KEY);
+      const std::vector<coord_t>& w = array->w;
+      
+      if (sampleSize <= 0) return s;
+      s.reserve(sampleSize);
+      const weight_t step = totalWeight() / sampleSize;
+      weight_t position = Random::uniform() * step;
+      for (size_t j = 0; j < w.size(); ++j)
+      {
+        while (position < w[j])
+        {
+          position += step;
+          kernel::base::ptr k = kernels_[j].polySample();
+          k->setWeight( 1.0/sampleSize );
+          s.add(NUKLEI_MOVE(k));
+        }
+        position -= w[j];
+      }
+      return s;
+    }
+    
+    if (sampleSize > 0) s.reserve(sampleSize);
     for (const_sample_iterator
          i = sampleBegin(sampleSize);
          i != i.end(); ++i)
     {
       kernel::base::ptr k = i->polySample();
       k->setWeight( 1.0/sampleSize );
-      s.add(*k);
+      s.add(NUKLEI_MOVE(k));
     }
     return s;
     NUKLEI_TRACE_END();
@@ -309,6 +696,7 @@ namespace nuklei {
   void KernelCollection::setKernelLocH(coord_t h)
   {
     NUKLEI_TRACE_BEGIN();
+    invalidateHelperStructures(LOC_H_PROPERTY);
     for (iterator i = kernels_.begin(); i != kernels_.end(); i++)
     {
       i->setLocH(h);
@@ -320,6 +708,7 @@ namespace nuklei {
   void KernelCollection::setKernelOriH(coord_t h)
   {
     NUKLEI_TRACE_BEGIN();
+    invalidateHelperStructures(ORI_H_PROPERTY);
     for (iterator i = kernels_.begin(); i != kernels_.end(); i++)
       i->setOriH(h);
     NUKLEI_TRACE_END();
@@ -0,0 +1,348 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#include "KernelCollectionArray.h"
+
+#include <nuklei/Common.h>
+#include <nuklei/SimdMath.h>
+
+namespace nuklei
+{
+
+  namespace kernel_array_types
+  {
+
+    template<class KernelType, typename T>
+    static coord_t eval_block_scalar(const KernelArray<T>& a,
+                                     const size_t* idx,
+                                     const size_t begin, const size_t n,
+                                     const KernelArrayQuery<coord_t>& q,
+                                     const KernelCollection::EvaluationStrategy strategy,
+                                     coord_t value)
+    {
+      typedef array_kernel<KernelType> ak;
+      for (size_t k = begin; k < n; ++k)
+      {
+        const size_t j = (idx == NULL ? k : idx[k]);
+        accumulate_evaluation(value, ak::eval(a, j, q), a.w[j], strategy);
+      }
+      return value;
+    }
+
+#if NUKLEI_X86_SIMD
+
+    // Each implementation below follows array_kernel::eval() operation by
+    // operation, on 2, 4 or 8 kernels. Conditionals become masks: the
+    // position value is zeroed outside of the triangle kernel's support, and
+    // the whole value is zeroed when the position value is below FLOATTOL.
+    // The orientation term uses the vector FastNegExp() of SimdMath.h.
+
+    // SSE2 ------------------------------------------------------------------
+
+    // The load functions read 2, 4 or 8 values, contiguous or gathered
+    // through idx, and convert float storage to double.
+
+    __attribute__((target("sse2")))
+    static inline __m128d load_sse2(const std::vector<double>& v,
+                                    const size_t* idx, const size_t k)
+    {
+      if (idx == NULL) return _mm_loadu_pd(&v[k]);
+      else return _mm_set_pd(v[idx[k+1]], v[idx[k]]);
+    }
+
+    __attribute__((target("sse2")))
+    static inline __m128d load_sse2(const std::vector<float>& v,
+                                    const size_t* idx, const size_t k)
+    {
+      if (idx == NULL) return _mm_set_pd(v[k+1], v[k]);
+      else return _mm_set_pd(v[idx[k+1]], v[idx[k]]);
+    }
+
+    template<class KernelType, typename T>
+    __attribute__((target("sse2")))
+    static coord_t eval_block_sse2(const KernelArray<T>& a,
+                                   const size_t* idx, const size_t n,
+                                   const KernelArrayQuery<coord_t>& q,
+                                   const KernelCollection::EvaluationStrategy strategy)
+    {
+      typedef array_kernel<KernelType> ak;
+      const __m128d spread = _mm_set1_pd(shape_function<shapeS::triangle,
+        func_implS::approx, squaredS::yes>::gauss_equiv_spread);
+      const __m128d one = _mm_set1_pd(1);
+      const __m128d floattol = _mm_set1_pd(FLOATTOL);
+      const __m128d signmask = _mm_set1_pd(-0.);
+      const __m128d qx = _mm_set1_pd(q.x), qy = _mm_set1_pd(q.y),
+        qz = _mm_set1_pd(q.z);
+      const __m128d q0 = _mm_set1_pd(q.o[0]), q1 = _mm_set1_pd(q.o[1]),
+        q2 = _mm_set1_pd(q.o[2]), q3 = _mm_set1_pd(q.o[3]);
+
+      __m128d acc = _mm_setzero_pd();
+      size_t k = 0;
+      for (; k+2 <= n; k += 2)
+      {
+        const __m128d dx = _mm_sub_pd(load_sse2(a.x, idx, k), qx);
+        const __m128d dy = _mm_sub_pd(load_sse2(a.y, idx, k), qy);
+        const __m128d dz = _mm_sub_pd(load_sse2(a.z, idx, k), qz);
+        const __m128d d2 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx),
+                                                 _mm_mul_pd(dy, dy)),
+                                      _mm_mul_pd(dz, dz));
+        const __m128d sh = _mm_mul_pd(spread, load_sse2(a.locH, idx, k));
+        __m128d value = _mm_sub_pd(one, _mm_div_pd(_mm_sqrt_pd(d2), sh));
+        value = _mm_and_pd(_mm_cmple_pd(d2, _mm_mul_pd(sh, sh)), value);
+
+        if (ak::ori_dim > 0)
+        {
+          __m128d dot = _mm_add_pd(_mm_add_pd(_mm_mul_pd(load_sse2(a.o0, idx, k), q0),
+                                              _mm_mul_pd(load_sse2(a.o1, idx, k), q1)),
+                                   _mm_mul_pd(load_sse2(a.o2, idx, k), q2));
+          if (ak::ori_dim == 4)
+            dot = _mm_add_pd(dot, _mm_mul_pd(load_sse2(a.o3, idx, k), q3));
+          if (ak::abs_dot) dot = _mm_andnot_pd(signmask, dot);
+          const __m128d e = simd::FastNegExp(_mm_mul_pd(load_sse2(a.oriKappa, idx, k),
+                                                        _mm_sub_pd(one, dot)));
+          value = _mm_and_pd(_mm_cmpge_pd(value, floattol),
+                             _mm_mul_pd(value, e));
+        }
+
+        if (strategy == KernelCollection::MAX_EVAL)
+          acc = _mm_max_pd(acc, value);
+        else if (strategy == KernelCollection::SUM_EVAL)
+          acc = _mm_add_pd(acc, value);
+        else
+          acc = _mm_add_pd(acc, _mm_mul_pd(value, load_sse2(a.w, idx, k)));
+      }
+
+      double lanes[2];
+      _mm_storeu_pd(lanes, acc);
+      coord_t value = 0;
+      for (int l = 0; l < 2; ++l)
+        accumulate_evaluation(value, lanes[l], 1, strategy == KernelCollection::MAX_EVAL ?
+                              strategy : KernelCollection::SUM_EVAL);
+      return eval_block_scalar<KernelType, T>(a, idx, k, n, q, strategy, value);
+    }
+
+    // AVX2 ------------------------------------------------------------------
+
+    __attribute__((target("avx2")))
+    static inline __m256d load_avx2(const std::vector<double>& v,
+                                    const size_t* idx, const size_t k)
+    {
+      if (idx == NULL) return _mm256_loadu_pd(&v[k]);
+      const __m256i vi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(idx+k));
+      return _mm256_i64gather_pd(&v[0], vi, 8);
+    }
+
+    __attribute__((target("avx2")))
+    static inline __m256d load_avx2(const std::vector<float>& v,
+                                    const size_t* idx, const size_t k)
+    {
+      if (idx == NULL) return _mm256_cvtps_pd(_mm_loadu_ps(&v[k]));
+      const __m256i vi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(idx+k));
+      return _mm256_cvtps_pd(_mm256_i64gather_ps(&v[0], vi, 4));
+    }
+
+    template<class KernelType, typename T>
+    __attribute__((target("avx2")))
+    static coord_t eval_block_avx2(const KernelArray<T>& a,
+                                   const size_t* idx, const size_t n,
+                                   const KernelArrayQuery<coord_t>& q,
+                                   const KernelCollection::EvaluationStrategy strategy)
+    {
+      typedef array_kernel<KernelType> ak;
+      const __m256d spread = _mm256_set1_pd(shape_function<shapeS::triangle,
+        func_implS::approx, squaredS::yes>::gauss_equiv_spread);
+      const __m256d one = _mm256_set1_pd(1);
+      const __m256d floattol = _mm256_set1_pd(FLOATTOL);
+      const __m256d signmask = _mm256_set1_pd(-0.);
+      const __m256d qx = _mm256_set1_pd(q.x), qy = _mm256_set1_pd(q.y),
+        qz = _mm256_set1_pd(q.z);
+      const __m256d q0 = _mm256_set1_pd(q.o[0]), q1 = _mm256_set1_pd(q.o[1]),
+        q2 = _mm256_set1_pd(q.o[2]), q3 = _mm256_set1_pd(q.o[3]);
+
+      __m256d acc = _mm256_setzero_pd();
+      size_t k = 0;
+      for (; k+4 <= n; k += 4)
+      {
+        const __m256d dx = _mm256_sub_pd(load_avx2(a.x, idx, k), qx);
+        const __m256d dy = _mm256_sub_pd(load_avx2(a.y, idx, k), qy);
+        const __m256d dz = _mm256_sub_pd(load_avx2(a.z, idx, k), qz);
+        const __m256d d2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx),
+                                                       _mm256_mul_pd(dy, dy)),
+                                         _mm256_mul_pd(dz, dz));
+        const __m256d sh = _mm256_mul_pd(spread, load_avx2(a.locH, idx, k));
+        __m256d value = _mm256_sub_pd(one, _mm256_div_pd(_mm256_sqrt_pd(d2), sh));
+        value = _mm256_and_pd(_mm256_cmp_pd(d2, _mm256_mul_pd(sh, sh), _CMP_LE_OQ),
+                              value);
+
+        if (ak::ori_dim > 0)
+        {
+          __m256d dot = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(load_avx2(a.o0, idx, k), q0),
+                                                    _mm256_mul_pd(load_avx2(a.o1, idx, k), q1)),
+                                      _mm256_mul_pd(load_avx2(a.o2, idx, k), q2));
+          if (ak::ori_dim == 4)
+            dot = _mm256_add_pd(dot, _mm256_mul_pd(load_avx2(a.o3, idx, k), q3));
+          if (ak::abs_dot) dot = _mm256_andnot_pd(signmask, dot);
+          const __m256d e = simd::FastNegExp(_mm256_mul_pd(load_avx2(a.oriKappa, idx, k),
+                                                           _mm256_sub_pd(one, dot)));
+          value = _mm256_and_pd(_mm256_cmp_pd(value, floattol, _CMP_GE_OQ),
+                                _mm256_mul_pd(value, e));
+        }
+
+        if (strategy == KernelCollection::MAX_EVAL)
+          acc = _mm256_max_pd(acc, value);
+        else if (strategy == KernelCollection::SUM_EVAL)
+          acc = _mm256_add_pd(acc, value);
+        else
+          acc = _mm256_add_pd(acc, _mm256_mul_pd(value, load_avx2(a.w, idx, k)));
+      }
+
+      double lanes[4];
+      _mm256_storeu_pd(lanes, acc);
+      coord_t value = 0;
+      for (int l = 0; l < 4; ++l)
+        accumulate_evaluation(value, lanes[l], 1, strategy == KernelCollection::MAX_EVAL ?
+                              strategy : KernelCollection::SUM_EVAL);
+      return eval_block_scalar<KernelType, T>(a, idx, k, n, q, strategy, value);
+    }
+
+    // AVX-512 ---------------------------------------------------------------
+
+    __attribute__((target("avx512f")))
+    static inline __m512d load_avx512(const std::vector<double>& v,
+                                      const size_t* idx, const size_t k)
+    {
+      if (idx == NULL) return _mm512_loadu_pd(&v[k]);
+      const __m512i vi = _mm512_loadu_si512(idx+k);
+      return _mm512_i64gather_pd(vi, &v[0], 8);
+    }
+
+    __attribute__((target("avx512f")))
+    static inline __m512d load_avx512(const std::vector<float>& v,
+                                      const size_t* idx, const size_t k)
+    {
+      if (idx == NULL) return _mm512_cvtps_pd(_mm256_loadu_ps(&v[k]));
+      const __m512i vi = _mm512_loadu_si512(idx+k);
+      return _mm512_cvtps_pd(_mm512_i64gather_ps(vi, &v[0], 4));
+    }
+
+    template<class KernelType, typename T>
+    __attribute__((target("avx512f")))
+    static coord_t eval_block_avx512(const KernelArray<T>& a,
+                                     const size_t* idx, const size_t n,
+                                     const KernelArrayQuery<coord_t>& q,
+                                     const KernelCollection::EvaluationStrategy strategy)
+    {
+      typedef array_kernel<KernelType> ak;
+      const __m512d spread = _mm512_set1_pd(shape_function<shapeS::triangle,
+        func_implS::approx, squaredS::yes>::gauss_equiv_spread);
+      const __m512d one = _mm512_set1_pd(1);
+      const __m512d floattol = _mm512_set1_pd(FLOATTOL);
+      const __m512d qx = _mm512_set1_pd(q.x), qy = _mm512_set1_pd(q.y),
+        qz = _mm512_set1_pd(q.z);
+      const __m512d q0 = _mm512_set1_pd(q.o[0]), q1 = _mm512_set1_pd(q.o[1]),
+        q2 = _mm512_set1_pd(q.o[2]), q3 = _mm512_set1_pd(q.o[3]);
+
+      __m512d acc = _mm512_setzero_pd();
+      size_t k = 0;
+      for (; k+8 <= n; k += 8)
+      {
+        const __m512d dx = _mm512_sub_pd(load_avx512(a.x, idx, k), qx);
+        const __m512d dy = _mm512_sub_pd(load_avx512(a.y, idx, k), qy);
+        const __m512d dz = _mm512_sub_pd(load_avx512(a.z, idx, k), qz);
+        const __m512d d2 = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, dx),
+                                                       _mm512_mul_pd(dy, dy)),
+                                         _mm512_mul_pd(dz, dz));
+        const __m512d sh = _mm512_mul_pd(spread, load_avx512(a.locH, idx, k));
+        __m512d value = _mm512_sub_pd(one, _mm512_div_pd(_mm512_sqrt_pd(d2), sh));
+        value = _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(d2, _mm512_mul_pd(sh, sh),
+                                                       _CMP_LE_OQ),
+                                    value);
+
+        if (ak::ori_dim > 0)
+        {
+          __m512d dot = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(load_avx512(a.o0, idx, k), q0),
+                                                    _mm512_mul_pd(load_avx512(a.o1, idx, k), q1)),
+                                      _mm512_mul_pd(load_avx512(a.o2, idx, k), q2));
+          if (ak::ori_dim == 4)
+            dot = _mm512_add_pd(dot, _mm512_mul_pd(load_avx512(a.o3, idx, k), q3));
+          if (ak::abs_dot) dot = simd::abs(dot);
+          const __m512d e = simd::FastNegExp(_mm512_mul_pd(load_avx512(a.oriKappa, idx, k),
+                                                             _mm512_sub_pd(one, dot)));
+          value = _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(value, floattol, _CMP_GE_OQ),
+                                      _mm512_mul_pd(value, e));
+        }
+
+        if (strategy == KernelCollection::MAX_EVAL)
+          acc = _mm512_max_pd(acc, value);
+        else if (strategy == KernelCollection::SUM_EVAL)
+          acc = _mm512_add_pd(acc, value);
+        else
+          acc = _mm512_add_pd(acc, _mm512_mul_pd(value, load_avx512(a.w, idx, k)));
+      }
+
+      double lanes[8];
+      _mm512_storeu_pd(lanes, acc);
+      coord_t value = 0;
+      for (int l = 0; l < 8; ++l)
+        accumulate_evaluation(value, lanes[l], 1, strategy == KernelCollection::MAX_EVAL ?
+                              strategy : KernelCollection::SUM_EVAL);
+      return eval_block_scalar<KernelType, T>(a, idx, k, n, q, strategy, value);
+    }
+
+#endif
+
+    template<class KernelType, typename T>
+    coord_t eval_block(const KernelArray<T>& a,
+                       const size_t* idx, const size_t n,
+                       const KernelArrayQuery<coord_t>& q,
+                       const KernelCollection::EvaluationStrategy strategy)
+    {
+      NUKLEI_ASSERT(strategy == KernelCollection::MAX_EVAL ||
+                    strategy == KernelCollection::SUM_EVAL ||
+                    strategy == KernelCollection::WEIGHTED_SUM_EVAL);
+      switch (simdLevel())
+      {
+#if NUKLEI_X86_SIMD
+        case SIMD_AVX512:
+          return eval_block_avx512<KernelType, T>(a, idx, n, q, strategy);
+        case SIMD_AVX2:
+          return eval_block_avx2<KernelType, T>(a, idx, n, q, strategy);
+        case SIMD_SSE2:
+          return eval_block_sse2<KernelType, T>(a, idx, n, q, strategy);
+#endif
+        default:
+          return eval_block_scalar<KernelType, T>(a, idx, 0, n, q, strategy, 0);
+      }
+    }
+
+    template coord_t eval_block<kernel::r3, double>
+    (const KernelArray<double>&, const size_t*, const size_t,
+     const KernelArrayQuery<coord_t>&, const KernelCollection::EvaluationStrategy);
+    template coord_t eval_block<kernel::r3xs2, double>
+    (const KernelArray<double>&, const size_t*, const size_t,
+     const KernelArrayQuery<coord_t>&, const KernelCollection::EvaluationStrategy);
+    template coord_t eval_block<kernel::r3xs2p, double>
+    (const KernelArray<double>&, const size_t*, const size_t,
+     const KernelArrayQuery<coord_t>&, const KernelCollection::EvaluationStrategy);
+    template coord_t eval_block<kernel::se3, double>
+    (const KernelArray<double>&, const size_t*, const size_t,
+     const KernelArrayQuery<coord_t>&, const KernelCollection::EvaluationStrategy);
+    template coord_t eval_block<kernel::r3, float>
+    (const KernelArray<float>&, const size_t*, const size_t,
+     const KernelArrayQuery<coord_t>&, const KernelCollection::EvaluationStrategy);
+    template coord_t eval_block<kernel::r3xs2, float>
+    (const KernelArray<float>&, const size_t*, const size_t,
+     const KernelArrayQuery<coord_t>&, const KernelCollection::EvaluationStrategy);
+    template coord_t eval_block<kernel::r3xs2p, float>
+    (const KernelArray<float>&, const size_t*, const size_t,
+     const KernelArrayQuery<coord_t>&, const KernelCollection::EvaluationStrategy);
+    template coord_t eval_block<kernel::se3, float>
+    (const KernelArray<float>&, const size_t*, const size_t,
+     const KernelArrayQuery<coord_t>&, const KernelCollection::EvaluationStrategy);
+
+  }
+
+}
@@ -0,0 +1,461 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#ifndef NUKLEI_KERNEL_COLLECTION_ARRAY_H
+#define NUKLEI_KERNEL_COLLECTION_ARRAY_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include <boost/type_traits/is_same.hpp>
+
+#include <nuklei/Definitions.h>
+#include <nuklei/Kernel.h>
+#include <nuklei/GenericKernel.h>
+#include <nuklei/KernelCollection.h>
+
+namespace nuklei
+{
+
+  namespace kernel_array_types
+  {
+
+    /**
+     * @brief Packed, structure-of-arrays copy of the kernels of a
+     * collection.
+     *
+     * Each member holds one value per kernel, in the order of the
+     * collection. The orientation components are (w, x, y, z) for
+     * kernel::se3, and (x, y, z) for kernel::r3xs2 and kernel::r3xs2p, in
+     * which case @c o3 is empty. kernel::r3 has no orientation. @c oriKappa
+     * holds the von Mises-Fisher concentration computed from @c oriH, which
+     * kernel::se3::eval() and kernel::r3xs2_base::eval() otherwise recompute
+     * at each evaluation.
+     *
+     * @p T is the storage type. Evaluation always computes in coord_t: with
+     * <tt>T = float</tt>, the array takes half the memory, and values are
+     * converted to double as they are read.
+     */
+    template<typename T>
+    struct KernelArray
+    {
+      typedef T value_t;
+
+      KernelArray() : type(kernel::base::UNKNOWN) {}
+
+      size_t size() const { return x.size(); }
+
+      kernel::base::Type type;
+      std::vector<T> x, y, z;
+      std::vector<T> o0, o1, o2, o3;
+      std::vector<T> locH, oriH, oriKappa;
+      std::vector<T> w;
+    };
+
+    /**
+     * @brief Query point, in the layout of a KernelArray.
+     *
+     * Queries are held in coord_t, whatever the storage type of the array.
+     */
+    template<typename T>
+    struct KernelArrayQuery
+    {
+      T x, y, z;
+      T o[4];
+    };
+
+    /**
+     * @brief Position part of kernel::se3::eval(), kernel::r3xs2_base::eval()
+     * and kernel::r3::eval().
+     *
+     * @p d2 is the squared distance between the kernel and the query, @p h
+     * is the location bandwidth of the kernel. This function follows
+     * shape_function<shapeS::triangle, FunctionImpl, squaredS::yes> to the
+     * operation, so that it returns the same values in double precision.
+     */
+    inline coord_t array_position_value(const coord_t d2, const coord_t h)
+    {
+      const coord_t spread = shape_function<shapeS::triangle, func_implS::approx,
+        squaredS::yes>::gauss_equiv_spread;
+      const coord_t abs_d = std::fabs(d2);
+      if (abs_d > spread*h*spread*h) return 0;
+      else return 1 - std::sqrt(abs_d)/(spread*h);
+    }
+
+    template<typename T>
+    inline coord_t array_squared_distance(const KernelArray<T>& a, const size_t j,
+                                          const KernelArrayQuery<coord_t>& q)
+    {
+      const coord_t dx = a.x[j]-q.x;
+      const coord_t dy = a.y[j]-q.y;
+      const coord_t dz = a.z[j]-q.z;
+      return dx*dx + dy*dy + dz*dz;
+    }
+
+    /**
+     * @brief Evaluates kernel @p j of a KernelArray at a query.
+     *
+     * Specializations mirror the eval() method of the corresponding kernel
+     * class. get() writes the orientation of kernel @p j to a kernel object.
+     * transform() writes the pose of @p k transformed with @p t to @p out,
+     * as k.transformedWith(t), but without copying the descriptor of @p k,
+     * which would allocate memory.
+     */
+    template<class KernelType>
+    struct array_kernel {};
+
+    template<>
+    struct array_kernel<kernel::r3>
+    {
+      typedef kernel::r3 kernel_t;
+      static const int ori_dim = 0;
+      static const bool abs_dot = false;
+
+      static coord_t kappa(const coord_t oriH) { return 0; }
+
+      static void fill(KernelArrayQuery<coord_t>& q, const kernel_t& k)
+      {
+        q.x = k.loc_.X(); q.y = k.loc_.Y(); q.z = k.loc_.Z();
+        q.o[0] = q.o[1] = q.o[2] = q.o[3] = 0;
+      }
+
+      static void transform(kernel_t& out, const kernel_t& k,
+                            const kernel::se3& t)
+      {
+        out.loc_ = la::transform(t.loc_, t.ori_, k.loc_);
+      }
+
+      template<typename T>
+      static void push_back(KernelArray<T>& a, const kernel_t& k)
+      {
+      }
+
+      template<typename T>
+      static void get(const KernelArray<T>& a, const size_t j, kernel_t& k)
+      {
+      }
+
+      template<typename T>
+      static coord_t eval(const KernelArray<T>& a, const size_t j,
+                          const KernelArrayQuery<coord_t>& q)
+      {
+        return array_position_value(array_squared_distance(a, j, q),
+                                    a.locH[j]);
+      }
+    };
+
+    template<>
+    struct array_kernel<kernel::se3>
+    {
+      typedef kernel::se3 kernel_t;
+      static const int ori_dim = 4;
+      static const bool abs_dot = true;
+
+      static coord_t kappa(const coord_t oriH)
+      {
+        return kernel_t::OrientationKernel::h_from_angle_h(oriH);
+      }
+
+      static void fill(KernelArrayQuery<coord_t>& q, const kernel_t& k)
+      {
+        q.x = k.loc_.X(); q.y = k.loc_.Y(); q.z = k.loc_.Z();
+        q.o[0] = k.ori_.W(); q.o[1] = k.ori_.X();
+        q.o[2] = k.ori_.Y(); q.o[3] = k.ori_.Z();
+      }
+
+      static void transform(kernel_t& out, const kernel_t& k,
+                            const kernel::se3& t)
+      {
+        la::transform(out.loc_, out.ori_, t.loc_, t.ori_, k.loc_, k.ori_);
+      }
+
+      template<typename T>
+      static void push_back(KernelArray<T>& a, const kernel_t& k)
+      {
+        a.o0.push_back(k.ori_.W()); a.o1.push_back(k.ori_.X());
+        a.o2.push_back(k.ori_.Y()); a.o3.push_back(k.ori_.Z());
+      }
+
+      template<typename T>
+      static void get(const KernelArray<T>& a, const size_t j, kernel_t& k)
+      {
+        k.ori_ = la::normalized(Quaternion(a.o0[j], a.o1[j], a.o2[j], a.o3[j]));
+      }
+
+      template<typename T>
+      static coord_t eval(const KernelArray<T>& a, const size_t j,
+                          const KernelArrayQuery<coord_t>& q)
+      {
+        coord_t r3e = array_position_value(array_squared_distance(a, j, q),
+                                           a.locH[j]);
+        if (r3e < FLOATTOL) return 0;
+        const coord_t dot = std::fabs(a.o0[j]*q.o[0] + a.o1[j]*q.o[1] +
+                                      a.o2[j]*q.o[2] + a.o3[j]*q.o[3]);
+        return r3e * FastNegExp( a.oriKappa[j]*(1-dot) );
+      }
+    };
+
+    template<class OriGrp>
+    struct array_kernel< kernel::r3xs2_base<OriGrp> >
+    {
+      typedef kernel::r3xs2_base<OriGrp> kernel_t;
+      static const int ori_dim = 3;
+      static const bool abs_dot = boost::is_same<OriGrp, groupS::s2p>::value;
+
+      static coord_t kappa(const coord_t oriH)
+      {
+        return kernel_t::OrientationKernel::h_from_angle_h(oriH);
+      }
+
+      static void fill(KernelArrayQuery<coord_t>& q, const kernel_t& k)
+      {
+        q.x = k.loc_.X(); q.y = k.loc_.Y(); q.z = k.loc_.Z();
+        q.o[0] = k.dir_.X(); q.o[1] = k.dir_.Y(); q.o[2] = k.dir_.Z();
+        q.o[3] = 0;
+      }
+
+      static void transform(kernel_t& out, const kernel_t& k,
+                            const kernel::se3& t)
+      {
+        la::transform(out.loc_, out.dir_, t.loc_, t.ori_, k.loc_, k.dir_);
+      }
+
+      template<typename T>
+      static void push_back(KernelArray<T>& a, const kernel_t& k)
+      {
+        a.o0.push_back(k.dir_.X());
+        a.o1.push_back(k.dir_.Y());
+        a.o2.push_back(k.dir_.Z());
+      }
+
+      template<typename T>
+      static void get(const KernelArray<T>& a, const size_t j, kernel_t& k)
+      {
+        k.dir_ = la::normalized(Vector3(a.o0[j], a.o1[j], a.o2[j]));
+      }
+
+      static coord_t dot(const coord_t d, groupS::s2) { return d; }
+      static coord_t dot(const coord_t d, groupS::s2p) { return std::fabs(d); }
+
+      template<typename T>
+      static coord_t eval(const KernelArray<T>& a, const size_t j,
+                          const KernelArrayQuery<coord_t>& q)
+      {
+        coord_t r3e = array_position_value(array_squared_distance(a, j, q),
+                                           a.locH[j]);
+        if (r3e < FLOATTOL) return 0;
+        const coord_t d = dot(a.o0[j]*q.o[0] + a.o1[j]*q.o[1] + a.o2[j]*q.o[2],
+                              OriGrp());
+        return r3e * FastNegExp( a.oriKappa[j]*(1-d) );
+      }
+    };
+
+    inline void accumulate_evaluation(coord_t& value,
+                                      const coord_t cvalue,
+                                      const weight_t weight,
+                                      const KernelCollection::EvaluationStrategy strategy)
+    {
+      if (strategy == KernelCollection::MAX_EVAL) value = std::max(value, cvalue);
+      else if (strategy == KernelCollection::SUM_EVAL) value += cvalue;
+      else if (strategy == KernelCollection::WEIGHTED_SUM_EVAL) value += cvalue * weight;
+      else NUKLEI_ASSERT(false);
+    }
+
+    /**
+     * @brief Evaluates kernels @p idx[0], ..., @p idx[n-1] of @p a at @p q,
+     * and combines the values according to @p strategy.
+     *
+     * If @p idx is NULL, kernels 0 to @p n-1 are evaluated. Kernels are
+     * processed 2, 4 or 8 at a time, depending on simdLevel(). The result
+     * equals that of calling array_kernel::eval() on each kernel and
+     * combining the values with accumulate_evaluation(), up to the order
+     * in which sums are computed.
+     *
+     * Instantiated for kernel::r3, kernel::r3xs2, kernel::r3xs2p and
+     * kernel::se3, and for float and double storage.
+     */
+    template<class KernelType, typename T>
+    coord_t eval_block(const KernelArray<T>& a,
+                       const size_t* idx, const size_t n,
+                       const KernelArrayQuery<coord_t>& q,
+                       const KernelCollection::EvaluationStrategy strategy);
+
+    /**
+     * @brief Number of queries whose neighbors are searched before they are
+     * evaluated with eval_block(). See prefetch_kernel().
+     */
+    const int QUERY_BLOCK_SIZE = 16;
+
+    /**
+     * @brief Hints the processor to load the members of kernel @p j that
+     * eval_block() reads.
+     */
+    template<class KernelType, typename T>
+    inline void prefetch_kernel(const KernelArray<T>& a, const size_t j)
+    {
+#ifdef __GNUC__
+      __builtin_prefetch(&a.x[j]);
+      __builtin_prefetch(&a.y[j]);
+      __builtin_prefetch(&a.z[j]);
+      __builtin_prefetch(&a.locH[j]);
+      __builtin_prefetch(&a.w[j]);
+      if (array_kernel<KernelType>::ori_dim > 0)
+      {
+        __builtin_prefetch(&a.o0[j]);
+        __builtin_prefetch(&a.o1[j]);
+        __builtin_prefetch(&a.o2[j]);
+        __builtin_prefetch(&a.oriKappa[j]);
+      }
+      if (array_kernel<KernelType>::ori_dim == 4)
+        __builtin_prefetch(&a.o3[j]);
+#endif
+    }
+
+    /**
+     * @brief Throws if a query in [@p first, @p last) is not of type
+     * @p type.
+     *
+     * Exceptions cannot leave an OpenMP region or a thread of
+     * parallelizer::for_each(): a failed assertion in a slice of queries
+     * would terminate the program. Parallel evaluation functions call this,
+     * and check their other prerequisites, before going parallel.
+     */
+    template<class QueryIterator>
+    void check_query_types(QueryIterator first, QueryIterator last,
+                           const kernel::base::Type type)
+    {
+      for (QueryIterator q = first; q != last; ++q)
+        if (q->polyType() != type)
+          NUKLEI_THROW("Query of type `" <<
+                       kernel::base::TypeNames[q->polyType()] <<
+                       "' evaluated against kernels of type `" <<
+                       kernel::base::TypeNames[type] << "'.");
+    }
+
+    /**
+     * @brief Returns @p k, or @p k transformed with @p t, stored in
+     * @p buffer.
+     *
+     * Only the pose of @p k is transformed into @p buffer, which does not
+     * allocate.
+     */
+    template<class KernelType>
+    inline const KernelType& transformed_query(const KernelType& k,
+                                               const kernel::se3* t,
+                                               KernelType& buffer)
+    {
+      if (t == NULL) return k;
+      array_kernel<KernelType>::transform(buffer, k, *t);
+      return buffer;
+    }
+
+    /**
+     * @brief Evaluates the kernels of @p a at the queries [@p first,
+     * @p last), and writes one value per query to @p values.
+     *
+     * Queries are first transformed with @p t, if provided. @p tree is an
+     * adaptor of the kd-tree of @p a, with a method
+     * <tt>void findNeighbors(const Vector3& loc, std::vector<size_t>& neighbors) const</tt>
+     * that appends to @p neighbors the indices of the kernels within reach
+     * of @p loc.
+     *
+     * Queries are processed in blocks of QUERY_BLOCK_SIZE. The neighbors of
+     * all the queries of a block are searched first, and the kernels they
+     * point to are prefetched while the search proceeds. The block is then
+     * evaluated from warm caches with eval_block().
+     */
+    template<class KernelType, typename T, class TreeAdaptor, class QueryIterator>
+    void eval_queries(const KernelArray<T>& a, const TreeAdaptor& tree,
+                      QueryIterator first, QueryIterator last,
+                      weight_t* values,
+                      const KernelCollection::EvaluationStrategy strategy,
+                      const kernel::se3* t)
+    {
+      typedef array_kernel<KernelType> ak;
+
+      // The neighbor buffers are kept by each thread from one call to the
+      // next, so that evaluating one query at a time does not allocate.
+      static thread_local std::vector<size_t> neighbors;
+      static thread_local std::vector<size_t> offsets;
+      KernelArrayQuery<coord_t> queries[QUERY_BLOCK_SIZE];
+      KernelType buffer;
+
+      QueryIterator q = first;
+      while (q != last)
+      {
+        neighbors.clear();
+        offsets.assign(1, 0);
+        int nQueries = 0;
+        for (; q != last && nQueries < QUERY_BLOCK_SIZE; ++q, ++nQueries)
+        {
+          NUKLEI_ASSERT(a.type == q->polyType());
+          const KernelType &query =
+            transformed_query(static_cast<const KernelType&>(*q), t, buffer);
+          ak::fill(queries[nQueries], query);
+          tree.findNeighbors(query.loc_, neighbors);
+          for (size_t i = offsets.back(); i < neighbors.size(); ++i)
+            prefetch_kernel<KernelType>(a, neighbors[i]);
+          offsets.push_back(neighbors.size());
+        }
+
+        for (int j = 0; j < nQueries; ++j, ++values)
+        {
+          const size_t n = offsets[j+1] - offsets[j];
+          *values = eval_block<KernelType>(a, n == 0 ? NULL : &neighbors[offsets[j]],
+                                           n, queries[j], strategy);
+        }
+      }
+    }
+
+    template<class KernelType, typename T, class InputIterator>
+    void build_kernel_array(KernelArray<T>& a,
+                            InputIterator first, InputIterator last)
+    {
+      typedef array_kernel<KernelType> ak;
+      const size_t n = std::distance(first, last);
+      a = KernelArray<T>();
+      a.type = KernelType().type();
+      a.x.reserve(n); a.y.reserve(n); a.z.reserve(n);
+      a.locH.reserve(n); a.oriH.reserve(n); a.oriKappa.reserve(n);
+      a.w.reserve(n);
+      for (InputIterator i = first; i != last; ++i)
+      {
+        const KernelType& k = static_cast<const KernelType&>(*i);
+        a.x.push_back(k.loc_.X());
+        a.y.push_back(k.loc_.Y());
+        a.z.push_back(k.loc_.Z());
+        ak::push_back(a, k);
+        a.locH.push_back(k.getLocH());
+        a.oriH.push_back(k.getOriH());
+        a.oriKappa.push_back(ak::kappa(k.getOriH()));
+        a.w.push_back(k.getWeight());
+      }
+    }
+
+    /**
+     * @brief Returns a kernel object holding the values of kernel @p j.
+     *
+     * With <tt>T = float</tt>, orientations are renormalized after
+     * conversion to double.
+     */
+    template<class KernelType, typename T>
+    kernel::base::ptr kernel_array_at(const KernelArray<T>& a, const size_t j)
+    {
+      typename KernelType::ptr k(new KernelType);
+      k->loc_ = Vector3(a.x[j], a.y[j], a.z[j]);
+      array_kernel<KernelType>::get(a, j, *k);
+      k->setLocH(a.locH[j]);
+      k->setOriH(a.oriH[j]);
+      k->setWeight(a.w[j]);
+      return kernel::base::ptr(k.release());
+    }
+
+  }
+
+}
+
+#endif
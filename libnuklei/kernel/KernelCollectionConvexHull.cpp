@@ -30,8 +30,7 @@ namespace nuklei {
     if (!CH_p->is_valid())
       NUKLEI_LOG("As it often happens, CGAL says the hull is invalid.");
     
-    if (deco_.has_key(HULL_KEY)) deco_.erase(HULL_KEY);
-    deco_.insert(HULL_KEY, CH_p);
+    setHelperStructure(HULL_KEY, CH_p);
 #else
     NUKLEI_THROW("This function requires CGAL. See http://renaud-detry.net/nuklei/group__install.html");
 #endif
@@ -45,6 +44,7 @@ namespace nuklei {
 #ifdef NUKLEI_USE_CGAL_DEPRECATED
     using namespace cgal_convex_hull_types;
     Vector3 loc = k.getLoc();
+    refreshHelperStructures();
     if (!deco_.has_key(HULL_KEY))
       NUKLEI_THROW("Undefined convex hull. Call buildConvexHull() first.");
     return deco_.get< boost::shared_ptr<Convex_hull_3> >(HULL_KEY)->bounded_side
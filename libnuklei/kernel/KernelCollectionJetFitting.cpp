@@ -40,19 +40,37 @@ namespace nuklei
     using namespace cgal_neighbor_search_types;
     using namespace cgal_jet_fitting_types;
     
-    if (!deco_.has_key(NSTREE_KEY))
-      NUKLEI_THROW("Undefined neighbor search tree. Call buildNeighborSearchTree() first.");
-
-    boost::shared_ptr<Tree> tree(deco_.get< boost::shared_ptr<Tree> >(NSTREE_KEY));
-      
-    Point_d center(loc.X(), loc.Y(), loc.Z());
-
     std::vector<DPoint> in_points;
-    K_neighbor_search search(*tree, center, 16+1);
-    NUKLEI_ASSERT(search.begin() != search.end());
-    for (K_neighbor_search::iterator i = search.begin(); i != search.end(); ++i)
+    
+    refreshHelperStructures();
+    if (deco_.has_key(KDTREE_KEY) && KDTREE_NANOFLANN)
     {
-      in_points.push_back(DPoint(i->first.x(), i->first.y(), i->first.z()));
+      std::vector<size_t> indices;
+      std::vector<coord_t> squaredDistances;
+      knn(loc, 16+1, indices, squaredDistances);
+      NUKLEI_ASSERT(!indices.empty());
+      for (std::vector<size_t>::const_iterator i = indices.begin();
+           i != indices.end(); ++i)
+      {
+        const Vector3 p = kernels_[*i].getLoc();
+        in_points.push_back(DPoint(p.X(), p.Y(), p.Z()));
+      }
+    }
+    else
+    {
+      if (!deco_.has_key(NSTREE_KEY))
+        NUKLEI_THROW("Undefined neighbor search tree. Call buildKdTree() or buildNeighborSearchTree() first.");
+      
+      boost::shared_ptr<Tree> tree(deco_.get< boost::shared_ptr<Tree> >(NSTREE_KEY));
+      
+      Point_d center(loc.X(), loc.Y(), loc.Z());
+      
+      K_neighbor_search search(*tree, center, 16+1);
+      NUKLEI_ASSERT(search.begin() != search.end());
+      for (K_neighbor_search::iterator i = search.begin(); i != search.end(); ++i)
+      {
+        in_points.push_back(DPoint(i->first.x(), i->first.y(), i->first.z()));
+      }
     }
     
     size_t d_fitting = 4;
@@ -96,38 +114,6 @@ namespace nuklei
     
     NUKLEI_TRACE_END();
   }
-
-  void KernelCollection::computeSurfaceNormals()
-  {
-    KernelCollection kc2;
-    
-    if (!deco_.has_key(NSTREE_KEY))
-      NUKLEI_THROW("Undefined neighbor search tree. "
-                   "Call buildNeighborSearchTree() first.");
-    
-    int skipped = 0;
-    for (KernelCollection::const_iterator i = as_const(*this).begin();
-         i != as_const(*this).end(); ++i)
-    {
-      kernel::r3xs2p k;
-      k.loc_ = i->getLoc();
-      boost::tuple<Matrix3, Vector3, coord_t> dp =
-      localLocationDifferential(k.loc_);
-      if (dp.get<2>() == 0)
-      {
-        skipped++;
-        continue;
-      }
-      k.dir_ = dp.get<0>().GetColumn(2);
-      k.setWeight(i->getWeight());
-      if (i->hasDescriptor()) k.setDescriptor(i->getDescriptor());
-      kc2.add(k);
-    }
-    if (skipped > 0)
-      NUKLEI_WARN("Skipped " << skipped << " kernels for which "
-                  "CGAL couldn't compute local diff.");
-    *this = kc2;
-  }
 }
 
 
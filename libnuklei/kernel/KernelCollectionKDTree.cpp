@@ -5,11 +5,18 @@
 /** @file */
 
 #include "KernelCollectionTypes.h"
+#include "KernelCollectionArray.h"
 
 #include <nuklei/KernelCollection.h>
+#include <nuklei/parallelizer.h>
 
 #include "nanoflann.hpp"
 
+#include <limits>
+
+#include <boost/bind.hpp>
+#include <boost/iterator/indirect_iterator.hpp>
+
 namespace nuklei {
   
   namespace nanoflann_types
@@ -62,7 +69,285 @@ namespace nuklei {
 		PointCloud,
 		3 /* dim */
 		> KDTreeIndex;
-    typedef std::pair<boost::shared_ptr<KDTreeIndex>, PointCloud> Tree;
+    
+    /**
+     * @brief Dynamic kd-tree, built as a logarithmic forest of static
+     * nanoflann trees.
+     *
+     * Each entry of the forest holds the position of kernel @c idx. An
+     * insertion adds a bucket of one entry, and merges the last buckets
+     * while a bucket is not larger than the one that follows it. Bucket sizes
+     * thus decrease at least geometrically, there are O(log n) buckets, and
+     * each entry is re-indexed O(log n) times.
+     *
+     * Removals are lazy: an entry is live if its serial number is the
+     * current serial of its kernel. Dead entries are skipped by searches,
+     * and discarded when their bucket is merged, or when they outnumber live
+     * entries. Buckets are never modified once built, which lets copies of a
+     * tree share them.
+     */
+    class Tree
+    {
+    public:
+      typedef std::vector<std::pair<size_t,coord_t> > result_t;
+      
+      Tree() : nDead_(0), nextSerial_(0) {}
+      
+      /** @brief Indexes @p pc, whose @f$ i^{\rm th} @f$ point is kernel @f$ i @f$. */
+      explicit Tree(const PointCloud& pc) : nDead_(0), nextSerial_(pc.pts.size())
+      {
+        std::vector<size_t> idx(pc.pts.size());
+        for (size_t i = 0; i < idx.size(); ++i) idx[i] = i;
+        current_ = idx;
+        if (!idx.empty()) buckets_.push_back(makeBucket(pc, idx, idx));
+      }
+      
+      /** @brief Indexes @p loc as the position of kernel @p idx. */
+      void insert(const size_t idx, const Vector3& loc)
+      {
+        if (idx >= current_.size()) current_.resize(idx+1, NONE);
+        NUKLEI_ASSERT(current_.at(idx) == NONE);
+        const size_t serial = nextSerial_++;
+        current_.at(idx) = serial;
+        
+        PointCloud pc;
+        pc.pts.push_back(PointCloud::Point(loc.X(), loc.Y(), loc.Z()));
+        buckets_.push_back(makeBucket(pc, std::vector<size_t>(1, idx),
+                                      std::vector<size_t>(1, serial)));
+        
+        while (buckets_.size() > 1 &&
+               buckets_.at(buckets_.size()-2)->size() <= buckets_.back()->size())
+        {
+          boost::shared_ptr<Bucket> last = buckets_.back();
+          buckets_.pop_back();
+          buckets_.back() = merge(*buckets_.back(), *last);
+        }
+        if (nDead_ > size()) compact();
+      }
+      
+      /** @brief Removes the position of kernel @p idx. */
+      void remove(const size_t idx)
+      {
+        NUKLEI_ASSERT(idx < current_.size() && current_.at(idx) != NONE);
+        current_.at(idx) = NONE;
+        nDead_++;
+        if (nDead_ > size()) compact();
+      }
+      
+      /** @brief Returns the number of live entries. */
+      size_t size() const
+      {
+        size_t n = 0;
+        for (std::vector< boost::shared_ptr<Bucket> >::const_iterator
+             b = buckets_.begin(); b != buckets_.end(); ++b)
+          n += (*b)->size();
+        return n - nDead_;
+      }
+      
+      /**
+       * @brief Writes to @p result the index and squared distance of the
+       * kernels whose position lies within @p squaredRange of @p center.
+       *
+       * @p buffer is used as scratch space. Passing the same buffers across
+       * calls avoids reallocations.
+       */
+      void findNeighbors(const coord_t* center, const coord_t squaredRange,
+                         result_t& result, result_t& buffer) const
+      {
+        if (buckets_.size() == 1 && nDead_ == 0 && buckets_.front()->identity)
+        {
+          // Common case of a tree built by buildKdTree(): indices need not
+          // be mapped.
+          RadiusResultSet<coord_t,size_t> resultSet(squaredRange, result);
+          buckets_.front()->index->findNeighbors(resultSet, center, SearchParams());
+          return;
+        }
+        
+        result.clear();
+        for (std::vector< boost::shared_ptr<Bucket> >::const_iterator
+             b = buckets_.begin(); b != buckets_.end(); ++b)
+        {
+          const Bucket& bucket = **b;
+          RadiusResultSet<coord_t,size_t> resultSet(squaredRange, buffer);
+          bucket.index->findNeighbors(resultSet, center, SearchParams());
+          for (result_t::const_iterator i = buffer.begin(); i != buffer.end(); ++i)
+          {
+            const size_t idx = bucket.idx[i->first];
+            if (current_[idx] == bucket.serial[i->first])
+              result.push_back(std::make_pair(idx, i->second));
+          }
+        }
+      }
+      
+      /**
+       * @brief Writes to @p result the index and squared distance of the
+       * @p k kernels nearest to @p center, by increasing distance.
+       */
+      void knn(const coord_t* center, const size_t k, result_t& result) const
+      {
+        result.clear();
+        if (k == 0) return;
+        for (std::vector< boost::shared_ptr<Bucket> >::const_iterator
+             b = buckets_.begin(); b != buckets_.end(); ++b)
+        {
+          // The result set spans buckets: its worst distance prunes the
+          // search in the following ones.
+          KNNResultSet resultSet(**b, current_, k, result);
+          (*b)->index->findNeighbors(resultSet, center, SearchParams());
+        }
+      }
+      
+    private:
+      static const size_t NONE = size_t(-1);
+      
+      struct Bucket;
+      
+      // nanoflann result set which keeps the k nearest live entries of a
+      // bucket, merged with the entries already in result.
+      class KNNResultSet
+      {
+      public:
+        KNNResultSet(const Bucket& bucket, const std::vector<size_t>& current,
+                     const size_t k, result_t& result) :
+          bucket_(bucket), current_(current), k_(k), result_(result) {}
+        
+        size_t size() const { return result_.size(); }
+        bool full() const { return result_.size() == k_; }
+        
+        void addPoint(const coord_t dist, const size_t local)
+        {
+          const size_t idx = bucket_.idx[local];
+          if (current_[idx] != bucket_.serial[local]) return;
+          if (full())
+          {
+            if (dist >= result_.back().second) return;
+            result_.pop_back();
+          }
+          result_t::iterator i = result_.end();
+          while (i != result_.begin() && (i-1)->second > dist) --i;
+          result_.insert(i, std::make_pair(idx, dist));
+        }
+        
+        coord_t worstDist() const
+        {
+          return full() ? result_.back().second :
+            std::numeric_limits<coord_t>::max();
+        }
+        
+      private:
+        const Bucket& bucket_;
+        const std::vector<size_t>& current_;
+        const size_t k_;
+        result_t& result_;
+      };
+      
+      struct Bucket
+      {
+        size_t size() const { return idx.size(); }
+        
+        PointCloud pc;
+        std::vector<size_t> idx;
+        std::vector<size_t> serial;
+        bool identity;
+        // Refers to pc: buckets cannot be copied.
+        boost::shared_ptr<KDTreeIndex> index;
+      };
+      
+      static boost::shared_ptr<Bucket> makeBucket(const PointCloud& pc,
+                                                  const std::vector<size_t>& idx,
+                                                  const std::vector<size_t>& serial)
+      {
+        boost::shared_ptr<Bucket> b(new Bucket);
+        b->pc = pc;
+        b->idx = idx;
+        b->serial = serial;
+        b->identity = true;
+        for (size_t i = 0; i < idx.size() && b->identity; ++i)
+          b->identity = (idx[i] == i);
+        b->index.reset(new KDTreeIndex(3 /*dim*/, b->pc, KDTreeSingleIndexAdaptorParams(10 /* max leaf */) ));
+        b->index->buildIndex();
+        return b;
+      }
+      
+      // Collects the live entries of b into pc, idx and serial.
+      void appendLive(const Bucket& b, PointCloud& pc,
+                      std::vector<size_t>& idx, std::vector<size_t>& serial)
+      {
+        for (size_t i = 0; i < b.size(); ++i)
+        {
+          if (current_[b.idx[i]] != b.serial[i])
+          {
+            nDead_--;
+            continue;
+          }
+          pc.pts.push_back(b.pc.pts[i]);
+          idx.push_back(b.idx[i]);
+          serial.push_back(b.serial[i]);
+        }
+      }
+      
+      boost::shared_ptr<Bucket> merge(const Bucket& b1, const Bucket& b2)
+      {
+        PointCloud pc;
+        std::vector<size_t> idx, serial;
+        appendLive(b1, pc, idx, serial);
+        appendLive(b2, pc, idx, serial);
+        return makeBucket(pc, idx, serial);
+      }
+      
+      void compact()
+      {
+        PointCloud pc;
+        std::vector<size_t> idx, serial;
+        for (std::vector< boost::shared_ptr<Bucket> >::const_iterator
+             b = buckets_.begin(); b != buckets_.end(); ++b)
+          appendLive(**b, pc, idx, serial);
+        buckets_.clear();
+        NUKLEI_ASSERT(nDead_ == 0);
+        if (!idx.empty()) buckets_.push_back(makeBucket(pc, idx, serial));
+      }
+      
+      std::vector< boost::shared_ptr<Bucket> > buckets_;
+      // Serial number of the live entry of each kernel, or NONE.
+      std::vector<size_t> current_;
+      size_t nDead_;
+      size_t nextSerial_;
+    };
+    
+    const size_t Tree::NONE;
+  }
+  
+  namespace
+  {
+    // Returns k, or k transformed with t, stored in buffer. See
+    // kernel_array_types::transformed_query().
+    template<class KernelType>
+    const KernelType& transformed_query(const KernelType& k,
+                                        const boost::optional<kernel::se3>& t,
+                                        KernelType& buffer)
+    {
+      return kernel_array_types::transformed_query(k, t ? &*t : NULL, buffer);
+    }
+    
+    // Adaptor of the forest for kernel_array_types::eval_queries().
+    struct ForestNeighbors
+    {
+      ForestNeighbors(const nanoflann_types::Tree& tree, const coord_t range) :
+        tree(tree), range(range) {}
+      
+      void findNeighbors(const Vector3& loc, std::vector<size_t>& neighbors) const
+      {
+        static thread_local nanoflann_types::Tree::result_t indices_dists, buffer;
+        // indices_dists is cleared without releasing its storage.
+        tree.findNeighbors(loc, range, indices_dists, buffer);
+        for (nanoflann_types::Tree::result_t::const_iterator i = indices_dists.begin();
+             i != indices_dists.end(); ++i)
+          neighbors.push_back(i->first);
+      }
+      
+      const nanoflann_types::Tree& tree;
+      const coord_t range;
+    };
   }
   
   void KernelCollection::buildNeighborSearchTree()
@@ -77,8 +362,7 @@ namespace nuklei {
       Vector3 loc = i->getLoc();
       tree->insert(Point_d(loc.X(), loc.Y(), loc.Z()));
     }
-    if (deco_.has_key(NSTREE_KEY)) deco_.erase(NSTREE_KEY);
-    deco_.insert(NSTREE_KEY, tree);
+    setHelperStructure(NSTREE_KEY, tree);
     
 #else
     NUKLEI_THROW("This function requires CGAL. See http://renaud-detry.net/nuklei/group__install.html");
@@ -88,6 +372,15 @@ namespace nuklei {
   
   void KernelCollection::buildKdTree()
   {
+    refreshHelperStructures();
+    // If the kernel array lives in another frame (see transformWith()), the
+    // tree is built in that frame too.
+    boost::optional<kernel::se3> toHelperFrame;
+    if (helperFrame_ && deco_.has_key(KERNELARRAY_KEY))
+      toHelperFrame = helperFrame_->inverseTransformation();
+    else
+      helperFrame_ = boost::none;
+    
     if (KDTREE_NANOFLANN)
     {
       using namespace nanoflann_types;
@@ -96,15 +389,13 @@ namespace nuklei {
       for (const_iterator i = as_const(*this).begin(); i != as_const(*this).end(); ++i)
       {
         Vector3 loc = i->getLoc();
+        if (toHelperFrame)
+          loc = la::transform(toHelperFrame->loc_, toHelperFrame->ori_, loc);
         pc.pts.push_back(PointCloud::Point(loc.X(), loc.Y(), loc.Z()));
       }
             
-      boost::shared_ptr<Tree> tree(new Tree(boost::shared_ptr<KDTreeIndex>(), pc));
-      tree->first = boost::shared_ptr<KDTreeIndex>(new KDTreeIndex(3 /*dim*/, tree->second, KDTreeSingleIndexAdaptorParams(10 /* max leaf */) ));
-      tree->first->buildIndex();
-      
-      if (deco_.has_key(KDTREE_KEY)) deco_.erase(KDTREE_KEY);
-      deco_.insert(KDTREE_KEY, tree);
+      boost::shared_ptr<Tree> tree(new Tree(pc));
+      setHelperStructure(KDTREE_KEY, tree);
     }
     else
     {
@@ -114,74 +405,224 @@ namespace nuklei {
       for (const_iterator i = as_const(*this).begin(); i != as_const(*this).end(); ++i)
       {
         Vector3 loc = i->getLoc();
+        if (toHelperFrame)
+          loc = la::transform(toHelperFrame->loc_, toHelperFrame->ori_, loc);
         tree->insert(FlexiblePoint(loc.X(), loc.Y(), loc.Z(),
                                    std::distance(as_const(*this).begin(), i)));
       }
       tree->optimise();
       
-      if (deco_.has_key(KDTREE_KEY)) deco_.erase(KDTREE_KEY);
-      deco_.insert(KDTREE_KEY, tree);
+      setHelperStructure(KDTREE_KEY, tree);
+    }
+  }
+  
+  void KernelCollection::updateKdTree(const size_t idx,
+                                      const kernel::base* previous) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    NUKLEI_ASSERT(deco_.has_key(KDTREE_KEY));
+    
+    // The tree lives in the frame recorded in helperFrame_ (see
+    // transformWith()).
+    boost::optional<kernel::se3> toHelperFrame;
+    if (helperFrame_)
+      toHelperFrame = helperFrame_->inverseTransformation();
+    Vector3 loc = kernels_[idx].getLoc();
+    if (toHelperFrame)
+      loc = la::transform(toHelperFrame->loc_, toHelperFrame->ori_, loc);
+    
+    if (KDTREE_NANOFLANN)
+    {
+      using namespace nanoflann_types;
+      boost::shared_ptr<Tree>& tree = deco_.get< boost::shared_ptr<Tree> >(KDTREE_KEY);
+      // Copies of *this share their intermediary results. The buckets of
+      // the forest are shared by the new tree.
+      if (!tree.unique()) tree.reset(new Tree(*tree));
+      if (previous != NULL) tree->remove(idx);
+      tree->insert(idx, loc);
+    }
+    else
+    {
+      using namespace libkdtree_types;
+      boost::shared_ptr<Tree>& tree = deco_.get< boost::shared_ptr<Tree> >(KDTREE_KEY);
+      if (!tree.unique()) tree.reset(new Tree(*tree));
+      if (previous != NULL)
+      {
+        // The stored position may differ from the transformed position of
+        // previous by rounding errors if *this was transformed since the
+        // tree was built. The entry is found by index around that position.
+        Vector3 old = previous->getLoc();
+        if (toHelperFrame)
+          old = la::transform(toHelperFrame->loc_, toHelperFrame->ori_, old);
+        std::vector<FlexiblePoint> candidates;
+        as_const(*tree).find_within_range(FlexiblePoint(old.X(), old.Y(), old.Z()),
+                                          FLOATTOL*(1+old.Length()),
+                                          std::back_inserter(candidates));
+        std::vector<FlexiblePoint>::const_iterator i = candidates.begin();
+        while (i != candidates.end() && i->idx() != int(idx)) ++i;
+        NUKLEI_ASSERT(i != candidates.end());
+        tree->erase_exact(*i);
+      }
+      tree->insert(FlexiblePoint(loc.X(), loc.Y(), loc.Z(), idx));
+    }
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelCollection::buildKernelArray()
+  {
+    NUKLEI_TRACE_BEGIN();
+    using namespace kernel_array_types;
+    refreshHelperStructures();
+    
+    // If the kd-tree lives in another frame (see transformWith()), the array
+    // is built from copies of the kernels transformed to that frame.
+    const KernelCollection* source = this;
+    KernelCollection local;
+    if (helperFrame_ && deco_.has_key(KDTREE_KEY))
+    {
+      const kernel::se3 toHelperFrame = helperFrame_->inverseTransformation();
+      for (const_iterator i = as_const(*this).begin(); i != as_const(*this).end(); ++i)
+      {
+        // transformedWith() does not preserve widths and weights.
+        kernel::base::ptr k = i->polyTransformedWith(toHelperFrame);
+        k->setLocH(i->getLocH());
+        k->setOriH(i->getOriH());
+        k->setWeight(i->getWeight());
+        local.add(*k);
+      }
+      source = &local;
+    }
+    else
+      helperFrame_ = boost::none;
+    
+    boost::shared_ptr< KernelArray<coord_t> > array(new KernelArray<coord_t>);
+    if (!empty())
+    {
+      switch (*kernelType_)
+      {
+        case kernel::base::R3:
+          build_kernel_array<kernel::r3>(*array, source->begin(), source->end());
+          break;
+        case kernel::base::R3XS2:
+          build_kernel_array<kernel::r3xs2>(*array, source->begin(), source->end());
+          break;
+        case kernel::base::R3XS2P:
+          build_kernel_array<kernel::r3xs2p>(*array, source->begin(), source->end());
+          break;
+        case kernel::base::SE3:
+          build_kernel_array<kernel::se3>(*array, source->begin(), source->end());
+          break;
+        default:
+          NUKLEI_THROW("Unknow kernel type.");
+      }
     }
+    
+    setHelperStructure(KERNELARRAY_KEY, array);
+    NUKLEI_TRACE_END();
   }
   
-  template<class KernelType>
-  weight_t KernelCollection::staticEvaluationAt(const kernel::base &k,
-                                                const EvaluationStrategy strategy) const
+  template<class KernelType, class QueryIterator>
+  void KernelCollection::staticEvaluationAt(QueryIterator first,
+                                            QueryIterator last,
+                                            weight_t* values,
+                                            const EvaluationStrategy strategy,
+                                            const kernel::se3* queryTransform) const
   {
     NUKLEI_TRACE_BEGIN();
     
     NUKLEI_ASSERT(size() > 0);
     
     NUKLEI_ASSERT(KernelType().type() == *kernelType_);
-    NUKLEI_ASSERT(*kernelType_ == k.polyType());
     
-    coord_t value = 0;
+    // The code below resolves the kd-tree, the packed kernel array and the
+    // cut point once for the whole query range, and reuses the neighbor
+    // buffers across queries. With the packed array, the neighbors of a
+    // query are evaluated in SIMD blocks by eval_block().
+    
+    using namespace kernel_array_types;
+    typedef array_kernel<KernelType> ak;
+    // Intermediary results are read through plain pointers: copying their
+    // shared_ptr would make concurrent evaluations contend on its counter.
+    const KernelArray<coord_t>* array = NULL;
+    if (deco_.has_key(KERNELARRAY_KEY))
+    {
+      array = deco_.get< boost::shared_ptr< KernelArray<coord_t> > >(KERNELARRAY_KEY).get();
+      NUKLEI_ASSERT(array->size() == size());
+    }
+    KernelArrayQuery<coord_t> query;
+    
+    // Queries are first transformed with queryTransform, if provided. The
+    // kd-tree and the kernel array may live in another frame than kernels_
+    // (see transformWith()): queries are evaluated against them in that
+    // frame, and against kernels_ in the frame of kernels_.
+    boost::optional<kernel::se3> toKernelFrame, toHelperFrame;
+    if (queryTransform != NULL) toKernelFrame = *queryTransform;
+    toHelperFrame = toKernelFrame;
+    if (helperFrame_)
+    {
+      const kernel::se3 inverse = helperFrame_->inverseTransformation();
+      toHelperFrame = toKernelFrame ? toKernelFrame->transformedWith(inverse) : inverse;
+    }
+    KernelType helperBuffer, kernelBuffer;
+    
     if (KDTREE_DENSITY_EVAL && size() > 1000)
     {
-#if NUKLEI_CHECK_KDTREE_COUNT
-      int n_inside = 0;
-      coord_t rng = maxLocCutPoint()*maxLocCutPoint();
-      {
-        const KernelType &evalPoint = static_cast<const KernelType&>(k);
-        for (const_iterator i = begin(); i != end(); i++)
-        {
-          const KernelType &densityPoint = static_cast<const KernelType&>(*i);
-          
-          if ((densityPoint.loc_-evalPoint.loc_).SquaredLength() < rng)
-            n_inside++;
-        }
-      }
-#endif
-      
       if (KDTREE_NANOFLANN)
       {
         using namespace nanoflann_types;
         if (!deco_.has_key(KDTREE_KEY))
           NUKLEI_THROW("Undefined kd-tree. Call buildKdTree() first.");
         
-        const KernelType &evalPoint = static_cast<const KernelType&>(k);
-        
-        boost::shared_ptr<Tree> tree(deco_.get< boost::shared_ptr<Tree> >(KDTREE_KEY));
-        //FlexiblePoint s(evalPoint.loc_.X(), evalPoint.loc_.Y(), evalPoint.loc_.Z(), -1);
+        const Tree* tree = deco_.get< boost::shared_ptr<Tree> >(KDTREE_KEY).get();
         
         coord_t range = maxLocCutPoint();
         // nanoflann takes squared distances.
         range = range*range;
         
-        std::vector<std::pair<size_t,coord_t> > indices_dists;
-        RadiusResultSet<coord_t,size_t> resultSet(range,indices_dists);
-        
-        as_const(*tree).first->findNeighbors(resultSet, evalPoint.loc_, nuklei_nanoflann::SearchParams());
-        
-        for (std::vector<std::pair<size_t,coord_t> >::const_iterator i = indices_dists.begin(); i != indices_dists.end(); i++)
+        if (array != NULL)
         {
-          coord_t cvalue = 0;
-          const KernelType &densityPoint = static_cast<const KernelType&>(at(i->first));
-          cvalue = densityPoint.eval(evalPoint);
-          if (strategy == MAX_EVAL) value = std::max(value, cvalue);
-          else if (strategy == SUM_EVAL) value += cvalue;
-          else if (strategy == WEIGHTED_SUM_EVAL) value += cvalue * densityPoint.getWeight();
-          else NUKLEI_ASSERT(false);
+          eval_queries<KernelType>(*array, ForestNeighbors(*tree, range),
+                                   first, last, values, strategy,
+                                   toHelperFrame ? &*toHelperFrame : NULL);
+        }
+        else
+        {
+          // The neighbor buffers are kept by each thread from one call to
+          // the next, so that evaluating one query at a time does not
+          // allocate.
+          static thread_local Tree::result_t indices_dists, buffer;
+          
+          for (QueryIterator q = first; q != last; ++q, ++values)
+          {
+            NUKLEI_ASSERT(*kernelType_ == q->polyType());
+            const KernelType &queryPoint = static_cast<const KernelType&>(*q);
+            const KernelType &helperPoint =
+              transformed_query(queryPoint, toHelperFrame, helperBuffer);
+            
+#if NUKLEI_CHECK_KDTREE_COUNT
+            int n_inside = 0;
+            for (const_iterator i = begin(); i != end(); i++)
+            {
+              const KernelType &densityPoint = static_cast<const KernelType&>(*i);
+              if ((densityPoint.loc_-transformed_query(queryPoint, toKernelFrame, kernelBuffer).loc_).SquaredLength() < range)
+                n_inside++;
+            }
+#endif
+            
+            tree->findNeighbors(helperPoint.loc_, range,
+                                indices_dists, buffer);
+            
+            coord_t value = 0;
+            const KernelType &evalPoint =
+              transformed_query(queryPoint, toKernelFrame, kernelBuffer);
+            for (std::vector<std::pair<size_t,coord_t> >::const_iterator i = indices_dists.begin(); i != indices_dists.end(); i++)
+            {
+              const KernelType &densityPoint = static_cast<const KernelType&>(kernels_[i->first]);
+              accumulate_evaluation(value, densityPoint.eval(evalPoint),
+                                    densityPoint.getWeight(), strategy);
+            }
+            *values = value;
+          }
         }
       }
       else
@@ -190,76 +631,97 @@ namespace nuklei {
         if (!deco_.has_key(KDTREE_KEY))
           NUKLEI_THROW("Undefined kd-tree. Call buildKdTree() first.");
         
-        const KernelType &evalPoint = static_cast<const KernelType&>(k);
-        std::vector<FlexiblePoint> in_range;
-        
-        
         boost::shared_ptr<Tree> tree(deco_.get< boost::shared_ptr<Tree> >(KDTREE_KEY));
-        FlexiblePoint s(evalPoint.loc_.X(), evalPoint.loc_.Y(), evalPoint.loc_.Z(), -1);
         
         coord_t range = maxLocCutPoint();
         
-        as_const(*tree).find_within_range(s, range, std::back_inserter(in_range));
+        static thread_local std::vector<FlexiblePoint> in_range;
         
-        for (std::vector<FlexiblePoint>::const_iterator i = in_range.begin(); i != in_range.end(); i++)
+        for (QueryIterator q = first; q != last; ++q, ++values)
         {
-          coord_t cvalue = 0;
-          const KernelType &densityPoint = static_cast<const KernelType&>(at(i->idx()));
-          cvalue = densityPoint.eval(evalPoint);
-          if (strategy == MAX_EVAL) value = std::max(value, cvalue);
-          else if (strategy == SUM_EVAL) value += cvalue;
-          else if (strategy == WEIGHTED_SUM_EVAL) value += cvalue * densityPoint.getWeight();
-          else NUKLEI_ASSERT(false);
+          NUKLEI_ASSERT(*kernelType_ == q->polyType());
+          const KernelType &queryPoint = static_cast<const KernelType&>(*q);
+          const KernelType &helperPoint =
+            transformed_query(queryPoint, toHelperFrame, helperBuffer);
+          const KernelType &evalPoint =
+            transformed_query(queryPoint, toKernelFrame, kernelBuffer);
+          FlexiblePoint s(helperPoint.loc_.X(), helperPoint.loc_.Y(), helperPoint.loc_.Z(), -1);
+          
+          in_range.clear();
+          as_const(*tree).find_within_range(s, range, std::back_inserter(in_range));
+          
+          coord_t value = 0;
+          for (std::vector<FlexiblePoint>::const_iterator i = in_range.begin(); i != in_range.end(); i++)
+          {
+            const KernelType &densityPoint = static_cast<const KernelType&>(kernels_[i->idx()]);
+            accumulate_evaluation(value, densityPoint.eval(evalPoint),
+                                  densityPoint.getWeight(), strategy);
+          }
+          *values = value;
         }
       }
     }
     else
     {
-      const KernelType &evalPoint = static_cast<const KernelType&>(k);
-      for (const_iterator i = begin(); i != end(); i++)
-      {
-        coord_t cvalue = 0;
-        const KernelType &densityPoint = static_cast<const KernelType&>(*i);
-        cvalue = densityPoint.eval(evalPoint);
-        if (strategy == MAX_EVAL) value = std::max(value, cvalue);
-        else if (strategy == SUM_EVAL) value += cvalue;
-        else if (strategy == WEIGHTED_SUM_EVAL) value += cvalue * densityPoint.getWeight();
-        else NUKLEI_ASSERT(false);
+      for (QueryIterator q = first; q != last; ++q, ++values)
+      {
+        NUKLEI_ASSERT(*kernelType_ == q->polyType());
+        const KernelType &queryPoint = static_cast<const KernelType&>(*q);
+        
+        coord_t value = 0;
+        if (array != NULL)
+        {
+          ak::fill(query, transformed_query(queryPoint, toHelperFrame, helperBuffer));
+          value = eval_block<KernelType>(*array, NULL, array->size(),
+                                         query, strategy);
+        }
+        else
+        {
+          const KernelType &evalPoint =
+            transformed_query(queryPoint, toKernelFrame, kernelBuffer);
+          for (const_iterator i = begin(); i != end(); i++)
+          {
+            const KernelType &densityPoint = static_cast<const KernelType&>(*i);
+            accumulate_evaluation(value, densityPoint.eval(evalPoint),
+                                  densityPoint.getWeight(), strategy);
+          }
+        }
+        *values = value;
       }
     }
     
-    return value;
     NUKLEI_TRACE_END();
   }
   
-  weight_t KernelCollection::evaluationAt(const kernel::base &k,
-                                          const EvaluationStrategy strategy) const
+  template<class QueryIterator>
+  void KernelCollection::dispatchEvaluationAt(QueryIterator first,
+                                              QueryIterator last,
+                                              weight_t* values,
+                                              const EvaluationStrategy strategy,
+                                              const kernel::se3* queryTransform) const
   {
     NUKLEI_TRACE_BEGIN();
-    if (empty()) return 0;
-    NUKLEI_ASSERT(kernelType_ == k.polyType());
-    
-    coord_t value = 0;
+    refreshHelperStructures();
     switch (*kernelType_)
     {
       case kernel::base::R3:
       {
-        value = staticEvaluationAt<kernel::r3>(k, strategy);
+        staticEvaluationAt<kernel::r3>(first, last, values, strategy, queryTransform);
         break;
       }
       case kernel::base::R3XS2:
       {
-        value = staticEvaluationAt<kernel::r3xs2>(k, strategy);
+        staticEvaluationAt<kernel::r3xs2>(first, last, values, strategy, queryTransform);
         break;
       }
       case kernel::base::R3XS2P:
       {
-        value = staticEvaluationAt<kernel::r3xs2p>(k, strategy);
+        staticEvaluationAt<kernel::r3xs2p>(first, last, values, strategy, queryTransform);
         break;
       }
       case kernel::base::SE3:
       {
-        value = staticEvaluationAt<kernel::se3>(k, strategy);
+        staticEvaluationAt<kernel::se3>(first, last, values, strategy, queryTransform);
         break;
       }
       default:
@@ -270,10 +732,390 @@ namespace nuklei {
         break;
       }
     }
+    NUKLEI_TRACE_END();
+  }
+  
+  weight_t KernelCollection::evaluationAt(const kernel::base &k,
+                                          const EvaluationStrategy strategy) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (empty()) return 0;
+    NUKLEI_ASSERT(kernelType_ == k.polyType());
     
+    weight_t value = 0;
+    const kernel::base* query = &k;
+    dispatchEvaluationAt(boost::make_indirect_iterator(&query),
+                         boost::make_indirect_iterator(&query + 1),
+                         &value, strategy);
     return value;
     NUKLEI_TRACE_END();
   }
   
+  weight_t KernelCollection::evaluationAt(const kernel::base &k,
+                                          const kernel::se3 &t,
+                                          const EvaluationStrategy strategy) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (empty()) return 0;
+    NUKLEI_ASSERT(kernelType_ == k.polyType());
+    
+    weight_t value = 0;
+    const kernel::base* query = &k;
+    dispatchEvaluationAt(boost::make_indirect_iterator(&query),
+                         boost::make_indirect_iterator(&query + 1),
+                         &value, strategy, &t);
+    return value;
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelCollection::evaluationAt(std::vector<const kernel::base*>::const_iterator first,
+                                      std::vector<const kernel::base*>::const_iterator last,
+                                      const kernel::se3 &t,
+                                      std::vector<weight_t> &values,
+                                      const EvaluationStrategy strategy) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    values.assign(std::distance(first, last), 0);
+    if (empty() || values.empty()) return;
+    dispatchEvaluationAt(boost::make_indirect_iterator(first),
+                         boost::make_indirect_iterator(last),
+                         &values.front(), strategy, &t);
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelCollection::evaluationAt(const KernelCollection &points,
+                                      std::vector<weight_t> &values,
+                                      const EvaluationStrategy strategy) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    evaluationAt(points.begin(), points.end(), values, strategy);
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelCollection::evaluationAt(const_iterator first,
+                                      const_iterator last,
+                                      std::vector<weight_t> &values,
+                                      const EvaluationStrategy strategy) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    values.assign(std::distance(first, last), 0);
+    if (empty() || values.empty()) return;
+    dispatchEvaluationAt(first, last, &values.front(), strategy);
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelCollection::evaluationSliceAt(const_iterator first,
+                                           weight_t* values,
+                                           const size_t n,
+                                           const size_t sliceSize,
+                                           const EvaluationStrategy strategy,
+                                           const kernel::se3* queryTransform,
+                                           const int slice) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    const size_t begin = slice*sliceSize;
+    const size_t end = std::min(begin+sliceSize, n);
+    if (begin >= end) return;
+    dispatchEvaluationAt(first+begin, first+end, values+begin, strategy,
+                         queryTransform);
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelCollection::evaluationAt(const KernelCollection &points,
+                                      std::vector<weight_t> &values,
+                                      const EvaluationStrategy strategy,
+                                      const parallelizer::Type parallelization) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    evaluationAt(points.begin(), points.end(), values, strategy,
+                 parallelization);
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelCollection::evaluationAt(const_iterator first,
+                                      const_iterator last,
+                                      std::vector<weight_t> &values,
+                                      const EvaluationStrategy strategy,
+                                      const parallelizer::Type parallelization) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    parallelEvaluationAt(first, last, values, strategy, NULL, parallelization);
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelCollection::evaluationAt(const KernelCollection &points,
+                                      const kernel::se3 &t,
+                                      std::vector<weight_t> &values,
+                                      const EvaluationStrategy strategy,
+                                      const parallelizer::Type parallelization) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    parallelEvaluationAt(points.begin(), points.end(), values, strategy, &t,
+                         parallelization);
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelCollection::parallelEvaluationAt(const_iterator first,
+                                              const_iterator last,
+                                              std::vector<weight_t> &values,
+                                              const EvaluationStrategy strategy,
+                                              const kernel::se3* queryTransform,
+                                              const parallelizer::Type parallelization) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    const size_t n = std::distance(first, last);
+    values.assign(n, 0);
+    if (empty() || n == 0) return;
+    
+    // The prerequisites of staticEvaluationAt are checked before going
+    // parallel. See kernel_array_types::check_query_types().
+    refreshHelperStructures();
+    if (!kernelType_)
+      NUKLEI_THROW("Undefined kernel type.");
+    kernel_array_types::check_query_types(first, last, *kernelType_);
+    if (KDTREE_DENSITY_EVAL && size() > 1000)
+    {
+      maxLocCutPoint();
+      if (!deco_.has_key(KDTREE_KEY))
+        NUKLEI_THROW("Undefined kd-tree. Call buildKdTree() first.");
+    }
+    
+    // Slices are a few times more numerous than threads, to balance the
+    // load when query costs vary. Small slices are not worth the overhead.
+    const size_t minSliceSize = 256;
+    int nSlices = parallelizer::concurrency(parallelization);
+    if (parallelization == parallelizer::OPENMP) nSlices *= 4;
+    nSlices = std::max<int>(1, std::min<size_t>(nSlices, n/minSliceSize));
+    const size_t sliceSize = (n + nSlices - 1) / nSlices;
+    
+    if (nSlices == 1)
+    {
+      dispatchEvaluationAt(first, last, &values.front(), strategy,
+                           queryTransform);
+      return;
+    }
+    
+    parallelizer p(nSlices, parallelization);
+    p.for_each(boost::bind(&KernelCollection::evaluationSliceAt, this,
+                           first, &values.front(), n, sliceSize, strategy,
+                           queryTransform, _1));
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelCollection::checkNeighborSearch(const size_t k) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    refreshHelperStructures();
+    if (!deco_.has_key(KDTREE_KEY))
+      NUKLEI_THROW("Undefined kd-tree. Call buildKdTree() first.");
+    if (k > 0 && !KDTREE_NANOFLANN)
+      NUKLEI_THROW("Nearest-neighbor queries require the nanoflann kd-tree. "
+                   "Unset NUKLEI_KDTREE_NANOFLANN.");
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelCollection::neighborSearch(const Vector3* queries,
+                                        const size_t n,
+                                        const size_t k,
+                                        const coord_t radius,
+                                        std::vector<size_t>& counts,
+                                        std::vector<size_t>& indices,
+                                        std::vector<coord_t>& squaredDistances) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    
+    // Queries are given in the frame of kernels_. The tree may live in
+    // another frame (see transformWith()). Distances are the same in both.
+    boost::optional<kernel::se3> toHelperFrame;
+    if (helperFrame_)
+      toHelperFrame = helperFrame_->inverseTransformation();
+    
+    // The neighbor buffers are kept by each thread from one call to the
+    // next, so that searching one query at a time does not allocate.
+    static thread_local std::vector<std::pair<size_t,coord_t> > result, buffer;
+    static thread_local std::vector<FlexiblePoint> in_range;
+    
+    for (const Vector3* q = queries; q != queries+n; ++q)
+    {
+      Vector3 center = *q;
+      if (toHelperFrame)
+        center = la::transform(toHelperFrame->loc_, toHelperFrame->ori_, center);
+      
+      if (KDTREE_NANOFLANN)
+      {
+        using namespace nanoflann_types;
+        const Tree& tree = *deco_.get< boost::shared_ptr<Tree> >(KDTREE_KEY);
+        if (k > 0)
+          tree.knn(center, k, result);
+        else
+        {
+          tree.findNeighbors(center, radius*radius, result, buffer);
+          std::sort(result.begin(), result.end(), IndexDist_Sorter());
+        }
+      }
+      else
+      {
+        using namespace libkdtree_types;
+        const Tree& tree = *deco_.get< boost::shared_ptr<Tree> >(KDTREE_KEY);
+        // find_within_range() searches a box.
+        in_range.clear();
+        tree.find_within_range(FlexiblePoint(center.X(), center.Y(), center.Z()),
+                               radius, std::back_inserter(in_range));
+        result.clear();
+        for (std::vector<FlexiblePoint>::const_iterator i = in_range.begin();
+             i != in_range.end(); ++i)
+        {
+          const coord_t d2 =
+            (Vector3(i->x(), i->y(), i->z()) - center).SquaredLength();
+          // Same strict comparison as nanoflann's RadiusResultSet: both
+          // trees exclude kernels at distance radius.
+          if (d2 < radius*radius) result.push_back(std::make_pair(i->idx(), d2));
+        }
+        std::sort(result.begin(), result.end(), nuklei_nanoflann::IndexDist_Sorter());
+      }
+      
+      counts.push_back(result.size());
+      for (std::vector<std::pair<size_t,coord_t> >::const_iterator i = result.begin();
+           i != result.end(); ++i)
+      {
+        indices.push_back(i->first);
+        squaredDistances.push_back(i->second);
+      }
+    }
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelCollection::neighborSearchSlice(const std::vector<Vector3>* queries,
+                                             const size_t k,
+                                             const coord_t radius,
+                                             const size_t sliceSize,
+                                             std::vector< std::vector<size_t> >* counts,
+                                             std::vector< std::vector<size_t> >* indices,
+                                             std::vector< std::vector<coord_t> >* squaredDistances,
+                                             const int slice) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    const size_t begin = slice*sliceSize;
+    const size_t end = std::min(begin+sliceSize, queries->size());
+    if (begin >= end) return;
+    neighborSearch(&queries->front()+begin, end-begin, k, radius,
+                   counts->at(slice), indices->at(slice),
+                   squaredDistances->at(slice));
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelCollection::parallelNeighborSearch(const std::vector<Vector3>& queries,
+                                                const size_t k,
+                                                const coord_t radius,
+                                                std::vector<size_t>& offsets,
+                                                std::vector<size_t>& indices,
+                                                std::vector<coord_t>& squaredDistances,
+                                                const parallelizer::Type parallelization) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    checkNeighborSearch(k);
+    
+    const size_t n = queries.size();
+    offsets.assign(1, 0);
+    indices.clear();
+    squaredDistances.clear();
+    if (n == 0) return;
+    
+    const size_t minSliceSize = 256;
+    int nSlices = parallelizer::concurrency(parallelization);
+    if (parallelization == parallelizer::OPENMP) nSlices *= 4;
+    nSlices = std::max<int>(1, std::min<size_t>(nSlices, n/minSliceSize));
+    const size_t sliceSize = (n + nSlices - 1) / nSlices;
+    
+    // Each slice writes to its own buffers, which are concatenated in
+    // order. The output does not depend on the parallelization.
+    std::vector< std::vector<size_t> > counts(nSlices), sliceIndices(nSlices);
+    std::vector< std::vector<coord_t> > sliceDistances(nSlices);
+    if (nSlices == 1)
+      neighborSearchSlice(&queries, k, radius, sliceSize, &counts,
+                          &sliceIndices, &sliceDistances, 0);
+    else
+    {
+      parallelizer p(nSlices, parallelization);
+      p.for_each(boost::bind(&KernelCollection::neighborSearchSlice, this,
+                             &queries, k, radius, sliceSize, &counts,
+                             &sliceIndices, &sliceDistances, _1));
+    }
+    
+    offsets.reserve(n+1);
+    for (int s = 0; s < nSlices; ++s)
+    {
+      for (std::vector<size_t>::const_iterator c = counts[s].begin();
+           c != counts[s].end(); ++c)
+        offsets.push_back(offsets.back() + *c);
+      indices.insert(indices.end(), sliceIndices[s].begin(), sliceIndices[s].end());
+      squaredDistances.insert(squaredDistances.end(),
+                              sliceDistances[s].begin(), sliceDistances[s].end());
+    }
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelCollection::knn(const Vector3& p,
+                             const size_t k,
+                             std::vector<size_t>& indices,
+                             std::vector<coord_t>& squaredDistances) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    checkNeighborSearch(k);
+    static thread_local std::vector<size_t> counts;
+    counts.clear();
+    indices.clear();
+    squaredDistances.clear();
+    neighborSearch(&p, 1, k, 0, counts, indices, squaredDistances);
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelCollection::knn(const std::vector<Vector3>& points,
+                             const size_t k,
+                             std::vector<size_t>& indices,
+                             std::vector<coord_t>& squaredDistances,
+                             const parallelizer::Type parallelization) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (k == 0)
+    {
+      indices.clear();
+      squaredDistances.clear();
+      return;
+    }
+    std::vector<size_t> offsets;
+    parallelNeighborSearch(points, k, 0, offsets, indices, squaredDistances,
+                           parallelization);
+    NUKLEI_ASSERT(indices.size() == points.size()*std::min(k, size()));
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelCollection::radiusSearch(const Vector3& p,
+                                      const coord_t r,
+                                      std::vector<size_t>& indices,
+                                      std::vector<coord_t>& squaredDistances) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    checkNeighborSearch(0);
+    static thread_local std::vector<size_t> counts;
+    counts.clear();
+    indices.clear();
+    squaredDistances.clear();
+    neighborSearch(&p, 1, 0, r, counts, indices, squaredDistances);
+    NUKLEI_TRACE_END();
+  }
+  
+  void KernelCollection::radiusSearch(const std::vector<Vector3>& points,
+                                      const coord_t r,
+                                      std::vector<size_t>& offsets,
+                                      std::vector<size_t>& indices,
+                                      std::vector<coord_t>& squaredDistances,
+                                      const parallelizer::Type parallelization) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    parallelNeighborSearch(points, 0, r, offsets, indices, squaredDistances,
+                           parallelization);
+    NUKLEI_TRACE_END();
+  }
+  
 }
-
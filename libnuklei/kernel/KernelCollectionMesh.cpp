@@ -36,14 +36,7 @@
 
 
 #include <CGAL/Simple_cartesian.h>
-#include <CGAL/AABB_tree.h>
-#include <CGAL/AABB_traits.h>
 #include <CGAL/Polyhedron_3.h>
-#if CGAL_VERSION_NR >= 1040300000
-#include <CGAL/AABB_face_graph_triangle_primitive.h>
-#else
-#include <CGAL/AABB_polyhedron_triangle_primitive.h>
-#endif
 #include <CGAL/property_map.h>
 #include <CGAL/IO/read_off_points.h>
 #include <CGAL/IO/read_xyz_points.h>
@@ -52,14 +45,19 @@
 
 #include <CGAL/squared_distance_3.h>
 #include <CGAL/Point_with_normal_3.h>
+#include <CGAL/Polyhedron_incremental_builder_3.h>
+#include <CGAL/Inverse_index.h>
 
 #endif
 
 #include <vector>
 #include <fstream>
+#include <cstring>
 #include <utility> // defines std::pair
 #include <list>
+#include <boost/cstdint.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
 #ifdef NUKLEI_HAS_PARTIAL_VIEW
 #include <trimesh/TriMesh.h>
 #endif
@@ -67,6 +65,9 @@
 #include <nuklei/KernelCollection.h>
 #include <nuklei/ObservationIO.h>
 
+#include "KernelCollectionViewCache.h"
+#include "KernelCollectionVisibility.h"
+
 #ifdef NUKLEI_HAS_PARTIAL_VIEW
 
 
@@ -95,51 +96,58 @@ namespace meshing_types {
 
 typedef CGAL::Polyhedron_3< CGAL::Simple_cartesian<double> > SimplePolyhedron;
 
-namespace view_types {
-  typedef CGAL::Simple_cartesian<double> K;
-  typedef K::Point_3 Point;
-  typedef K::Plane_3 Plane;
-  typedef K::Vector_3 Vector;
-  typedef K::Segment_3 Segment;
-  typedef K::Line_3 Line;
-  typedef SimplePolyhedron Polyhedron;
-#if CGAL_VERSION_NR >= 1040300000
-  typedef CGAL::AABB_face_graph_triangle_primitive<Polyhedron> Primitive;
-#else
-  typedef CGAL::AABB_polyhedron_triangle_primitive<K,Polyhedron> Primitive;
-#endif
-  typedef CGAL::AABB_traits<K, Primitive> Traits;
-  typedef CGAL::AABB_tree<Traits> Tree;
-  typedef Tree::Object_and_primitive_id Object_and_primitive_id;
-  typedef Tree::Primitive_id Primitive_id;
-  
-  
-  typedef CGAL::Point_with_normal_3<K> Point_with_normal;
-  typedef std::vector<Point_with_normal> PointList;
-}
-
 #endif
 
 namespace nuklei {
   
 #ifdef NUKLEI_HAS_PARTIAL_VIEW
-  static void buildAABBTree(decoration<int>& deco, const int aabbKey,
-                            SimplePolyhedron& poly)
+  // Vertex coordinates and vertex indices of the triangles of poly.
+  // Polygonal facets, which may come from readMeshFromOffFile(), are
+  // split into fans of triangles.
+  static void meshTriangles(const SimplePolyhedron& poly,
+                            std::vector<coord_t>& vertices,
+                            std::vector<boost::uint32_t>& triangles)
   {
-    using namespace view_types;
-    
-    boost::shared_ptr<Tree> tree(new Tree);
-    
-    // constructs AABB tree
-#if CGAL_VERSION_NR >= 1040300000
-    tree.reset(new Tree(faces(poly).first, faces(poly).second, poly));
-#else
-    tree.reset(new Tree(poly.facets_begin(),poly.facets_end()));
-#endif
-    tree->accelerate_distance_queries();
+    vertices.clear();
+    vertices.reserve(3*poly.size_of_vertices());
+    for (SimplePolyhedron::Vertex_const_iterator v = poly.vertices_begin();
+         v != poly.vertices_end(); ++v)
+    {
+      vertices.push_back(v->point().x());
+      vertices.push_back(v->point().y());
+      vertices.push_back(v->point().z());
+    }
     
-    if (deco.has_key(aabbKey)) deco.erase(aabbKey);
-    deco.insert(aabbKey, tree);
+    typedef CGAL::Inverse_index<SimplePolyhedron::Vertex_const_iterator> vertex_index_t;
+    vertex_index_t vertexIndex(poly.vertices_begin(), poly.vertices_end());
+    std::vector<boost::uint32_t> facet;
+    triangles.clear();
+    triangles.reserve(3*poly.size_of_facets());
+    for (SimplePolyhedron::Facet_const_iterator f = poly.facets_begin();
+         f != poly.facets_end(); ++f)
+    {
+      facet.clear();
+      SimplePolyhedron::Halfedge_around_facet_const_circulator h = f->facet_begin();
+      do {
+        facet.push_back(vertexIndex[SimplePolyhedron::Vertex_const_iterator(h->vertex())]);
+      } while (++h != f->facet_begin());
+      for (size_t i = 1; i+1 < facet.size(); ++i)
+      {
+        triangles.push_back(facet[0]);
+        triangles.push_back(facet[i]);
+        triangles.push_back(facet[i+1]);
+      }
+    }
+  }
+  
+  static boost::shared_ptr<visibility_types::VisibilityEngine>
+  buildVisibilityEngine(const SimplePolyhedron& poly)
+  {
+    std::vector<coord_t> vertices;
+    std::vector<boost::uint32_t> triangles;
+    meshTriangles(poly, vertices, triangles);
+    return boost::shared_ptr<visibility_types::VisibilityEngine>
+      (new visibility_types::VisibilityEngine(vertices, triangles));
   }
 #endif
   
@@ -288,10 +296,10 @@ namespace nuklei {
       }
     }
     
-    if (deco_.has_key(MESH_KEY)) deco_.erase(MESH_KEY);
-    deco_.insert(MESH_KEY, poly);
+    setHelperStructure(MESH_KEY, poly);
     
-    buildAABBTree(deco_, AABBTREE_KEY, *poly);
+    setHelperStructure(VISIBILITY_KEY, buildVisibilityEngine(*poly));
+    meshSource_ = 0;
 #else
     NUKLEI_THROW("This function requires the partial view build of Nuklei. See http://renaud-detry.net/nuklei/group__install.html");
 #endif
@@ -302,6 +310,7 @@ namespace nuklei {
   {
     NUKLEI_TRACE_BEGIN();
 #ifdef NUKLEI_HAS_PARTIAL_VIEW
+    refreshHelperStructures();
     if (!deco_.has_key(MESH_KEY))
       NUKLEI_THROW("Undefined mesh. Call buildMesh() first.");
     std::ofstream out(filename.c_str());
@@ -343,9 +352,9 @@ namespace nuklei {
     {
       NUKLEI_THROW("Cannot read mesh.");
     }
-    if (deco_.has_key(MESH_KEY)) deco_.erase(MESH_KEY);
-    deco_.insert(MESH_KEY, poly);
-    buildAABBTree(deco_, AABBTREE_KEY, *poly);
+    setHelperStructure(MESH_KEY, poly);
+    setHelperStructure(VISIBILITY_KEY, buildVisibilityEngine(*poly));
+    meshSource_ = fileHash(filename);
 #else
     NUKLEI_THROW("This function requires the partial view build of Nuklei. See http://renaud-detry.net/nuklei/group__install.html");
 #endif
@@ -371,6 +380,411 @@ namespace nuklei {
 #endif
     NUKLEI_TRACE_END();
   }
+  
+#ifdef NUKLEI_HAS_PARTIAL_VIEW
+  
+  // Partial view cache files hold, in native byte order:
+  // - the magic string, the format version, and a byte order mark,
+  // - the number of kernels and a hash of their positions and orientations,
+  // - the source of the mesh: 0 if it was built by buildMesh(), or a hash
+  //   of the OFF file it was read from,
+  // - the parameters of buildPartialViewCache(),
+  // - the mesh, as vertex coordinates and vertex indices of triangles,
+  // - the views, as directions, offsets into the index array, and indices.
+  
+  static const char PARTIAL_VIEW_CACHE_MAGIC[8] =
+  { 'N', 'U', 'K', 'L', 'E', 'I', 'P', 'V' };
+  static const boost::uint32_t PARTIAL_VIEW_CACHE_VERSION = 2;
+  static const boost::uint32_t PARTIAL_VIEW_CACHE_BOM = 0x01020304;
+  
+  // 64-bit FNV-1a hash. Unlike boost::hash, its value does not depend on the
+  // platform or on the version of Boost.
+  static const boost::uint64_t FNV_OFFSET_BASIS = 14695981039346656037ULL;
+  
+  static void fnv1a(boost::uint64_t& h, const char* data, const size_t size)
+  {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    for (size_t b = 0; b < size; ++b)
+    {
+      h ^= bytes[b];
+      h *= 1099511628211ULL;
+    }
+  }
+  
+  // Hash of the contents of a file, used as the mesh source of meshes read
+  // from that file. Never 0, which stands for buildMesh().
+  static boost::uint64_t fileHash(const std::string& filename)
+  {
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    if (!in)
+      NUKLEI_THROW("Cannot open `" << filename << "'.");
+    boost::uint64_t h = FNV_OFFSET_BASIS;
+    char buffer[1 << 16];
+    while (in)
+    {
+      in.read(buffer, sizeof(buffer));
+      fnv1a(h, buffer, in.gcount());
+    }
+    return h != 0 ? h : 1;
+  }
+  
+  static boost::uint64_t contentHash(const KernelCollection& kc)
+  {
+    boost::uint64_t h = FNV_OFFSET_BASIS;
+    for (KernelCollection::const_iterator i = kc.begin(); i != kc.end(); ++i)
+    {
+      coord_t values[7] = { i->getLoc().X(), i->getLoc().Y(), i->getLoc().Z(),
+        0, 0, 0, 0 };
+      switch (i->polyType())
+      {
+        case kernel::base::SE3:
+        {
+          const Quaternion& q = static_cast<const kernel::se3&>(*i).ori_;
+          values[3] = q.W(); values[4] = q.X(); values[5] = q.Y(); values[6] = q.Z();
+          break;
+        }
+        case kernel::base::R3XS2:
+        {
+          const Vector3& d = static_cast<const kernel::r3xs2&>(*i).dir_;
+          values[3] = d.X(); values[4] = d.Y(); values[5] = d.Z();
+          break;
+        }
+        case kernel::base::R3XS2P:
+        {
+          const Vector3& d = static_cast<const kernel::r3xs2p&>(*i).dir_;
+          values[3] = d.X(); values[4] = d.Y(); values[5] = d.Z();
+          break;
+        }
+        default:
+          break;
+      }
+      fnv1a(h, reinterpret_cast<const char*>(values), sizeof(values));
+    }
+    return h;
+  }
+  
+  template<typename T>
+  static void writeBinary(std::ostream& out, const T& value)
+  {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+  
+  template<typename T>
+  static void writeBinary(std::ostream& out, const std::vector<T>& values)
+  {
+    if (!values.empty())
+      out.write(reinterpret_cast<const char*>(&values.front()),
+                values.size()*sizeof(T));
+  }
+  
+  // Reads values from a memory-mapped file. Values are copied rather than
+  // accessed in place, as they may not be aligned. Reading past the end of
+  // the file sets failed(), and returns zeros from then on.
+  class BinaryReader
+  {
+  public:
+    BinaryReader(const char* data, const size_t size) :
+    p_(data), end_(data + size), failed_(false) {}
+    
+    template<typename T>
+    T read()
+    {
+      T value = T();
+      if (!check(1, sizeof(T))) return value;
+      std::memcpy(&value, p_, sizeof(T));
+      p_ += sizeof(T);
+      return value;
+    }
+    
+    // n is a count read from the file. It is checked against the size of
+    // the file before anything is allocated.
+    template<typename T>
+    void read(std::vector<T>& values, const boost::uint64_t n)
+    {
+      values.clear();
+      if (!check(n, sizeof(T))) return;
+      values.resize(n);
+      if (n > 0)
+        std::memcpy(&values.front(), p_, n*sizeof(T));
+      p_ += n*sizeof(T);
+    }
+    
+    bool failed() const { return failed_; }
+    
+  private:
+    bool check(const boost::uint64_t n, const size_t size)
+    {
+      if (failed_ || n > boost::uint64_t(end_ - p_) / size)
+        failed_ = true;
+      return !failed_;
+    }
+    
+    const char* p_;
+    const char* end_;
+    bool failed_;
+  };
+  
+  template <class HDS>
+  class TriangleMeshBuilder : public CGAL::Modifier_base<HDS>
+  {
+  public:
+    TriangleMeshBuilder(const std::vector<double>& vertices,
+                        const std::vector<boost::uint32_t>& triangles) :
+    vertices_(vertices), triangles_(triangles), ok_(false) {}
+    
+    void operator()(HDS& hds)
+    {
+      typedef typename HDS::Vertex::Point Point;
+      CGAL::Polyhedron_incremental_builder_3<HDS> builder(hds, true);
+      builder.begin_surface(vertices_.size()/3, triangles_.size()/3);
+      for (size_t i = 0; i+2 < vertices_.size(); i += 3)
+        builder.add_vertex(Point(vertices_[i], vertices_[i+1], vertices_[i+2]));
+      for (size_t i = 0; i+2 < triangles_.size(); i += 3)
+      {
+        builder.begin_facet();
+        builder.add_vertex_to_facet(triangles_[i]);
+        builder.add_vertex_to_facet(triangles_[i+1]);
+        builder.add_vertex_to_facet(triangles_[i+2]);
+        builder.end_facet();
+        if (builder.error()) break;
+      }
+      if (builder.error())
+        builder.rollback();
+      else
+      {
+        builder.end_surface();
+        ok_ = !builder.error();
+      }
+    }
+    
+    bool ok() const { return ok_; }
+    
+  private:
+    const std::vector<double>& vertices_;
+    const std::vector<boost::uint32_t>& triangles_;
+    bool ok_;
+  };
+  
+#endif
+  
+  void KernelCollection::writePartialViewCache(const std::string& filename) const
+  {
+    NUKLEI_TRACE_BEGIN();
+#ifdef NUKLEI_HAS_PARTIAL_VIEW
+    typedef view_cache_types::ViewCache viewcache_t;
+    refreshHelperStructures();
+    if (!deco_.has_key(MESH_KEY))
+      NUKLEI_THROW("Undefined mesh. Call buildMesh() first.");
+    if (!deco_.has_key(VIEWCACHE_KEY))
+      NUKLEI_THROW("Undefined view cache. Call buildPartialViewCache() first.");
+    
+    const SimplePolyhedron& poly = *deco_.get< boost::shared_ptr<SimplePolyhedron> >(MESH_KEY);
+    const viewcache_t& viewIndex = *deco_.get< boost::shared_ptr<viewcache_t> >(VIEWCACHE_KEY);
+    
+    std::vector<double> vertices;
+    std::vector<boost::uint32_t> triangles;
+    meshTriangles(poly, vertices, triangles);
+    
+    std::vector<double> directions;
+    std::vector<boost::uint64_t> offsets(1, 0);
+    std::vector<boost::int32_t> indices;
+    for (size_t i = 0; i < viewIndex.size(); ++i)
+    {
+      directions.push_back(viewIndex.direction(i).X());
+      directions.push_back(viewIndex.direction(i).Y());
+      directions.push_back(viewIndex.direction(i).Z());
+      indices.insert(indices.end(), viewIndex.view(i).begin(), viewIndex.view(i).end());
+      offsets.push_back(indices.size());
+    }
+    
+    // The file is written under a temporary name, then renamed, so that
+    // concurrent readers never see a partial file.
+    NUKLEI_ASSERT(meshSource_);
+    boost::filesystem::path target(filename);
+    boost::filesystem::path tmp = target;
+    tmp += boost::filesystem::unique_path(".%%%%-%%%%-%%%%");
+    {
+      std::ofstream out(tmp.c_str(), std::ios::binary);
+      if (!out)
+        NUKLEI_THROW("Cannot open `" << tmp.string() << "' for writing.");
+      out.write(PARTIAL_VIEW_CACHE_MAGIC, sizeof(PARTIAL_VIEW_CACHE_MAGIC));
+      writeBinary(out, PARTIAL_VIEW_CACHE_VERSION);
+      writeBinary(out, PARTIAL_VIEW_CACHE_BOM);
+      writeBinary(out, boost::uint64_t(size()));
+      writeBinary(out, contentHash(*this));
+      writeBinary(out, *meshSource_);
+      writeBinary(out, double(viewIndex.meshTol()));
+      writeBinary(out, double(viewIndex.angularResolution()));
+      writeBinary(out, boost::uint32_t(viewIndex.useRayToSurfacenormalAngle()));
+      writeBinary(out, boost::uint64_t(vertices.size()/3));
+      writeBinary(out, boost::uint64_t(triangles.size()/3));
+      writeBinary(out, vertices);
+      writeBinary(out, triangles);
+      writeBinary(out, boost::uint64_t(viewIndex.size()));
+      writeBinary(out, boost::uint64_t(indices.size()));
+      writeBinary(out, directions);
+      writeBinary(out, offsets);
+      writeBinary(out, indices);
+      out.close();
+      if (!out)
+      {
+        boost::system::error_code ec;
+        boost::filesystem::remove(tmp, ec);
+        NUKLEI_THROW("Error writing `" << tmp.string() << "'.");
+      }
+    }
+    boost::system::error_code ec;
+    boost::filesystem::rename(tmp, target, ec);
+    if (ec)
+    {
+      boost::system::error_code ignored;
+      boost::filesystem::remove(tmp, ignored);
+      NUKLEI_THROW("Cannot rename `" << tmp.string() << "' to `" <<
+                   target.string() << "': " << ec.message() << ".");
+    }
+#else
+    NUKLEI_THROW("This function requires the partial view build of Nuklei. See http://renaud-detry.net/nuklei/group__install.html");
+#endif
+    NUKLEI_TRACE_END();
+  }
+  
+  bool KernelCollection::readPartialViewCache(const std::string& filename,
+                                              const double meshTol,
+                                              const bool useRayToSurfacenormalAngle,
+                                              const double angularResolution,
+                                              const std::string& meshfile)
+  {
+    NUKLEI_TRACE_BEGIN();
+#ifdef NUKLEI_HAS_PARTIAL_VIEW
+    typedef view_cache_types::ViewCache viewcache_t;
+    if (!boost::filesystem::exists(filename))
+      return false;
+    
+    const boost::uint64_t meshSource = meshfile.empty() ? 0 : fileHash(meshfile);
+    
+    boost::iostreams::mapped_file_source file;
+    try
+    {
+      file.open(filename);
+    }
+    catch (std::exception& e)
+    {
+      NUKLEI_WARN("Ignoring partial view cache `" << filename <<
+                  "': " << e.what());
+      return false;
+    }
+    BinaryReader in(file.data(), file.size());
+    
+    char magic[sizeof(PARTIAL_VIEW_CACHE_MAGIC)];
+    for (size_t i = 0; i < sizeof(magic); ++i)
+      magic[i] = in.read<char>();
+    if (in.failed() ||
+        std::memcmp(magic, PARTIAL_VIEW_CACHE_MAGIC, sizeof(magic)) != 0)
+    {
+      NUKLEI_WARN("Ignoring partial view cache `" << filename <<
+                  "': not a partial view cache file.");
+      return false;
+    }
+    if (in.read<boost::uint32_t>() != PARTIAL_VIEW_CACHE_VERSION ||
+        in.read<boost::uint32_t>() != PARTIAL_VIEW_CACHE_BOM)
+    {
+      NUKLEI_WARN("Ignoring partial view cache `" << filename <<
+                  "': incompatible format.");
+      return false;
+    }
+    if (in.read<boost::uint64_t>() != size() ||
+        in.read<boost::uint64_t>() != contentHash(*this))
+    {
+      NUKLEI_INFO("Ignoring partial view cache `" << filename <<
+                  "': built from different kernels.");
+      return false;
+    }
+    if (in.read<boost::uint64_t>() != meshSource)
+    {
+      NUKLEI_INFO("Ignoring partial view cache `" << filename <<
+                  "': built from a different mesh.");
+      return false;
+    }
+    if (in.read<double>() != meshTol ||
+        in.read<double>() != angularResolution ||
+        in.read<boost::uint32_t>() != boost::uint32_t(useRayToSurfacenormalAngle))
+    {
+      NUKLEI_INFO("Ignoring partial view cache `" << filename <<
+                  "': built with different parameters.");
+      return false;
+    }
+    
+    std::vector<double> vertices;
+    std::vector<boost::uint32_t> triangles;
+    const boost::uint64_t nVertices = in.read<boost::uint64_t>();
+    const boost::uint64_t nTriangles = in.read<boost::uint64_t>();
+    // Counts larger than the file are rejected before they are multiplied.
+    if (nVertices > file.size() || nTriangles > file.size())
+    {
+      NUKLEI_WARN("Ignoring partial view cache `" << filename <<
+                  "': corrupt file.");
+      return false;
+    }
+    in.read(vertices, 3*nVertices);
+    in.read(triangles, 3*nTriangles);
+    bool corrupt = in.failed();
+    for (std::vector<boost::uint32_t>::const_iterator t = triangles.begin();
+         t != triangles.end() && !corrupt; ++t)
+      corrupt = *t >= nVertices;
+    
+    std::vector<double> directions;
+    std::vector<boost::uint64_t> offsets;
+    std::vector<boost::int32_t> indices;
+    const boost::uint64_t nViews = in.read<boost::uint64_t>();
+    const boost::uint64_t nIndices = in.read<boost::uint64_t>();
+    corrupt = corrupt || nViews >= file.size();
+    if (!corrupt)
+    {
+      in.read(directions, 3*nViews);
+      in.read(offsets, nViews+1);
+      in.read(indices, nIndices);
+      corrupt = in.failed() || offsets.front() != 0;
+    }
+    for (size_t i = 0; i < nViews && !corrupt; ++i)
+      corrupt = offsets[i] > offsets[i+1] || offsets[i+1] > nIndices;
+    for (std::vector<boost::int32_t>::const_iterator i = indices.begin();
+         i != indices.end() && !corrupt; ++i)
+      corrupt = *i < 0 || size_t(*i) >= size();
+    if (corrupt)
+    {
+      NUKLEI_WARN("Ignoring partial view cache `" << filename <<
+                  "': corrupt file.");
+      return false;
+    }
+    
+    boost::shared_ptr<SimplePolyhedron> poly(new SimplePolyhedron);
+    TriangleMeshBuilder<SimplePolyhedron::HalfedgeDS> builder(vertices, triangles);
+    poly->delegate(builder);
+    if (!builder.ok() || !poly->is_valid() || poly->empty())
+    {
+      NUKLEI_WARN("Ignoring partial view cache `" << filename <<
+                  "': invalid mesh.");
+      return false;
+    }
+    
+    boost::shared_ptr<viewcache_t>
+    viewIndex(new viewcache_t(meshTol, useRayToSurfacenormalAngle,
+                              angularResolution));
+    for (size_t i = 0; i < nViews; ++i)
+      viewIndex->add(Vector3(directions[3*i], directions[3*i+1], directions[3*i+2]),
+                     std::vector<int>(indices.begin() + offsets[i],
+                                      indices.begin() + offsets[i+1]));
+    viewIndex->buildIndex();
+    
+    setHelperStructure(MESH_KEY, poly);
+    setHelperStructure(VISIBILITY_KEY, buildVisibilityEngine(*poly));
+    setHelperStructure(VIEWCACHE_KEY, viewIndex);
+    meshSource_ = meshSource;
+    return true;
+#else
+    NUKLEI_THROW("This function requires the partial view build of Nuklei. See http://renaud-detry.net/nuklei/group__install.html");
+#endif
+    NUKLEI_TRACE_END();
+  }
 
 }
-
@@ -6,6 +6,9 @@
 
 #include "KernelCollectionTypes.h"
 #include <nuklei/KernelCollection.h>
+#include <nuklei/parallelizer.h>
+
+#include <boost/bind.hpp>
 
 namespace nuklei
 {
@@ -119,6 +122,133 @@ namespace nuklei
     NUKLEI_TRACE_END();
   }
 
+  namespace
+  {
+    // Writes to normals[i] the direction of least variance of the
+    // neighbors of point i, for the points of a slice. Leaves valid[i] to
+    // false if there are fewer than three neighbors, or if they coincide.
+    void fit_normals_slice(const std::vector<Vector3>* points,
+                           const std::vector<size_t>* offsets,
+                           const std::vector<size_t>* indices,
+                           const size_t sliceSize,
+                           std::vector<Vector3>* normals,
+                           std::vector<char>* valid,
+                           const int slice)
+    {
+      const size_t begin = slice*sliceSize;
+      const size_t end = std::min(begin+sliceSize, points->size());
+      for (size_t i = begin; i < end; ++i)
+      {
+        const size_t first = offsets->at(i), last = offsets->at(i+1);
+        if (last - first < 3) continue;
+        
+        Vector3 centroid = Vector3::ZERO;
+        for (size_t j = first; j < last; ++j)
+          centroid += points->at(indices->at(j));
+        centroid /= (last - first);
+        
+        Matrix3 cov = Matrix3::ZERO;
+        for (size_t j = first; j < last; ++j)
+        {
+          const Vector3 d = points->at(indices->at(j)) - centroid;
+          cov += Matrix3(d, d);
+        }
+        
+        Matrix3 eVectors;
+        Vector3 eValues;
+        la::fastEigenDecomposition(eVectors, eValues, cov);
+        if (eValues[0] == 0) continue;
+        normals->at(i) = eVectors.GetColumn(2);
+        valid->at(i) = true;
+      }
+    }
+  }
+  
+  void KernelCollection::computeSurfaceNormals(const size_t k,
+                                               const coord_t radius,
+                                               const boost::optional<Vector3>& viewpoint,
+                                               const parallelizer::Type parallelization)
+  {
+    NUKLEI_TRACE_BEGIN();
+    if (k == 0 && !(radius > 0))
+      NUKLEI_THROW("Either k or radius must be positive.");
+    
+    refreshHelperStructures();
+    if (!deco_.has_key(KDTREE_KEY))
+      buildKdTree();
+    
+    const std::vector<Vector3> points = get3DPointCloud();
+    const size_t n = points.size();
+    
+    std::vector<size_t> offsets, indices;
+    std::vector<coord_t> squaredDistances;
+    if (k > 0)
+    {
+      as_const(*this).knn(points, k, indices, squaredDistances, parallelization);
+      // Rows of knn() have min(k, n) entries. Neighbors farther than radius
+      // are discarded.
+      const size_t m = std::min(k, n);
+      offsets.assign(1, 0);
+      size_t j = 0;
+      for (size_t i = 0; i < n; ++i)
+      {
+        for (size_t l = i*m; l < (i+1)*m; ++l)
+          if (!(radius > 0) || squaredDistances[l] < radius*radius)
+            indices[j++] = indices[l];
+        offsets.push_back(j);
+      }
+      indices.resize(j);
+    }
+    else
+      as_const(*this).radiusSearch(points, radius, offsets, indices,
+                                   squaredDistances, parallelization);
+    
+    std::vector<Vector3> normals(n);
+    std::vector<char> valid(n, false);
+    const size_t minSliceSize = 256;
+    int nSlices = parallelizer::concurrency(parallelization);
+    nSlices = std::max<int>(1, std::min<size_t>(nSlices, n/minSliceSize));
+    const size_t sliceSize = (n + nSlices - 1) / nSlices;
+    if (nSlices == 1)
+      fit_normals_slice(&points, &offsets, &indices, sliceSize,
+                        &normals, &valid, 0);
+    else
+    {
+      parallelizer p(nSlices, parallelization);
+      p.for_each(boost::bind(fit_normals_slice, &points, &offsets, &indices,
+                             sliceSize, &normals, &valid, _1));
+    }
+    
+    Container kernels;
+    kernels.reserve(n);
+    int skipped = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+      if (!valid[i])
+      {
+        skipped++;
+        continue;
+      }
+      const kernel::base& source = kernels_[i];
+      kernel::r3xs2p::ptr normal(new kernel::r3xs2p);
+      normal->loc_ = points[i];
+      normal->dir_ = normals[i];
+      if (viewpoint && normal->dir_.Dot(*viewpoint - normal->loc_) < 0)
+        normal->dir_ = -normal->dir_;
+      normal->setWeight(source.getWeight());
+      if (source.hasDescriptor()) normal->setDescriptor(source.getDescriptor());
+      kernels.push_back(normal.release());
+    }
+    if (skipped > 0)
+      NUKLEI_WARN("Skipped " << skipped << " kernels for which "
+                  "no normal could be computed.");
+    
+    // If no kernel was skipped, positions are unchanged, and so are the
+    // intermediary results that depend on positions only.
+    replaceKernels(kernels, skipped == 0);
+    NUKLEI_TRACE_END();
+  }
+  
   namespace la
   {
 //    Vector3 project(const Plane3& plane, const Vector3& point)
@@ -4,166 +4,36 @@
 
 /** @file */
 
-#ifdef NUKLEI_HAS_PARTIAL_VIEW
-
-#ifndef CGAL_EIGEN3_ENABLED
-#  define CGAL_EIGEN3_ENABLED 1
-#endif
-
-#include <CGAL/Simple_cartesian.h>
-#include <CGAL/AABB_tree.h>
-#include <CGAL/AABB_traits.h>
-#include <CGAL/Polyhedron_3.h>
-#if CGAL_VERSION_NR >= 1040300000
-#include <CGAL/AABB_face_graph_triangle_primitive.h>
-#else
-#include <CGAL/AABB_polyhedron_triangle_primitive.h>
-#endif
-#include <CGAL/property_map.h>
-#include <CGAL/IO/read_off_points.h>
-#include <CGAL/IO/read_xyz_points.h>
-#include <CGAL/IO/write_xyz_points.h>
-#include <CGAL/IO/Polyhedron_iostream.h>
-
-#include <CGAL/squared_distance_3.h>
-#include <CGAL/Point_with_normal_3.h>
-
-#endif
-
 #include <nuklei/KernelCollection.h>
 #include <nuklei/ObservationIO.h>
+#include <nuklei/ProgressIndicator.h>
+#include <nuklei/parallelizer.h>
 
 #include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/bind.hpp>
 
-#include <nuklei/KernelCollection.h>
-
-#ifdef NUKLEI_HAS_PARTIAL_VIEW
-
-typedef CGAL::Simple_cartesian<double> K;
-typedef K::Point_3 Point;
-typedef K::Plane_3 Plane;
-typedef K::Vector_3 Vector;
-typedef K::Segment_3 Segment;
-typedef K::Line_3 Line;
-typedef CGAL::Polyhedron_3<K> Polyhedron;
-#if CGAL_VERSION_NR >= 1040300000
-typedef CGAL::AABB_face_graph_triangle_primitive<Polyhedron> Primitive;
-#else
-typedef CGAL::AABB_polyhedron_triangle_primitive<K,Polyhedron> Primitive;
-#endif
-typedef CGAL::AABB_traits<K, Primitive> Traits;
-typedef CGAL::AABB_tree<Traits> Tree;
-typedef Tree::Object_and_primitive_id Object_and_primitive_id;
-typedef Tree::Primitive_id Primitive_id;
-
-typedef CGAL::Point_with_normal_3<K> Point_with_normal;
-typedef std::vector<Point_with_normal> PointList;
-
-#endif
+#include "KernelCollectionViewCache.h"
+#include "KernelCollectionVisibility.h"
 
 namespace nuklei {
 
-  typedef std::vector< std::pair< Vector3, std::vector<int> > > viewcache_t;
-
-#ifdef NUKLEI_HAS_PARTIAL_VIEW
-  
-  
-  inline bool isVisible(const Vector3& wtarget,
-                        const Vector3& wnormal,
-                        const Vector3& wcamera,
-                        const Polyhedron& poly,
-                        const Tree& tree,
-                        const coord_t& tolerance)
-  {
-    if (std::fabs(wnormal.SquaredLength()-1) < FLOATTOL)
-    {
-      Vector3 ctot = la::normalized(wtarget-wcamera);
-      double dot = wnormal.Dot(ctot);
-      if (std::acos(std::fabs(dot)) > (80./180*M_PI))
-      {
-        return false;
-      }
-    }
-    
-    Point camera(wcamera.X(), wcamera.Y(), wcamera.Z());
-    Point target(wtarget.X(), wtarget.Y(), wtarget.Z());
-    
-    //double d = dot();
-    Segment segment_query(camera,target);
-    bool visible = true;
-    
-    std::list<Object_and_primitive_id> intersections;
-    tree.all_intersections(segment_query, std::back_inserter(intersections));
-    
-    int self_intersect = 0;
-    for (std::list<Object_and_primitive_id>::const_iterator intersection = intersections.begin();
-         intersection != intersections.end(); ++intersection)
-    {
-      Object_and_primitive_id op = *intersection;
-      CGAL::Object object = op.first;
-      Point intersectionPoint;
-      if(CGAL::assign(intersectionPoint,object))
-      {
-        double sq2 = squared_distance(intersectionPoint, target);
-        if (sq2 < tolerance*tolerance) self_intersect++;
-      }
-      else
-      {
-        // This is very unlikely (p<<0.001)
-        //NUKLEI_THROW("intersection is not a point!");
-      }
-    }
-    
-    int num_inter = intersections.size();
-    if (self_intersect > 1)
-      NUKLEI_LOG("Number of self-intersections (" << self_intersect << ") greater than 1");
-    
-    if (num_inter == 0)
-      visible = true;
-    else
-    {
-      if (num_inter - self_intersect > 0)
-        visible = false;
-      else
-        visible = true;
-    }
-    if (num_inter > 1 && visible)
-      NUKLEI_INFO("Strange visibility at" << target);
-    
-    return visible;
-    
-  }
-  
-  inline bool isVisible(const Vector3& wtarget,
-                        const Vector3& wcamera,
-                        const Polyhedron& poly,
-                        const Tree& tree,
-                        const coord_t& tolerance)
-  {
-    return isVisible(wtarget,
-                     Vector3::ZERO,
-                     wcamera,
-                     poly,
-                     tree,
-                     tolerance);
-  }
-
-#endif
+  typedef view_cache_types::ViewCache viewcache_t;
+  typedef visibility_types::VisibilityEngine visibility_t;
   
   bool KernelCollection::isVisibleFrom(const Vector3& p, const Vector3& viewpoint,
                                        const coord_t& tolerance) const
   {
     NUKLEI_TRACE_BEGIN();
 #ifdef NUKLEI_HAS_PARTIAL_VIEW
+    refreshHelperStructures();
     if (!deco_.has_key(MESH_KEY))
       NUKLEI_THROW("Undefined mesh. Call buildMesh() first.");
-    if (!deco_.has_key(AABBTREE_KEY))
-      NUKLEI_THROW("Undefined AABB tree. Call buildMesh() first.");
+    if (!deco_.has_key(VISIBILITY_KEY))
+      NUKLEI_THROW("Undefined visibility engine. Call buildMesh() first.");
     
-    return isVisible(p, viewpoint,
-                     *deco_.get< boost::shared_ptr<Polyhedron> >(MESH_KEY),
-                     *deco_.get< boost::shared_ptr<Tree> >(AABBTREE_KEY),
-                     tolerance);
+    return deco_.get< boost::shared_ptr<visibility_t> >(VISIBILITY_KEY)->
+      isVisible(p, Vector3::ZERO, viewpoint, tolerance);
 #else
     NUKLEI_THROW("This function requires the partial view build of Nuklei. See http://renaud-detry.net/nuklei/group__install.html");
 #endif
@@ -175,15 +45,14 @@ namespace nuklei {
   {
     NUKLEI_TRACE_BEGIN();
 #ifdef NUKLEI_HAS_PARTIAL_VIEW
+    refreshHelperStructures();
     if (!deco_.has_key(MESH_KEY))
       NUKLEI_THROW("Undefined mesh. Call buildMesh() first.");
-    if (!deco_.has_key(AABBTREE_KEY))
-      NUKLEI_THROW("Undefined AABB tree. Call buildMesh() first.");
+    if (!deco_.has_key(VISIBILITY_KEY))
+      NUKLEI_THROW("Undefined visibility engine. Call buildMesh() first.");
 
-    return isVisible(p.loc_, p.dir_, viewpoint,
-                     *deco_.get< boost::shared_ptr<Polyhedron> >(MESH_KEY),
-                     *deco_.get< boost::shared_ptr<Tree> >(AABBTREE_KEY),
-                     tolerance);
+    return deco_.get< boost::shared_ptr<visibility_t> >(VISIBILITY_KEY)->
+      isVisible(p.loc_, p.dir_, viewpoint, tolerance);
 #else
     NUKLEI_THROW("This function requires the partial view build of Nuklei. See http://renaud-detry.net/nuklei/group__install.html");
 #endif
@@ -194,70 +63,94 @@ namespace nuklei {
   C KernelCollection::partialView(const Vector3& viewpoint,
                                   const coord_t& tolerance,
                                   const bool useViewcache,
-                                  const bool useRayToSurfacenormalAngle) const
+                                  const bool useRayToSurfacenormalAngle,
+                                  const parallelizer::Type parallelization,
+                                  const VisibilityMethod method,
+                                  const int zbufferResolution) const
   {
     NUKLEI_TRACE_BEGIN();
 
     C index_collection;
+    refreshHelperStructures();
 
     if (!useViewcache)
     {
 #ifdef NUKLEI_HAS_PARTIAL_VIEW
       if (!deco_.has_key(MESH_KEY))
         NUKLEI_THROW("Undefined mesh. Call buildMesh() first.");
-      if (!deco_.has_key(AABBTREE_KEY))
-        NUKLEI_THROW("Undefined AABB tree. Call buildMesh() first.");
+      if (!deco_.has_key(VISIBILITY_KEY))
+        NUKLEI_THROW("Undefined visibility engine. Call buildMesh() first.");
       
-      const Polyhedron& poly = *deco_.get< boost::shared_ptr<Polyhedron> >(MESH_KEY);
-      const Tree& tree = *deco_.get< boost::shared_ptr<Tree> >(AABBTREE_KEY);
+      const visibility_t& engine = *deco_.get< boost::shared_ptr<visibility_t> >(VISIBILITY_KEY);
       
+      std::vector<Vector3> targets, normals;
+      targets.reserve(size());
+      if (useRayToSurfacenormalAngle) normals.reserve(size());
       for (const_iterator v = begin(); v != end(); ++v)
       {
-        Vector3 p = v->getLoc();
-        Vector3 normal = Vector3::ZERO;
+        targets.push_back(v->getLoc());
         if (useRayToSurfacenormalAngle)
-          normal = kernel::r3xs2p(*v).dir_;
-        if (isVisible(p, normal, viewpoint, poly, tree, tolerance))
-          index_collection.push_back(std::distance(begin(), v));
+          normals.push_back(kernel::r3xs2p(*v).dir_);
+      }
+      std::vector<char> visible;
+      switch (method)
+      {
+        case RAYCAST_VISIBILITY:
+          engine.isVisible(targets, useRayToSurfacenormalAngle ? &normals : NULL,
+                           viewpoint, tolerance, visible, parallelization);
+          break;
+        case ZBUFFER_VISIBILITY:
+          engine.isVisibleDepthBuffer(targets,
+                                      useRayToSurfacenormalAngle ? &normals : NULL,
+                                      viewpoint, tolerance, zbufferResolution,
+                                      visible, parallelization);
+          break;
+        default:
+          NUKLEI_THROW("Unknown visibility method.");
       }
+      for (size_t i = 0; i < visible.size(); ++i)
+        if (visible[i]) index_collection.push_back(i);
 #else
       NUKLEI_THROW("This function requires the partial view build of Nuklei. See http://renaud-detry.net/nuklei/group__install.html");
 #endif
     }
     else
     {
-      if (!deco_.has_key(VIEWCACHE_KEY))
-        NUKLEI_THROW("Undefined view cache. Call buildPartialViewCache() first.");
-
-      const viewcache_t &viewIndex = *deco_.get< boost::shared_ptr<viewcache_t> >(VIEWCACHE_KEY);
-      
-      double minDist = 1e6;
-      viewcache_t::const_iterator closest = as_const(viewIndex).begin();
-      for (viewcache_t::const_iterator oo = as_const(viewIndex).begin(); oo != viewIndex.end(); ++oo)
-      {
-        double tmp = (viewpoint-oo->first).SquaredLength();
-        if (tmp < minDist*minDist)
-        {
-          minDist = tmp;
-          closest = oo;
-        }
-      }
-      for (std::vector<int>::const_iterator i = closest->second.begin(); i != closest->second.end(); ++i)
-        index_collection.push_back(*i);
+      const std::vector<int>& view = cachedPartialView(viewpoint);
+      index_collection.insert(index_collection.end(), view.begin(), view.end());
     }
     return index_collection;
     NUKLEI_TRACE_END();
   }
   
   
+  const std::vector<int>&
+  KernelCollection::cachedPartialView(const Vector3& direction) const
+  {
+    NUKLEI_TRACE_BEGIN();
+    refreshHelperStructures();
+    if (!deco_.has_key(VIEWCACHE_KEY))
+      NUKLEI_THROW("Undefined view cache. Call buildPartialViewCache() first.");
+    
+    const viewcache_t &viewIndex = *deco_.get< boost::shared_ptr<viewcache_t> >(VIEWCACHE_KEY);
+    return viewIndex.view(viewIndex.closest(direction));
+    NUKLEI_TRACE_END();
+  }
+  
+  
   std::vector<int> KernelCollection::partialView(const Vector3& viewpoint,
                                                  const coord_t& tolerance,
                                                  const bool useViewcache,
-                                                 const bool useRayToSurfacenormalAngle) const
+                                                 const bool useRayToSurfacenormalAngle,
+                                                 const parallelizer::Type parallelization,
+                                                 const VisibilityMethod method,
+                                                 const int zbufferResolution) const
   {
     NUKLEI_TRACE_BEGIN();
 #ifdef NUKLEI_HAS_PARTIAL_VIEW
-    return partialView< std::vector<int> >(viewpoint, tolerance, useViewcache, useRayToSurfacenormalAngle);
+    return partialView< std::vector<int> >(viewpoint, tolerance, useViewcache,
+                                          useRayToSurfacenormalAngle, parallelization,
+                                          method, zbufferResolution);
 #else
     NUKLEI_THROW("This function requires the partial view build of Nuklei. See http://renaud-detry.net/nuklei/group__install.html");
 #endif
@@ -268,7 +161,10 @@ namespace nuklei {
   KernelCollection::const_partialview_iterator KernelCollection::partialViewBegin(const Vector3& viewpoint,
                                                                                   const coord_t& tolerance,
                                                                                   const bool useViewcache,
-                                                                                  const bool useRayToSurfacenormalAngle) const
+                                                                                  const bool useRayToSurfacenormalAngle,
+                                                                                  const parallelizer::Type parallelization,
+                                                                                  const VisibilityMethod method,
+                                                                                  const int zbufferResolution) const
   {
     NUKLEI_TRACE_BEGIN();
 #ifdef NUKLEI_HAS_PARTIAL_VIEW
@@ -281,7 +177,10 @@ namespace nuklei {
     index_t;
     
     index_container_ptr index_collection(new index_container);
-    *index_collection = partialView< index_container >(viewpoint, tolerance, useViewcache, useRayToSurfacenormalAngle);
+    *index_collection = partialView< index_container >(viewpoint, tolerance, useViewcache,
+                                                       useRayToSurfacenormalAngle,
+                                                       parallelization,
+                                                       method, zbufferResolution);
     
     return const_partialview_iterator(begin(), index_collection);
 #else
@@ -290,116 +189,112 @@ namespace nuklei {
     NUKLEI_TRACE_END();
   }
   
-  void KernelCollection::buildPartialViewCache(const double meshTol, const bool useRayToSurfacenormalAngle)
+#ifdef NUKLEI_HAS_PARTIAL_VIEW
+  
+  // Directions of a spherical Fibonacci lattice, whose neighbors are about
+  // angularResolution radians apart. Each direction covers an area of
+  // about angularResolution^2.
+  static std::vector<Vector3> fibonacciDirections(const double angularResolution)
+  {
+    const int n = std::max(1, int(std::ceil(4*M_PI /
+                                             (angularResolution*angularResolution))));
+    const double goldenAngle = M_PI * (3 - std::sqrt(5.));
+    std::vector<Vector3> directions;
+    directions.reserve(n);
+    for (int i = 0; i < n; ++i)
+    {
+      const double z = 1 - (2*i+1) / double(n);
+      const double r = std::sqrt(std::max(1 - z*z, 0.));
+      const double a = goldenAngle * i;
+      directions.push_back(Vector3(r*std::cos(a), r*std::sin(a), z));
+    }
+    return directions;
+  }
+  
+  // Arguments of partialView() common to all views.
+  struct view_parameters
+  {
+    double meshTol;
+    bool useRayToSurfacenormalAngle;
+    KernelCollection::VisibilityMethod method;
+    int zbufferResolution;
+  };
+  
+  // Computes the views of directions slice, slice+nSlices, slice+2*nSlices,
+  // etc. Interleaving slices balances directions from which many points are
+  // visible.
+  static void partialViewSlice(const KernelCollection* kc,
+                               const std::vector<Vector3>* viewpoints,
+                               std::vector< std::vector<int> >* views,
+                               const view_parameters* params,
+                               const int nSlices,
+                               ProgressIndicator* pi,
+                               const int slice)
+  {
+    for (size_t i = slice; i < viewpoints->size(); i += nSlices)
+    {
+      views->at(i) = kc->partialView(viewpoints->at(i), params->meshTol, false,
+                                     params->useRayToSurfacenormalAngle,
+                                     parallelizer::SINGLE, params->method,
+                                     params->zbufferResolution);
+      if (pi != NULL) pi->mtInc();
+    }
+  }
+  
+#endif
+  
+  void KernelCollection::buildPartialViewCache(const double meshTol,
+                                               const bool useRayToSurfacenormalAngle,
+                                               const double angularResolution,
+                                               const parallelizer::Type parallelization,
+                                               const bool progress,
+                                               const VisibilityMethod method,
+                                               const int zbufferResolution)
   {
     NUKLEI_TRACE_BEGIN();
 #ifdef NUKLEI_HAS_PARTIAL_VIEW
+    NUKLEI_ASSERT(angularResolution > 0);
     Vector3 mean = as_const(*this).moments()->getLoc();
     double stdev = as_const(*this).moments()->getLocH();
     
-    std::vector< Vector3 > keys;
-    for (int o = 0; o < 10000; ++o)
-    {
-      Vector3 key = Random::uniformDirection3d();
-      keys.push_back(key);
-    }
+    std::vector< Vector3 > keys = fibonacciDirections(angularResolution);
+    std::vector< Vector3 > viewpoints;
+    viewpoints.reserve(keys.size());
+    for (std::vector<Vector3>::const_iterator i = keys.begin(); i != keys.end(); ++i)
+      viewpoints.push_back(mean + *i*stdev*20);
     
+    // Each view is written at the index of its direction: the cache does
+    // not depend on the parallelization.
+    std::vector< std::vector<int> > views(keys.size());
+    boost::scoped_ptr<ProgressIndicator> pi;
+    if (progress)
+      pi.reset(new ProgressIndicator(keys.size(), "Building partial views: "));
+    view_parameters params;
+    params.meshTol = meshTol;
+    params.useRayToSurfacenormalAngle = useRayToSurfacenormalAngle;
+    params.method = method;
+    params.zbufferResolution = zbufferResolution;
+    int nSlices = parallelizer::concurrency(parallelization);
+    if (parallelization == parallelizer::OPENMP) nSlices *= 4;
+    nSlices = std::max<int>(1, std::min<size_t>(nSlices, keys.size()));
+    if (nSlices == 1)
+      partialViewSlice(this, &viewpoints, &views, &params, 1, pi.get(), 0);
+    else
     {
-      double minDist2 = .15;
-      std::vector< Vector3 > tmp = keys;
-      keys.clear();
-      for (std::vector<Vector3>::const_iterator
-           i = tmp.begin();
-           i != tmp.end(); ++i)
-      {
-        bool cnt = false;
-        Vector3 iLoc = (*i);
-        for (std::vector<Vector3>::const_iterator
-             j = keys.begin();
-             j != keys.end(); ++j)
-        {
-          if ( (iLoc - *j).SquaredLength() < minDist2*minDist2 )
-          {
-            cnt = true;
-            break;
-          }
-        }
-        if (!cnt)
-        {
-          keys.push_back(iLoc);
-        }
-      }
+      parallelizer p(nSlices, parallelization);
+      p.for_each(boost::bind(&partialViewSlice, this, &viewpoints, &views,
+                             &params, nSlices, pi.get(), _1));
     }
     
-    boost::shared_ptr<viewcache_t> viewIndex(new viewcache_t());
+    boost::shared_ptr<viewcache_t>
+    viewIndex(new viewcache_t(meshTol, useRayToSurfacenormalAngle,
+                              angularResolution));
     
     for (unsigned int o = 0; o < keys.size(); ++o)
-    {
-      Vector3 key = keys.at(o);
-      Vector3 vp = mean + key*stdev*20;
-      std::vector<int> vi = as_const(*this).partialView(vp, meshTol, false, useRayToSurfacenormalAngle);
-#if 0
-      // debug - delete when code is considered stable
-      KernelCollection v;
-      for (std::vector<int>::iterator i = vi.begin(); i != vi.end(); ++i)
-        v.add(as_const(*this).at(*i));
-      v.computeKernelStatistics();
-      kernel::base::ptr k = v.randomKernel().create();
-      k->setLoc(vp);
-      v.add(*k);
-      v.computeKernelStatistics();
-#endif
-      viewIndex->push_back(std::make_pair(key, vi));
-    }
+      viewIndex->add(keys.at(o), views.at(o));
+    viewIndex->buildIndex();
     
-    if (deco_.has_key(VIEWCACHE_KEY)) deco_.erase(VIEWCACHE_KEY);
-    deco_.insert(VIEWCACHE_KEY, viewIndex);
-    
-#if 0
-    // debug - delete when code is considered stable
-    
-      for (viewcache_t::iterator o = viewIndex->begin(); o != viewIndex->end(); ++o)
-      {
-        double d = 1e6;
-        KernelCollection near;
-        
-        for (viewcache_t::iterator oo = viewIndex->begin(); oo != viewIndex->end(); ++oo)
-        {
-          if (oo == o) continue;
-          double dd = (o->first-oo->first).Length();
-          if (dd < d) {
-            d = dd;
-            near.clear();
-            for (std::vector<int>::iterator j = oo->second.begin(); j != oo->second.end(); ++j)
-              near.add(as_const(*this).at(*j));
-            near.computeKernelStatistics();
-            if (near.size() == 0) continue;
-            kernel::base::ptr k = near.randomKernel().create();
-            k->setLoc(mean + oo->first*stdev*20);
-            near.add(*k);
-            near.computeKernelStatistics();
-          }
-        }
-        for (KernelCollection::iterator i = near.begin(); i != near.end(); ++i)
-        {
-          ColorDescriptor cd;
-          cd.setColor(RGBColor(1, 0, 0));
-          i->setDescriptor(cd);
-        }
-        for (std::vector<int>::iterator j = o->second.begin(); j != o->second.end(); ++j)
-        {
-          near.add(as_const(*this).at(*j));
-          near.back().setLoc(near.back().getLoc()+Vector3(0.001, 0, 0));
-        }
-        near.computeKernelStatistics();
-        if (near.size() == 0) continue;
-        kernel::base::ptr k = near.randomKernel().create();
-        k->setLoc(mean + o->first*stdev*20);
-        near.add(*k);
-        near.computeKernelStatistics();
-        writeObservations("/tmp/v/" + stringify(std::distance(viewIndex->begin(), o)), near, Observation::SERIAL);
-      }
-#endif
+    setHelperStructure(VIEWCACHE_KEY, viewIndex);
     
 #else
     NUKLEI_THROW("This function requires the partial view build of Nuklei. See http://renaud-detry.net/nuklei/group__install.html");
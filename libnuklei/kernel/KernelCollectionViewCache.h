@@ -0,0 +1,140 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#ifndef NUKLEI_KERNEL_COLLECTION_VIEW_CACHE_H
+#define NUKLEI_KERNEL_COLLECTION_VIEW_CACHE_H
+
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include <nuklei/Definitions.h>
+#include <nuklei/Common.h>
+#include <nuklei/LinearAlgebraTypes.h>
+
+#include "nanoflann.hpp"
+
+namespace nuklei
+{
+
+  namespace view_cache_types
+  {
+
+    /**
+     * @brief Partial views of an object, indexed by view direction.
+     *
+     * Each view holds a unit direction and the indices of the kernels that
+     * are visible from that direction. The directions are indexed by a
+     * kd-tree, which returns the view closest to a query in logarithmic
+     * time.
+     *
+     * The cache also records the parameters of
+     * KernelCollection::buildPartialViewCache() it was built with, which
+     * allows checking that a cache read from disk is still suitable.
+     */
+    class ViewCache
+    {
+    public:
+      ViewCache(const coord_t meshTol,
+                const bool useRayToSurfacenormalAngle,
+                const coord_t angularResolution) :
+      meshTol_(meshTol),
+      useRayToSurfacenormalAngle_(useRayToSurfacenormalAngle),
+      angularResolution_(angularResolution) {}
+      
+      coord_t meshTol() const { return meshTol_; }
+      bool useRayToSurfacenormalAngle() const { return useRayToSurfacenormalAngle_; }
+      coord_t angularResolution() const { return angularResolution_; }
+
+      /**
+       * @brief Adds a view. Views added after the last call to buildIndex()
+       * are not found by closest().
+       */
+      void add(const Vector3& direction, const std::vector<int>& indices)
+      {
+        directions_.push_back(direction);
+        views_.push_back(indices);
+      }
+
+      /** @brief Indexes the directions of the views. */
+      void buildIndex()
+      {
+        NUKLEI_TRACE_BEGIN();
+        index_.reset();
+        if (directions_.empty()) return;
+        index_.reset(new Index(3 /*dim*/, *this,
+                               nuklei_nanoflann::
+                               KDTreeSingleIndexAdaptorParams(10 /* max leaf */)));
+        index_->buildIndex();
+        NUKLEI_TRACE_END();
+      }
+
+      size_t size() const { return views_.size(); }
+      const Vector3& direction(const size_t i) const { return directions_.at(i); }
+      const std::vector<int>& view(const size_t i) const { return views_.at(i); }
+
+      /**
+       * @brief Returns the index of the view whose direction is closest to
+       * @p direction.
+       *
+       * Since directions are unit vectors, the closest direction is the same
+       * whether @p direction is normalized or not.
+       */
+      size_t closest(const Vector3& direction) const
+      {
+        NUKLEI_TRACE_BEGIN();
+        if (!index_)
+          NUKLEI_THROW("Empty or unindexed view cache.");
+        const coord_t query[3] = { direction.X(), direction.Y(), direction.Z() };
+        size_t i = 0;
+        coord_t squaredDistance = 0;
+        index_->knnSearch(query, 1, &i, &squaredDistance);
+        return i;
+        NUKLEI_TRACE_END();
+      }
+
+      // nanoflann dataset interface.
+      inline size_t kdtree_get_point_count() const { return directions_.size(); }
+      inline coord_t kdtree_distance(const coord_t *p1, const size_t idx_p2,
+                                     size_t size) const
+      {
+        const Vector3& d = directions_[idx_p2];
+        const coord_t d0 = p1[0]-d.X();
+        const coord_t d1 = p1[1]-d.Y();
+        const coord_t d2 = p1[2]-d.Z();
+        return d0*d0+d1*d1+d2*d2;
+      }
+      inline coord_t kdtree_get_pt(const size_t idx, int dim) const
+      {
+        return directions_[idx][dim];
+      }
+      template <class BBOX>
+      bool kdtree_get_bbox(BBOX &bb) const { return false; }
+
+    private:
+      typedef nuklei_nanoflann::KDTreeSingleIndexAdaptor<
+        nuklei_nanoflann::L2_Simple_Adaptor<coord_t, ViewCache>,
+        ViewCache,
+        3 /* dim */
+      > Index;
+
+      // The index refers to *this, hence ViewCache is not copyable.
+      ViewCache(const ViewCache&);
+      ViewCache& operator=(const ViewCache&);
+
+      coord_t meshTol_;
+      bool useRayToSurfacenormalAngle_;
+      coord_t angularResolution_;
+      std::vector<Vector3> directions_;
+      std::vector< std::vector<int> > views_;
+      boost::shared_ptr<Index> index_;
+    };
+
+  }
+
+}
+
+#endif
@@ -0,0 +1,602 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+#include <boost/bind.hpp>
+
+#include <nuklei/parallelizer.h>
+
+#include "KernelCollectionVisibility.h"
+
+namespace nuklei {
+
+  namespace visibility_types {
+
+    namespace
+    {
+      // Number of triangles in a block.
+      const int W = 4;
+
+      // Orders triangles by the coordinate of their centroid along an axis.
+      struct centroid_less
+      {
+        centroid_less(const std::vector<coord_t>& centroids, const int axis) :
+        centroids_(centroids), axis_(axis) {}
+        bool operator()(const boost::uint32_t a, const boost::uint32_t b) const
+        {
+          return centroids_[3*a+axis_] < centroids_[3*b+axis_];
+        }
+        const std::vector<coord_t>& centroids_;
+        int axis_;
+      };
+
+      // Moller-Trumbore test of a ray against lane l of a block.
+      template<class Block, class Ray>
+      inline bool hitsTriangle(const Block& b, const Ray& r, const int l)
+      {
+        const coord_t px = r.d[1]*b.e2[2][l] - r.d[2]*b.e2[1][l];
+        const coord_t py = r.d[2]*b.e2[0][l] - r.d[0]*b.e2[2][l];
+        const coord_t pz = r.d[0]*b.e2[1][l] - r.d[1]*b.e2[0][l];
+        const coord_t det = b.e1[0][l]*px + b.e1[1][l]*py + b.e1[2][l]*pz;
+        // Degenerate triangles give det = 0, and NaN below.
+        const coord_t inv = 1 / det;
+        const coord_t sx = r.o[0] - b.v0[0][l];
+        const coord_t sy = r.o[1] - b.v0[1][l];
+        const coord_t sz = r.o[2] - b.v0[2][l];
+        const coord_t u = (sx*px + sy*py + sz*pz) * inv;
+        const coord_t qx = sy*b.e1[2][l] - sz*b.e1[1][l];
+        const coord_t qy = sz*b.e1[0][l] - sx*b.e1[2][l];
+        const coord_t qz = sx*b.e1[1][l] - sy*b.e1[0][l];
+        const coord_t v = (r.d[0]*qx + r.d[1]*qy + r.d[2]*qz) * inv;
+        const coord_t t = (b.e2[0][l]*qx + b.e2[1][l]*qy + b.e2[2][l]*qz) * inv;
+        return u >= 0 && v >= 0 && u + v <= 1 && t > 0 && t <= r.tmax;
+      }
+
+#if NUKLEI_X86_SIMD
+
+      // Same as hitsTriangle(), for lanes l and l+1.
+      template<class Block, class Ray>
+      __attribute__((target("sse2")))
+      inline bool hitsTriangles_sse2(const Block& b, const Ray& r, const int l)
+      {
+        const __m128d dx = _mm_set1_pd(r.d[0]);
+        const __m128d dy = _mm_set1_pd(r.d[1]);
+        const __m128d dz = _mm_set1_pd(r.d[2]);
+        const __m128d e1x = _mm_loadu_pd(&b.e1[0][l]);
+        const __m128d e1y = _mm_loadu_pd(&b.e1[1][l]);
+        const __m128d e1z = _mm_loadu_pd(&b.e1[2][l]);
+        const __m128d e2x = _mm_loadu_pd(&b.e2[0][l]);
+        const __m128d e2y = _mm_loadu_pd(&b.e2[1][l]);
+        const __m128d e2z = _mm_loadu_pd(&b.e2[2][l]);
+        const __m128d px = _mm_sub_pd(_mm_mul_pd(dy, e2z), _mm_mul_pd(dz, e2y));
+        const __m128d py = _mm_sub_pd(_mm_mul_pd(dz, e2x), _mm_mul_pd(dx, e2z));
+        const __m128d pz = _mm_sub_pd(_mm_mul_pd(dx, e2y), _mm_mul_pd(dy, e2x));
+        const __m128d det = _mm_add_pd(_mm_add_pd(_mm_mul_pd(e1x, px),
+                                                  _mm_mul_pd(e1y, py)),
+                                       _mm_mul_pd(e1z, pz));
+        const __m128d inv = _mm_div_pd(_mm_set1_pd(1), det);
+        const __m128d sx = _mm_sub_pd(_mm_set1_pd(r.o[0]), _mm_loadu_pd(&b.v0[0][l]));
+        const __m128d sy = _mm_sub_pd(_mm_set1_pd(r.o[1]), _mm_loadu_pd(&b.v0[1][l]));
+        const __m128d sz = _mm_sub_pd(_mm_set1_pd(r.o[2]), _mm_loadu_pd(&b.v0[2][l]));
+        const __m128d u = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(sx, px),
+                                                           _mm_mul_pd(sy, py)),
+                                                _mm_mul_pd(sz, pz)), inv);
+        const __m128d qx = _mm_sub_pd(_mm_mul_pd(sy, e1z), _mm_mul_pd(sz, e1y));
+        const __m128d qy = _mm_sub_pd(_mm_mul_pd(sz, e1x), _mm_mul_pd(sx, e1z));
+        const __m128d qz = _mm_sub_pd(_mm_mul_pd(sx, e1y), _mm_mul_pd(sy, e1x));
+        const __m128d v = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, qx),
+                                                           _mm_mul_pd(dy, qy)),
+                                                _mm_mul_pd(dz, qz)), inv);
+        const __m128d t = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(e2x, qx),
+                                                           _mm_mul_pd(e2y, qy)),
+                                                _mm_mul_pd(e2z, qz)), inv);
+        const __m128d zero = _mm_setzero_pd();
+        __m128d hit = _mm_and_pd(_mm_cmpge_pd(u, zero), _mm_cmpge_pd(v, zero));
+        hit = _mm_and_pd(hit, _mm_cmple_pd(_mm_add_pd(u, v), _mm_set1_pd(1)));
+        hit = _mm_and_pd(hit, _mm_cmpgt_pd(t, zero));
+        hit = _mm_and_pd(hit, _mm_cmple_pd(t, _mm_set1_pd(r.tmax)));
+        return _mm_movemask_pd(hit) != 0;
+      }
+
+      // Same as hitsTriangle(), for the four lanes.
+      template<class Block, class Ray>
+      __attribute__((target("avx2")))
+      inline bool hitsTriangles_avx2(const Block& b, const Ray& r)
+      {
+        const __m256d dx = _mm256_set1_pd(r.d[0]);
+        const __m256d dy = _mm256_set1_pd(r.d[1]);
+        const __m256d dz = _mm256_set1_pd(r.d[2]);
+        const __m256d e1x = _mm256_loadu_pd(b.e1[0]);
+        const __m256d e1y = _mm256_loadu_pd(b.e1[1]);
+        const __m256d e1z = _mm256_loadu_pd(b.e1[2]);
+        const __m256d e2x = _mm256_loadu_pd(b.e2[0]);
+        const __m256d e2y = _mm256_loadu_pd(b.e2[1]);
+        const __m256d e2z = _mm256_loadu_pd(b.e2[2]);
+        const __m256d px = _mm256_sub_pd(_mm256_mul_pd(dy, e2z), _mm256_mul_pd(dz, e2y));
+        const __m256d py = _mm256_sub_pd(_mm256_mul_pd(dz, e2x), _mm256_mul_pd(dx, e2z));
+        const __m256d pz = _mm256_sub_pd(_mm256_mul_pd(dx, e2y), _mm256_mul_pd(dy, e2x));
+        const __m256d det = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e1x, px),
+                                                        _mm256_mul_pd(e1y, py)),
+                                          _mm256_mul_pd(e1z, pz));
+        const __m256d inv = _mm256_div_pd(_mm256_set1_pd(1), det);
+        const __m256d sx = _mm256_sub_pd(_mm256_set1_pd(r.o[0]), _mm256_loadu_pd(b.v0[0]));
+        const __m256d sy = _mm256_sub_pd(_mm256_set1_pd(r.o[1]), _mm256_loadu_pd(b.v0[1]));
+        const __m256d sz = _mm256_sub_pd(_mm256_set1_pd(r.o[2]), _mm256_loadu_pd(b.v0[2]));
+        const __m256d u = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(sx, px),
+                                                                    _mm256_mul_pd(sy, py)),
+                                                      _mm256_mul_pd(sz, pz)), inv);
+        const __m256d qx = _mm256_sub_pd(_mm256_mul_pd(sy, e1z), _mm256_mul_pd(sz, e1y));
+        const __m256d qy = _mm256_sub_pd(_mm256_mul_pd(sz, e1x), _mm256_mul_pd(sx, e1z));
+        const __m256d qz = _mm256_sub_pd(_mm256_mul_pd(sx, e1y), _mm256_mul_pd(sy, e1x));
+        const __m256d v = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, qx),
+                                                                    _mm256_mul_pd(dy, qy)),
+                                                      _mm256_mul_pd(dz, qz)), inv);
+        const __m256d t = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e2x, qx),
+                                                                    _mm256_mul_pd(e2y, qy)),
+                                                      _mm256_mul_pd(e2z, qz)), inv);
+        const __m256d zero = _mm256_setzero_pd();
+        __m256d hit = _mm256_and_pd(_mm256_cmp_pd(u, zero, _CMP_GE_OQ),
+                                    _mm256_cmp_pd(v, zero, _CMP_GE_OQ));
+        hit = _mm256_and_pd(hit, _mm256_cmp_pd(_mm256_add_pd(u, v),
+                                               _mm256_set1_pd(1), _CMP_LE_OQ));
+        hit = _mm256_and_pd(hit, _mm256_cmp_pd(t, zero, _CMP_GT_OQ));
+        hit = _mm256_and_pd(hit, _mm256_cmp_pd(t, _mm256_set1_pd(r.tmax), _CMP_LE_OQ));
+        return _mm256_movemask_pd(hit) != 0;
+      }
+
+#endif
+
+      // Returns true if target is seen from camera at an angle of more than
+      // 80 degrees from normal and its opposite. normal is ignored unless it
+      // is a unit vector.
+      inline bool grazing(const Vector3& target,
+                          const Vector3& normal,
+                          const Vector3& camera)
+      {
+        if (!(std::fabs(normal.SquaredLength()-1) < FLOATTOL)) return false;
+        Vector3 ctot = target-camera;
+        ctot.Normalize();
+        double dot = normal.Dot(ctot);
+        return std::acos(std::min(std::fabs(dot), 1.)) > (80./180*M_PI);
+      }
+
+      // A triangle projected onto the depth buffer: pixel coordinates and
+      // inverse depth of its vertices.
+      struct ScreenTriangle
+      {
+        coord_t x[3];
+        coord_t y[3];
+        coord_t w[3];
+      };
+
+      // Rasterizes triangles into rows [slice*sliceSize, (slice+1)*sliceSize)
+      // of depth. Pixels are sampled at their center, and inverse depth is
+      // interpolated linearly in screen space, which is exact under
+      // perspective projection. Both windings are drawn.
+      void rasterizeSlice(const std::vector<ScreenTriangle>* triangles,
+                          std::vector<float>* depth,
+                          const int resolution,
+                          const int sliceSize,
+                          const int slice)
+      {
+        const int firstRow = slice * sliceSize;
+        const int lastRow = std::min(firstRow + sliceSize, resolution);
+        for (std::vector<ScreenTriangle>::const_iterator t = triangles->begin();
+             t != triangles->end(); ++t)
+        {
+          const coord_t area = ((t->x[1]-t->x[0]) * (t->y[2]-t->y[0]) -
+                                (t->x[2]-t->x[0]) * (t->y[1]-t->y[0]));
+          if (!(area != 0)) continue;
+          const coord_t ymin = std::min(std::min(t->y[0], t->y[1]), t->y[2]);
+          const coord_t ymax = std::max(std::max(t->y[0], t->y[1]), t->y[2]);
+          const int row0 = std::max(firstRow, int(std::ceil(ymin - .5)));
+          const int row1 = std::min(lastRow - 1, int(std::floor(ymax - .5)));
+          if (row0 > row1) continue;
+          const coord_t xmin = std::min(std::min(t->x[0], t->x[1]), t->x[2]);
+          const coord_t xmax = std::max(std::max(t->x[0], t->x[1]), t->x[2]);
+          const int col0 = std::max(0, int(std::ceil(xmin - .5)));
+          const int col1 = std::min(resolution - 1, int(std::floor(xmax - .5)));
+          if (col0 > col1) continue;
+          
+          const coord_t inv = 1 / area;
+          for (int row = row0; row <= row1; ++row)
+          {
+            const coord_t py = row + .5;
+            float* line = &(*depth)[size_t(row)*resolution];
+            for (int col = col0; col <= col1; ++col)
+            {
+              const coord_t px = col + .5;
+              const coord_t b0 = ((t->x[1]-px) * (t->y[2]-py) -
+                                  (t->x[2]-px) * (t->y[1]-py)) * inv;
+              const coord_t b1 = ((t->x[2]-px) * (t->y[0]-py) -
+                                  (t->x[0]-px) * (t->y[2]-py)) * inv;
+              const coord_t b2 = 1 - b0 - b1;
+              if (b0 < 0 || b1 < 0 || b2 < 0) continue;
+              const float z = 1 / (b0*t->w[0] + b1*t->w[1] + b2*t->w[2]);
+              if (z < line[col]) line[col] = z;
+            }
+          }
+        }
+      }
+    }
+
+    VisibilityEngine::VisibilityEngine(const std::vector<coord_t>& vertices,
+                                       const std::vector<boost::uint32_t>& triangles) :
+    nTriangles_(triangles.size()/3), simd_(simdLevel())
+    {
+      NUKLEI_TRACE_BEGIN();
+      NUKLEI_ASSERT(triangles.size() % 3 == 0);
+      for (std::vector<boost::uint32_t>::const_iterator i = triangles.begin();
+           i != triangles.end(); ++i)
+        NUKLEI_ASSERT(3*size_t(*i)+2 < vertices.size());
+
+      std::vector<coord_t> centroids(3*nTriangles_);
+      std::vector<boost::uint32_t> order(nTriangles_);
+      for (size_t i = 0; i < nTriangles_; ++i)
+      {
+        order[i] = i;
+        for (int k = 0; k < 3; ++k)
+          centroids[3*i+k] = (vertices[3*triangles[3*i]+k] +
+                              vertices[3*triangles[3*i+1]+k] +
+                              vertices[3*triangles[3*i+2]+k]) / 3;
+      }
+      nodes_.reserve(2*(nTriangles_/W+1));
+      blocks_.reserve(nTriangles_/W+1);
+      if (nTriangles_ > 0)
+        build(order, vertices, triangles, centroids, 0, nTriangles_);
+      NUKLEI_TRACE_END();
+    }
+
+    void VisibilityEngine::build(std::vector<boost::uint32_t>& order,
+                                 const std::vector<coord_t>& vertices,
+                                 const std::vector<boost::uint32_t>& triangles,
+                                 const std::vector<coord_t>& centroids,
+                                 const size_t first,
+                                 const size_t last)
+    {
+      const size_t index = nodes_.size();
+      nodes_.push_back(Node());
+      {
+        Node& node = nodes_.back();
+        for (int k = 0; k < 3; ++k)
+        {
+          node.lo[k] = std::numeric_limits<coord_t>::infinity();
+          node.hi[k] = -std::numeric_limits<coord_t>::infinity();
+        }
+        for (size_t i = first; i < last; ++i)
+          for (int c = 0; c < 3; ++c)
+            for (int k = 0; k < 3; ++k)
+            {
+              const coord_t x = vertices[3*triangles[3*order[i]+c]+k];
+              node.lo[k] = std::min(node.lo[k], x);
+              node.hi[k] = std::max(node.hi[k], x);
+            }
+      }
+
+      if (last - first <= W)
+      {
+        Node& node = nodes_.back();
+        node.offset = blocks_.size();
+        node.count = 1;
+        Block b;
+        for (int l = 0; l < W; ++l)
+        {
+          for (int k = 0; k < 3; ++k)
+          {
+            if (first + l < last)
+            {
+              const boost::uint32_t* t = &triangles[3*order[first+l]];
+              b.v0[k][l] = vertices[3*t[0]+k];
+              b.e1[k][l] = vertices[3*t[1]+k] - vertices[3*t[0]+k];
+              b.e2[k][l] = vertices[3*t[2]+k] - vertices[3*t[0]+k];
+            }
+            else
+              b.v0[k][l] = b.e1[k][l] = b.e2[k][l] = 0;
+          }
+        }
+        blocks_.push_back(b);
+        return;
+      }
+
+      // Median split along the axis of largest centroid extent. The first
+      // half holds a multiple of W triangles, so that blocks are full.
+      coord_t lo[3], hi[3];
+      for (int k = 0; k < 3; ++k)
+      {
+        lo[k] = std::numeric_limits<coord_t>::infinity();
+        hi[k] = -std::numeric_limits<coord_t>::infinity();
+      }
+      for (size_t i = first; i < last; ++i)
+        for (int k = 0; k < 3; ++k)
+        {
+          lo[k] = std::min(lo[k], centroids[3*order[i]+k]);
+          hi[k] = std::max(hi[k], centroids[3*order[i]+k]);
+        }
+      int axis = 0;
+      for (int k = 1; k < 3; ++k)
+        if (hi[k]-lo[k] > hi[axis]-lo[axis]) axis = k;
+      const size_t mid = first + W * ((last - first + 2*W - 1) / (2*W));
+      std::nth_element(order.begin() + first, order.begin() + mid,
+                       order.begin() + last, centroid_less(centroids, axis));
+
+      nodes_[index].count = 0;
+      build(order, vertices, triangles, centroids, first, mid);
+      nodes_[index].offset = nodes_.size();
+      build(order, vertices, triangles, centroids, mid, last);
+    }
+
+    inline bool VisibilityEngine::hitsBox(const Node& node, const Ray& ray) const
+    {
+      coord_t tnear = 0, tfar = ray.tmax;
+      for (int k = 0; k < 3; ++k)
+      {
+        coord_t t1 = (node.lo[k] - ray.o[k]) * ray.inv[k];
+        coord_t t2 = (node.hi[k] - ray.o[k]) * ray.inv[k];
+        if (t1 > t2) std::swap(t1, t2);
+        tnear = std::max(tnear, t1);
+        tfar = std::min(tfar, t2);
+      }
+      return tnear <= tfar;
+    }
+
+    inline bool VisibilityEngine::hitsBlock(const Block& block, const Ray& ray) const
+    {
+      switch (simd_)
+      {
+#if NUKLEI_X86_SIMD
+        case SIMD_AVX512:
+        case SIMD_AVX2:
+          return hitsTriangles_avx2(block, ray);
+        case SIMD_SSE2:
+          return hitsTriangles_sse2(block, ray, 0) ||
+            hitsTriangles_sse2(block, ray, 2);
+#endif
+        default:
+          for (int l = 0; l < W; ++l)
+            if (hitsTriangle(block, ray, l)) return true;
+          return false;
+      }
+    }
+
+    bool VisibilityEngine::occluded(const Ray& ray) const
+    {
+      if (nodes_.empty() || !(ray.tmax > 0)) return false;
+      // The depth of the hierarchy is logarithmic in the number of
+      // triangles.
+      boost::uint32_t stack[64];
+      int top = 0;
+      stack[top++] = 0;
+      while (top > 0)
+      {
+        const boost::uint32_t index = stack[--top];
+        const Node& node = nodes_[index];
+        if (!hitsBox(node, ray)) continue;
+        if (node.count > 0)
+        {
+          for (boost::uint32_t b = node.offset; b < node.offset + node.count; ++b)
+            if (hitsBlock(blocks_[b], ray)) return true;
+        }
+        else
+        {
+          NUKLEI_FAST_ASSERT(top + 2 <= 64);
+          stack[top++] = node.offset;
+          stack[top++] = index + 1;
+        }
+      }
+      return false;
+    }
+
+    bool VisibilityEngine::occluded(const Vector3& camera,
+                                    const Vector3& target,
+                                    const coord_t tolerance) const
+    {
+      const Vector3 d = target - camera;
+      const coord_t length = d.Length();
+      Ray ray;
+      for (int k = 0; k < 3; ++k)
+      {
+        ray.o[k] = camera[k];
+        ray.d[k] = length > 0 ? d[k] / length : 0;
+        // Avoids 0 * infinity in hitsBox().
+        ray.inv[k] = ray.d[k] != 0 ? 1 / ray.d[k] :
+          std::numeric_limits<coord_t>::max();
+      }
+      // Intersections within tolerance of the target are the surface of the
+      // target itself.
+      ray.tmax = length - std::max(tolerance, coord_t(0));
+      return occluded(ray);
+    }
+
+    bool VisibilityEngine::isVisible(const Vector3& target,
+                                     const Vector3& normal,
+                                     const Vector3& camera,
+                                     const coord_t tolerance) const
+    {
+      if (grazing(target, normal, camera))
+        return false;
+      return !occluded(camera, target, tolerance);
+    }
+
+    void VisibilityEngine::isVisibleSlice(const std::vector<Vector3>* targets,
+                                          const std::vector<Vector3>* normals,
+                                          const Vector3 camera,
+                                          const coord_t tolerance,
+                                          std::vector<char>* visible,
+                                          const size_t sliceSize,
+                                          const int slice) const
+    {
+      const size_t first = slice * sliceSize;
+      const size_t last = std::min(first + sliceSize, targets->size());
+      for (size_t i = first; i < last; ++i)
+        (*visible)[i] = isVisible((*targets)[i],
+                                  normals != NULL ? (*normals)[i] : Vector3::ZERO,
+                                  camera, tolerance);
+    }
+
+    void VisibilityEngine::isVisible(const std::vector<Vector3>& targets,
+                                     const std::vector<Vector3>* normals,
+                                     const Vector3& camera,
+                                     const coord_t tolerance,
+                                     std::vector<char>& visible,
+                                     const parallelizer::Type parallelization) const
+    {
+      NUKLEI_TRACE_BEGIN();
+      NUKLEI_ASSERT(normals == NULL || normals->size() == targets.size());
+      const size_t n = targets.size();
+      visible.assign(n, 0);
+      if (n == 0) return;
+
+      const size_t minSliceSize = 256;
+      int nSlices = parallelizer::concurrency(parallelization);
+      if (parallelization == parallelizer::OPENMP) nSlices *= 4;
+      nSlices = std::max<int>(1, std::min<size_t>(nSlices, n/minSliceSize));
+      const size_t sliceSize = (n + nSlices - 1) / nSlices;
+      if (nSlices == 1)
+        isVisibleSlice(&targets, normals, camera, tolerance, &visible,
+                       sliceSize, 0);
+      else
+      {
+        parallelizer p(nSlices, parallelization);
+        p.for_each(boost::bind(&VisibilityEngine::isVisibleSlice, this,
+                               &targets, normals, camera, tolerance,
+                               &visible, sliceSize, _1));
+      }
+      NUKLEI_TRACE_END();
+    }
+
+    void VisibilityEngine::isVisibleDepthBuffer(const std::vector<Vector3>& targets,
+                                                const std::vector<Vector3>* normals,
+                                                const Vector3& camera,
+                                                const coord_t tolerance,
+                                                const int resolution,
+                                                std::vector<char>& visible,
+                                                const parallelizer::Type parallelization) const
+    {
+      NUKLEI_TRACE_BEGIN();
+      NUKLEI_ASSERT(normals == NULL || normals->size() == targets.size());
+      NUKLEI_ASSERT(resolution > 0);
+      const size_t n = targets.size();
+      visible.assign(n, 0);
+      if (n == 0) return;
+      if (nodes_.empty())
+      {
+        for (size_t i = 0; i < n; ++i)
+          visible[i] = !grazing(targets[i],
+                                normals != NULL ? (*normals)[i] : Vector3::ZERO,
+                                camera);
+        return;
+      }
+
+      // The camera looks at the center of the root box, with a field of
+      // view that encloses the sphere circumscribed to the box.
+      const Node& root = nodes_.front();
+      Vector3 center, halfDiagonal;
+      for (int k = 0; k < 3; ++k)
+      {
+        center[k] = (root.lo[k] + root.hi[k]) / 2;
+        halfDiagonal[k] = (root.hi[k] - root.lo[k]) / 2;
+      }
+      const coord_t radius = halfDiagonal.Length();
+      Vector3 forward = center - camera;
+      const coord_t distance = forward.Length();
+      if (!(distance > radius * 1.01))
+      {
+        isVisible(targets, normals, camera, tolerance, visible, parallelization);
+        return;
+      }
+      forward /= distance;
+      // The image axes are built from the world axis least aligned with
+      // the view direction.
+      int k = 0;
+      for (int j = 1; j < 3; ++j)
+        if (std::fabs(forward[j]) < std::fabs(forward[k])) k = j;
+      Vector3 axis = Vector3::ZERO;
+      axis[k] = 1;
+      Vector3 right = forward.Cross(axis);
+      right.Normalize();
+      const Vector3 up = right.Cross(forward);
+      // Pixels per unit of tangent.
+      const coord_t scale = resolution / 2. /
+        (1.01 * radius / std::sqrt(distance*distance - radius*radius));
+      const coord_t half = resolution / 2.;
+
+      std::vector<ScreenTriangle> screen;
+      screen.reserve(nTriangles_);
+      for (std::vector<Block>::const_iterator b = blocks_.begin();
+           b != blocks_.end(); ++b)
+        for (int l = 0; l < W; ++l)
+        {
+          ScreenTriangle t;
+          for (int c = 0; c < 3; ++c)
+          {
+            Vector3 v(b->v0[0][l], b->v0[1][l], b->v0[2][l]);
+            if (c > 0)
+            {
+              const coord_t (*e)[W] = c == 1 ? b->e1 : b->e2;
+              v += Vector3(e[0][l], e[1][l], e[2][l]);
+            }
+            const Vector3 d = v - camera;
+            const coord_t z = d.Dot(forward);
+            t.x[c] = half + scale * d.Dot(right) / z;
+            t.y[c] = half + scale * d.Dot(up) / z;
+            t.w[c] = 1 / z;
+          }
+          screen.push_back(t);
+        }
+
+      std::vector<float> depth(size_t(resolution)*resolution,
+                               std::numeric_limits<float>::infinity());
+      int nSlices = parallelizer::concurrency(parallelization);
+      if (parallelization == parallelizer::OPENMP) nSlices *= 4;
+      nSlices = std::max(1, std::min(nSlices, resolution/16));
+      const int sliceSize = (resolution + nSlices - 1) / nSlices;
+      if (nSlices == 1)
+        rasterizeSlice(&screen, &depth, resolution, sliceSize, 0);
+      else
+      {
+        parallelizer p(nSlices, parallelization);
+        p.for_each(boost::bind(&rasterizeSlice, &screen, &depth,
+                               resolution, sliceSize, _1));
+      }
+
+      std::vector<Vector3> outside, outsideNormals;
+      std::vector<size_t> outsideIndices;
+      for (size_t i = 0; i < n; ++i)
+      {
+        const Vector3 normal = normals != NULL ? (*normals)[i] : Vector3::ZERO;
+        if (grazing(targets[i], normal, camera)) continue;
+        const Vector3 d = targets[i] - camera;
+        const coord_t z = d.Dot(forward);
+        const coord_t x = half + scale * d.Dot(right) / z;
+        const coord_t y = half + scale * d.Dot(up) / z;
+        if (!(z > 0 && x >= 0 && x < resolution && y >= 0 && y < resolution))
+        {
+          outside.push_back(targets[i]);
+          outsideNormals.push_back(normal);
+          outsideIndices.push_back(i);
+          continue;
+        }
+        // Converts the tolerance along the ray to a tolerance in depth.
+        const coord_t limit = z - tolerance * z / d.Length();
+        visible[i] = !(depth[size_t(y)*resolution + size_t(x)] < limit);
+      }
+      if (!outside.empty())
+      {
+        std::vector<char> outsideVisible;
+        isVisible(outside, &outsideNormals, camera, tolerance, outsideVisible,
+                  parallelization);
+        for (size_t i = 0; i < outsideIndices.size(); ++i)
+          visible[outsideIndices[i]] = outsideVisible[i];
+      }
+      NUKLEI_TRACE_END();
+    }
+
+  }
+
+}
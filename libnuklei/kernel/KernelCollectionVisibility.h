@@ -0,0 +1,176 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#ifndef NUKLEI_KERNEL_COLLECTION_VISIBILITY_H
+#define NUKLEI_KERNEL_COLLECTION_VISIBILITY_H
+
+#include <vector>
+
+#include <boost/cstdint.hpp>
+
+#include <nuklei/Definitions.h>
+#include <nuklei/Common.h>
+#include <nuklei/LinearAlgebraTypes.h>
+#include <nuklei/SimdMath.h>
+#include <nuklei/parallelizer_decl.h>
+
+namespace nuklei
+{
+
+  namespace visibility_types
+  {
+
+    /**
+     * @brief Ray caster that computes the visibility of points from a
+     * viewpoint, given a triangle mesh of the surface they lie on.
+     *
+     * The triangles are held in a bounding volume hierarchy stored in a flat
+     * array. Leaves hold blocks of four triangles in a structure-of-arrays
+     * layout. A ray is tested against the four triangles of a block at once
+     * with SSE2 or AVX2 instructions, according to simdLevel().
+     *
+     * A point is visible if the segment that links the viewpoint to the
+     * point does not intersect the mesh, except within @p tolerance of the
+     * point. These are the semantics of the segment queries of
+     * KernelCollection::isVisibleFrom().
+     *
+     * For large batches of targets, isVisibleDepthBuffer() renders the mesh
+     * into a depth buffer instead, and compares the depth of each target
+     * with the buffer.
+     *
+     * The engine is immutable once built, and may be queried from several
+     * threads.
+     */
+    class VisibilityEngine
+    {
+    public:
+      /**
+       * @brief Builds the hierarchy of @p triangles.
+       *
+       * @p vertices holds the coordinates of the vertices, three per vertex.
+       * @p triangles holds the indices of the vertices of the triangles,
+       * three per triangle.
+       */
+      VisibilityEngine(const std::vector<coord_t>& vertices,
+                       const std::vector<boost::uint32_t>& triangles);
+
+      size_t nTriangles() const { return nTriangles_; }
+
+      /**
+       * @brief Returns true if the segment from @p camera to @p target
+       * intersects a triangle farther than @p tolerance from @p target.
+       */
+      bool occluded(const Vector3& camera,
+                    const Vector3& target,
+                    const coord_t tolerance) const;
+
+      /**
+       * @brief Returns true if @p target is visible from @p camera.
+       *
+       * If @p normal is a unit vector, @p target is additionally required
+       * to be seen at an angle of less than 80 degrees from @p normal or
+       * its opposite.
+       */
+      bool isVisible(const Vector3& target,
+                     const Vector3& normal,
+                     const Vector3& camera,
+                     const coord_t tolerance) const;
+
+      /**
+       * @brief Computes the visibility of each point of @p targets.
+       *
+       * @p normals is either NULL or holds one normal per target (see
+       * isVisible()). @p visible receives one flag per target. Targets are
+       * distributed over threads according to @p parallelization. The
+       * result does not depend on the parallelization.
+       */
+      void isVisible(const std::vector<Vector3>& targets,
+                     const std::vector<Vector3>* normals,
+                     const Vector3& camera,
+                     const coord_t tolerance,
+                     std::vector<char>& visible,
+                     const parallelizer::Type parallelization = parallelizer::SINGLE) const;
+
+      /**
+       * @brief Same as the batch isVisible(), but tests targets against a
+       * depth buffer of the mesh rendered from @p camera.
+       *
+       * The mesh is rasterized once into a @p resolution x @p resolution
+       * depth buffer whose field of view encloses the bounding sphere of
+       * the mesh. A target is occluded if the depth stored at its pixel is
+       * smaller than its own by more than @p tolerance, measured along the
+       * ray. Targets that project outside the buffer, and all targets if
+       * @p camera lies within the bounding sphere, are ray cast.
+       *
+       * Results differ from ray casting within about a pixel of silhouettes,
+       * and where triangles are smaller than a pixel. Rows of the buffer are
+       * distributed over threads according to @p parallelization.
+       */
+      void isVisibleDepthBuffer(const std::vector<Vector3>& targets,
+                                const std::vector<Vector3>* normals,
+                                const Vector3& camera,
+                                const coord_t tolerance,
+                                const int resolution,
+                                std::vector<char>& visible,
+                                const parallelizer::Type parallelization = parallelizer::SINGLE) const;
+
+    private:
+      // Inner nodes are followed by their first child, and hold the index of
+      // their second child in @c offset. Leaves hold @c count blocks from
+      // block @c offset.
+      struct Node
+      {
+        coord_t lo[3];
+        coord_t hi[3];
+        boost::uint32_t offset;
+        boost::uint32_t count;
+      };
+
+      // Four triangles, as a vertex and two edges. Blocks are padded with
+      // degenerate triangles, which no ray intersects.
+      struct Block
+      {
+        coord_t v0[3][4];
+        coord_t e1[3][4];
+        coord_t e2[3][4];
+      };
+
+      struct Ray
+      {
+        coord_t o[3];
+        coord_t d[3];
+        coord_t inv[3];
+        coord_t tmax;
+      };
+
+      void build(std::vector<boost::uint32_t>& order,
+                 const std::vector<coord_t>& vertices,
+                 const std::vector<boost::uint32_t>& triangles,
+                 const std::vector<coord_t>& centroids,
+                 const size_t first,
+                 const size_t last);
+      bool hitsBox(const Node& node, const Ray& ray) const;
+      bool hitsBlock(const Block& block, const Ray& ray) const;
+      bool occluded(const Ray& ray) const;
+      void isVisibleSlice(const std::vector<Vector3>* targets,
+                          const std::vector<Vector3>* normals,
+                          const Vector3 camera,
+                          const coord_t tolerance,
+                          std::vector<char>* visible,
+                          const size_t sliceSize,
+                          const int slice) const;
+
+      std::vector<Node> nodes_;
+      std::vector<Block> blocks_;
+      size_t nTriangles_;
+      SimdLevel simd_;
+    };
+
+  }
+
+}
+
+#endif
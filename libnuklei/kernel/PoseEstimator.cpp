@@ -6,7 +6,9 @@
 
 #include <nuklei/PoseEstimator.h>
 #include <boost/bind.hpp>
+#include <numeric>
 #include <nuklei/parallelizer.h>
+#include <nuklei/task_pool.h>
 
 namespace nuklei
 {
@@ -22,7 +24,10 @@ namespace nuklei
   loc_h_(locH), ori_h_(oriH),
   nChains_(nChains), n_(n),
   cif_(cif), partialview_(partialview),
-  progress_(progress), meshTol_(4)
+  progress_(progress), meshTol_(4),
+  visibilityMethod_(KernelCollection::RAYCAST_VISIBILITY),
+  zbufferResolution_(512), singlePrecision_(false),
+  evidenceBlockSize_(16)
   {
     if (nChains_ <= 0) nChains_ = 8;
     parallel_ = typeFromName<parallelizer>(PARALLELIZATION);
@@ -51,7 +56,7 @@ namespace nuklei
       n = n_;
     
     KernelCollection poses;
-    if (!hasOpenMP())
+    if (!hasOpenMP() && parallel_ == parallelizer::OPENMP)
     {
       NUKLEI_WARN("Nuklei has not been compiled with OpenMP support. "
                   "Pose estimation will use a single core.");
@@ -107,28 +112,18 @@ namespace nuklei
     
     if (!partialview_)
     {
-      double w1 = 0, w2 = 0;
-      
-      KernelCollection tmp = objectModel_;
-      tmp.transformWith(t);
-      tmp.computeKernelStatistics();
-      tmp.buildKdTree();
-      
-      for (KernelCollection::const_iterator i = objectModel_.begin();
-           i != objectModel_.end(); ++i)
-      {
-        w1 += sceneModel_.evaluationAt(*i->polyTransformedWith(t),
-                                       evaluationStrategy_);
-      }
-      
-      for (KernelCollection::const_iterator i = sceneModel_.begin();
-           i != sceneModel_.end(); ++i)
-      {
-        w2 += tmp.evaluationAt(*i, evaluationStrategy_);
-      }
+      // The object model is evaluated in place: each point is transformed
+      // with t on the fly.
+      std::vector<weight_t> values;
+      if (singlePrecision_)
+        compactSceneModel_.evaluationAt(objectModel_, t, values,
+                                        evaluationStrategy_, parallel_);
+      else
+        sceneModel_.evaluationAt(objectModel_, t, values,
+                                 evaluationStrategy_, parallel_);
+      double w1 = std::accumulate(values.begin(), values.end(), 0.);
       
       t.setWeight(w1/objectModel_.size() * (cif_?cif_->factor(pose):1.));
-      //t.setWeight(std::sqrt(w1/objectModel_.size()*w2/objectModel_.size()));
     }
     else
     {
@@ -140,8 +135,7 @@ namespace nuklei
       for (KernelCollection::const_partialview_iterator i = viewIterator;
            i != i.end(); ++i)
       {
-        weight_t w = sceneModel_.evaluationAt(*i->polyTransformedWith(t),
-                                              evaluationStrategy_);
+        weight_t w = sceneEvaluationAt(*i, t, evaluationStrategy_);
         t.setWeight(t.getWeight() + w);
       }
       t.setWeight(t.getWeight()/std::pow(std::distance(viewIterator, viewIterator.end()), .7) * (cif_?cif_->factor(pose):1.));
@@ -196,7 +190,7 @@ namespace nuklei
     {
       if (computeNormals)
       {
-        objectModel_.buildNeighborSearchTree();
+        objectModel_.buildKdTree();
         objectModel_.computeSurfaceNormals();
       }
     }
@@ -205,7 +199,7 @@ namespace nuklei
     {
       if (computeNormals)
       {
-        sceneModel_.buildNeighborSearchTree();
+        sceneModel_.buildKdTree();
         sceneModel_.computeSurfaceNormals();
       }
     }
@@ -238,15 +232,49 @@ namespace nuklei
     
     objectModel_.computeKernelStatistics();
     sceneModel_.computeKernelStatistics();
-    sceneModel_.buildKdTree();
+    if (singlePrecision_)
+    {
+      compactSceneModel_.assign(sceneModel_);
+      compactSceneModel_.buildKdTree();
+    }
+    else
+    {
+      compactSceneModel_.assign(KernelCollection());
+      sceneModel_.buildKdTree();
+      sceneModel_.buildKernelArray();
+    }
     
     if (partialview_)
     {
-      if (!meshfile.empty())
-        objectModel_.readMeshFromOffFile(meshfile);
-      else
-        objectModel_.buildMesh();
-      objectModel_.buildPartialViewCache(meshTol_, as_const(objectModel_).front().polyType() == kernel::base::R3XS2P);
+      const bool useRayToSurfacenormalAngle =
+        as_const(objectModel_).front().polyType() == kernel::base::R3XS2P;
+      if (viewCacheFile_.empty() ||
+          !objectModel_.readPartialViewCache(viewCacheFile_, meshTol_,
+                                             useRayToSurfacenormalAngle,
+                                             .15, meshfile))
+      {
+        if (!meshfile.empty())
+          objectModel_.readMeshFromOffFile(meshfile);
+        else
+          objectModel_.buildMesh();
+        objectModel_.buildPartialViewCache(meshTol_, useRayToSurfacenormalAngle,
+                                           .15, parallel_, progress_,
+                                           visibilityMethod_, zbufferResolution_);
+        // The cache only saves time on the next run: failing to write it
+        // does not prevent estimation.
+        if (!viewCacheFile_.empty())
+        {
+          try
+          {
+            objectModel_.writePartialViewCache(viewCacheFile_);
+          }
+          catch (std::exception& e)
+          {
+            NUKLEI_WARN("Cannot write partial view cache `" << viewCacheFile_ <<
+                        "': " << e.what());
+          }
+        }
+      }
     }
     
     // Create dummy ProgressIndicator
@@ -273,16 +301,19 @@ namespace nuklei
   {
     Vector3 mean = objectModel_.mean()->getLoc();
     Vector3 v = la::normalized(viewpointInFrame(nextPose) - mean);
-    std::vector<int> pindices = objectModel_.partialView(v, meshTol_, true, true);
+    const std::vector<int>& pindices = objectModel_.cachedPartialView(v);
     
     if (pindices.size() < 20) return false;
-    indices = pindices;
+    // assign() reuses the storage of indices across proposals.
+    indices.assign(pindices.begin(), pindices.end());
     
     //      indices = objectModel_.partialView(viewpointInFrame(nextPose),
     //                                         meshTol_);
-    std::random_shuffle(indices.begin(), indices.end(), Random::uniformInt);
-    if (indices.size() > n)
-      indices.resize(n);
+    // Only the first n elements need to be shuffled.
+    const int m = std::min<int>(n, indices.size());
+    for (int i = 0; i < m; ++i)
+      std::swap(indices[i], indices[i + Random::uniformInt(indices.size() - i)]);
+    indices.resize(m);
     return true;
   }
   
@@ -328,8 +359,11 @@ namespace nuklei
       {
         if (count == 100) return;
         const kernel::base& randomModelPoint = objectModel_.at(indices.at(Random::uniformInt(indices.size())));
-        kernel::se3::ptr k2 = randomModelPoint.polySe3Proj();
-        kernel::se3::ptr k1 = sceneModel_.at(Random::uniformInt(sceneModel_.size())).polySe3Proj();
+        // The proposal kernels are constructed in the scratch arena of the
+        // calling thread, and destroyed at the end of the iteration.
+        arena::scope proposal(arena::scratch());
+        const kernel::se3* k2 = randomModelPoint.polySe3Proj(proposal.get());
+        const kernel::se3* k1 = sceneModel_.at(Random::uniformInt(sceneModel_.size())).polySe3Proj(proposal.get());
         
         nextPose = k1->transformationFrom(*k2);
         
@@ -379,30 +413,38 @@ namespace nuklei
     
     double factor = (cif_?cif_->factor(nextPose):1.);
 
-    // Go through the points of the model
+    const KernelCollection::EvaluationStrategy strategy =
+      WEIGHTED_SUM_EVIDENCE_EVAL ?
+      KernelCollection::WEIGHTED_SUM_EVAL : KernelCollection::MAX_EVAL;
+    const double noise = WEIGHTED_SUM_EVIDENCE_EVAL ?
+      WHITE_NOISE_POWER/sceneModel_.size() : WHITE_NOISE_POWER;
+    
+    std::vector<const kernel::base*> points;
+    points.reserve(indices.size());
     for (unsigned pi = 0; pi < indices.size(); ++pi)
+      points.push_back(&objectModel_.at(indices.at(pi)));
+    std::vector<weight_t> values;
+    
+    // Go through the points of the model, in blocks of evidenceBlockSize_
+    // points. The points of a block are transformed with nextPose on the fly
+    // and evaluated together. The early abort test is applied between blocks.
+    // With the POOL parallelization, idle workers may evaluate the blocks
+    // that follow the current one. Evidence is still accumulated one block at
+    // a time, in the same order.
+    unsigned evaluated = 0, offset = 0;
+    for (unsigned begin = 0; begin < points.size(); begin += evidenceBlockSize_)
     {
-      const kernel::base& objectPoint =
-      objectModel_.at(indices.at(pi));
-      
-      kernel::base::ptr test = objectPoint.polyTransformedWith(nextPose);
-      
-      weight_t w = 0;
-      if (WEIGHTED_SUM_EVIDENCE_EVAL)
+      const unsigned end =
+        std::min<unsigned>(begin + evidenceBlockSize_, points.size());
+      if (end > evaluated)
       {
-        w = (sceneModel_.evaluationAt(*test,
-                                      KernelCollection::WEIGHTED_SUM_EVAL) +
-             WHITE_NOISE_POWER/sceneModel_.size() );
+        offset = begin;
+        evaluated = sceneEvaluationAt(points, begin, nextPose, values, strategy);
       }
-      else
-      {
-        w = (sceneModel_.evaluationAt(*test, KernelCollection::MAX_EVAL) +
-             WHITE_NOISE_POWER );
-      }
-
-      w *= factor;
-
-      weight += w;
+      for (unsigned j = begin; j < end; ++j)
+        weight += (values[j - offset] + noise) * factor;
+      
+      const unsigned pi = end - 1;
       
       // At least consider sqrt(size(model)) points
       if (pi < std::sqrt(indices.size())) continue;
@@ -445,7 +487,84 @@ namespace nuklei
     NUKLEI_THROW("Reached forbidden state.");
     NUKLEI_TRACE_END();
   }
-  
+
+  weight_t
+  PoseEstimator::sceneEvaluationAt(const kernel::base& k,
+                                   const kernel::se3& t,
+                                   const KernelCollection::EvaluationStrategy strategy) const
+  {
+    if (singlePrecision_)
+      return compactSceneModel_.evaluationAt(k, t, strategy);
+    else
+      return sceneModel_.evaluationAt(k, t, strategy);
+  }
+
+  void
+  PoseEstimator::sceneEvaluationAt(std::vector<const kernel::base*>::const_iterator first,
+                                   std::vector<const kernel::base*>::const_iterator last,
+                                   const kernel::se3& t,
+                                   std::vector<weight_t>& values,
+                                   const KernelCollection::EvaluationStrategy strategy) const
+  {
+    if (singlePrecision_)
+      compactSceneModel_.evaluationAt(first, last, t, values, strategy);
+    else
+      sceneModel_.evaluationAt(first, last, t, values, strategy);
+  }
+
+  unsigned
+  PoseEstimator::sceneEvaluationAt(const std::vector<const kernel::base*>& points,
+                                   const unsigned begin,
+                                   const kernel::se3& t,
+                                   std::vector<weight_t>& values,
+                                   const KernelCollection::EvaluationStrategy strategy) const
+  {
+    const unsigned blockSize = evidenceBlockSize_;
+    const unsigned remaining = points.size() - begin;
+    unsigned nBlocks = 1;
+    if (parallel_ == parallelizer::POOL)
+      nBlocks = std::min<unsigned>(1 + task_pool::global().idleWorkers(),
+                                   (remaining + blockSize - 1) / blockSize);
+    const unsigned end = begin + std::min(nBlocks * blockSize, remaining);
+    
+    if (nBlocks <= 1)
+    {
+      sceneEvaluationAt(points.begin() + begin, points.begin() + end,
+                        t, values, strategy);
+      return end;
+    }
+    
+    // Each block writes to its own range of values, and the first block is
+    // evaluated by the calling thread.
+    values.resize(end - begin);
+    task_group group;
+    for (unsigned b = 1; b < nBlocks; ++b)
+    {
+      const unsigned first = begin + b * blockSize;
+      group.run(boost::bind(&PoseEstimator::evidenceBlockAt, this,
+                            boost::cref(points), first,
+                            std::min(first + blockSize, end), boost::cref(t),
+                            &values[first - begin], strategy));
+    }
+    evidenceBlockAt(points, begin, begin + blockSize, t, &values[0], strategy);
+    group.wait();
+    return end;
+  }
+
+  void
+  PoseEstimator::evidenceBlockAt(const std::vector<const kernel::base*>& points,
+                                 const unsigned first,
+                                 const unsigned last,
+                                 const kernel::se3& t,
+                                 weight_t* values,
+                                 const KernelCollection::EvaluationStrategy strategy) const
+  {
+    static thread_local std::vector<weight_t> block;
+    sceneEvaluationAt(points.begin() + first, points.begin() + last,
+                      t, block, strategy);
+    std::copy(block.begin(), block.end(), values);
+  }
+
   kernel::se3
   PoseEstimator::mcmc(const int n) const
   {
@@ -546,6 +665,14 @@ namespace nuklei
     NUKLEI_TRACE_END();
   }
   
+  void PoseEstimator::setEvidenceBlockSize(const int blockSize)
+  {
+    NUKLEI_TRACE_BEGIN();
+    NUKLEI_ASSERT(blockSize > 0);
+    evidenceBlockSize_ = blockSize;
+    NUKLEI_TRACE_END();
+  }
+  
   void PoseEstimator::setCustomIntegrandFactor(boost::shared_ptr<CustomIntegrandFactor> cif)
   {
     cif_ = cif;
@@ -0,0 +1,200 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+/** @file */
+
+#ifndef NUKLEI_COMPACTKERNELCOLLECTION_H
+#define NUKLEI_COMPACTKERNELCOLLECTION_H
+
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/optional.hpp>
+
+#include <nuklei/Definitions.h>
+#include <nuklei/Kernel.h>
+#include <nuklei/KernelCollection.h>
+#include <nuklei/parallelizer_decl.h>
+
+namespace nuklei {
+
+  namespace kernel_array_types
+  {
+    template<typename T> struct KernelArray;
+  }
+
+  /**
+   * @ingroup kernels
+   * @brief Read-only, single-precision copy of a KernelCollection, for
+   * density evaluation and sampling.
+   *
+   * A CompactKernelCollection stores kernel positions, orientations, widths
+   * and weights in packed arrays of @c float, which takes less than half
+   * the memory of a KernelCollection. It is meant for large densities that
+   * are evaluated many times, such as the scene model of PoseEstimator, where
+   * evaluation is bound by memory bandwidth.
+   *
+   * Values are converted to double when they are read, and all computations
+   * are done in double precision. Results differ from those of the
+   * KernelCollection the compact collection was built from by the
+   * single-precision rounding of positions and orientations (about
+   * @f$ 10^{-7} @f$ relative to the coordinates).
+   *
+   * The collection must contain kernels of a single type, among
+   * kernel::r3, kernel::r3xs2, kernel::r3xs2p and kernel::se3. Copies share
+   * their data.
+   */
+  class CompactKernelCollection
+  {
+  public:
+    typedef KernelCollection::EvaluationStrategy EvaluationStrategy;
+
+    /** @brief Creates an empty collection. */
+    CompactKernelCollection();
+    /** @brief Creates a compact copy of @p kc. */
+    explicit CompactKernelCollection(const KernelCollection &kc);
+
+    /**
+     * @brief Replaces the contents of *this with a compact copy of @p kc.
+     *
+     * The kd-tree is discarded.
+     */
+    void assign(const KernelCollection &kc);
+
+    size_t size() const;
+    bool empty() const { return size() == 0; }
+    kernel::base::Type kernelType() const;
+
+    /**
+     * @brief Returns the sum of the kernel weights, as stored in single
+     * precision.
+     */
+    weight_t totalWeight() const { return totalWeight_; }
+    /** @brief Returns the largest cut point of the position kernels. */
+    coord_t maxLocCutPoint() const { return maxLocCutPoint_; }
+
+    /**
+     * @brief Returns a kernel object holding the values of the
+     * @f$ i^{\rm th} @f$ kernel.
+     */
+    kernel::base::ptr at(const size_t i) const;
+
+    /**
+     * @brief Builds a @f$k@f$d-tree of the kernel positions and stores
+     * it internally.
+     *
+     * The tree indexes the single-precision positions directly, without
+     * copying them. Like KernelCollection::buildKdTree(), it is required by
+     * #evaluationAt() on collections of more than 1000 kernels.
+     */
+    void buildKdTree();
+
+    /**
+     * @brief Evaluates the density represented by *this at @p k.
+     *
+     * See KernelCollection::evaluationAt(const kernel::base&, const EvaluationStrategy) const.
+     */
+    weight_t evaluationAt(const kernel::base &k,
+                          const EvaluationStrategy strategy = KernelCollection::WEIGHTED_SUM_EVAL) const;
+
+    /**
+     * @brief Evaluates the density represented by *this at @p k transformed
+     * with @p t.
+     *
+     * See KernelCollection::evaluationAt(const kernel::base&, const kernel::se3&, const EvaluationStrategy) const.
+     */
+    weight_t evaluationAt(const kernel::base &k,
+                          const kernel::se3 &t,
+                          const EvaluationStrategy strategy = KernelCollection::WEIGHTED_SUM_EVAL) const;
+
+    /**
+     * @brief Evaluates the density represented by *this at each kernel
+     * pointed to by [@p first, @p last), transformed with @p t.
+     *
+     * See KernelCollection::evaluationAt(std::vector<const kernel::base*>::const_iterator, std::vector<const kernel::base*>::const_iterator, const kernel::se3&, std::vector<weight_t>&, const EvaluationStrategy) const.
+     */
+    void evaluationAt(std::vector<const kernel::base*>::const_iterator first,
+                      std::vector<const kernel::base*>::const_iterator last,
+                      const kernel::se3 &t,
+                      std::vector<weight_t> &values,
+                      const EvaluationStrategy strategy = KernelCollection::WEIGHTED_SUM_EVAL) const;
+
+    /**
+     * @brief Evaluates the density represented by *this at each kernel of
+     * @p points.
+     *
+     * See KernelCollection::evaluationAt(const KernelCollection&, std::vector<weight_t>&, const EvaluationStrategy) const.
+     */
+    void evaluationAt(const KernelCollection &points,
+                      std::vector<weight_t> &values,
+                      const EvaluationStrategy strategy = KernelCollection::WEIGHTED_SUM_EVAL) const;
+
+    /**
+     * @brief Parallel version of
+     * #evaluationAt(const KernelCollection&, std::vector<weight_t>&, const EvaluationStrategy) const.
+     *
+     * See KernelCollection::evaluationAt(const KernelCollection&, std::vector<weight_t>&, const EvaluationStrategy, const parallelizer::Type) const.
+     */
+    void evaluationAt(const KernelCollection &points,
+                      std::vector<weight_t> &values,
+                      const EvaluationStrategy strategy,
+                      const parallelizer::Type parallelization) const;
+
+    /**
+     * @brief Evaluates the density represented by *this at each kernel of
+     * @p points transformed with @p t.
+     *
+     * See KernelCollection::evaluationAt(const KernelCollection&, const kernel::se3&, std::vector<weight_t>&, const EvaluationStrategy, const parallelizer::Type) const.
+     */
+    void evaluationAt(const KernelCollection &points,
+                      const kernel::se3 &t,
+                      std::vector<weight_t> &values,
+                      const EvaluationStrategy strategy,
+                      const parallelizer::Type parallelization) const;
+
+    /**
+     * @brief Returns @p sampleSize samples from the density modeled by
+     * *this.
+     *
+     * See KernelCollection::sample().
+     */
+    KernelCollection sample(int sampleSize) const;
+
+  private:
+    struct KdTree;
+
+    boost::optional<kernel::base::Type> kernelType_;
+    boost::shared_ptr< kernel_array_types::KernelArray<float> > array_;
+    boost::shared_ptr<KdTree> tree_;
+    weight_t totalWeight_;
+    coord_t maxLocCutPoint_;
+
+    template<class KernelType, class QueryIterator>
+    void staticEvaluationAt(QueryIterator first,
+                            QueryIterator last,
+                            weight_t* values,
+                            const EvaluationStrategy strategy,
+                            const kernel::se3* queryTransform) const;
+    template<class QueryIterator>
+    void dispatchEvaluationAt(QueryIterator first,
+                              QueryIterator last,
+                              weight_t* values,
+                              const EvaluationStrategy strategy,
+                              const kernel::se3* queryTransform = NULL) const;
+    void evaluationSliceAt(KernelCollection::const_iterator first,
+                           weight_t* values,
+                           const size_t n,
+                           const size_t sliceSize,
+                           const EvaluationStrategy strategy,
+                           const kernel::se3* queryTransform,
+                           const int slice) const;
+    void parallelEvaluationAt(const KernelCollection &points,
+                              std::vector<weight_t> &values,
+                              const EvaluationStrategy strategy,
+                              const kernel::se3* queryTransform,
+                              const parallelizer::Type parallelization) const;
+  };
+
+}
+
+#endif
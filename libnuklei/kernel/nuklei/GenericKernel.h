@@ -594,6 +594,106 @@ namespace nuklei {
   }
   
 
+  // Helpers for the direct orientation samplers below. A sample is drawn
+  // in two steps: its dot product w with the mean, from the marginal
+  // distribution of w, then its direction around the mean, uniformly.
+  struct orientation_sampling
+  {
+    // Dot product between the mean and a sample of a von Mises-Fisher
+    // distribution of concentration h on S^3, with Wood's algorithm
+    // ("Simulation of the von Mises Fisher distribution", 1994). The
+    // expected number of iterations is bounded for all h.
+    static coord_t vmf_s3_dot(const coord_t h)
+    {
+      const int d = 4;
+      const coord_t t1 = std::sqrt(4*h*h + (d-1)*(d-1));
+      const coord_t b = (-2*h+t1)/(d-1);
+      const coord_t x0 = (1-b)/(1+b);
+      const coord_t c = h*x0 + (d-1) * std::log(1-x0*x0);
+      coord_t u[3];
+      for (;;)
+      {
+        Random::fillUniform(u, 3);
+        // z ~ Beta(3/2, 3/2): 1-2z has the density sqrt(1-x^2) of the
+        // first coordinate of a point uniformly distributed in the disk.
+        coord_t z = (1 - std::sqrt(u[0]) * std::cos(2*M_PI*u[1])) / 2;
+        coord_t w = (1-(1+b)*z)/(1-(1-b)*z);
+        coord_t t = h*w + (d-1)*std::log(1-x0*w)-c;
+        if ( ! (t < std::log(u[2])) )
+          return w;
+      }
+    }
+    
+    // Same as above, restricted to the hemisphere w >= 0. This is the
+    // distribution of |w| for the kernels of SO(3), which evaluate
+    // exp(h (|w|-1)). Rejection accepts at least half of the draws.
+    static coord_t vmf_s3_abs_dot(const coord_t h)
+    {
+      for (;;)
+      {
+        const coord_t w = vmf_s3_dot(h);
+        if (w >= 0) return w;
+      }
+    }
+    
+    // Dot product between the mean and a sample of a von Mises-Fisher
+    // distribution of concentration h on S^2, by inversion of its CDF.
+    // If lower is 0, the distribution is restricted to the hemisphere
+    // w >= 0, which is the distribution of |w| for the kernels of S^2_+.
+    static coord_t vmf_s2_dot(const coord_t h, const coord_t lower = -1)
+    {
+      // 1-uniform() is in (0,1].
+      const coord_t u = 1 - Random::uniform();
+      if (h < FLOATTOL) return lower + (1-lower)*u;
+      const coord_t w = 1 + std::log(u + (1-u)*std::exp(-(1-lower)*h)) / h;
+      return std::max(lower, std::min(w, coord_t(1)));
+    }
+    
+    // Uniformly distributed unit quaternion whose dot product with mean is w.
+    static Quaternion around(const Quaternion &mean, const coord_t w)
+    {
+      Vector3 v = std::sqrt(std::max(1 - w*w, coord_t(0))) *
+        Random::uniformDirection3d();
+      Quaternion q(v.X(), v.Y(), v.Z(), w);
+      NUKLEI_FAST_DEBUG_ASSERT(std::fabs(1-q.Length()) < 1e-6);
+      Quaternion sample = (mean * Quaternion(0, 0, 0, 1).Conjugate()) * q;
+      sample.Normalize();
+      return sample;
+    }
+    
+    // Uniformly distributed unit vector whose dot product with mean is w.
+    static Vector3 around(const Vector3 &mean, const coord_t w)
+    {
+      Vector2 v = std::sqrt(std::max(1 - w*w, coord_t(0))) *
+        Random::uniformDirection2d();
+      Vector3 q(v.X(), v.Y(), w);
+      NUKLEI_FAST_DEBUG_ASSERT(std::fabs(1-q.Length()) < 1e-6);
+      // Rotation that takes Z to mean. The half-way quaternion vanishes
+      // when mean is -Z, where any half-turn about an axis orthogonal to Z
+      // will do.
+      Vector3 cross = Vector3::UNIT_Z.Cross(mean);
+      Quaternion rotation(1+Vector3::UNIT_Z.Dot(mean),
+                          cross.X(),
+                          cross.Y(),
+                          cross.Z());
+      if (rotation.Length() < FLOATTOL)
+        rotation = Quaternion(0, 1, 0, 0);
+      rotation.Normalize();
+      return la::normalized(rotation.Rotate(q));
+    }
+    
+    // Technically, in SO(3) and in S^2_+, x is equivalent to -x. The sign
+    // of samples is randomized to make this equivalence explicit.
+    template<class T>
+    static T random_sign(const T &x)
+    {
+      if (Random::uniformInt(2))
+        return x;
+      else
+        return -x;
+    }
+  };
+
   template<class Kernel> struct sampler {};
   
   
@@ -613,8 +713,10 @@ namespace nuklei {
       static Vector3 s(const Vector3 &mean, const coord_t h)
       {
         Vector3 s(mean);
+        coord_t g[3];
+        Random::fillGaussian(g, 3, h);
         for (int i = 0; i < 3; ++i)
-          s[i] += Random::gaussian(h);
+          s[i] += g[i];
         return s;
       }
     };
@@ -635,21 +737,32 @@ namespace nuklei {
       Vector3 zero(Vector3::ZERO);
       coord_t kernelMaxPoint = kernel_t::eval(zero, h, zero);
       coord_t cutPoint = kernel_t::cut_point(h);
+      // Rejection sampling from the bounding cube. The acceptance rate is
+      // low (pi/24 for the triangle kernel), so the uniform numbers of
+      // TRIALS trials (3 coordinates and a threshold each) are drawn at
+      // once.
+      const int TRIALS = 8;
+      coord_t u[4*TRIALS];
       Vector3 r;
       for (;;)
       {
-        r.X() = Random::uniform(-cutPoint, cutPoint);
-        r.Y() = Random::uniform(-cutPoint, cutPoint);
-        r.Z() = Random::uniform(-cutPoint, cutPoint);
-        coord_t e = kernel_t::eval(zero, h, r);
-        // if e == 0, avoid drawing a random number
-        if (e == 0) continue;
-        if (kernelMaxPoint*Random::uniform() < e)
-          break;
+        Random::fillUniform(u, 4*TRIALS);
+        for (int t = 0; t < TRIALS; ++t)
+        {
+          const coord_t* v = u + 4*t;
+          r.X() = (2*v[0] - 1) * cutPoint;
+          r.Y() = (2*v[1] - 1) * cutPoint;
+          r.Z() = (2*v[2] - 1) * cutPoint;
+          coord_t e = kernel_t::eval(zero, h, r);
+          if (e == 0) continue;
+          if (kernelMaxPoint*v[3] < e)
+          {
+            for (int i = 0; i < 3; ++i)
+              r[i] += mean[i];
+            return r;
+          }
+        }
       }
-      for (int i = 0; i < 3; ++i)
-        r[i] += mean[i];
-      return r;
     }
   };
   
@@ -668,11 +781,29 @@ namespace nuklei {
 
       static Quaternion s(const Quaternion &mean, const coord_t h)
       {
-        if (h < .1) NUKLEI_WARN("S^2 IS with h=" + stringify(h) + " is slow.");
-        // The max angle between two quaternions is pi/2.
-        // Actually no, this is taken care of in the metric function
-        // h /= 2.0;
-        return importance_sampling_uniform_proposal<kernel_t>(mean, h);
+        const coord_t cut = kernel_t::cut_point(h);
+        if (!(cut < std::numeric_limits<coord_t>::infinity()))
+        {
+          if (h < .1) NUKLEI_WARN("S^2 IS with h=" + stringify(h) + " is slow.");
+          return importance_sampling_uniform_proposal<kernel_t>(mean, h);
+        }
+        // The angle a between the mean and a uniformly distributed rotation
+        // has density (1-cos a)/pi over [0, pi]. Angles are drawn from that
+        // density restricted to the support of the kernel, and accepted
+        // with the kernel value. The acceptance rate is at least 1/12 for
+        // the triangle shape.
+        const coord_t c = std::min(cut, coord_t(M_PI));
+        const coord_t maxDensity = 1 - std::cos(c);
+        coord_t u[3];
+        for (;;)
+        {
+          Random::fillUniform(u, 3);
+          const coord_t a = c*u[0];
+          if (maxDensity*u[1] >= 1 - std::cos(a)) continue;
+          if (u[2] >= kernel_t::shape_function_t::s(h, a)) continue;
+          return orientation_sampling::random_sign
+            (orientation_sampling::around(mean, std::cos(a/2)));
+        }
       }
     };
 
@@ -686,13 +817,26 @@ namespace nuklei {
   watson_kernel<ValueScale, FunctionImpl>
   >
   {
-    typedef watson_kernel<FunctionImpl> kernel_t;
+    typedef watson_kernel<ValueScale, FunctionImpl> kernel_t;
     typedef typename kernel_t::group_t group_t;
     typedef typename kernel_t::function_impl_t function_impl_t;
     
     static Quaternion s(const Quaternion &mean, const coord_t h)
     {
-      return importance_sampling_uniform_proposal<kernel_t>(mean, h);
+      if (h <= 0)
+        return importance_sampling_uniform_proposal<kernel_t>(mean, h);
+      // The dot product t between the mean and a sample has density
+      // exp(h t^2) sqrt(1-t^2) over [-1,1]. |t| is drawn by rejection from
+      // the von Mises-Fisher marginal exp(h t) sqrt(1-t^2) restricted to
+      // [0,1], which bounds it up to a constant since t^2 <= t. The
+      // acceptance rate stays bounded away from zero as h grows.
+      for (;;)
+      {
+        const coord_t t = orientation_sampling::vmf_s3_abs_dot(h);
+        if (std::log(1 - Random::uniform()) > h*(t*t - t)) continue;
+        return orientation_sampling::random_sign
+          (orientation_sampling::around(mean, t));
+      }
     }
   };
   
@@ -733,76 +877,24 @@ namespace nuklei {
                         groupS::so3, h_scaleS::intrinsic)
     {
       //return importance_sampling_uniform_proposal<kernel_t>(mean, h);
-      const int d = 4;
-      const coord_t t1 = std::sqrt(4*h*h + (d-1)*(d-1));
-      const coord_t b = (-2*h+t1)/(d-1);
-      const coord_t x0 = (1-b)/(1+b);
-      
-      const coord_t m = (d-1.0)/2;
-      const coord_t c = h*x0 + (d-1) * std::log(1-x0*x0);
-      coord_t w = -1;
-      for (;;)
-      {
-        coord_t z = Random::beta(m,m);
-        w = (1-(1+b)*z)/(1-(1-b)*z);
-        coord_t t = h*w + (d-1)*std::log(1-x0*w)-c;
-        if ( ! (t < std::log( Random::uniform() )) )
-          break;
-      }
-      Vector3 v = std::sqrt(1 - w*w) * Random::uniformDirection3d();
-      Quaternion q(v.X(), v.Y(), v.Z(), w);
-      NUKLEI_FAST_DEBUG_ASSERT(std::fabs(1-q.Length()) < 1e-6);
-      Quaternion sample = (mean * Quaternion(0, 0, 0, 1).Conjugate()) * q;
-      sample.Normalize();
-      // Technically, in SO3, sample is equivalent to -sample.
-      // We randomize the sign of sample to make this equivalence explicit.
-      if (Random::uniformInt(2))
-        return sample;
-      else
-        return -sample;
+      const coord_t w = orientation_sampling::vmf_s3_abs_dot(h);
+      return orientation_sampling::random_sign
+        (orientation_sampling::around(mean, w));
     }
 
     static Vector3 s(const Vector3 &mean, const coord_t h,
                      groupS::s2, h_scaleS::intrinsic)
     {
-      const int d = 3;
-      const coord_t t1 = std::sqrt(4*h*h + (d-1)*(d-1));
-      const coord_t b = (-2*h+t1)/(d-1);
-      const coord_t x0 = (1-b)/(1+b);
-      
-      const coord_t m = (d-1.)/2;
-      const coord_t c = h*x0 + (d-1) * std::log(1-x0*x0);
-      coord_t w = -1;
-      for (;;)
-      {
-        coord_t z = Random::beta(m,m);
-        w = (1-(1+b)*z)/(1-(1-b)*z);
-        coord_t t = h*w + (d-1)*std::log(1-x0*w)-c;
-        if ( ! (t < std::log( Random::uniform() )) )
-          break;
-      }
-      Vector2 v = std::sqrt(1 - w*w) * Random::uniformDirection2d();
-      Vector3 q(v.X(), v.Y(), w);
-      NUKLEI_FAST_DEBUG_ASSERT(std::fabs(1-q.Length()) < 1e-6);
-      Vector3 cross = Vector3::UNIT_Z.Cross(mean);
-      Quaternion rotation(1+Vector3::UNIT_Z.Dot(mean),
-                          cross.X(),
-                          cross.Y(),
-                          cross.Z());
-      rotation.Normalize();
-      return la::normalized(rotation.Rotate(q));
+      const coord_t w = orientation_sampling::vmf_s2_dot(h);
+      return orientation_sampling::around(mean, w);
     }
     
     static Vector3 s(const Vector3 &mean, const coord_t h,
                      groupS::s2p, h_scaleS::intrinsic)
     {
-      Vector3 sample = s(mean, h, groupS::s2(), h_scaleS::intrinsic());
-      // Technically, in s2p, sample is equivalent to -sample.
-      // We randomize the sign of sample to make this equivalence explicit.
-      if (Random::uniformInt(2))
-        return sample;
-      else
-        return -sample;
+      const coord_t w = orientation_sampling::vmf_s2_dot(h, 0);
+      return orientation_sampling::random_sign
+        (orientation_sampling::around(mean, w));
     }      
   };
   
@@ -821,8 +913,26 @@ namespace nuklei {
 
       static Vector3 s(const Vector3 &mean, const coord_t h)
       {
-        if (h < .1) NUKLEI_WARN("S^2 IS with h=" + stringify(h) + " is slow.");
-        return importance_sampling_uniform_proposal<kernel_t>(mean, h);
+        const coord_t cut = kernel_t::cut_point(h);
+        if (!(cut < std::numeric_limits<coord_t>::infinity()))
+        {
+          if (h < .1) NUKLEI_WARN("S^2 IS with h=" + stringify(h) + " is slow.");
+          return importance_sampling_uniform_proposal<kernel_t>(mean, h);
+        }
+        // The cosine of the angle between the mean and a uniformly
+        // distributed direction is uniform over [-1, 1]. Angles are drawn
+        // within the support of the kernel, and accepted with the kernel
+        // value. The acceptance rate is at least 1/3 for the triangle shape.
+        const coord_t cosCut = std::cos(std::min(cut, coord_t(M_PI)));
+        coord_t u[2];
+        for (;;)
+        {
+          Random::fillUniform(u, 2);
+          const coord_t w = 1 - (1-cosCut)*u[0];
+          const coord_t a = std::acos(std::max(coord_t(-1), w));
+          if (u[1] >= kernel_t::shape_function_t::s(h, a)) continue;
+          return orientation_sampling::around(mean, w);
+        }
       }
     };
 
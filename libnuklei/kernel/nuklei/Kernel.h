@@ -14,6 +14,7 @@
 #include <nuklei/GenericKernel.h>
 #include <nuklei/Descriptor.h>
 #include <nuklei/Indenter.h>
+#include <nuklei/arena.h>
 
 namespace nuklei {
   
@@ -152,6 +153,12 @@ namespace nuklei {
        * extra DOFs.
        */
       virtual NUKLEI_UNIQUE_PTR<kernel::se3> polySe3Proj() const = 0;
+      /**
+       * @brief Same as above, with the result constructed in @p a.
+       *
+       * The result is destroyed by @p a.
+       */
+      virtual kernel::se3* polySe3Proj(arena& a) const = 0;
       
       /**
        * @addtogroup matrix_transfo
@@ -162,6 +169,14 @@ namespace nuklei {
        * result. (See @ref matrix_transfo.)
        */
       virtual base::ptr polyTransformedWith(const kernel::se3& k) const = 0;
+      /**
+       * @brief Same as above, with the result constructed in @p a.
+       *
+       * The result is destroyed by @p a. Use this method in loops that
+       * transform many kernels, such as pose estimation, to avoid a heap
+       * allocation per kernel. See arena.
+       */
+      virtual base* polyTransformedWith(const kernel::se3& k, arena& a) const = 0;
       /**
        * @brief Transforms @p *this with @p k and sets @p *this to the
        * result. (See @ref matrix_transfo.)
@@ -346,6 +361,8 @@ namespace nuklei {
       
       NUKLEI_UNIQUE_PTR<kernel::se3> polySe3Proj() const;
       
+      kernel::se3* polySe3Proj(arena& a) const;
+      
       base::ptr polyProjectedOn(const kernel::se3& k) const
       {
         NUKLEI_TRACE_BEGIN();
@@ -362,6 +379,13 @@ namespace nuklei {
         NUKLEI_TRACE_END();
       }
       
+      base* polyTransformedWith(const kernel::se3& k, arena& a) const
+      {
+        NUKLEI_TRACE_BEGIN();
+        return a.create<T>(static_cast<const T*>(this)->transformedWith(k));
+        NUKLEI_TRACE_END();
+      }
+      
       void polyMakeTransformWith(const kernel::se3& k)
       {
         NUKLEI_TRACE_BEGIN();
@@ -956,6 +980,15 @@ namespace nuklei {
       NUKLEI_TRACE_END();
     }
     
+    template<class T>
+    kernel::se3*
+    kernel::implementation_prototype<T>::polySe3Proj(arena& a) const
+    {
+      NUKLEI_TRACE_BEGIN();
+      return a.create<se3>(static_cast<const T*>(this)->se3Proj());
+      NUKLEI_TRACE_END();
+    }
+    
     
   }
 }
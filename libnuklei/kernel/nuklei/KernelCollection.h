@@ -12,11 +12,15 @@
 #include <string>
 #include <iostream>
 #include <list>
+#include <map>
+#include <atomic>
 #include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/any.hpp>
 #include <boost/optional.hpp>
+#include <boost/cstdint.hpp>
 #include <boost/none.hpp>
 #include <boost/tuple/tuple.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include <nuklei/decoration.h>
 #include <nuklei/BoostSerialization.h>
@@ -24,6 +28,7 @@
 #include <nuklei/Kernel.h>
 #include <nuklei/nullable.h>
 #include <nuklei/RegionOfInterest.h>
+#include <nuklei/parallelizer_decl.h>
 #include <nuklei/trsl/common.hpp>
 #include <nuklei/trsl/ppfilter_iterator.hpp>
 #include <nuklei/trsl/is_picked_systematic.hpp>
@@ -74,19 +79,39 @@ namespace nuklei {
    * The functions responsible for computing intermediary results are:
    * - #computeKernelStatistics() 
    * - #buildKdTree()
+   * - #buildKernelArray()
    * - #buildNeighborSearchTree()
    * - #buildConvexHull()
    *
    * When a KernelCollection is modified, intermediary results become
-   * invalid. To avoid inconsistencies, each call to a KernelCollection method
-   * which can potentially allow one to modify the contained kernels (for
-   * instance, #add()) automatically destroys all intermediary results. In order
-   * to preserve intermediary results, one has to be careful to avoid calling
-   * these methods. In particular, several methods, such as #front() and
+   * invalid. #add() and #replace() update the kd-tree and the kernel
+   * statistics in place, and destroy the other intermediary results.
+   * #clear() destroys all intermediary results. Several methods, such as #front() and
    * #front()const, or #begin() and #begin()const, have a @p const and a @p
-   * non-const version. The @p const methods will always preserve intermediary
-   * results, while the @p non-const methods are likely to destroy them. One can
-   * force a call to the @p const version with as_const():
+   * non-const version. The @p non-const methods return references through
+   * which the kernels can be modified. They record a copy of the kernel
+   * positions, orientations, widths and weights: #at(), #front() and
+   * #back() copy those of the kernel they return, and iterators copy those
+   * of all kernels. At the next access to an intermediary result, the
+   * copies are compared to the kernels, and only the results that depend
+   * on a property that changed are destroyed:
+   * - kd-tree, neighbor search tree, convex hull, mesh: positions,
+   * - partial view cache: positions and orientations,
+   * - kernel array: positions, orientations, widths and weights,
+   * - total weight: weights; max cut point: location widths.
+   *
+   * Changing descriptors or flags destroys nothing. Values are compared
+   * exactly, so that no change goes unnoticed.
+   *
+   * #at(), #front() and #back() copy one kernel the first time each index
+   * is requested. The first non-const iterator requested after an access to
+   * an intermediary result copies all kernels, and the next access compares
+   * all of them: both take time and memory linear in the size of the
+   * collection. Code that alternates non-const iteration with, e.g.,
+   * #evaluationAt() pays that cost at each iteration, which is quadratic
+   * over the whole collection. The @p const methods always preserve
+   * intermediary results without that cost. One can force a call to the
+   * @p const version with as_const():
    * @code
    * using namespace nuklei;
    * KernelCollection kc;
@@ -109,17 +134,21 @@ namespace nuklei {
    * double e = kc.evaluationAt(k); // ok!
    *
    * // In the following line, even though i is a const_iterator, kc.begin()
-   * // calls the non-const begin() method, which destroys intermediary results.
+   * // calls the non-const begin() method, which copies the kernels.
    * for (KernelCollection::const_iterator i = kc.begin();
    *      i != kc.end(); ++i)
    * {
    *   i->setLocH(10);
    * }
    *
-   * double e = kc.evaluationAt(k); // throws exception: no kernel statistics,
-   *                                // no kd-tree.
+   * double e = kc.evaluationAt(k); // throws exception: no kernel statistics.
+   *                                // The kd-tree is preserved, as positions
+   *                                // did not change.
    * @endcode
    *
+   * #helperBuildCount() and #helperInvalidationCount() tell how often each
+   * intermediary result has been built and destroyed.
+   *
    * If the intermediary results that a method requires have not been computed,
    * the method throws an exception.
    *
@@ -155,6 +184,31 @@ namespace nuklei {
     public:
       void assertConsistency() const;
 
+      /** @brief Intermediary results. See @ref intermediary. */
+      typedef enum
+      {
+        HULL_HELPER = 0,
+        KDTREE_HELPER,
+        NSTREE_HELPER,
+        MESH_HELPER,
+        VISIBILITY_HELPER,
+        VIEWCACHE_HELPER,
+        KERNELARRAY_HELPER,
+        KERNELSTATISTICS_HELPER,
+        N_HELPERS
+      } HelperStructure;
+
+      /**
+       * @brief Returns the number of times the intermediary result @p h has
+       * been built. See @ref intermediary.
+       */
+      int helperBuildCount(const HelperStructure h) const;
+      /**
+       * @brief Returns the number of times the intermediary result @p h has
+       * been destroyed because the kernels changed. See @ref intermediary.
+       */
+      int helperInvalidationCount(const HelperStructure h) const;
+
       // Forwarded container symbols
 
       /** @brief Kernel container type. */
@@ -170,21 +224,21 @@ namespace nuklei {
 
       /** @brief Returns the kernel at index @p n. */
       Container::reference at(Container::size_type n)
-        { invalidateHelperStructures(); return kernels_.at(n); }
+        { markModified(n); return kernels_.at(n); }
       /** @brief Returns the kernel at index @p n. */
       Container::const_reference at(Container::size_type n) const
         { return kernels_.at(n); }
 
       /** @brief Returns the kernel at index @p 0. */
       Container::reference front()
-        { invalidateHelperStructures(); return kernels_.front(); }
+        { markModified(0); return kernels_.front(); }
       /** @brief Returns the kernel at index @p 0. */
       Container::const_reference front() const
         { return kernels_.front(); }
 
       /** @brief Returns the kernel at index #size()-1. */
       Container::reference back()
-        { invalidateHelperStructures(); return kernels_.back(); }
+        { markModified(size()-1); return kernels_.back(); }
       /** @brief Returns the kernel at index #size()-1. */
       Container::const_reference back() const
         { return kernels_.back(); }
@@ -199,26 +253,26 @@ namespace nuklei {
 
       /** @brief Returns an iterator pointing to the first kernel. */
       Container::iterator begin()
-        { invalidateHelperStructures(); return kernels_.begin(); }
+        { markModified(); return kernels_.begin(); }
       /** @brief Returns an iterator pointing to the first kernel. */
       Container::const_iterator begin() const
         { return kernels_.begin(); }
       /** @brief Returns an iterator pointing to the last kernel. */
       Container::iterator end()
-        { invalidateHelperStructures(); return kernels_.end(); }
+        { markModified(); return kernels_.end(); }
       /** @brief Returns an iterator pointing to the last kernel. */
       Container::const_iterator end() const
         { return kernels_.end(); }
 
       /** @brief Returns an reverse iterator pointing to the last kernel. */
       Container::reverse_iterator rbegin()
-        { invalidateHelperStructures(); return kernels_.rbegin(); }
+        { markModified(); return kernels_.rbegin(); }
       /** @brief Returns an reverse iterator pointing to the last kernel. */
       Container::const_reverse_iterator rbegin() const
         { return kernels_.rbegin(); }
       /** @brief Returns an reverse iterator pointing to the first kernel. */
       Container::reverse_iterator rend()
-        { invalidateHelperStructures(); return kernels_.rend(); }
+        { markModified(); return kernels_.rend(); }
       /** @brief Returns an reverse iterator pointing to the first kernel. */
       Container::const_reverse_iterator rend() const
         { return kernels_.rend(); }
@@ -227,11 +281,88 @@ namespace nuklei {
 
       /** @brief Resets the class to its initial state. */
       void clear();
-      /** @brief Adds a copy of @p f. */
+      /**
+       * @brief Adds a copy of @p f.
+       *
+       * If a kd-tree exists, @p f is inserted into it, in amortized
+       * logarithmic time, and the kernel statistics are updated. The other
+       * intermediary results are destroyed. See @ref intermediary.
+       */
       void add(const kernel::base &f);
-      /** @brief Adds a copy of the kernels contained in @p kv. */
+      /**
+       * @brief Adds @p f, taking ownership of it.
+       *
+       * Same as #add(const kernel::base&), without the copy.
+       */
+      void add(kernel::base::ptr f);
+      /**
+       * @brief Adds a copy of the kernels contained in @p kv.
+       *
+       * If a kd-tree exists, the new kernels are inserted into it. Otherwise,
+       * intermediary results are destroyed once. @p kv may be @c *this.
+       */
       void add(const KernelCollection &kv);
-      /** @brief Replaces the @p idx'th kernel with a copy of @p k. */
+      /**
+       * @brief Replaces the content of the collection with copies of the
+       * kernels in [@p first, @p last).
+       *
+       * All kernels must be of the same type. Intermediary results are
+       * destroyed once, instead of being updated for each kernel as in
+       * #add().
+       */
+      template<class InputIterator>
+      void assign(InputIterator first, InputIterator last)
+      {
+        NUKLEI_TRACE_BEGIN();
+        Container kernels;
+        for (; first != last; ++first)
+        {
+          if (!kernels.empty())
+            NUKLEI_ASSERT(kernels.front().polyType() == first->polyType());
+          kernels.push_back(NUKLEI_RELEASE(first->clone()));
+        }
+        replaceKernels(kernels, false);
+        NUKLEI_TRACE_END();
+      }
+      /**
+       * @brief Adds a default-constructed kernel of type @p KernelType, and
+       * returns a reference to it.
+       *
+       * Unlike #add(), this method does not update the intermediary results
+       * (see @ref intermediary). The new kernel is integrated into them, with
+       * the values it holds at that time, the next time an intermediary
+       * result is accessed. The reference may be used to fill in the kernel
+       * until then, at no cost. Filling in a series of kernels costs the
+       * same as adding them.
+       *
+       * @code
+       * KernelCollection kc;
+       * kc.reserve(n);
+       * for (int i = 0; i < n; ++i)
+       *   kc.emplace<kernel::r3>().loc_ = points.at(i);
+       * @endcode
+       */
+      template<class KernelType>
+      KernelType& emplace()
+      {
+        NUKLEI_TRACE_BEGIN();
+        KernelType* k = new KernelType;
+        addPending(kernel::base::ptr(k));
+        return *k;
+        NUKLEI_TRACE_END();
+      }
+      /**
+       * @brief Preallocates storage for @p n kernels.
+       *
+       * Does not change the size of the collection.
+       */
+      void reserve(const size_t n) { kernels_.reserve(n); }
+      /**
+       * @brief Replaces the @p idx'th kernel with a copy of @p k.
+       *
+       * Intermediary results are updated as in #add(). The position of the
+       * replaced kernel is removed lazily from the kd-tree.
+       */
       void replace(const size_t idx, const kernel::base &k);
       kernel::base::Type kernelType() const;
 
@@ -353,7 +484,16 @@ namespace nuklei {
       
       // Geometrical properties
       
-      /** @brief Transforms the data with @p t. */
+      /**
+       * @brief Transforms the data with @p t.
+       *
+       * The @f$k@f$d-tree and the packed kernel array (see #buildKdTree() and
+       * #buildKernelArray()) survive the transformation: they are kept in the
+       * frame in which they were built, and #evaluationAt() brings its
+       * queries to that frame. Kernel statistics are also preserved, as they
+       * are invariant to rigid transformations. Other intermediary results are
+       * destroyed.
+       */
       void transformWith(const kernel::se3& t);
       /** @brief Transforms the data with the provided translation and rotation. */
       void transformWith(const Vector3 &translation,
@@ -363,9 +503,10 @@ namespace nuklei {
        * @brief Computes the local differential properties of the nearest
        * neighbors of @p k.
        *
-       * This function requires a neighbor search tree. Its call must thus be
-       * preceded by a call to #buildNeighborSearchTree(). See @ref
-       * intermediary.
+       * This function requires a kd-tree or a neighbor search tree. Its call
+       * must thus be preceded by a call to #buildKdTree() or
+       * #buildNeighborSearchTree(). The kd-tree is used if both exist. See
+       * @ref intermediary.
        *
        * This function uses the CGAL <a
        * href="http://www.cgal.org/Manual/3.3/doc_html/cgal_manual/Jet_fitting_3/Chapter_main.html">Monge
@@ -406,19 +547,43 @@ namespace nuklei {
        *
        * The orientations/directions that may be associated to the kernels
        * prior to calling this method are ignored and replaced with the normals
-       * computed from local neighbors.
+       * computed from local neighbors. The normal at a kernel is the
+       * direction of least variance of the positions of its neighbors
+       * (principal component analysis). Neighbors are the @p k kernels nearest
+       * to the kernel, including itself. If @p radius is positive, neighbors
+       * farther than @p radius are discarded. If @p k is zero, all the kernels
+       * closer than @p radius are used. The default reproduces the PCA basis
+       * of the Monge fit of #localLocationDifferential(). Kernels that have
+       * fewer than three neighbors are removed.
+       *
+       * If @p viewpoint is provided, normals are oriented towards it.
+       * Otherwise, their sign is arbitrary. Weights and descriptors are
+       * preserved. Points are processed in parallel with @p parallelization.
        *
-       * This function requires a neighbor search tree. Its call must thus be
-       * preceded by a call to #buildNeighborSearchTree(). See @ref
-       * intermediary.
+       * This function uses the kd-tree, and builds it if it does not exist. It
+       * does not require CGAL. See @ref intermediary.
        */
-      void computeSurfaceNormals();
+      void computeSurfaceNormals(const size_t k = 16+1,
+                                 const coord_t radius = 0,
+                                 const boost::optional<Vector3>& viewpoint = boost::none,
+                                 const parallelizer::Type parallelization = parallelizer::OPENMP);
 
       /**
        * @brief Builds a kd-tree of the kernel positions and stores the tree
        * internally. See @ref intermediary.
        */
       void buildKdTree();
+      /**
+       * @brief Builds a packed copy of the kernels, in which positions,
+       * orientations, widths and weights are stored in contiguous arrays, and
+       * stores it internally. See @ref intermediary.
+       *
+       * When the packed copy is available, #evaluationAt() and #sample()
+       * stream through it instead of visiting the kernel objects one by one,
+       * which is significantly faster on large collections. The results are
+       * the same with or without the packed copy.
+       */
+      void buildKernelArray();
       /**
        * @brief Builds a neighbor search tree of the kernel positions and stores
        * the tree internally. See @ref intermediary.
@@ -444,10 +609,69 @@ namespace nuklei {
       void readMeshFromOffFile(const std::string& filename);
       void writeMeshToPlyFile(const std::string& filename) const;
       void readMeshFromPlyFile(const std::string& filename);
+      /**
+       * @brief Methods for computing which points are visible from a
+       * viewpoint.
+       *
+       * RAYCAST_VISIBILITY casts a ray towards each point.
+       * ZBUFFER_VISIBILITY renders the mesh into a depth buffer, and compares
+       * the depth of each point with the buffer. It is much faster on dense
+       * models, and agrees with ray casting except within about a pixel of
+       * silhouettes. See #partialView().
+       */
+      typedef enum { RAYCAST_VISIBILITY, ZBUFFER_VISIBILITY } VisibilityMethod;
       /**
        * @brief Builds set of partial views of the object. See @ref intermediary.
+       *
+       * Views are computed from directions that cover the sphere
+       * uniformly, about @p angularResolution radians apart. The
+       * directions are deterministic, and views are computed in parallel
+       * according to @p parallelization. If @p progress is true, progress
+       * is reported through a ProgressIndicator.
+       *
+       * Visibility is computed with @p method. See #partialView().
+       *
+       * This function requires prior computation of a surface mesh from the
+       * points of the collection. See buildMesh().
+       */
+      void buildPartialViewCache(const double meshTol,
+                                 const bool useRayToSurfacenormalAngle = false,
+                                 const double angularResolution = .15,
+                                 const parallelizer::Type parallelization = parallelizer::OPENMP,
+                                 const bool progress = false,
+                                 const VisibilityMethod method = RAYCAST_VISIBILITY,
+                                 const int zbufferResolution = 512);
+      /**
+       * @brief Writes the mesh and the partial view cache to @p filename.
+       *
+       * The file is keyed by the positions and orientations of the kernels,
+       * by the source of the mesh (#buildMesh() or the contents of the file
+       * given to #readMeshFromOffFile()), and by the parameters given to
+       * #buildPartialViewCache(). See #readPartialViewCache().
+       *
+       * The file is written under a temporary name, which is removed if
+       * writing fails.
        */
-      void buildPartialViewCache(const double meshTol, const bool useRayToSurfacenormalAngle = false);
+      void writePartialViewCache(const std::string& filename) const;
+      /**
+       * @brief Reads the mesh and the partial view cache from a file written
+       * by #writePartialViewCache(), and rebuilds the ray-casting hierarchy of
+       * the mesh.
+       *
+       * @p meshfile is the OFF file the mesh should be read from, or an
+       * empty string if the mesh should be built by #buildMesh().
+       *
+       * The file is memory-mapped. If it does not exist, if it was written
+       * from different kernels, from a different mesh or with different
+       * parameters, or if it is not a valid cache file, this function
+       * returns false and leaves the collection unchanged. The visibility
+       * method the views were computed with is not recorded.
+       */
+      bool readPartialViewCache(const std::string& filename,
+                                const double meshTol,
+                                const bool useRayToSurfacenormalAngle = false,
+                                const double angularResolution = .15,
+                                const std::string& meshfile = "");
       /**
        * @brief Assuming that the points in this collection form the surface of
        * an object, this function computes whether a point @p p is visible from
@@ -477,12 +701,34 @@ namespace nuklei {
        * an object, this function returns the indices of points visible from
        * @p viewpoint.
        *
-       * See isVisibleFrom() for more details.
+       * See isVisibleFrom() for more details. Unless @p useViewcache is
+       * true, points are tested in parallel according to @p
+       * parallelization.
+       *
+       * If @p method is ZBUFFER_VISIBILITY, the mesh is rendered from @p
+       * viewpoint into a @p zbufferResolution x @p zbufferResolution depth
+       * buffer, whose field of view encloses the mesh. A point is occluded
+       * if the buffer is closer to @p viewpoint than the point by more than
+       * @p tolerance. Points that project outside the buffer, and all
+       * points if @p viewpoint is close to the mesh, are tested by ray
+       * casting.
        */
       std::vector<int> partialView(const Vector3& viewpoint,
                                    const coord_t& tolerance = FLOATTOL,
                                    const bool useViewcache = false,
-                                   const bool useRayToSurfacenormalAngle = false) const;
+                                   const bool useRayToSurfacenormalAngle = false,
+                                   const parallelizer::Type parallelization = parallelizer::SINGLE,
+                                   const VisibilityMethod method = RAYCAST_VISIBILITY,
+                                   const int zbufferResolution = 512) const;
+      /**
+       * @brief Returns the indices of the points visible from the cached view
+       * whose direction is closest to @p direction.
+       *
+       * Precede by a call to #buildPartialViewCache(). The lookup takes
+       * logarithmic time in the number of cached views. The returned
+       * reference is valid until the cache is rebuilt or invalidated.
+       */
+      const std::vector<int>& cachedPartialView(const Vector3& direction) const;
       /**
        * @brief Partial View Iterator type.
        *
@@ -495,7 +741,8 @@ namespace nuklei {
        * an object, this function returns an iterator that iterates through the
        * kernels that are visible from @p viewpoint.
        *
-       * See isVisibleFrom() for more details.
+       * Visible kernels are computed as in #partialView(), which documents
+       * the arguments.
        *
        * See @ref iterators for more details.
        */
@@ -503,7 +750,10 @@ namespace nuklei {
       partialViewBegin(const Vector3& viewpoint,
                        const coord_t& tolerance = FLOATTOL,
                        const bool useViewcache = false,
-                       const bool useRayToSurfacenormalAngle = false) const;
+                       const bool useRayToSurfacenormalAngle = false,
+                       const parallelizer::Type parallelization = parallelizer::SINGLE,
+                       const VisibilityMethod method = RAYCAST_VISIBILITY,
+                       const int zbufferResolution = 512) const;
       
       // Density-related methods
             
@@ -554,6 +804,177 @@ namespace nuklei {
        */
       weight_t evaluationAt(const kernel::base &f,
                             const EvaluationStrategy strategy = WEIGHTED_SUM_EVAL) const;
+      /**
+       * @brief Evaluates the density represented by @p *this at @p f
+       * transformed with @p t.
+       *
+       * Returns the same value as
+       * <tt>evaluationAt(*f.polyTransformedWith(t), strategy)</tt>, without
+       * allocating memory: the pose of @p f is transformed into a buffer of
+       * the type of the kernels of @p *this. This is the fast way of scoring
+       * a rigid alignment point by point, as in pose estimation.
+       *
+       * Precede by a call to #computeKernelStatistics() and #buildKdTree(). See
+       * @ref intermediary.
+       */
+      weight_t evaluationAt(const kernel::base &f,
+                            const kernel::se3 &t,
+                            const EvaluationStrategy strategy = WEIGHTED_SUM_EVAL) const;
+      /**
+       * @brief Evaluates the density represented by @p *this at each kernel
+       * pointed to by the range [@p first, @p last), transformed with @p t.
+       *
+       * After the call, @p values[i] holds the value that
+       * #evaluationAt(const kernel::base&, const kernel::se3&, const EvaluationStrategy) const
+       * would return for the @p i-th kernel of the range. The neighbors of
+       * the queries are searched in blocks before being evaluated, which is
+       * faster than a loop of single evaluations. Use this method to score a
+       * few kernels picked from another collection, for instance in
+       * pose estimation.
+       *
+       * Precede by a call to #computeKernelStatistics() and #buildKdTree(). See
+       * @ref intermediary.
+       */
+      void evaluationAt(std::vector<const kernel::base*>::const_iterator first,
+                        std::vector<const kernel::base*>::const_iterator last,
+                        const kernel::se3 &t,
+                        std::vector<weight_t> &values,
+                        const EvaluationStrategy strategy = WEIGHTED_SUM_EVAL) const;
+      /**
+       * @brief Evaluates the density represented by @p *this at all the
+       * kernels of @p points, and stores the results in @p values.
+       *
+       * After the call, @p values has the same size as @p points, and @p
+       * values[i] holds the value that #evaluationAt(const kernel::base&, const EvaluationStrategy) const
+       * would return for the @p i-th kernel of @p points. The kd-tree and
+       * the kernel type are resolved once for the whole batch, which is
+       * considerably faster than calling #evaluationAt() in a loop.
+       *
+       * Precede by a call to #computeKernelStatistics() and #buildKdTree(). See
+       * @ref intermediary.
+       */
+      void evaluationAt(const KernelCollection &points,
+                        std::vector<weight_t> &values,
+                        const EvaluationStrategy strategy = WEIGHTED_SUM_EVAL) const;
+      /**
+       * @brief Evaluates the density represented by @p *this at all the
+       * kernels of the range [@p first, @p last), and stores the results in
+       * @p values.
+       *
+       * See #evaluationAt(const KernelCollection&, std::vector<weight_t>&, const EvaluationStrategy) const.
+       */
+      void evaluationAt(const_iterator first,
+                        const_iterator last,
+                        std::vector<weight_t> &values,
+                        const EvaluationStrategy strategy = WEIGHTED_SUM_EVAL) const;
+      /**
+       * @brief Evaluates the density represented by @p *this at all the
+       * kernels of @p points, distributing the queries over the cores of
+       * the machine.
+       *
+       * The queries are split in contiguous slices, which are processed by
+       * the backend selected by @p parallelization. Each slice writes its
+       * results at their position in @p values, so the output is identical
+       * to that of the serial
+       * #evaluationAt(const KernelCollection&, std::vector<weight_t>&, const EvaluationStrategy) const,
+       * regardless of the backend and of the number of threads.
+       *
+       * Precede by a call to #computeKernelStatistics() and #buildKdTree(). See
+       * @ref intermediary.
+       */
+      void evaluationAt(const KernelCollection &points,
+                        std::vector<weight_t> &values,
+                        const EvaluationStrategy strategy,
+                        const parallelizer::Type parallelization) const;
+      /**
+       * @brief Parallel version of
+       * #evaluationAt(const_iterator, const_iterator, std::vector<weight_t>&, const EvaluationStrategy) const.
+       *
+       * See #evaluationAt(const KernelCollection&, std::vector<weight_t>&, const EvaluationStrategy, const parallelizer::Type) const.
+       */
+      void evaluationAt(const_iterator first,
+                        const_iterator last,
+                        std::vector<weight_t> &values,
+                        const EvaluationStrategy strategy,
+                        const parallelizer::Type parallelization) const;
+      /**
+       * @brief Evaluates the density represented by @p *this at all the
+       * kernels of @p points transformed with @p t.
+       *
+       * The result is the same as transforming a copy of @p points with @p t
+       * and passing it to
+       * #evaluationAt(const KernelCollection&, std::vector<weight_t>&, const EvaluationStrategy, const parallelizer::Type) const,
+       * but @p points is neither copied nor modified. This is the fast way of
+       * scoring a rigid alignment of @p points with @p *this.
+       *
+       * Precede by a call to #computeKernelStatistics() and #buildKdTree(). See
+       * @ref intermediary.
+       */
+      void evaluationAt(const KernelCollection &points,
+                        const kernel::se3 &t,
+                        std::vector<weight_t> &values,
+                        const EvaluationStrategy strategy,
+                        const parallelizer::Type parallelization) const;
+      
+      // Neighbor search
+      
+      /**
+       * @brief Finds the @p k kernels whose position is nearest to @p p.
+       *
+       * Writes the index of the kernels to @p indices, and their squared
+       * distance to @p p to @p squaredDistances, by increasing distance.
+       * Fewer than @p k kernels are returned if the collection is smaller than
+       * @p k. The buffers are cleared first, but their storage is reused.
+       *
+       * Precede by a call to #buildKdTree(). See @ref intermediary. This
+       * function is not available with the libkdtree++ backend
+       * (NUKLEI_KDTREE_NANOFLANN=0).
+       */
+      void knn(const Vector3& p, const size_t k,
+               std::vector<size_t>& indices,
+               std::vector<coord_t>& squaredDistances) const;
+      /**
+       * @brief Finds the @p k nearest kernels of each point of @p points.
+       *
+       * The neighbors of the @f$ i^{\rm th} @f$ point are written to row
+       * @f$ i @f$ of @p indices and @p squaredDistances, where rows have
+       * @f$ \min(k, n) @f$ entries, @f$ n @f$ being #size(). Queries are
+       * distributed as in
+       * #evaluationAt(const KernelCollection&, std::vector<weight_t>&, const EvaluationStrategy, const parallelizer::Type) const.
+       *
+       * See #knn(const Vector3&, const size_t, std::vector<size_t>&, std::vector<coord_t>&) const.
+       */
+      void knn(const std::vector<Vector3>& points, const size_t k,
+               std::vector<size_t>& indices,
+               std::vector<coord_t>& squaredDistances,
+               const parallelizer::Type parallelization = parallelizer::OPENMP) const;
+      /**
+       * @brief Finds the kernels whose position is closer than @p r to @p p.
+       *
+       * Kernels at distance @p r are excluded, whichever kd-tree backend
+       * is in use. Results are written as in
+       * #knn(const Vector3&, const size_t, std::vector<size_t>&, std::vector<coord_t>&) const.
+       *
+       * Precede by a call to #buildKdTree(). See @ref intermediary.
+       */
+      void radiusSearch(const Vector3& p, const coord_t r,
+                        std::vector<size_t>& indices,
+                        std::vector<coord_t>& squaredDistances) const;
+      /**
+       * @brief Finds the kernels closer than @p r to each point of
+       * @p points.
+       *
+       * The neighbors of the @f$ i^{\rm th} @f$ point are written to
+       * entries @p offsets[i] to @p offsets[i+1]-1 of @p indices and
+       * @p squaredDistances. @p offsets has @p points.size()+1 entries.
+       *
+       * See #radiusSearch(const Vector3&, const coord_t, std::vector<size_t>&, std::vector<coord_t>&) const.
+       */
+      void radiusSearch(const std::vector<Vector3>& points, const coord_t r,
+                        std::vector<size_t>& offsets,
+                        std::vector<size_t>& indices,
+                        std::vector<coord_t>& squaredDistances,
+                        const parallelizer::Type parallelization = parallelizer::OPENMP) const;
       
       
       // Misc
@@ -565,30 +986,159 @@ namespace nuklei {
     private:
       Container kernels_;
       
-      boost::optional<weight_t> totalWeight_;
-      boost::optional<coord_t> maxLocCutPoint_;
+      // Intermediary results are mutable: they are destroyed lazily by const
+      // methods, when refreshHelperStructures() finds that the kernels have
+      // changed.
+      mutable boost::optional<weight_t> totalWeight_;
+      mutable boost::optional<coord_t> maxLocCutPoint_;
       boost::optional<kernel::base::Type> kernelType_;
       
-      decoration<int> deco_;
+      // Transformation from the frame in which the kd-tree and the kernel
+      // array were built to the frame of kernels_. Unset when the two frames
+      // are the same. See transformWith().
+      mutable boost::optional<kernel::se3> helperFrame_;
+      
+      // Source of the mesh stored in deco_: 0 for buildMesh(), or a hash of
+      // the OFF file it was read from. Set along with the mesh.
+      boost::optional<boost::uint64_t> meshSource_;
+      
+      mutable decoration<int> deco_;
       const static int HULL_KEY;
       const static int KDTREE_KEY;
       const static int NSTREE_KEY;
       const static int MESH_KEY;
-      const static int AABBTREE_KEY;
+      const static int VISIBILITY_KEY;
       const static int VIEWCACHE_KEY;
+      const static int KERNELARRAY_KEY;
 
+      // Dirty tracking of intermediary results. See @ref intermediary.
+      struct HelperTracker
+      {
+        HelperTracker();
+        HelperTracker(const HelperTracker& t);
+        HelperTracker& operator=(const HelperTracker& t);
+        
+        // Set by markModified(), cleared by refreshHelperStructures().
+        std::atomic<bool> modified;
+        // Property values of the kernels when an iterator was first
+        // requested, or empty.
+        std::vector<coord_t> snapshot;
+        // Property values of the kernels returned by at(), front() and
+        // back(), when they were first requested.
+        std::map< std::size_t, std::vector<coord_t> > touched;
+        // Index of the first kernel added by emplace() that is not yet
+        // integrated into the intermediary results, or none. Kernels are
+        // integrated by refreshHelperStructures().
+        boost::optional<std::size_t> pendingFrom;
+        std::vector<int> buildCounts;
+        std::vector<int> invalidationCounts;
+        boost::mutex mutex;
+      };
+      mutable HelperTracker tracker_;
+
+      // Destroys all intermediary results.
       void invalidateHelperStructures();
+      // Swaps kernels_ with @p kernels. If @p samePositions, the new kernels
+      // have the positions of the old ones, and the intermediary results that
+      // depend on positions only are preserved.
+      void replaceKernels(Container& kernels, const bool samePositions);
+      // Destroys the intermediary results that depend on the kernel
+      // properties in the bitfield @p properties.
+      void invalidateHelperStructures(const bitfield_t properties) const;
+      // Same as above, without calling refreshHelperStructures().
+      void dropHelperStructures(const bitfield_t properties) const;
+      // Called by the non-const accessors that give access to all kernels.
+      void markModified();
+      // Called by the non-const accessors that give access to kernel @p idx.
+      void markModified(const size_t idx);
+      // Appends @p f, and defers its integration into the intermediary
+      // results to the next refreshHelperStructures().
+      void addPending(kernel::base::ptr f);
+      // Number of kernels integrated into the intermediary results.
+      size_t integratedSize() const;
+      // Destroys the intermediary results invalidated by changes made through
+      // non-const accessors, and integrates the kernels added by emplace().
+      // Must be called before reading or writing intermediary results.
+      void refreshHelperStructures() const;
+      // Property values of the first integratedSize() kernels.
+      std::vector<coord_t> snapshot() const;
+      void eraseHelperStructure(const int key) const;
+      // Called by add() and replace() after kernel @p idx was added, or
+      // replaced with @p previous.
+      void updateHelperStructures(const size_t idx,
+                                  const kernel::base* previous) const;
+      void updateKdTree(const size_t idx, const kernel::base* previous) const;
+      
+      // Throws if the prerequisites of neighborSearch() are not met.
+      void checkNeighborSearch(const size_t k) const;
+      // Appends the neighbors of queries[0], ..., queries[n-1] to the
+      // buffers: the k nearest if k > 0, else those within radius.
+      void neighborSearch(const Vector3* queries,
+                          const size_t n,
+                          const size_t k,
+                          const coord_t radius,
+                          std::vector<size_t>& counts,
+                          std::vector<size_t>& indices,
+                          std::vector<coord_t>& squaredDistances) const;
+      void neighborSearchSlice(const std::vector<Vector3>* queries,
+                               const size_t k,
+                               const coord_t radius,
+                               const size_t sliceSize,
+                               std::vector< std::vector<size_t> >* counts,
+                               std::vector< std::vector<size_t> >* indices,
+                               std::vector< std::vector<coord_t> >* squaredDistances,
+                               const int slice) const;
+      void parallelNeighborSearch(const std::vector<Vector3>& queries,
+                                  const size_t k,
+                                  const coord_t radius,
+                                  std::vector<size_t>& offsets,
+                                  std::vector<size_t>& indices,
+                                  std::vector<coord_t>& squaredDistances,
+                                  const parallelizer::Type parallelization) const;
+      template<typename T>
+      void setHelperStructure(const int key, const T& value)
+      {
+        refreshHelperStructures();
+        if (deco_.has_key(key)) deco_.erase(key);
+        deco_.insert(key, value);
+        tracker_.buildCounts.at(key)++;
+      }
 
-      template<class KernelType>
-      weight_t staticEvaluationAt(const kernel::base &k,
-                                  const EvaluationStrategy strategy) const;
+      template<class KernelType, class QueryIterator>
+      void staticEvaluationAt(QueryIterator first,
+                              QueryIterator last,
+                              weight_t* values,
+                              const EvaluationStrategy strategy,
+                              const kernel::se3* queryTransform) const;
+      template<class QueryIterator>
+      void dispatchEvaluationAt(QueryIterator first,
+                                QueryIterator last,
+                                weight_t* values,
+                                const EvaluationStrategy strategy,
+                                const kernel::se3* queryTransform = NULL) const;
+      void evaluationSliceAt(const_iterator first,
+                             weight_t* values,
+                             const size_t n,
+                             const size_t sliceSize,
+                             const EvaluationStrategy strategy,
+                             const kernel::se3* queryTransform,
+                             const int slice) const;
+      void parallelEvaluationAt(const_iterator first,
+                                const_iterator last,
+                                std::vector<weight_t> &values,
+                                const EvaluationStrategy strategy,
+                                const kernel::se3* queryTransform,
+                                const parallelizer::Type parallelization) const;
       
       kernel::base::ptr deviation(const kernel::base &center) const;
       template<typename C>
       C partialView(const Vector3& viewpoint,
                     const coord_t& tolerance,
                     const bool useViewcache,
-                    const bool useRayToSurfacenormalAngle) const;
+                    const bool useRayToSurfacenormalAngle,
+                    const parallelizer::Type parallelization,
+                    const VisibilityMethod method,
+                    const int zbufferResolution) const;
       
       friend class NUKLEI_SERIALIZATION_FRIEND_CLASSNAME;
       template<class Archive>
@@ -8,6 +8,7 @@
 #define NUKLEI_POSE_ESTIMATOR_H
 
 #include <nuklei/KernelCollection.h>
+#include <nuklei/CompactKernelCollection.h>
 #include <nuklei/ObservationIO.h>
 #include <nuklei/Types.h>
 #include <nuklei/ProgressIndicator.h>
@@ -67,9 +68,52 @@ namespace nuklei {
     
     void setMeshToVisibilityTol(const double meshTol) { meshTol_ = meshTol; }
     
+    /**
+     * @brief Method with which partial views of the object model are
+     * computed (see KernelCollection::partialView()). Must be called before
+     * load().
+     */
+    void setVisibilityMethod(const KernelCollection::VisibilityMethod method,
+                             const int zbufferResolution = 512)
+    {
+      visibilityMethod_ = method;
+      zbufferResolution_ = zbufferResolution;
+    }
+    
+    /**
+     * @brief File in which the mesh and partial views of the object model
+     * are cached across runs.
+     *
+     * When set, load() reads them from @p filename if it matches the object
+     * model and mesh file (see KernelCollection::readPartialViewCache()),
+     * and otherwise builds them and writes them to @p filename. A cache that
+     * cannot be read or written is reported with a warning, and does not
+     * prevent estimation. Must be called before load().
+     */
+    void setPartialViewCacheFile(const std::string& filename) { viewCacheFile_ = filename; }
+    
     void setParallelization(const parallelizer::Type t) { parallel_ = t; }
     parallelizer::Type getParallelization() const { return parallel_; }
     
+    /**
+     * @brief Evaluates the scene model from a single-precision copy
+     * (see CompactKernelCollection).
+     *
+     * Must be called before load().
+     */
+    void setSinglePrecision(const bool singlePrecision) { singlePrecision_ = singlePrecision; }
+    bool getSinglePrecision() const { return singlePrecision_; }
+    
+    /**
+     * @brief Number of model points evaluated together in each MCMC step.
+     *
+     * Evidence for a pose is accumulated in blocks of @p blockSize model
+     * points, and the early rejection test is applied between blocks. A
+     * block size of 1 tests after each point.
+     */
+    void setEvidenceBlockSize(const int blockSize);
+    int getEvidenceBlockSize() const { return evidenceBlockSize_; }
+    
     void setCustomIntegrandFactor(boost::shared_ptr<CustomIntegrandFactor> cif);
     boost::shared_ptr<CustomIntegrandFactor> getCustomIntegrandFactor() const;
 
@@ -104,6 +148,29 @@ namespace nuklei {
                        const bool firstRun,
                        const int n) const;
     
+    weight_t sceneEvaluationAt(const kernel::base& k,
+                               const kernel::se3& t,
+                               const KernelCollection::EvaluationStrategy strategy) const;
+    void sceneEvaluationAt(std::vector<const kernel::base*>::const_iterator first,
+                           std::vector<const kernel::base*>::const_iterator last,
+                           const kernel::se3& t,
+                           std::vector<weight_t>& values,
+                           const KernelCollection::EvaluationStrategy strategy) const;
+    // Evaluates the points that follow begin, one block at a time, or with
+    // the POOL parallelization, one block per idle worker. Returns the end of
+    // the evaluated range. values[j] is the value of points[begin+j].
+    unsigned sceneEvaluationAt(const std::vector<const kernel::base*>& points,
+                               const unsigned begin,
+                               const kernel::se3& t,
+                               std::vector<weight_t>& values,
+                               const KernelCollection::EvaluationStrategy strategy) const;
+    void evidenceBlockAt(const std::vector<const kernel::base*>& points,
+                         const unsigned first,
+                         const unsigned last,
+                         const kernel::se3& t,
+                         weight_t* values,
+                         const KernelCollection::EvaluationStrategy strategy) const;
+    
     kernel::se3
     mcmc(const int n) const;
     bool recomputeIndices(std::vector<int>& indices,
@@ -113,6 +180,7 @@ namespace nuklei {
     KernelCollection objectModel_;
     double objectSize_;
     KernelCollection sceneModel_;
+    CompactKernelCollection compactSceneModel_;
     Vector3 viewpoint_;
     KernelCollection::EvaluationStrategy evaluationStrategy_;
     double loc_h_;
@@ -125,6 +193,11 @@ namespace nuklei {
     bool progress_;
     parallelizer::Type parallel_;
     double meshTol_;
+    KernelCollection::VisibilityMethod visibilityMethod_;
+    int zbufferResolution_;
+    std::string viewCacheFile_;
+    bool singlePrecision_;
+    int evidenceBlockSize_;
   };
   
 }
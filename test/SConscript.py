@@ -28,3 +28,89 @@ target_name = 'kde'
 target  = os.path.join(env['BinDir'], 'tests', target_name)
 product = env.Program(source = sources, target = target)
 env.Alias('check', [ 'install', target ], product[0].abspath)
+
+## fast math ###############
+env = origEnv.Clone()
+
+sources = [ 'fastmath.cpp' ]
+
+target_name = 'fastmath'
+target  = os.path.join(env['BinDir'], 'tests', target_name)
+product = env.Program(source = sources, target = target)
+env.Alias('check', [ 'install', target ], product[0].abspath)
+
+## packed kernel evaluation
+env = origEnv.Clone()
+# eval_block() is declared in a private header of libnuklei.
+env.Prepend(CPPPATH = [ '#libnuklei/kernel' ])
+
+sources = [ 'evalblock.cpp' ]
+
+target_name = 'evalblock'
+target  = os.path.join(env['BinDir'], 'tests', target_name)
+product = env.Program(source = sources, target = target)
+env.Alias('check', [ 'install', target ], product[0].abspath)
+
+## kd-tree updates #########
+env = origEnv.Clone()
+
+sources = [ 'kdtree.cpp' ]
+
+target_name = 'kdtree'
+target  = os.path.join(env['BinDir'], 'tests', target_name)
+product = env.Program(source = sources, target = target)
+env.Alias('check', [ 'install', target ], product[0].abspath)
+
+## neighbor search #########
+env = origEnv.Clone()
+
+sources = [ 'knn.cpp' ]
+
+target_name = 'knn'
+target  = os.path.join(env['BinDir'], 'tests', target_name)
+product = env.Program(source = sources, target = target)
+env.Alias('check', [ 'install', target ], product[0].abspath)
+
+## batched evaluation #####
+env = origEnv.Clone()
+
+sources = [ 'evaluation.cpp' ]
+
+target_name = 'evaluation'
+target  = os.path.join(env['BinDir'], 'tests', target_name)
+product = env.Program(source = sources, target = target)
+env.Alias('check', [ 'install', target ], product[0].abspath)
+
+## orientation sampling ###
+env = origEnv.Clone()
+
+sources = [ 'orientation.cpp' ]
+
+target_name = 'orientation'
+target  = os.path.join(env['BinDir'], 'tests', target_name)
+product = env.Program(source = sources, target = target)
+env.Alias('check', [ 'install', target ], product[0].abspath)
+
+## partial view cache ######
+if env['PartialView']:
+  env = origEnv.Clone()
+
+  sources = [ 'viewcache.cpp' ]
+
+  target_name = 'viewcache'
+  target  = os.path.join(env['BinDir'], 'tests', target_name)
+  product = env.Program(source = sources, target = target)
+  env.Alias('check', [ 'install', target ], product[0].abspath)
+
+## visibility ##############
+if env['PartialView']:
+  env = origEnv.Clone()
+  # The ray casting engine is declared in a private header of libnuklei.
+  env.Prepend(CPPPATH = [ '#libnuklei/kernel' ])
+
+  sources = [ 'visibility.cpp' ]
+
+  target_name = 'visibility'
+  target  = os.path.join(env['BinDir'], 'tests', target_name)
+  product = env.Program(source = sources, target = target)
+  env.Alias('check', [ 'install', target ], product[0].abspath)
@@ -0,0 +1,87 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+// Reporting helpers shared by the test programs. Each helper prints one line
+// ending with "(ok)" or "(FAILED)", and returns whether the check passed, so
+// that checks can be chained as
+//
+//   ok = check("name", condition) && ok;
+//
+// Test programs return a non-zero status if any check failed.
+
+#ifndef NUKLEI_TEST_CHECK_H
+#define NUKLEI_TEST_CHECK_H
+
+#include <cmath>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+namespace nuklei_test
+{
+
+  inline bool report(const std::string& line, const bool ok)
+  {
+    std::cout << line << (ok ? " (ok)" : " (FAILED)") << std::endl;
+    return ok;
+  }
+
+  /** @brief Checks that @p ok is true. */
+  inline bool check(const std::string& name, const bool ok)
+  {
+    return report(name, ok);
+  }
+
+  /** @brief Checks that @p count, a number of errors, is zero. */
+  inline bool checkCount(const std::string& name, const size_t count,
+                         const std::string& what = "errors")
+  {
+    std::ostringstream line;
+    line << name << ": " << count << " " << what;
+    return report(line.str(), count == 0);
+  }
+
+  /** @brief Checks that @p error is smaller than @p bound. */
+  inline bool checkError(const std::string& name, const double error,
+                         const double bound)
+  {
+    std::ostringstream line;
+    line << name << ": max error " << error;
+    return report(line.str(), error < bound);
+  }
+
+  /**
+   * @brief Returns the largest absolute difference between @p values and
+   * @p expected, or infinity if their sizes differ.
+   */
+  inline double maxError(const std::vector<double>& values,
+                         const std::vector<double>& expected)
+  {
+    if (values.size() != expected.size()) return HUGE_VAL;
+    double e = 0;
+    for (size_t i = 0; i < values.size(); ++i)
+      e = std::max(e, std::fabs(values[i]-expected[i]));
+    return e;
+  }
+
+  /**
+   * @brief Same as above, relative to the largest of 1 and the magnitude of
+   * each expected value.
+   */
+  inline double maxRelativeError(const std::vector<double>& values,
+                                 const std::vector<double>& expected)
+  {
+    if (values.size() != expected.size()) return HUGE_VAL;
+    double e = 0;
+    for (size_t i = 0; i < values.size(); ++i)
+      e = std::max(e, std::fabs(values[i]-expected[i]) /
+                   std::max(1., std::fabs(expected[i])));
+    return e;
+  }
+
+}
+
+#endif
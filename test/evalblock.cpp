@@ -0,0 +1,152 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+// This test compares eval_block(), which evaluates packed kernels 2, 4 or 8
+// at a time, to array_kernel::eval() combined with accumulate_evaluation(),
+// for each kernel type, float and double storage and evaluation strategy.
+// Block sizes that are not multiples of the vector width exercise the
+// scalar remainder.
+//
+// simdLevel() is fixed for the life of a process. Without arguments, this
+// program runs itself once for each value of NUKLEI_SIMD.
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <nuklei/KernelCollection.h>
+#include <nuklei/Random.h>
+#include <nuklei/SimdMath.h>
+
+#include "KernelCollectionArray.h"
+#include "check.h"
+
+namespace
+{
+  using namespace nuklei;
+  using namespace nuklei::kernel_array_types;
+
+  const size_t N = 203;
+  const size_t BLOCK_SIZES[] = { 0, 1, 3, 5, 7, 8, 9, 15, 17, 31, N };
+
+  template<class KernelType>
+  void randomKernel(KernelType& k)
+  {
+    k.loc_ = Vector3(Random::uniform(), Random::uniform(), Random::uniform());
+    k.setLocH(Random::uniform(.2, .6));
+    k.setOriH(Random::uniform(.2, .8));
+    k.setWeight(Random::uniform());
+  }
+
+  void randomOrientation(kernel::r3& k) {}
+  void randomOrientation(kernel::r3xs2& k) { k.dir_ = Random::uniformDirection3d(); }
+  void randomOrientation(kernel::r3xs2p& k) { k.dir_ = Random::uniformDirection3d(); }
+  void randomOrientation(kernel::se3& k) { k.ori_ = Random::uniformQuaternion(); }
+
+  template<class KernelType, typename T>
+  coord_t reference(const KernelArray<T>& a, const size_t* idx,
+                    const size_t n, const KernelArrayQuery<coord_t>& q,
+                    const KernelCollection::EvaluationStrategy strategy)
+  {
+    coord_t value = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+      const size_t j = idx == NULL ? i : idx[i];
+      accumulate_evaluation(value, array_kernel<KernelType>::eval(a, j, q),
+                            a.w[j], strategy);
+    }
+    return value;
+  }
+
+  template<class KernelType, typename T>
+  bool checkType(const std::string& name)
+  {
+    KernelCollection kc;
+    for (size_t i = 0; i < N; ++i)
+    {
+      KernelType k;
+      randomKernel(k);
+      randomOrientation(k);
+      kc.add(k);
+    }
+    KernelArray<T> a;
+    build_kernel_array<KernelType>(a, kc.begin(), kc.end());
+
+    // Neighbor lists are out of order, as those returned by the kd-tree.
+    std::vector<size_t> idx(N);
+    for (size_t i = 0; i < N; ++i) idx.at(i) = (i*97) % N;
+
+    const KernelCollection::EvaluationStrategy strategies[] = {
+      KernelCollection::MAX_EVAL, KernelCollection::SUM_EVAL,
+      KernelCollection::WEIGHTED_SUM_EVAL
+    };
+    const char* strategyNames[] = { "max", "sum", "weighted sum" };
+
+    bool ok = true;
+    for (int s = 0; s < 3; ++s)
+    {
+      std::vector<double> values, expected;
+      for (int trial = 0; trial < 20; ++trial)
+      {
+        KernelType query;
+        randomKernel(query);
+        randomOrientation(query);
+        KernelArrayQuery<coord_t> q;
+        array_kernel<KernelType>::fill(q, query);
+        for (size_t b = 0; b < sizeof(BLOCK_SIZES)/sizeof(size_t); ++b)
+        {
+          const size_t n = BLOCK_SIZES[b];
+          values.push_back(eval_block<KernelType>(a, NULL, n, q, strategies[s]));
+          expected.push_back(reference<KernelType>(a, NULL, n, q, strategies[s]));
+          values.push_back(eval_block<KernelType>(a, &idx.front(), n, q, strategies[s]));
+          expected.push_back(reference<KernelType>(a, &idx.front(), n, q, strategies[s]));
+        }
+      }
+      // Values differ by the order of sums, and by the vector FastNegExp,
+      // which follows the scalar one to rounding errors.
+      ok = nuklei_test::checkError(name + ", " + strategyNames[s],
+                                   nuklei_test::maxRelativeError(values, expected),
+                                   1e-9) && ok;
+    }
+    return ok;
+  }
+
+  bool checkLevel()
+  {
+    const char* levelNames[] = { "none", "sse2", "avx2", "avx512" };
+    std::cout << "SIMD level: " << levelNames[simdLevel()] << std::endl;
+    Random::seed(0);
+    bool ok = true;
+    ok = checkType<kernel::r3, double>("r3, double") && ok;
+    ok = checkType<kernel::r3xs2, double>("r3xs2, double") && ok;
+    ok = checkType<kernel::r3xs2p, double>("r3xs2p, double") && ok;
+    ok = checkType<kernel::se3, double>("se3, double") && ok;
+    ok = checkType<kernel::r3, float>("r3, float") && ok;
+    ok = checkType<kernel::r3xs2, float>("r3xs2, float") && ok;
+    ok = checkType<kernel::r3xs2p, float>("r3xs2p, float") && ok;
+    ok = checkType<kernel::se3, float>("se3, float") && ok;
+    return ok;
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  if (argc > 1 && std::string(argv[1]) == "--current-level")
+    return checkLevel() ? 0 : 1;
+
+  // Levels the processor does not support run at the highest supported
+  // level.
+  const char* levels[] = { "none", "sse2", "avx2", "avx512" };
+  bool ok = true;
+  for (int l = 0; l < 4; ++l)
+  {
+    setenv("NUKLEI_SIMD", levels[l], 1);
+    const std::string command =
+      "'" + std::string(argv[0]) + "' --current-level";
+    ok = nuklei_test::check(std::string("NUKLEI_SIMD=") + levels[l],
+                            std::system(command.c_str()) == 0) && ok;
+  }
+  return ok ? 0 : 1;
+}
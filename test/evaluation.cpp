@@ -0,0 +1,231 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+// This test compares the batched evaluationAt() methods, which evaluate a
+// range of queries at once, to a loop of single-query evaluationAt(), for
+// each evaluation strategy. Parallel evaluations are compared to the same
+// loop for each parallelization backend. Finally, CompactKernelCollection is
+// compared to the collection it was built from.
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#include <nuklei/KernelCollection.h>
+#include <nuklei/CompactKernelCollection.h>
+#include <nuklei/Random.h>
+
+#include "check.h"
+
+namespace
+{
+  using namespace nuklei;
+
+  // More than the number of kernels above which evaluationAt() uses the
+  // kd-tree.
+  const int N = 3000;
+
+  kernel::se3 randomKernel()
+  {
+    kernel::se3 k;
+    k.loc_ = Vector3(Random::uniform(), Random::uniform(), Random::uniform());
+    k.ori_ = Random::uniformQuaternion();
+    k.setLocH(.05);
+    k.setOriH(.3);
+    k.setWeight(Random::uniform());
+    return k;
+  }
+
+  // Returns the largest difference between values and expected, relative to
+  // the largest expected value. Densities are much smaller than 1, which
+  // would make nuklei_test::maxRelativeError() an absolute error.
+  double relativeError(const std::vector<weight_t>& values,
+                       const std::vector<weight_t>& expected)
+  {
+    return nuklei_test::maxError(values, expected) /
+      *std::max_element(expected.begin(), expected.end());
+  }
+
+  // Values of the density at each query, one query at a time.
+  std::vector<weight_t> singleEvaluations(const KernelCollection& kc,
+                                          const KernelCollection& queries,
+                                          const KernelCollection::EvaluationStrategy strategy)
+  {
+    std::vector<weight_t> values;
+    for (KernelCollection::const_iterator q = queries.begin();
+         q != queries.end(); ++q)
+      values.push_back(kc.evaluationAt(*q, strategy));
+    return values;
+  }
+
+  bool checkStrategy(const std::string& name,
+                     const KernelCollection& kc,
+                     const KernelCollection& queries,
+                     const KernelCollection::EvaluationStrategy strategy)
+  {
+    using namespace nuklei_test;
+    bool ok = true;
+    const std::vector<weight_t> expected =
+      singleEvaluations(kc, queries, strategy);
+
+    // Batches sum the contributions of the neighbors in the same order as
+    // single evaluations, but may use packed arithmetic.
+    std::vector<weight_t> values;
+    kc.evaluationAt(queries, values, strategy);
+    ok = checkError(name + ", collection",
+                    relativeError(values, expected), 1e-9) && ok;
+
+    // A range in the middle of the queries
+    const size_t first = 17, last = queries.size()-29;
+    kc.evaluationAt(queries.begin()+first, queries.begin()+last, values,
+                    strategy);
+    ok = checkError(name + ", range",
+                    relativeError(values,
+                                     std::vector<weight_t>(expected.begin()+first,
+                                                           expected.begin()+last)),
+                    1e-9) && ok;
+
+    // Pointers to queries transformed with t. The transformation is small,
+    // so that the transformed queries remain close to the density.
+    kernel::se3 t;
+    t.loc_ = Vector3(.01, -.02, .005);
+    t.ori_.FromAxisAngle(la::normalized(Vector3(1, 2, 3)), .05);
+    std::vector<const kernel::base*> pointers;
+    std::vector<weight_t> transformed;
+    for (KernelCollection::const_iterator q = queries.begin();
+         q != queries.end(); ++q)
+    {
+      pointers.push_back(&*q);
+      transformed.push_back(kc.evaluationAt(*q->polyTransformedWith(t),
+                                            strategy));
+    }
+    std::vector<weight_t> single;
+    for (KernelCollection::const_iterator q = queries.begin();
+         q != queries.end(); ++q)
+      single.push_back(kc.evaluationAt(*q, t, strategy));
+    ok = checkError(name + ", single query, transformed",
+                    relativeError(single, transformed), 1e-9) && ok;
+    kc.evaluationAt(pointers.begin(), pointers.end(), t, values, strategy);
+    ok = checkError(name + ", pointers, transformed",
+                    relativeError(values, transformed), 1e-9) && ok;
+
+    // Parallel evaluations write the value of each query at its position,
+    // regardless of the backend.
+    const parallelizer::Type types[] = {
+      parallelizer::SINGLE, parallelizer::OPENMP, parallelizer::PTHREAD,
+      parallelizer::POOL
+    };
+    const char* typeNames[] = { "single", "openmp", "pthread", "pool" };
+    for (int p = 0; p < 4; ++p)
+    {
+      kc.evaluationAt(queries, values, strategy, types[p]);
+      ok = checkError(name + ", " + typeNames[p],
+                      relativeError(values, expected), 1e-9) && ok;
+      kc.evaluationAt(queries.begin()+first, queries.begin()+last, values,
+                      strategy, types[p]);
+      ok = checkError(name + ", " + typeNames[p] + ", range",
+                      relativeError(values,
+                                    std::vector<weight_t>(expected.begin()+first,
+                                                          expected.begin()+last)),
+                      1e-9) && ok;
+      kc.evaluationAt(queries, t, values, strategy, types[p]);
+      ok = checkError(name + ", " + typeNames[p] + ", transformed",
+                      relativeError(values, transformed), 1e-9) && ok;
+    }
+
+    return ok;
+  }
+
+  // Kernels are stored in single precision, and values may differ from
+  // those of the double precision collection by rounding errors in the
+  // positions and in the kernels.
+  bool checkCompact(const std::string& name,
+                    const KernelCollection& kc,
+                    const CompactKernelCollection& compact,
+                    const KernelCollection& queries,
+                    const KernelCollection::EvaluationStrategy strategy)
+  {
+    using namespace nuklei_test;
+    const double tol = 1e-5;
+    bool ok = true;
+    const std::vector<weight_t> expected =
+      singleEvaluations(kc, queries, strategy);
+
+    std::vector<weight_t> values;
+    for (KernelCollection::const_iterator q = queries.begin();
+         q != queries.end(); ++q)
+      values.push_back(compact.evaluationAt(*q, strategy));
+    ok = checkError(name + ", compact, single query",
+                    relativeError(values, expected), tol) && ok;
+    compact.evaluationAt(queries, values, strategy);
+    ok = checkError(name + ", compact, collection",
+                    relativeError(values, expected), tol) && ok;
+    compact.evaluationAt(queries, values, strategy, parallelizer::OPENMP);
+    ok = checkError(name + ", compact, openmp",
+                    relativeError(values, expected), tol) && ok;
+
+    kernel::se3 t;
+    t.loc_ = Vector3(.01, -.02, .005);
+    t.ori_.FromAxisAngle(la::normalized(Vector3(1, 2, 3)), .05);
+    std::vector<const kernel::base*> pointers;
+    std::vector<weight_t> transformed;
+    for (KernelCollection::const_iterator q = queries.begin();
+         q != queries.end(); ++q)
+    {
+      pointers.push_back(&*q);
+      transformed.push_back(kc.evaluationAt(*q, t, strategy));
+    }
+    compact.evaluationAt(pointers.begin(), pointers.end(), t, values,
+                         strategy);
+    ok = checkError(name + ", compact, pointers, transformed",
+                    relativeError(values, transformed), tol) && ok;
+    compact.evaluationAt(queries, t, values, strategy, parallelizer::POOL);
+    ok = checkError(name + ", compact, pool, transformed",
+                    relativeError(values, transformed), tol) && ok;
+
+    return ok;
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  Random::seed(0);
+
+  KernelCollection kc, queries;
+  for (int i = 0; i < N; ++i)
+    kc.add(randomKernel());
+  // Queries are drawn from the density, so that most of them have
+  // neighbors.
+  for (int i = 0; i < 1000; ++i)
+  {
+    kernel::se3 q = randomKernel();
+    q.loc_ = as_const(kc).at(Random::uniformInt(N)).getLoc() +
+      Vector3(Random::uniform(-.05, .05), Random::uniform(-.05, .05),
+              Random::uniform(-.05, .05));
+    queries.add(q);
+  }
+  kc.computeKernelStatistics();
+  kc.buildKdTree();
+
+  bool ok = true;
+  ok = checkStrategy("max", kc, queries, KernelCollection::MAX_EVAL) && ok;
+  ok = checkStrategy("sum", kc, queries, KernelCollection::SUM_EVAL) && ok;
+  ok = checkStrategy("weighted sum", kc, queries,
+                     KernelCollection::WEIGHTED_SUM_EVAL) && ok;
+
+  CompactKernelCollection compact(kc);
+  compact.buildKdTree();
+  ok = nuklei_test::checkError("compact, total weight",
+                               std::fabs(compact.totalWeight()-kc.totalWeight()) /
+                               kc.totalWeight(), 1e-6) && ok;
+  ok = checkCompact("max", kc, compact, queries,
+                    KernelCollection::MAX_EVAL) && ok;
+  ok = checkCompact("sum", kc, compact, queries,
+                    KernelCollection::SUM_EVAL) && ok;
+  ok = checkCompact("weighted sum", kc, compact, queries,
+                    KernelCollection::WEIGHTED_SUM_EVAL) && ok;
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,78 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+// This test compares the batch versions of FastNegExp, FastACos and
+// FastQuaternionAngle to std::exp and std::acos across their domain. The
+// batch functions use the instruction set returned by simdLevel(), which can
+// be changed with NUKLEI_SIMD.
+
+#include <cmath>
+#include <vector>
+#include <iostream>
+
+#include <nuklei/Math.h>
+#include <nuklei/SimdMath.h>
+
+#include "check.h"
+
+namespace
+{
+  // An odd size exercises the scalar remainder of the vector code.
+  const size_t N = 100003;
+
+  bool check(const std::string& name,
+             const std::vector<double>& values,
+             const std::vector<double>& expected,
+             const double bound)
+  {
+    return nuklei_test::checkError(name,
+                                   nuklei_test::maxError(values, expected),
+                                   bound);
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  std::cout << "SIMD level: " << nuklei::simdLevel() << std::endl;
+  
+  bool ok = true;
+  std::vector<double> in(N), out(N), expected(N);
+  
+  // FastNegExp, on [0, 50]
+  for (size_t i = 0; i < N; ++i)
+  {
+    in.at(i) = 50.*i/(N-1);
+    expected.at(i) = std::exp(-in.at(i));
+  }
+  nuklei::FastNegExp(&in.front(), &out.front(), N);
+  ok = check("FastNegExp", out, expected, 2.5e-7) && ok;
+  
+  // Negative inputs are treated as 0.
+  in.at(0) = -1e-9;
+  nuklei::FastNegExp(&in.front(), &out.front(), 1);
+  ok = check("FastNegExp (negative input)",
+             std::vector<double>(1, out.front()),
+             std::vector<double>(1, 1.), 2.5e-7) && ok;
+  
+  // FastACos, on [-1, 1]
+  for (size_t i = 0; i < N; ++i)
+  {
+    in.at(i) = -1 + 2.*i/(N-1);
+    expected.at(i) = std::acos(in.at(i));
+  }
+  nuklei::FastACos(&in.front(), &out.front(), N);
+  ok = check("FastACos", out, expected, 6.8e-5) && ok;
+  
+  // FastQuaternionAngle, on [-1, 1]
+  for (size_t i = 0; i < N; ++i)
+    expected.at(i) = 2*std::acos(std::fabs(in.at(i)));
+  nuklei::FastQuaternionAngle(&in.front(), &out.front(), N);
+  ok = check("FastQuaternionAngle", out, expected, 1.4e-4) && ok;
+  
+  // In place
+  nuklei::FastQuaternionAngle(&in.front(), &in.front(), N);
+  ok = check("FastQuaternionAngle (in place)", in, out, 1e-12) && ok;
+  
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,124 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+// This test interleaves add() and replace() on a collection whose kd-tree is
+// updated in place, and compares evaluationAt() and radiusSearch() to those
+// of a collection built afresh from the same kernels. It does the same with
+// a copy of the collection, which shares the kd-tree until it is mutated.
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#include <nuklei/KernelCollection.h>
+#include <nuklei/Random.h>
+
+#include "check.h"
+
+namespace
+{
+  using namespace nuklei;
+
+  // More than the number of kernels above which evaluationAt() uses the
+  // kd-tree.
+  const int N = 3000;
+
+  kernel::se3 randomKernel()
+  {
+    kernel::se3 k;
+    k.loc_ = Vector3(Random::uniform(), Random::uniform(), Random::uniform());
+    k.ori_ = Random::uniformQuaternion();
+    k.setLocH(.05);
+    k.setOriH(.3);
+    k.setWeight(Random::uniform());
+    return k;
+  }
+
+  // Adds and replaces kernels. Replacements move some kernels far away, and
+  // some by a small amount.
+  void mutate(KernelCollection& kc, const int n)
+  {
+    for (int i = 0; i < n; ++i)
+    {
+      if (i % 3 == 0)
+        kc.add(randomKernel());
+      else
+      {
+        const size_t idx = Random::uniformInt(kc.size());
+        kernel::se3 k(static_cast<const kernel::se3&>(as_const(kc).at(idx)));
+        if (i % 3 == 1) k = randomKernel();
+        else k.loc_ += Vector3(.01, -.01, .02);
+        kc.replace(idx, k);
+      }
+    }
+  }
+
+  bool check(const std::string& name,
+             const KernelCollection& kc,
+             const KernelCollection& queries)
+  {
+    KernelCollection fresh;
+    fresh.assign(kc.begin(), kc.end());
+    fresh.computeKernelStatistics();
+    fresh.buildKdTree();
+
+    std::vector<weight_t> values, expected;
+    kc.evaluationAt(queries, values);
+    fresh.evaluationAt(queries, expected);
+
+    // Sets of neighbors are compared regardless of the order of equidistant
+    // kernels.
+    int nMismatches = 0;
+    std::vector<size_t> indices, expectedIndices;
+    std::vector<coord_t> d, expectedD;
+    for (KernelCollection::const_iterator q = queries.begin();
+         q != queries.end(); ++q)
+    {
+      kc.radiusSearch(q->getLoc(), .1, indices, d);
+      fresh.radiusSearch(q->getLoc(), .1, expectedIndices, expectedD);
+      std::sort(indices.begin(), indices.end());
+      std::sort(expectedIndices.begin(), expectedIndices.end());
+      if (indices != expectedIndices) nMismatches++;
+    }
+
+    using namespace nuklei_test;
+    bool ok = true;
+    ok = checkError(name + ", evaluationAt()",
+                    maxError(values, expected), 1e-9) && ok;
+    ok = checkCount(name + ", radiusSearch()", nMismatches,
+                    "mismatches") && ok;
+    ok = nuklei_test::check(name + ", statistics",
+                            std::fabs(kc.totalWeight()-fresh.totalWeight()) < 1e-9 &&
+                            kc.maxLocCutPoint() == fresh.maxLocCutPoint()) && ok;
+    return ok;
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  Random::seed(0);
+
+  KernelCollection kc, queries;
+  for (int i = 0; i < N; ++i)
+    kc.add(randomKernel());
+  for (int i = 0; i < 500; ++i)
+    queries.add(randomKernel());
+  kc.computeKernelStatistics();
+  kc.buildKdTree();
+
+  bool ok = true;
+
+  KernelCollection copy(kc);
+  mutate(kc, 1000);
+  ok = check("add/replace", kc, queries) && ok;
+
+  // The copy shares the kd-tree of kc as it was before kc was mutated.
+  ok = check("copy", copy, queries) && ok;
+  mutate(copy, 1000);
+  ok = check("copy, add/replace", copy, queries) && ok;
+  ok = check("add/replace, after the copy is mutated", kc, queries) && ok;
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,127 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+// This test compares knn() and radiusSearch() to a linear search, on a
+// collection and on the same collection after transformWith(), which keeps
+// the kd-tree in its original frame.
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#include <nuklei/KernelCollection.h>
+#include <nuklei/Random.h>
+
+#include "check.h"
+
+namespace
+{
+  using namespace nuklei;
+
+  const int N = 2000;
+  const size_t K = 12;
+  const coord_t R = .08;
+
+  Vector3 randomPoint()
+  {
+    return Vector3(Random::uniform(), Random::uniform(), Random::uniform());
+  }
+
+  // Returns the squared distances of all kernels to p, in increasing order.
+  std::vector<coord_t> sortedDistances(const KernelCollection& kc,
+                                       const Vector3& p)
+  {
+    std::vector<coord_t> d;
+    for (KernelCollection::const_iterator i = kc.begin(); i != kc.end(); ++i)
+      d.push_back((i->getLoc()-p).SquaredLength());
+    std::sort(d.begin(), d.end());
+    return d;
+  }
+
+  bool check(const std::string& name,
+             const KernelCollection& kc,
+             const std::vector<Vector3>& queries)
+  {
+    // Distances may differ from the linear search by rounding errors if the
+    // kd-tree lives in another frame.
+    const coord_t tol = 1e-9;
+    int nErrors = 0;
+    std::vector<size_t> indices, batchIndices, offsets;
+    std::vector<coord_t> d, batchD;
+    kc.knn(queries, K, batchIndices, batchD, parallelizer::SINGLE);
+    if (batchIndices.size() != queries.size()*K) nErrors++;
+    for (size_t q = 0; q < queries.size(); ++q)
+    {
+      const Vector3& p = queries.at(q);
+      const std::vector<coord_t> expected = sortedDistances(kc, p);
+
+      kc.knn(p, K, indices, d);
+      if (indices.size() != K || d.size() != K) { nErrors++; continue; }
+      for (size_t j = 0; j < K; ++j)
+      {
+        // Neighbors are sorted by increasing distance, the distances are
+        // those of the returned kernels, and they are the K smallest.
+        if (j > 0 && d.at(j) < d.at(j-1)) nErrors++;
+        if (std::fabs(d.at(j)-(kc.at(indices.at(j)).getLoc()-p).SquaredLength()) > tol)
+          nErrors++;
+        if (std::fabs(d.at(j)-expected.at(j)) > tol) nErrors++;
+        if (batchIndices.size() == queries.size()*K &&
+            batchIndices.at(q*K+j) != indices.at(j))
+          nErrors++;
+      }
+
+      kc.radiusSearch(p, R, indices, d);
+      const size_t nInRange =
+        std::lower_bound(expected.begin(), expected.end(), R*R) - expected.begin();
+      // Kernels at distance R up to rounding errors may be found or not.
+      const size_t nOnBoundary =
+        std::lower_bound(expected.begin(), expected.end(), R*R+tol) - expected.begin();
+      if (indices.size() < nInRange || indices.size() > nOnBoundary) nErrors++;
+      for (size_t j = 0; j < indices.size(); ++j)
+      {
+        if (j > 0 && d.at(j) < d.at(j-1)) nErrors++;
+        if ((kc.at(indices.at(j)).getLoc()-p).SquaredLength() > R*R+tol)
+          nErrors++;
+      }
+    }
+
+    // k larger than the collection
+    kc.knn(queries.front(), kc.size()+5, indices, d);
+    if (indices.size() != kc.size()) nErrors++;
+
+    return nuklei_test::checkCount(name, nErrors);
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  Random::seed(0);
+
+  KernelCollection kc;
+  for (int i = 0; i < N; ++i)
+  {
+    kernel::r3 k;
+    k.loc_ = randomPoint();
+    kc.add(k);
+  }
+  kc.buildKdTree();
+
+  std::vector<Vector3> queries;
+  for (int i = 0; i < 200; ++i)
+    queries.push_back(randomPoint());
+
+  bool ok = true;
+  ok = check("knn", kc, queries) && ok;
+
+  kernel::se3 t;
+  t.loc_ = Vector3(10, -3, 2);
+  t.ori_ = Random::uniformQuaternion();
+  kc.transformWith(t);
+  for (std::vector<Vector3>::iterator i = queries.begin(); i != queries.end(); ++i)
+    *i = la::transform(t.loc_, t.ori_, *i);
+  ok = check("knn, transformed", kc, queries) && ok;
+
+  return ok ? 0 : 1;
+}
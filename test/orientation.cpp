@@ -0,0 +1,163 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+// This test draws samples from the direct samplers of the von Mises-Fisher
+// kernels on S^2, S^2_+ and SO(3), and of the Watson kernel, for several
+// concentrations. It checks that the samples are centered on the mean, and
+// that the first two moments of their dot product with the mean match
+// those of the density of the kernel, integrated numerically.
+
+#include <cmath>
+#include <vector>
+#include <iostream>
+#include <sstream>
+
+#include <nuklei/GenericKernel.h>
+#include <nuklei/Random.h>
+
+#include "check.h"
+
+namespace
+{
+  using namespace nuklei;
+
+  const int N_SAMPLES = 20000;
+  const coord_t CONCENTRATIONS[] = { .5, 2, 10, 100, 1000 };
+
+  typedef von_mises_fisher_kernel<groupS::s2, value_scaleS::max1,
+    func_implS::exact, h_scaleS::intrinsic> vmf_s2;
+  typedef von_mises_fisher_kernel<groupS::s2p, value_scaleS::max1,
+    func_implS::exact, h_scaleS::intrinsic> vmf_s2p;
+  typedef von_mises_fisher_kernel<groupS::so3, value_scaleS::max1,
+    func_implS::exact, h_scaleS::intrinsic> vmf_so3;
+  typedef watson_kernel<value_scaleS::max1, func_implS::exact> watson;
+
+  // Density of the dot product w between the mean and a sample, up to a
+  // constant, over [lower, 1]. For S^2_+ and SO(3), w is the absolute
+  // value of the dot product.
+  struct Marginal
+  {
+    virtual ~Marginal() {}
+    virtual coord_t lower() const = 0;
+    virtual coord_t density(const coord_t w, const coord_t h) const = 0;
+  };
+
+  // exp(h (w-1)) on S^2, and on S^2_+ for w >= 0
+  struct VMFS2 : Marginal
+  {
+    VMFS2(const coord_t lower) : lower_(lower) {}
+    coord_t lower() const { return lower_; }
+    coord_t density(const coord_t w, const coord_t h) const
+    { return std::exp(h*(w-1)); }
+    coord_t lower_;
+  };
+
+  // exp(h (w-1)) sqrt(1-w^2) on S^3, for w >= 0
+  struct VMFS3 : Marginal
+  {
+    coord_t lower() const { return 0; }
+    coord_t density(const coord_t w, const coord_t h) const
+    { return std::exp(h*(w-1)) * std::sqrt(1-w*w); }
+  };
+
+  // exp(h (w^2-1)) sqrt(1-w^2) on S^3, for w >= 0
+  struct Watson : Marginal
+  {
+    coord_t lower() const { return 0; }
+    coord_t density(const coord_t w, const coord_t h) const
+    { return std::exp(h*(w*w-1)) * std::sqrt(1-w*w); }
+  };
+
+  // Returns the first two moments of w, by the midpoint rule.
+  void moments(const Marginal& m, const coord_t h,
+               coord_t& m1, coord_t& m2)
+  {
+    const int n = 200000;
+    const coord_t step = (1 - m.lower()) / n;
+    coord_t z = 0;
+    m1 = m2 = 0;
+    for (int i = 0; i < n; ++i)
+    {
+      const coord_t w = m.lower() + (i+.5)*step;
+      const coord_t d = m.density(w, h);
+      z += d;
+      m1 += w*d;
+      m2 += w*w*d;
+    }
+    m1 /= z;
+    m2 /= z;
+  }
+
+  coord_t dot(const Vector3& a, const Vector3& b) { return a.Dot(b); }
+  coord_t dot(const Quaternion& a, const Quaternion& b) { return a.Dot(b); }
+
+  // Samples whose dot product with the mean is negative are flipped on
+  // groups where x and -x are the same element. Their mean is then
+  // compared to the mean of the kernel: the error of its component
+  // orthogonal to the mean is about sqrt((1-E[w^2])/n).
+  template<class Kernel, class Element>
+  bool checkSampler(const std::string& name, const Marginal& m,
+                    const bool symmetric, const Element& mean)
+  {
+    bool ok = true;
+    for (size_t c = 0; c < sizeof(CONCENTRATIONS)/sizeof(coord_t); ++c)
+    {
+      const coord_t h = CONCENTRATIONS[c];
+      coord_t m1, m2;
+      moments(m, h, m1, m2);
+
+      coord_t s1 = 0, s2 = 0;
+      Element sum = mean * 0.;
+      int nErrors = 0;
+      for (int i = 0; i < N_SAMPLES; ++i)
+      {
+        const Element s = sampler<Kernel>::s(mean, h);
+        if (std::fabs(s.Length()-1) > 1e-9) nErrors++;
+        coord_t w = dot(mean, s);
+        if (symmetric && w < 0)
+        {
+          w = -w;
+          sum = sum - s;
+        }
+        else
+          sum = sum + s;
+        s1 += w;
+        s2 += w*w;
+      }
+      s1 /= N_SAMPLES;
+      s2 /= N_SAMPLES;
+      sum = sum / N_SAMPLES;
+      const Element orthogonal = sum - mean * dot(mean, sum);
+
+      // Five standard errors
+      const coord_t sd1 = std::sqrt((m2 - m1*m1) / N_SAMPLES);
+      const coord_t sdOrthogonal = std::sqrt((1 - m2) / N_SAMPLES);
+      if (std::fabs(s1 - m1) > 5*sd1 + 1e-12) nErrors++;
+      // The variance of w^2 is at most that of 2w, as w is in [-1, 1].
+      if (std::fabs(s2 - m2) > 10*sd1 + 1e-12) nErrors++;
+      if (orthogonal.Length() > 5*sdOrthogonal + 1e-12) nErrors++;
+
+      std::ostringstream line;
+      line << name << ", h = " << h << ", E[w] = " << s1 << " (expected "
+      << m1 << ")";
+      ok = nuklei_test::checkCount(line.str(), nErrors) && ok;
+    }
+    return ok;
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  Random::seed(0);
+
+  bool ok = true;
+  const Vector3 direction = Random::uniformDirection3d();
+  const Quaternion rotation = Random::uniformQuaternion();
+  ok = checkSampler<vmf_s2>("vMF S^2", VMFS2(-1), false, direction) && ok;
+  ok = checkSampler<vmf_s2p>("vMF S^2_+", VMFS2(0), true, direction) && ok;
+  ok = checkSampler<vmf_so3>("vMF SO(3)", VMFS3(), true, rotation) && ok;
+  ok = checkSampler<watson>("Watson", Watson(), true, rotation) && ok;
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,176 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+// This test writes the partial view cache of a cube to a file, reads it
+// back into another collection, and compares the views. It then checks that
+// files written with other parameters, truncated files and files with a bad
+// header are rejected, and leave the collection unchanged.
+//
+// It requires the partial view build of Nuklei.
+
+#include <vector>
+#include <fstream>
+#include <iostream>
+
+#include <boost/filesystem.hpp>
+
+#include <nuklei/KernelCollection.h>
+
+#include "check.h"
+
+namespace
+{
+  using namespace nuklei;
+
+  const double MESH_TOL = 1e-3;
+  const double ANGULAR_RESOLUTION = .5;
+
+  // Writes a cube of half-width 1 centered at the origin, with outward
+  // facing triangles.
+  void writeCube(const std::string& filename)
+  {
+    std::ofstream off(filename.c_str());
+    off << "OFF\n8 12 0\n";
+    for (int i = 0; i < 8; ++i)
+      off << (i&1 ? 1 : -1) << " " << (i&2 ? 1 : -1) << " "
+      << (i&4 ? 1 : -1) << "\n";
+    const int faces[12][3] = {
+      {0,2,3}, {0,3,1}, {4,5,7}, {4,7,6}, {0,1,5}, {0,5,4},
+      {2,6,7}, {2,7,3}, {0,4,6}, {0,6,2}, {1,3,7}, {1,7,5}
+    };
+    for (int i = 0; i < 12; ++i)
+      off << "3 " << faces[i][0] << " " << faces[i][1] << " "
+      << faces[i][2] << "\n";
+  }
+
+  // Points on a grid on each face of the cube.
+  void cubePoints(KernelCollection& kc)
+  {
+    const int n = 6;
+    for (int axis = 0; axis < 3; ++axis)
+      for (int side = -1; side <= 1; side += 2)
+        for (int i = 0; i < n; ++i)
+          for (int j = 0; j < n; ++j)
+          {
+            coord_t c[3];
+            c[axis] = side;
+            c[(axis+1)%3] = -1 + (2*i+1.)/n;
+            c[(axis+2)%3] = -1 + (2*j+1.)/n;
+            kernel::r3 k;
+            k.loc_ = Vector3(c[0], c[1], c[2]);
+            kc.add(k);
+          }
+  }
+
+  bool hasCache(const KernelCollection& kc)
+  {
+    try
+    {
+      kc.cachedPartialView(Vector3::UNIT_X);
+      return true;
+    }
+    catch (Error&)
+    {
+      return false;
+    }
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  namespace fs = boost::filesystem;
+  using nuklei_test::check;
+  const fs::path dir = fs::temp_directory_path() /
+    fs::unique_path("nuklei-viewcache-%%%%-%%%%");
+  fs::create_directories(dir);
+  const std::string meshfile = (dir / "cube.off").string();
+  const std::string cachefile = (dir / "cube.cache").string();
+  writeCube(meshfile);
+
+  KernelCollection kc;
+  cubePoints(kc);
+  kc.readMeshFromOffFile(meshfile);
+  kc.buildPartialViewCache(MESH_TOL, false, ANGULAR_RESOLUTION,
+                           parallelizer::SINGLE);
+  kc.writePartialViewCache(cachefile);
+
+  bool ok = true;
+
+  // Round trip
+  {
+    KernelCollection read;
+    cubePoints(read);
+    ok = check("read", read.readPartialViewCache(cachefile, MESH_TOL, false,
+                                                 ANGULAR_RESOLUTION,
+                                                 meshfile)) && ok;
+    int nDifferent = 0;
+    const Vector3 directions[] = {
+      Vector3::UNIT_X, -Vector3::UNIT_Y, Vector3(1, 1, 1),
+      Vector3(-1, 2, -3), Vector3(.3, -.2, 1)
+    };
+    for (size_t i = 0; i < sizeof(directions)/sizeof(Vector3); ++i)
+    {
+      const Vector3 d = la::normalized(directions[i]);
+      if (kc.cachedPartialView(d) != read.cachedPartialView(d))
+        nDifferent++;
+    }
+    ok = check("round trip", hasCache(read) && nDifferent == 0) && ok;
+  }
+
+  // Files written with other parameters, or from other kernels, are
+  // misses.
+  {
+    KernelCollection read;
+    cubePoints(read);
+    ok = check("other tolerance",
+               !read.readPartialViewCache(cachefile, 2*MESH_TOL, false,
+                                          ANGULAR_RESOLUTION, meshfile) &&
+               !hasCache(read)) && ok;
+    ok = check("other resolution",
+               !read.readPartialViewCache(cachefile, MESH_TOL, false,
+                                          ANGULAR_RESOLUTION/2, meshfile) &&
+               !hasCache(read)) && ok;
+    read.add(kernel::r3());
+    ok = check("other kernels",
+               !read.readPartialViewCache(cachefile, MESH_TOL, false,
+                                          ANGULAR_RESOLUTION, meshfile) &&
+               !hasCache(read)) && ok;
+  }
+
+  // Corrupt files are rejected without throwing.
+  {
+    const std::string corrupt = (dir / "corrupt.cache").string();
+    const boost::uintmax_t size = fs::file_size(cachefile);
+
+    fs::copy_file(cachefile, corrupt);
+    fs::resize_file(corrupt, size/2);
+    KernelCollection read;
+    cubePoints(read);
+    ok = check("truncated file",
+               !read.readPartialViewCache(corrupt, MESH_TOL, false,
+                                          ANGULAR_RESOLUTION, meshfile) &&
+               !hasCache(read)) && ok;
+
+    fs::remove(corrupt);
+    fs::copy_file(cachefile, corrupt);
+    {
+      std::fstream f(corrupt.c_str(),
+                     std::ios::in | std::ios::out | std::ios::binary);
+      f.write("garbage", 7);
+    }
+    ok = check("bad header",
+               !read.readPartialViewCache(corrupt, MESH_TOL, false,
+                                          ANGULAR_RESOLUTION, meshfile) &&
+               !hasCache(read)) && ok;
+
+    ok = check("missing file",
+               !read.readPartialViewCache((dir / "none.cache").string(),
+                                          MESH_TOL, false,
+                                          ANGULAR_RESOLUTION, meshfile)) && ok;
+  }
+
+  fs::remove_all(dir);
+
+  return ok ? 0 : 1;
+}
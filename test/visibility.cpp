@@ -0,0 +1,310 @@
+// (C) Copyright Renaud Detry   2007-2015.
+// Distributed under the GNU General Public License and under the
+// BSD 3-Clause License (See accompanying file LICENSE.txt).
+
+// This test compares the visibility computed by the ray casting engine of
+// partial views, which traverses a bounding volume hierarchy and tests
+// blocks of triangles with SIMD instructions, to a linear search of the
+// triangles that intersect the segment from the camera to each target. It
+// then checks that the depth buffer and ray casting agree on the partial
+// views of a cube, seen from each side.
+//
+// simdLevel() is fixed for the life of a process. Without arguments, this
+// program runs itself once for each value of NUKLEI_SIMD.
+//
+// It requires the partial view build of Nuklei.
+
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+#include <boost/filesystem.hpp>
+
+#include <nuklei/KernelCollection.h>
+#include <nuklei/Random.h>
+#include <nuklei/SimdMath.h>
+
+#include "KernelCollectionVisibility.h"
+#include "check.h"
+
+namespace
+{
+  using namespace nuklei;
+  using namespace nuklei::visibility_types;
+
+  const int N_TRIANGLES = 500;
+  const coord_t TOLERANCE = .05;
+
+  // Segments that pass within EPSILON of an edge of a triangle, or that end
+  // within EPSILON of a triangle, may or may not intersect it.
+  const coord_t EPSILON = 1e-7;
+
+  struct Mesh
+  {
+    std::vector<coord_t> vertices;
+    std::vector<boost::uint32_t> triangles;
+
+    Vector3 vertex(const size_t t, const int k) const
+    {
+      const size_t v = triangles.at(3*t+k);
+      return Vector3(vertices.at(3*v), vertices.at(3*v+1), vertices.at(3*v+2));
+    }
+  };
+
+  Vector3 randomPoint(const coord_t a, const coord_t b)
+  {
+    return Vector3(Random::uniform(a, b), Random::uniform(a, b),
+                   Random::uniform(a, b));
+  }
+
+  // Small triangles scattered in a cube.
+  Mesh randomMesh()
+  {
+    Mesh m;
+    for (int t = 0; t < N_TRIANGLES; ++t)
+    {
+      const Vector3 c = randomPoint(-1, 1);
+      for (int k = 0; k < 3; ++k)
+      {
+        const Vector3 v = c + randomPoint(-.3, .3);
+        for (int j = 0; j < 3; ++j) m.vertices.push_back(v[j]);
+        m.triangles.push_back(3*t+k);
+      }
+    }
+    return m;
+  }
+
+  // Moller-Trumbore intersection of the segment from camera to target with
+  // all triangles, excluding intersections within TOLERANCE of the target.
+  // Returns 1 if the segment is occluded, 0 if it is not, and -1 if the
+  // answer is ambiguous.
+  int bruteForceOccluded(const Mesh& m, const Vector3& camera,
+                         const Vector3& target)
+  {
+    const coord_t length = (target-camera).Length();
+    const Vector3 d = (target-camera) / length;
+    const coord_t tmax = length - TOLERANCE;
+    bool ambiguous = false;
+    for (size_t t = 0; t < m.triangles.size()/3; ++t)
+    {
+      const Vector3 v0 = m.vertex(t, 0);
+      const Vector3 e1 = m.vertex(t, 1) - v0;
+      const Vector3 e2 = m.vertex(t, 2) - v0;
+      const Vector3 p = d.Cross(e2);
+      const coord_t det = e1.Dot(p);
+      if (std::fabs(det) < EPSILON) continue;
+      const Vector3 s = camera - v0;
+      const coord_t u = s.Dot(p) / det;
+      const Vector3 q = s.Cross(e1);
+      const coord_t v = d.Dot(q) / det;
+      const coord_t h = e2.Dot(q) / det;
+      const coord_t margin = std::min(std::min(u, v), std::min(1-u-v,
+                                      std::min(h, tmax-h)));
+      if (std::fabs(margin) < EPSILON) ambiguous = true;
+      else if (margin > 0) return 1;
+    }
+    return ambiguous ? -1 : 0;
+  }
+
+  // A cube of half-width 1 centered at the origin, with outward facing
+  // triangles.
+  Mesh cube()
+  {
+    Mesh m;
+    for (int i = 0; i < 8; ++i)
+    {
+      m.vertices.push_back(i&1 ? 1 : -1);
+      m.vertices.push_back(i&2 ? 1 : -1);
+      m.vertices.push_back(i&4 ? 1 : -1);
+    }
+    const int faces[12][3] = {
+      {0,2,3}, {0,3,1}, {4,5,7}, {4,7,6}, {0,1,5}, {0,5,4},
+      {2,6,7}, {2,7,3}, {0,4,6}, {0,6,2}, {1,3,7}, {1,7,5}
+    };
+    for (int i = 0; i < 12; ++i)
+      for (int k = 0; k < 3; ++k)
+        m.triangles.push_back(faces[i][k]);
+    return m;
+  }
+
+  void writeOff(const Mesh& m, const std::string& filename)
+  {
+    std::ofstream off(filename.c_str());
+    off << "OFF\n" << m.vertices.size()/3 << " " << m.triangles.size()/3
+    << " 0\n";
+    for (size_t i = 0; i < m.vertices.size(); i += 3)
+      off << m.vertices.at(i) << " " << m.vertices.at(i+1) << " "
+      << m.vertices.at(i+2) << "\n";
+    for (size_t i = 0; i < m.triangles.size(); i += 3)
+      off << "3 " << m.triangles.at(i) << " " << m.triangles.at(i+1) << " "
+      << m.triangles.at(i+2) << "\n";
+  }
+
+  // Points on a grid on each face of the cube, away from the edges, and
+  // the outward normals of the faces.
+  void cubePoints(std::vector<Vector3>& points, std::vector<Vector3>& normals)
+  {
+    const int n = 8;
+    for (int axis = 0; axis < 3; ++axis)
+      for (int side = -1; side <= 1; side += 2)
+        for (int i = 0; i < n; ++i)
+          for (int j = 0; j < n; ++j)
+          {
+            Vector3 p, normal = Vector3::ZERO;
+            p[axis] = side;
+            p[(axis+1)%3] = -1 + (2*i+1.)/n;
+            p[(axis+2)%3] = -1 + (2*j+1.)/n;
+            normal[axis] = side;
+            points.push_back(p);
+            normals.push_back(normal);
+          }
+  }
+
+  // Viewpoints on each side of the cube, slightly off the axes so that
+  // the other faces are not seen edge-on.
+  std::vector<Vector3> cubeViewpoints()
+  {
+    std::vector<Vector3> viewpoints;
+    for (int axis = 0; axis < 3; ++axis)
+      for (int side = -1; side <= 1; side += 2)
+      {
+        Vector3 v(.3, -.2, .1);
+        v[axis] = 4*side;
+        viewpoints.push_back(v);
+      }
+    return viewpoints;
+  }
+
+  bool checkCube()
+  {
+    namespace fs = boost::filesystem;
+    const Mesh m = cube();
+    const VisibilityEngine engine(m.vertices, m.triangles);
+    std::vector<Vector3> points, normals;
+    cubePoints(points, normals);
+    const std::vector<Vector3> viewpoints = cubeViewpoints();
+
+    const fs::path dir = fs::temp_directory_path() /
+      fs::unique_path("nuklei-visibility-%%%%-%%%%");
+    fs::create_directories(dir);
+    const std::string meshfile = (dir / "cube.off").string();
+    writeOff(m, meshfile);
+    KernelCollection kc;
+    for (size_t i = 0; i < points.size(); ++i)
+    {
+      kernel::r3 k;
+      k.loc_ = points.at(i);
+      kc.add(k);
+    }
+    kc.readMeshFromOffFile(meshfile);
+    fs::remove_all(dir);
+
+    bool ok = true;
+    for (size_t v = 0; v < viewpoints.size(); ++v)
+    {
+      const Vector3& camera = viewpoints.at(v);
+      int nErrors = 0;
+      for (int useNormals = 0; useNormals < 2; ++useNormals)
+      {
+        const std::vector<Vector3>* n = useNormals ? &normals : NULL;
+        std::vector<char> ray, zbuffer;
+        engine.isVisible(points, n, camera, TOLERANCE, ray);
+        engine.isVisibleDepthBuffer(points, n, camera, TOLERANCE, 64, zbuffer);
+        if (ray != zbuffer) nErrors++;
+        // Exactly one face is visible.
+        if (std::count(ray.begin(), ray.end(), 1) != int(points.size()/6))
+          nErrors++;
+      }
+
+      const std::vector<int> rayView =
+        kc.partialView(camera, TOLERANCE, false, false, parallelizer::SINGLE,
+                       KernelCollection::RAYCAST_VISIBILITY);
+      const std::vector<int> zbufferView =
+        kc.partialView(camera, TOLERANCE, false, false, parallelizer::OPENMP,
+                       KernelCollection::ZBUFFER_VISIBILITY, 64);
+      if (rayView != zbufferView || rayView.size() != points.size()/6)
+        nErrors++;
+
+      ok = nuklei_test::checkCount("cube, viewpoint " +
+                                   std::string(1, char('0'+v)),
+                                   nErrors) && ok;
+    }
+    return ok;
+  }
+
+  bool checkLevel()
+  {
+    const char* levelNames[] = { "none", "sse2", "avx2", "avx512" };
+    std::cout << "SIMD level: " << levelNames[simdLevel()] << std::endl;
+    Random::seed(0);
+
+    const Mesh m = randomMesh();
+    const VisibilityEngine engine(m.vertices, m.triangles);
+
+    // Half of the targets lie on the triangles, as the points of a partial
+    // view do.
+    std::vector<Vector3> targets;
+    for (int i = 0; i < 1000; ++i)
+    {
+      const size_t t = Random::uniformInt(N_TRIANGLES);
+      coord_t a = Random::uniform(), b = Random::uniform();
+      if (a + b > 1) { a = 1-a; b = 1-b; }
+      const Vector3 v0 = m.vertex(t, 0);
+      targets.push_back(v0 + a*(m.vertex(t, 1)-v0) + b*(m.vertex(t, 2)-v0));
+      targets.push_back(randomPoint(-1.3, 1.3));
+    }
+
+    bool ok = true;
+    for (int c = 0; c < 6; ++c)
+    {
+      const Vector3 camera = Random::uniformDirection3d() * 4.;
+      std::vector<char> visible, parallelVisible;
+      engine.isVisible(targets, NULL, camera, TOLERANCE, visible,
+                       parallelizer::SINGLE);
+      engine.isVisible(targets, NULL, camera, TOLERANCE, parallelVisible,
+                       parallelizer::OPENMP);
+      int nErrors = 0, nAmbiguous = 0, nOccluded = 0;
+      for (size_t i = 0; i < targets.size(); ++i)
+      {
+        const int expected = bruteForceOccluded(m, camera, targets.at(i));
+        if (expected < 0) { nAmbiguous++; continue; }
+        nOccluded += expected;
+        if (engine.occluded(camera, targets.at(i), TOLERANCE) != bool(expected))
+          nErrors++;
+        if (bool(visible.at(i)) == bool(expected)) nErrors++;
+        if (parallelVisible.at(i) != visible.at(i)) nErrors++;
+      }
+      // Both outcomes are tested, and few segments graze a triangle.
+      if (nOccluded == 0 || nOccluded == int(targets.size()) - nAmbiguous ||
+          nAmbiguous > int(targets.size()) / 100)
+        nErrors++;
+      ok = nuklei_test::checkCount("camera " + std::string(1, char('0'+c)),
+                                   nErrors) && ok;
+    }
+    return ok;
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  if (argc > 1 && std::string(argv[1]) == "--current-level")
+    return checkLevel() ? 0 : 1;
+
+  // Levels the processor does not support run at the highest supported
+  // level.
+  const char* levels[] = { "none", "sse2", "avx2", "avx512" };
+  bool ok = checkCube();
+  for (int l = 0; l < 4; ++l)
+  {
+    setenv("NUKLEI_SIMD", levels[l], 1);
+    const std::string command =
+      "'" + std::string(argv[0]) + "' --current-level";
+    ok = nuklei_test::check(std::string("NUKLEI_SIMD=") + levels[l],
+                            std::system(command.c_str()) == 0) && ok;
+  }
+  return ok ? 0 : 1;
+}
@@ -125,14 +125,11 @@ void convert(const std::vector<std::string>& files,
     if (removePlane || !fittedPlaneFile.empty())
     {
       KernelCollection kc;
+      kc.reserve(observations.size());
       for (std::vector< boost::shared_ptr<Observation> >::const_iterator
            i = observations.begin();
            i != observations.end(); ++i)
-      {
-        kernel::r3 r3k;
-        r3k.loc_ = (*i)->getKernel()->getLoc();
-        kc.add(r3k);
-      }
+        kc.emplace<kernel::r3>().loc_ = (*i)->getKernel()->getLoc();
       kernel::se3 k = kc.ransacPlaneFit(inlierThreshold, ransacIter);
       Plane3 plane(la::matrixCopy(k.ori_).GetColumn(2), k.loc_);
       
@@ -180,6 +177,7 @@ void convert(const std::vector<std::string>& files,
     if (removeNormals)
     {
       KernelCollection kc1;
+      kc1.reserve(observations.size());
       for (std::vector< boost::shared_ptr<Observation> >::const_iterator
            i = observations.begin();
            i != observations.end(); ++i)
@@ -214,13 +212,14 @@ void convert(const std::vector<std::string>& files,
                      nameFromType<Observation>(Observation::PCD) << ".");
     
       KernelCollection kc1;
+      kc1.reserve(observations.size());
       
       for (std::vector< boost::shared_ptr<Observation> >::const_iterator
            i = observations.begin();
            i != observations.end(); ++i)
-        kc1.add(*(*i)->getKernel());
+        kc1.add((*i)->getKernel());
       
-      kc1.buildNeighborSearchTree();
+      kc1.buildKdTree();
       kc1.computeSurfaceNormals();
       
       observations.clear();
@@ -262,11 +261,12 @@ void convert(const std::vector<std::string>& files,
     if (normalizePose || !normalizingTransfoFile.empty())
     {
       KernelCollection kc1;
+      kc1.reserve(observations.size());
       
       for (std::vector< boost::shared_ptr<Observation> >::const_iterator
            i = observations.begin();
            i != observations.end(); ++i)
-        kc1.add(*(*i)->getKernel());
+        kc1.add((*i)->getKernel());
       
       kc1.uniformizeWeights();
       kernel::se3 p = kc1.linearLeastSquarePlaneFit();
@@ -297,11 +297,12 @@ void convert(const std::vector<std::string>& files,
     if (normalizeScale || !normalizingScaleFile.empty())
     {
       KernelCollection kc1;
+      kc1.reserve(observations.size());
       
       for (std::vector< boost::shared_ptr<Observation> >::const_iterator
            i = observations.begin();
            i != observations.end(); ++i)
-        kc1.add(*(*i)->getKernel());
+        kc1.add((*i)->getKernel());
       
       kc1.uniformizeWeights();
       coord_t stdev = kc1.moments()->getLocH();
@@ -328,11 +329,12 @@ void convert(const std::vector<std::string>& files,
       
       {
         KernelCollection kc1;
+        kc1.reserve(observations.size());
 
         for (std::vector< boost::shared_ptr<Observation> >::const_iterator
              i = observations.begin();
              i != observations.end(); ++i)
-          kc1.add(*(*i)->getKernel());
+          kc1.add((*i)->getKernel());
         
         kc1.uniformizeWeights();
         coord_t stdev = kc1.moments()->getLocH();
@@ -11,10 +11,13 @@
 
 #include <tclap/CmdLine.h>
 #include <nuklei/KernelCollection.h>
+#include <nuklei/CompactKernelCollection.h>
 #include <nuklei/SerializedKernelObservationIO.h>
 #include <nuklei/ObservationIO.h>
 #include <nuklei/ProgressIndicator.h>
 #include <nuklei/Stopwatch.h>
+#include <nuklei/parallelizer.h>
+#include <nuklei/Types.h>
 
 using namespace nuklei;
 
@@ -272,14 +275,14 @@ int importance_sampling(int argc, char ** argv)
   importanceDistribution.computeKernelStatistics();
   importanceDistribution.buildKdTree();
 
-  Plotter p;
-  for (KernelCollection::iterator i = weightedSamples.begin();
-       i != weightedSamples.end(); ++i)
+  // Queries are converted to the domain of the importance distribution, then
+  // evaluated in a single parallel batch.
+  KernelCollection queries;
+  for (KernelCollection::const_iterator i = as_const(weightedSamples).begin();
+       i != as_const(weightedSamples).end(); ++i)
   {
-    coord_t iv = 0;
-    
     if (importanceDistribution.kernelType() == i->polyType())
-      iv = as_const(importanceDistribution).evaluationAt(*i, KernelCollection::WEIGHTED_SUM_EVAL);
+      queries.add(*i);
     else if (importanceDistribution.kernelType() == kernel::base::R3XS2P &&
              i->polyType() == kernel::base::SE3)
     {
@@ -287,9 +290,21 @@ int importance_sampling(int argc, char ** argv)
       kernel::r3xs2p r3xs2pk;
       r3xs2pk.loc_ = se3k.getLoc();
       r3xs2pk.dir_ = la::normalized(la::matrixCopy(se3k.ori_).GetColumn(2));
-      iv = as_const(importanceDistribution).evaluationAt(r3xs2pk, KernelCollection::WEIGHTED_SUM_EVAL);
+      queries.add(r3xs2pk);
     }
     else NUKLEI_THROW("Unsupported proposal type.");
+  }
+  
+  std::vector<weight_t> values;
+  as_const(importanceDistribution).evaluationAt(queries, values,
+                                                KernelCollection::WEIGHTED_SUM_EVAL,
+                                                typeFromName<parallelizer>(PARALLELIZATION));
+  
+  Plotter p;
+  for (KernelCollection::const_iterator i = as_const(weightedSamples).begin();
+       i != as_const(weightedSamples).end(); ++i)
+  {
+    coord_t iv = values.at(std::distance(as_const(weightedSamples).begin(), i));
     
     coord_t w = iv + uniformComponentPowerArg.getValue()/as_const(importanceDistribution).size();
     
@@ -340,6 +355,10 @@ int evaluate(int argc, char ** argv)
   ("p", "points",
    "Points at which the density is to be evaluated.",
    true, "", "filename", cmd);
+  
+  TCLAP::SwitchArg floatArg
+  ("", "float",
+   "Evaluate the density from a single-precision copy.", cmd);
     
 //  TCLAP::UnlabeledValueArg<std::string> outFileArg
 //  ("output",
@@ -364,15 +383,29 @@ int evaluate(int argc, char ** argv)
   
   density.normalizeWeights();
   density.computeKernelStatistics();
-  density.buildKdTree();
   
-  for (KernelCollection::iterator i = points.begin();
-       i != points.end(); ++i)
+  std::vector<weight_t> values;
+  if (floatArg.getValue())
+  {
+    CompactKernelCollection compactDensity(density);
+    compactDensity.buildKdTree();
+    compactDensity.evaluationAt(points, values,
+                                KernelCollection::WEIGHTED_SUM_EVAL,
+                                typeFromName<parallelizer>(PARALLELIZATION));
+  }
+  else
   {
-    coord_t iv = as_const(density).evaluationAt(*i, KernelCollection::WEIGHTED_SUM_EVAL);
-    std::cout << iv << std::endl;
+    density.buildKdTree();
+    as_const(density).evaluationAt(points, values,
+                                   KernelCollection::WEIGHTED_SUM_EVAL,
+                                   typeFromName<parallelizer>(PARALLELIZATION));
   }
   
+  for (std::vector<weight_t>::const_iterator i = values.begin();
+       i != values.end(); ++i)
+    std::cout << *i << "\n";
+  std::cout << std::flush;
+  
 //  KernelWriter writer(outFileArg.getValue());
 //  writer.init();
 //  writeObservations(writer, empiricalDensity);
@@ -5,6 +5,8 @@
 /** @file */
 
 #include <string>
+#include <algorithm>
+#include <iterator>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <boost/tuple/tuple.hpp>
@@ -15,6 +17,7 @@
 #include <nuklei/SerializedKernelObservationIO.h>
 #include <nuklei/Serial.h>
 #include <nuklei/nullable.h>
+#include <nuklei/Stopwatch.h>
 
 using namespace nuklei;
 
@@ -71,6 +74,19 @@ int partial_view(int argc, char ** argv)
   ("n", "use_normals",
    "Use surface normals in computing visibility.", cmd);
 
+  TCLAP::ValueArg<int> zbufferArg
+  ("z", "zbuffer",
+   "Compute visibility by rendering the mesh into a depth buffer of the "
+   "given resolution, instead of casting a ray towards each point. 0 selects "
+   "ray casting.",
+   false, 0, "int", cmd);
+
+  TCLAP::SwitchArg benchmarkArg
+  ("", "benchmark",
+   "Time ray casting and depth buffer visibility (at the resolution given "
+   "by --zbuffer, or 512), and report the number of points on which they "
+   "disagree.", cmd);
+
   cmd.parse( argc, argv );
   
   NUKLEI_ASSERT(setpriority(PRIO_PROCESS, 0, niceArg.getValue()) == 0);
@@ -79,7 +95,7 @@ int partial_view(int argc, char ** argv)
   readObservations(inFileArg.getValue(), kc);
   if (normalsArg.getValue())
   {
-    kc.buildNeighborSearchTree();
+    kc.buildKdTree();
     kc.computeSurfaceNormals();
   }
   
@@ -92,17 +108,56 @@ int partial_view(int argc, char ** argv)
 
   double tol = tolArg.getValue();
   NUKLEI_ASSERT(tol >= 0);
+  NUKLEI_ASSERT(zbufferArg.getValue() >= 0);
+  
+  KernelCollection::VisibilityMethod method = KernelCollection::RAYCAST_VISIBILITY;
+  int resolution = zbufferArg.getValue();
+  if (resolution > 0)
+    method = KernelCollection::ZBUFFER_VISIBILITY;
+  
+  if (benchmarkArg.getValue())
+  {
+    if (resolution == 0) resolution = 512;
+    const int nRuns = 5;
+    std::vector<int> raycast, zbuffer;
+    Stopwatch sw("");
+    for (int r = 0; r < nRuns; ++r)
+      raycast = kc.partialView(viewpoint, tol, false, normalsArg.getValue(),
+                               parallelizer::SINGLE,
+                               KernelCollection::RAYCAST_VISIBILITY);
+    sw.lap("ray casting, " + stringify(nRuns) + " runs");
+    for (int r = 0; r < nRuns; ++r)
+      zbuffer = kc.partialView(viewpoint, tol, false, normalsArg.getValue(),
+                               parallelizer::SINGLE,
+                               KernelCollection::ZBUFFER_VISIBILITY, resolution);
+    sw.lap("depth buffer " + stringify(resolution) + "x" +
+           stringify(resolution) + ", " + stringify(nRuns) + " runs");
+    std::vector<int> difference;
+    std::set_symmetric_difference(raycast.begin(), raycast.end(),
+                                  zbuffer.begin(), zbuffer.end(),
+                                  std::back_inserter(difference));
+    std::cout << kc.size() << " points, " << raycast.size() <<
+      " visible by ray casting, " << zbuffer.size() <<
+      " visible by depth buffer, " << difference.size() <<
+      " differ." << std::endl;
+  }
+  
+  std::vector<char> visible(kc.size(), false);
+  {
+    std::vector<int> indices = kc.partialView(viewpoint, tol, false,
+                                              normalsArg.getValue(),
+                                              parallelizer::SINGLE,
+                                              method, resolution);
+    for (std::vector<int>::const_iterator i = indices.begin();
+         i != indices.end(); ++i)
+      visible.at(*i) = true;
+  }
   
   KernelCollection view;
   for (KernelCollection::const_iterator i = as_const(kc).begin();
        i != as_const(kc).end(); ++i)
   {
-    bool visible = false;
-    if (normalsArg.getValue())
-      visible = kc.isVisibleFrom(kernel::r3xs2p(*i), viewpoint, tol);
-    else
-      visible = kc.isVisibleFrom(i->getLoc(), viewpoint, tol);
-    if (visible)
+    if (visible.at(std::distance(as_const(kc).begin(), i)))
     {
       view.add(*i);
       if (colorizeArg.getValue())
@@ -75,6 +75,17 @@ int pe(int argc, char ** argv)
      "By default, only 10000 points of the scene point cloud are used, "
      "for speed. If --slow is specified, all input points are used.", cmd);
     
+    SwitchArg floatArg
+    ("", "float",
+     "Evaluate the scene model from a single-precision copy, which uses "
+     "less memory and is faster on large scenes.", cmd);
+    
+    ValueArg<int> blockSizeArg
+    ("", "block_size",
+     "Number of model points evaluated together in each MCMC step. "
+     "Poses are rejected early only between blocks.",
+     false, 16, "int", cmd);
+    
     SwitchArg timeArg
     ("", "time",
      "Print computation time.", cmd);
@@ -93,6 +104,12 @@ int pe(int argc, char ** argv)
      "Sets the distance to the mesh at which a point is considered to be visible.",
      false, 4., "float", cmd);
     
+    ValueArg<int> zbufferArg
+    ("", "zbuffer_visibility",
+     "Computes partial views by rendering the object mesh into a depth buffer "
+     "of the given resolution, instead of ray casting. 0 selects ray casting.",
+     false, 0, "int", cmd);
+    
     ValueArg<std::string> groundTruthFileArg
     ("", "ground_truth_transfo",
      "File the ground truth transformation. The file must provide kernel bandwidth, "
@@ -115,6 +132,11 @@ int pe(int argc, char ** argv)
                      boost::shared_ptr<CustomIntegrandFactor>(),
                      partialviewArg.getValue());
     pe.setMeshToVisibilityTol(meshVisibilityArg.getValue());
+    if (zbufferArg.getValue() > 0)
+      pe.setVisibilityMethod(KernelCollection::ZBUFFER_VISIBILITY,
+                             zbufferArg.getValue());
+    pe.setSinglePrecision(floatArg.getValue());
+    pe.setEvidenceBlockSize(blockSizeArg.getValue());
     
     pe.load(objectFileArg.getValue(),
             sceneFileArg.getValue(),